@@ -0,0 +1,547 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Microbenchmarks of the functions on the path of every request: the header
+ and body frames of httpd.c, sending and receiving through 0MQ with
+ helpers.c and rendering the monitoring XML. Each runs in a loop over
+ realistic inputs and reports the time, the heap allocations and the bytes
+ passed to memcpy and memmove per call as JSON, so that the output of two
+ builds can be diffed.
+
+ Allocations and copies are counted by interposing malloc and memcpy of
+ glibc, in the calling thread only so that the 0MQ IO threads don't add
+ noise. Copies the compiler expands inline, typically small ones of a
+ constant size, are not seen.
+
+ Usage: bench-micro [iterations]
+ */
+
+/* Exported by libevent http.c but not declared in the public headers, libevent 2.1 added an underscore */
+#ifdef EVENT__NUMERIC_VERSION
+# define evhttp_parse_firstline evhttp_parse_firstline_
+# define evhttp_parse_headers evhttp_parse_headers_
+#endif
+int evhttp_parse_firstline(struct evhttp_request *req, struct evbuffer *buffer);
+int evhttp_parse_headers(struct evhttp_request *req, struct evbuffer *buffer);
+
+/* The server's flags, normally in main.c */
+volatile sig_atomic_t shutting_down = 0;
+volatile sig_atomic_t reload_requested = 0;
+
+/* Messages in flight between the untimed and timed halves of the 0MQ benchmarks */
+#define HP_BENCH_BATCH 256
+
+#define HP_REMOTE_HOST "192.0.2.10"
+
+static __thread struct {
+    bool counting;
+    uint64_t allocs;
+    uint64_t copied;
+} hp_bench_stats;
+
+#ifdef __GLIBC__
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+void *__memcpy_chk(void *dest, const void *src, size_t len, size_t dest_len);
+void *__memmove_chk(void *dest, const void *src, size_t len, size_t dest_len);
+
+/* Called through volatile pointers so that the compiler can't turn them back into memcpy */
+static void *(*volatile hp_bench_memcpy)(void *, const void *, size_t, size_t) = __memcpy_chk;
+static void *(*volatile hp_bench_memmove)(void *, const void *, size_t, size_t) = __memmove_chk;
+
+void *malloc(size_t size)
+{
+    if (hp_bench_stats.counting) {
+        hp_bench_stats.allocs++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (hp_bench_stats.counting) {
+        hp_bench_stats.allocs++;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (hp_bench_stats.counting) {
+        hp_bench_stats.allocs++;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+void *memcpy(void *dest, const void *src, size_t len)
+{
+    if (hp_bench_stats.counting) {
+        hp_bench_stats.copied += len;
+    }
+    return hp_bench_memcpy(dest, src, len, len);
+}
+
+void *memmove(void *dest, const void *src, size_t len)
+{
+    if (hp_bench_stats.counting) {
+        hp_bench_stats.copied += len;
+    }
+    return hp_bench_memmove(dest, src, len, len);
+}
+# define HP_BENCH_COUNTING 1
+#else
+# define HP_BENCH_COUNTING 0
+#endif
+
+struct hp_bench_result_t {
+    uint64_t ns;
+    uint64_t allocs;
+    uint64_t copied;
+    long iterations;
+};
+
+static void hp_bench_begin(uint64_t *start)
+{
+    hp_bench_stats.allocs = 0;
+    hp_bench_stats.copied = 0;
+    hp_bench_stats.counting = true;
+    *start = hp_now_ns();
+}
+
+static void hp_bench_end(struct hp_bench_result_t *result, uint64_t start, long iterations)
+{
+    uint64_t ns = hp_now_ns() - start;
+
+    hp_bench_stats.counting = false;
+    result->ns += ns;
+    result->allocs += hp_bench_stats.allocs;
+    result->copied += hp_bench_stats.copied;
+    result->iterations += iterations;
+}
+
+static void hp_bench_report(const char *name, const char *variant, struct hp_bench_result_t *result, bool *first)
+{
+    double n = (double) result->iterations;
+
+    printf("%s\n    {\"name\": \"%s/%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, ", (*first ? "" : ","), name, variant, result->iterations, result->ns / n);
+
+    if (HP_BENCH_COUNTING) {
+        printf("\"allocs_per_op\": %.2f, \"bytes_copied_per_op\": %.1f}", result->allocs / n, result->copied / n);
+    } else {
+        printf("\"allocs_per_op\": null, \"bytes_copied_per_op\": null}");
+    }
+    *first = false;
+}
+
+/* The header sets of bench-parser */
+struct hp_bench_request_t {
+    const char *name;
+    const char *data;
+};
+
+static struct hp_bench_request_t requests[] = {
+    {
+        "minimal",
+        "POST /events HTTP/1.1\r\n"
+        "Host: collector\r\n"
+        "Content-Length: 2\r\n"
+        "\r\n"
+    },
+    {
+        "curl",
+        "POST /api/v1/events?source=web HTTP/1.1\r\n"
+        "User-Agent: curl/7.68.0\r\n"
+        "Host: collector.example.com:8080\r\n"
+        "Accept: */*\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 512\r\n"
+        "\r\n"
+    },
+    {
+        "proxied",
+        "POST /api/v1/events?source=mobile&version=3.2.1 HTTP/1.1\r\n"
+        "Host: collector.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (Linux; Android 10; SM-G973F) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/83.0.4103.106 Mobile Safari/537.36\r\n"
+        "Accept: application/json, text/plain, */*\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+        "Content-Type: application/json;charset=UTF-8\r\n"
+        "Content-Length: 2048\r\n"
+        "Origin: https://www.example.com\r\n"
+        "Referer: https://www.example.com/products/1234\r\n"
+        "Cookie: session=4f1c2d3e4b5a69788796a5b4c3d2e1f0; tracking=abcdef0123456789\r\n"
+        "X-Forwarded-For: 203.0.113.7, 198.51.100.2\r\n"
+        "X-Forwarded-Proto: https\r\n"
+        "X-Request-Id: 9b2e0a4c-6f1d-4e8b-a3c5-7d9e1f2a4b6c\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+    },
+};
+
+/* Body sizes of the 0MQ benchmarks */
+static size_t body_sizes[] = { 64, 1024, 16384 };
+
+static bool hp_bench_headers(long iterations, bool *first)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof (requests) / sizeof (requests[0]); i++) {
+        struct evbuffer *buffer = evbuffer_new();
+        struct evhttp_request *req = evhttp_request_new(NULL, NULL);
+        struct hp_bench_result_t result;
+        uint64_t start;
+        zmq_msg_t msg;
+        long n;
+
+        if (!buffer || !req) {
+            return false;
+        }
+
+        req->kind = EVHTTP_REQUEST;
+        req->remote_host = strdup(HP_REMOTE_HOST);
+        evbuffer_add(buffer, requests[i].data, strlen(requests[i].data));
+
+        if (evhttp_parse_firstline(req, buffer) != 1 || evhttp_parse_headers(req, buffer) != 1) {
+            fprintf(stderr, "Failed to parse the '%s' request\n", requests[i].name);
+            return false;
+        }
+
+        memset(&result, 0, sizeof (struct hp_bench_result_t));
+        hp_bench_begin(&start);
+
+        for (n = 0; n < iterations; n++) {
+            if (hp_httpd_headers_to_msg(req, &msg) == false) {
+                return false;
+            }
+            (void) zmq_msg_close(&msg);
+        }
+        hp_bench_end(&result, start, iterations);
+        hp_bench_report("hp_httpd_headers_to_msg", requests[i].name, &result, first);
+
+        evhttp_request_free(req);
+        evbuffer_free(buffer);
+    }
+    return true;
+}
+
+/* Body sizes of the body frame benchmark */
+static size_t frame_sizes[] = { 1024, 16384, 262144 };
+
+/* The body as evhttp reads it off the socket, in 4 KB pieces */
+static bool hp_bench_fill_body(struct evbuffer *buffer, const char *body, size_t len)
+{
+    size_t off;
+
+    for (off = 0; off < len; off += 4096) {
+        if (evbuffer_add(buffer, body + off, (len - off < 4096) ? len - off : 4096) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool hp_bench_body_to_msg(long iterations, bool *first)
+{
+    static char body[262144];
+    struct evhttp_request *req = evhttp_request_new(NULL, NULL);
+    size_t i;
+
+    if (!req) {
+        return false;
+    }
+    memset(body, 'x', sizeof (body));
+
+    for (i = 0; i < sizeof (frame_sizes) / sizeof (frame_sizes[0]); i++) {
+        struct hp_bench_result_t result;
+        char variant[32];
+        zmq_msg_t msg;
+        long n;
+
+        memset(&result, 0, sizeof (struct hp_bench_result_t));
+
+        /* The larger bodies take long enough to refill, fewer rounds do */
+        for (n = 0; n < iterations / (long) (frame_sizes[i] / 1024); n++) {
+            uint64_t start;
+
+            evbuffer_drain(req->input_buffer, EVBUFFER_LENGTH(req->input_buffer));
+            if (hp_bench_fill_body(req->input_buffer, body, frame_sizes[i]) == false) {
+                return false;
+            }
+
+            hp_bench_begin(&start);
+            if (hp_httpd_body_to_msg(req, &msg) == false) {
+                return false;
+            }
+            (void) zmq_msg_close(&msg);
+            hp_bench_end(&result, start, 1);
+        }
+
+        (void) snprintf(variant, sizeof (variant), "%zu", frame_sizes[i]);
+        hp_bench_report("hp_httpd_body_to_msg", variant, &result, first);
+    }
+
+    evhttp_request_free(req);
+    return true;
+}
+
+/* Receives what the timed half sent so that the pipe never fills up */
+static bool hp_bench_drain(void *socket, int count)
+{
+    zmq_msg_t msg;
+    int i;
+
+    if (zmq_msg_init(&msg) != 0) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (zmq_recv(socket, &msg, 0) != 0) {
+            (void) zmq_msg_close(&msg);
+            return false;
+        }
+    }
+    return (zmq_msg_close(&msg) == 0);
+}
+
+static bool hp_bench_sendmsg(void *ctx, long iterations, bool *first)
+{
+    void *push = zmq_socket(ctx, ZMQ_PUSH), *pull = zmq_socket(ctx, ZMQ_PULL);
+    static char body[16384];
+    size_t i;
+
+    if (!push || !pull || zmq_bind(pull, "inproc://bench-sendmsg") != 0 || zmq_connect(push, "inproc://bench-sendmsg") != 0) {
+        return false;
+    }
+    memset(body, 'x', sizeof (body));
+
+    for (i = 0; i < sizeof (body_sizes) / sizeof (body_sizes[0]); i++) {
+        struct hp_bench_result_t result;
+        long n;
+
+        memset(&result, 0, sizeof (struct hp_bench_result_t));
+
+        for (n = 0; n < iterations; n += HP_BENCH_BATCH) {
+            uint64_t start;
+            int j;
+
+            hp_bench_begin(&start);
+            for (j = 0; j < HP_BENCH_BATCH; j++) {
+                if (hp_sendmsg(push, body, body_sizes[i], ZMQ_NOBLOCK) == false) {
+                    return false;
+                }
+            }
+            hp_bench_end(&result, start, HP_BENCH_BATCH);
+
+            if (hp_bench_drain(pull, HP_BENCH_BATCH) == false) {
+                return false;
+            }
+        }
+
+        {
+            char variant[32];
+            (void) snprintf(variant, sizeof (variant), "%zu", body_sizes[i]);
+            hp_bench_report("hp_sendmsg", variant, &result, first);
+        }
+    }
+
+    (void) zmq_close(push);
+    (void) zmq_close(pull);
+    return true;
+}
+
+static bool hp_bench_recvmsg_ident(void *ctx, long iterations, bool *first)
+{
+    void *router = zmq_socket(ctx, ZMQ_XREP), *dealer = zmq_socket(ctx, ZMQ_XREQ);
+    static char body[16384], message[16384];
+    size_t i;
+
+    if (!router || !dealer || zmq_bind(router, "inproc://bench-recvmsg") != 0 || zmq_connect(dealer, "inproc://bench-recvmsg") != 0) {
+        return false;
+    }
+    memset(body, 'x', sizeof (body));
+
+    for (i = 0; i < sizeof (body_sizes) / sizeof (body_sizes[0]); i++) {
+        struct hp_bench_result_t result;
+        long n;
+
+        memset(&result, 0, sizeof (struct hp_bench_result_t));
+
+        for (n = 0; n < iterations; n += HP_BENCH_BATCH) {
+            char identity[HP_IDENTITY_MAX];
+            uint64_t start;
+            int j;
+
+            /* As a REQ client would send them, the router adds the identity */
+            for (j = 0; j < HP_BENCH_BATCH; j++) {
+                if (hp_sendmsg(dealer, NULL, 0, ZMQ_SNDMORE) == false || hp_sendmsg(dealer, body, body_sizes[i], 0) == false) {
+                    return false;
+                }
+            }
+
+            hp_bench_begin(&start);
+            for (j = 0; j < HP_BENCH_BATCH; j++) {
+                size_t identity_size = HP_IDENTITY_MAX, message_size = sizeof (message);
+
+                if (hp_recvmsg_ident(router, identity, &identity_size, message, &message_size) == false || message_size != body_sizes[i]) {
+                    return false;
+                }
+            }
+            hp_bench_end(&result, start, HP_BENCH_BATCH);
+        }
+
+        {
+            char variant[32];
+            (void) snprintf(variant, sizeof (variant), "%zu", body_sizes[i]);
+            hp_bench_report("hp_recvmsg_ident", variant, &result, first);
+        }
+    }
+
+    (void) zmq_close(router);
+    (void) zmq_close(dealer);
+    return true;
+}
+
+/* The monitoring XML of 8 threads, plain and with -k, -D and four -K shards */
+static bool hp_bench_counters_to_xml(long iterations, bool *first)
+{
+    static struct hp_httpd_counters_t counters[8], total;
+    static struct hp_histogram_t latency[HP_LATENCY_MAX];
+    static struct hp_output_counters_t outputs[4];
+    static struct hp_uri_t uris[4];
+    static struct hp_uri_t *uri_list[4];
+    static char uri_names[4][32];
+    struct httpush_args_t args;
+    int variant, i;
+
+    for (i = 0; i < 8; i++) {
+        counters[i].requests = 1000000 + i * 7919;
+        counters[i].accepts  = 1000 + i;
+        counters[i].code_200 = counters[i].requests - i;
+        counters[i].code_503 = i;
+        counters[i].bytes_in = counters[i].requests * 600;
+        hp_stats_sum_counters(&total, &(counters[i]));
+    }
+
+    for (i = 0; i < HP_LATENCY_MAX; i++) {
+        uint64_t value;
+
+        for (value = 100; value < 10000000; value += value / 3) {
+            hp_histogram_record(&(latency[i]), value);
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        (void) snprintf(uri_names[i], sizeof (uri_names[i]), "tcp://10.0.0.%d:5567", i + 1);
+        uris[i].uri = uri_names[i];
+        uri_list[i] = &(uris[i]);
+        outputs[i].requests = outputs[i].messages = 250000 + i * 1000;
+        outputs[i].bytes = outputs[i].messages * 600;
+    }
+
+    for (variant = 0; variant < 2; variant++) {
+        struct hp_bench_result_t result;
+        uint64_t start;
+        long n;
+
+        memset(&args, 0, sizeof (struct httpush_args_t));
+        args.shard.source = HP_SHARD_NONE;
+
+        if (variant == 1) {
+            args.ack.max_inflight = 10000;
+            args.dedup.max_keys = 256 * 1024;
+            args.shard.source = HP_SHARD_HEADER;
+            args.shard.name = "X-User-Id";
+            args.shard.name_len = sizeof ("X-User-Id") - 1;
+            args.uris = uri_list;
+            args.num_uris = 4;
+        }
+
+        memset(&result, 0, sizeof (struct hp_bench_result_t));
+        hp_bench_begin(&start);
+
+        for (n = 0; n < iterations; n++) {
+            struct evbuffer *evb = hp_counters_to_xml(&total, counters, latency, 1, 8, &args, outputs);
+
+            if (!evb) {
+                return false;
+            }
+            evbuffer_free(evb);
+        }
+        hp_bench_end(&result, start, iterations);
+        hp_bench_report("hp_counters_to_xml", (variant == 0 ? "plain" : "sharded"), &result, first);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 100000;
+    bool first = true, success;
+    void *ctx;
+
+    if (iterations < HP_BENCH_BATCH) {
+        fprintf(stderr, "Usage: %s [iterations], at least %d\n", argv[0], HP_BENCH_BATCH);
+        return 1;
+    }
+
+    ctx = zmq_init(1);
+    if (!ctx) {
+        fprintf(stderr, "Failed to initialize zeromq: %s\n", zmq_strerror(errno));
+        return 1;
+    }
+
+    printf("{\"iterations\": %ld, \"benchmarks\": [", iterations);
+
+    success = hp_bench_headers(iterations, &first) &&
+              hp_bench_body_to_msg(iterations, &first) &&
+              hp_bench_sendmsg(ctx, iterations, &first) &&
+              hp_bench_recvmsg_ident(ctx, iterations, &first) &&
+              /* Rendering is two orders of magnitude slower than the rest */
+              hp_bench_counters_to_xml(iterations / 100 + 1, &first);
+
+    printf("\n]}\n");
+
+    if (!success) {
+        fprintf(stderr, "Benchmark failed: %s\n", zmq_strerror(errno));
+    }
+
+    (void) zmq_term(ctx);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Compares the request parsing of the two front-ends: evhttp parsing the
+ request line and headers into lists and the header frame being written
+ from them, as in httpd.c, against parser.c parsing in place and writing
+ the frame from the offsets, as in conn.c. Both start from the request in
+ an evbuffer, as read from the socket.
+
+ Usage: bench-parser [iterations]
+ */
+
+/* Exported by libevent http.c but not declared in the public headers, libevent 2.1 added an underscore */
+#ifdef EVENT__NUMERIC_VERSION
+# define evhttp_parse_firstline evhttp_parse_firstline_
+# define evhttp_parse_headers evhttp_parse_headers_
+#endif
+int evhttp_parse_firstline(struct evhttp_request *req, struct evbuffer *buffer);
+int evhttp_parse_headers(struct evhttp_request *req, struct evbuffer *buffer);
+
+struct hp_bench_request_t {
+    const char *name;
+    const char *data;
+};
+
+static struct hp_bench_request_t requests[] = {
+    {
+        "minimal",
+        "POST /events HTTP/1.1\r\n"
+        "Host: collector\r\n"
+        "Content-Length: 2\r\n"
+        "\r\n"
+    },
+    {
+        "curl",
+        "POST /api/v1/events?source=web HTTP/1.1\r\n"
+        "User-Agent: curl/7.68.0\r\n"
+        "Host: collector.example.com:8080\r\n"
+        "Accept: */*\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 512\r\n"
+        "\r\n"
+    },
+    {
+        "proxied",
+        "POST /api/v1/events?source=mobile&version=3.2.1 HTTP/1.1\r\n"
+        "Host: collector.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (Linux; Android 10; SM-G973F) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/83.0.4103.106 Mobile Safari/537.36\r\n"
+        "Accept: application/json, text/plain, */*\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+        "Content-Type: application/json;charset=UTF-8\r\n"
+        "Content-Length: 2048\r\n"
+        "Origin: https://www.example.com\r\n"
+        "Referer: https://www.example.com/products/1234\r\n"
+        "Cookie: session=4f1c2d3e4b5a69788796a5b4c3d2e1f0; tracking=abcdef0123456789\r\n"
+        "X-Forwarded-For: 203.0.113.7, 198.51.100.2\r\n"
+        "X-Forwarded-Proto: https\r\n"
+        "X-Request-Id: 9b2e0a4c-6f1d-4e8b-a3c5-7d9e1f2a4b6c\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+    },
+};
+
+#define HP_REMOTE_HOST "192.0.2.10"
+#define HP_REMOTE_HOST_LEN (sizeof (HP_REMOTE_HOST) - 1)
+
+static char frame[HP_REQUEST_MAX_HEAD + 256];
+
+/* The header frame as hp_httpd_headers_measure and hp_httpd_headers_write produce it */
+static size_t hp_bench_evhttp_frame(struct evhttp_request *req)
+{
+    struct evkeyval *header;
+    const char *uri = evhttp_request_uri(req);
+    bool has_xff = false;
+    size_t size, uri_len = strlen(uri);
+    char *p = frame;
+
+    size = 4 + 1 + uri_len + sizeof (" HTTP/1.1\r\n") - 1;
+
+    TAILQ_FOREACH(header, req->input_headers, next) {
+        size += strlen(header->key) + 2 + strlen(header->value) + 2;
+    }
+    size += sizeof ("X-Forwarded-For") - 1 + 2 + HP_REMOTE_HOST_LEN + 2;
+
+    if (size > sizeof (frame)) {
+        return 0;
+    }
+
+    memcpy(p, "POST ", 5);
+    p += 5;
+    memcpy(p, uri, uri_len);
+    p += uri_len;
+    memcpy(p, " HTTP/1.1\r\n", sizeof (" HTTP/1.1\r\n") - 1);
+    p += sizeof (" HTTP/1.1\r\n") - 1;
+
+    TAILQ_FOREACH(header, req->input_headers, next) {
+        size_t key_len = strlen(header->key), value_len = strlen(header->value);
+
+        memcpy(p, header->key, key_len);
+        p += key_len;
+        *(p++) = ':';
+        *(p++) = ' ';
+        memcpy(p, header->value, value_len);
+        p += value_len;
+
+        if (!strcasecmp(header->key, "X-Forwarded-For")) {
+            has_xff = true;
+            memcpy(p, ", " HP_REMOTE_HOST, 2 + HP_REMOTE_HOST_LEN);
+            p += 2 + HP_REMOTE_HOST_LEN;
+        }
+        *(p++) = '\r';
+        *(p++) = '\n';
+    }
+
+    if (!has_xff) {
+        memcpy(p, "X-Forwarded-For: " HP_REMOTE_HOST "\r\n", sizeof ("X-Forwarded-For: " HP_REMOTE_HOST "\r\n") - 1);
+        p += sizeof ("X-Forwarded-For: " HP_REMOTE_HOST "\r\n") - 1;
+    }
+    return p - frame;
+}
+
+static size_t hp_bench_evhttp(struct evbuffer *buffer, const char *data, size_t len)
+{
+    struct evhttp_request *req;
+    size_t size = 0;
+
+    evbuffer_add(buffer, data, len);
+
+    req = evhttp_request_new(NULL, NULL);
+    req->kind = EVHTTP_REQUEST;
+
+    if (evhttp_parse_firstline(req, buffer) == 1 && evhttp_parse_headers(req, buffer) == 1) {
+        size = hp_bench_evhttp_frame(req);
+    }
+
+    evhttp_request_free(req);
+    evbuffer_drain(buffer, EVBUFFER_LENGTH(buffer));
+    return size;
+}
+
+static size_t hp_bench_parser(struct evbuffer *buffer, const char *data, size_t len, char *head)
+{
+    struct hp_request_t req;
+    size_t size = 0;
+
+    evbuffer_add(buffer, data, len);
+
+    if (hp_parse_request((const char *) EVBUFFER_DATA(buffer), EVBUFFER_LENGTH(buffer), &req) == HP_PARSE_DONE) {
+        /* conn.c keeps a copy of the head for the frame */
+        memcpy(head, EVBUFFER_DATA(buffer), req.head_len);
+
+        size = hp_request_frame_size(&req, HP_REMOTE_HOST_LEN);
+        if (size <= sizeof (frame)) {
+            size = hp_request_frame_write(&req, head, HP_REMOTE_HOST, HP_REMOTE_HOST_LEN, frame) - frame;
+        }
+    }
+
+    evbuffer_drain(buffer, EVBUFFER_LENGTH(buffer));
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    struct evbuffer *buffer = evbuffer_new();
+    static char head[HP_REQUEST_MAX_HEAD];
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+    size_t i;
+
+    if (!buffer || iterations < 1) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %12s %12s %8s\n", "request", "evhttp ns", "parser ns", "speedup");
+
+    for (i = 0; i < sizeof (requests) / sizeof (requests[0]); i++) {
+        const char *data = requests[i].data;
+        size_t len = strlen(data), evhttp_size, parser_size;
+        uint64_t start, evhttp_ns, parser_ns;
+        long n;
+
+        /* The frames must match for the comparison to be fair */
+        evhttp_size = hp_bench_evhttp(buffer, data, len);
+        parser_size = hp_bench_parser(buffer, data, len, head);
+
+        if (evhttp_size == 0 || evhttp_size != parser_size) {
+            fprintf(stderr, "Frame size mismatch for '%s': %zu != %zu\n", requests[i].name, evhttp_size, parser_size);
+            return 1;
+        }
+
+        start = hp_now_ns();
+        for (n = 0; n < iterations; n++) {
+            hp_bench_evhttp(buffer, data, len);
+        }
+        evhttp_ns = hp_now_ns() - start;
+
+        start = hp_now_ns();
+        for (n = 0; n < iterations; n++) {
+            hp_bench_parser(buffer, data, len, head);
+        }
+        parser_ns = hp_now_ns() - start;
+
+        printf("%-10s %12.1f %12.1f %7.1fx\n", requests[i].name,
+               (double) evhttp_ns / iterations, (double) parser_ns / iterations, (double) evhttp_ns / parser_ns);
+    }
+
+    evbuffer_free(buffer);
+    return 0;
+}
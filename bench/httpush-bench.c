@@ -0,0 +1,811 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <netdb.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/*
+ End-to-end load benchmark. Client threads keep -c connections busy
+ posting requests to httpush while a PULL socket bound to the -z endpoint
+ receives what comes out on the other side. Every body starts with the
+ time it was sent, so besides the response latency seen by the clients the
+ sink measures how long a message took to arrive. Requests and messages
+ are counted between the warmup and the end of the run, and the results
+ are written as JSON.
+
+ Usage: httpush-bench [OPTIONS] [-- httpush [OPTIONS]]
+
+ A command after "--" is started before the run and stopped with SIGTERM
+ afterwards, so that the -t and -i settings of the server can be varied
+ from run to run, e.g.
+
+ httpush-bench -c 128 -s 1024 -- ../src/httpush -t 4 -i 2 -z tcp://127.0.0.1:5567
+ */
+
+/* Responses of httpush are small, anything bigger is an error */
+#define HP_BENCH_RESPONSE_MAX 4096
+
+/* The send time at the start of each body, in hex */
+#define HP_BENCH_STAMP_LEN 16
+
+struct hp_bench_config_t {
+    const char *host;
+    const char *port;
+    const char *path;
+    const char *sink_dsn;
+    const char *label;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    int connections;
+    int threads;
+    size_t body_size;
+    int headers;
+    bool keepalive;
+
+    long warmup_sec;
+    long duration_sec;
+
+    /* Counting starts and ends at these */
+    uint64_t measure_start;
+    uint64_t measure_end;
+
+    char **server_argv;
+};
+
+struct hp_bench_conn_t {
+    int fd;
+
+    /* The request with the send time in the body */
+    char *request;
+    size_t request_len;
+    size_t sent;
+
+    char response[HP_BENCH_RESPONSE_MAX];
+    size_t received;
+
+    uint64_t start;
+};
+
+struct hp_bench_client_t {
+    pthread_t thread;
+    struct hp_bench_config_t *config;
+
+    struct hp_bench_conn_t *conns;
+    int num_conns;
+
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t non_2xx;
+    uint64_t bytes;
+
+    struct hp_histogram_t latency;
+};
+
+struct hp_bench_sink_t {
+    pthread_t thread;
+    struct hp_bench_config_t *config;
+    void *socket;
+
+    volatile sig_atomic_t stop;
+
+    uint64_t messages;
+    uint64_t bytes;
+
+    struct hp_histogram_t latency;
+};
+
+static void hp_bench_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] [-- httpush [OPTIONS]]\n", name);
+    fprintf(stderr, " -c <value>    Number of connections (default 64)\n");
+    fprintf(stderr, " -d <value>    Seconds to measure (default 10)\n");
+    fprintf(stderr, " -H <value>    Number of extra headers per request (default 8)\n");
+    fprintf(stderr, " -l <value>    Label to tell the run apart in the results\n");
+    fprintf(stderr, " -n            Open a new connection for every request\n");
+    fprintf(stderr, " -o <value>    Write the results to a file instead of stdout\n");
+    fprintf(stderr, " -p <value>    Request path (default /bench)\n");
+    fprintf(stderr, " -s <value>    Body size in bytes (default 512)\n");
+    fprintf(stderr, " -t <value>    Number of client threads (default 4)\n");
+    fprintf(stderr, " -u <value>    httpush address, host:port (default 127.0.0.1:8080)\n");
+    fprintf(stderr, " -w <value>    Seconds to run before measuring (default 1)\n");
+    fprintf(stderr, " -z <value>    Dsn for the sink to bind to (default tcp://127.0.0.1:5567)\n");
+}
+
+/* The request head and a body of the configured size, the stamp is filled in per request */
+static char *hp_bench_request(struct hp_bench_config_t *config, size_t *len)
+{
+    struct evbuffer *evb = evbuffer_new();
+    char *request;
+    int i;
+
+    if (!evb) {
+        return NULL;
+    }
+
+    evbuffer_add_printf(evb, "POST %s HTTP/1.1\r\nHost: %s:%s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n",
+                        config->path, config->host, config->port, config->body_size);
+
+    for (i = 0; i < config->headers; i++) {
+        evbuffer_add_printf(evb, "X-Bench-%d: %08x-%04x-4bench-value\r\n", i, (unsigned int) (i * 2654435761u), (unsigned int) i);
+    }
+
+    if (!config->keepalive) {
+        evbuffer_add_printf(evb, "Connection: close\r\n");
+    }
+    evbuffer_add(evb, "\r\n", 2);
+
+    *len = EVBUFFER_LENGTH(evb) + config->body_size;
+    request = malloc(*len);
+
+    if (request) {
+        memcpy(request, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb));
+        memset(request + EVBUFFER_LENGTH(evb), 'x', config->body_size);
+    }
+    evbuffer_free(evb);
+    return request;
+}
+
+static void hp_bench_close(struct hp_bench_conn_t *conn)
+{
+    if (conn->fd != -1) {
+        (void) close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->sent = 0;
+    conn->received = 0;
+}
+
+/* Connects if needed and stamps the next request */
+static bool hp_bench_prepare(struct hp_bench_config_t *config, struct hp_bench_conn_t *conn)
+{
+    if (conn->fd == -1) {
+        conn->fd = socket(config->addr.ss_family, SOCK_STREAM, 0);
+
+        if (conn->fd == -1) {
+            return false;
+        }
+
+        if (evutil_make_socket_nonblocking(conn->fd) != 0 ||
+            (connect(conn->fd, (struct sockaddr *) &(config->addr), config->addr_len) != 0 && errno != EINPROGRESS)) {
+            hp_bench_close(conn);
+            return false;
+        }
+    }
+
+    conn->start = hp_now_ns();
+    conn->sent = 0;
+    conn->received = 0;
+
+    if (config->body_size >= HP_BENCH_STAMP_LEN) {
+        char stamp[HP_BENCH_STAMP_LEN + 1];
+
+        (void) snprintf(stamp, sizeof (stamp), "%016" PRIx64, conn->start);
+        memcpy(conn->request + conn->request_len - config->body_size, stamp, HP_BENCH_STAMP_LEN);
+    }
+    return true;
+}
+
+/*
+ Whether the response is complete. Sets 'status' and whether the server
+ closes the connection
+ */
+static bool hp_bench_response(struct hp_bench_conn_t *conn, int *status, bool *close_conn)
+{
+    const char *end, *length;
+    size_t head_len, content_length = 0;
+
+    conn->response[conn->received] = '\0';
+
+    end = strstr(conn->response, "\r\n\r\n");
+    if (!end) {
+        return false;
+    }
+    head_len = end + 4 - conn->response;
+
+    length = strcasestr(conn->response, "\r\nContent-Length:");
+    if (length && length < end) {
+        content_length = (size_t) strtoul(length + sizeof ("\r\nContent-Length:") - 1, NULL, 10);
+    }
+
+    if (conn->received < head_len + content_length) {
+        return false;
+    }
+
+    *status = (conn->received > 12) ? atoi(conn->response + 9) : 0;
+    *close_conn = (strcasestr(conn->response, "\r\nConnection: close") != NULL || !strncmp(conn->response, "HTTP/1.0", 8));
+    return true;
+}
+
+/* Handles the events of one connection, returns false when it failed */
+static bool hp_bench_io(struct hp_bench_client_t *client, struct hp_bench_conn_t *conn)
+{
+    struct hp_bench_config_t *config = client->config;
+    uint64_t now;
+    ssize_t rc;
+    int status;
+    bool close_conn;
+
+    if (conn->sent < conn->request_len) {
+        rc = write(conn->fd, conn->request + conn->sent, conn->request_len - conn->sent);
+
+        if (rc < 0) {
+            return (errno == EAGAIN || errno == EINTR);
+        }
+        conn->sent += (size_t) rc;
+        return true;
+    }
+
+    rc = read(conn->fd, conn->response + conn->received, sizeof (conn->response) - 1 - conn->received);
+
+    if (rc < 0) {
+        return (errno == EAGAIN || errno == EINTR);
+    }
+
+    if (rc == 0) {
+        return false;
+    }
+    conn->received += (size_t) rc;
+
+    if (hp_bench_response(conn, &status, &close_conn) == false) {
+        /* Too large to be a response of httpush */
+        return (conn->received < sizeof (conn->response) - 1);
+    }
+
+    now = hp_now_ns();
+
+    if (conn->start >= config->measure_start && now <= config->measure_end) {
+        client->requests++;
+        client->bytes += conn->request_len;
+
+        if (status < 200 || status > 299) {
+            client->non_2xx++;
+        }
+        hp_histogram_record(&(client->latency), now - conn->start);
+    }
+
+    if (close_conn || !config->keepalive) {
+        hp_bench_close(conn);
+    }
+
+    if (hp_bench_prepare(config, conn) == false) {
+        client->errors++;
+    }
+    return true;
+}
+
+static void *hp_bench_client(void *arg)
+{
+    struct hp_bench_client_t *client = (struct hp_bench_client_t *) arg;
+    struct hp_bench_config_t *config = client->config;
+    struct pollfd *fds;
+    int i;
+
+    fds = calloc(client->num_conns, sizeof (struct pollfd));
+    if (!fds) {
+        return NULL;
+    }
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (hp_bench_prepare(config, &(client->conns[i])) == false) {
+            client->errors++;
+        }
+    }
+
+    while (hp_now_ns() < config->measure_end) {
+        for (i = 0; i < client->num_conns; i++) {
+            struct hp_bench_conn_t *conn = &(client->conns[i]);
+
+            /* Failed to connect, try again */
+            if (conn->fd == -1 && hp_bench_prepare(config, conn) == false) {
+                client->errors++;
+            }
+
+            fds[i].fd = conn->fd;
+            fds[i].events = (conn->sent < conn->request_len) ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, client->num_conns, 100) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (i = 0; i < client->num_conns; i++) {
+            struct hp_bench_conn_t *conn = &(client->conns[i]);
+
+            if (fds[i].fd == -1 || !fds[i].revents) {
+                continue;
+            }
+
+            if (hp_bench_io(client, conn) == false) {
+                /* Connection refused or closed under a request */
+                if (conn->start >= config->measure_start) {
+                    client->errors++;
+                }
+                hp_bench_close(conn);
+            }
+        }
+    }
+
+    for (i = 0; i < client->num_conns; i++) {
+        hp_bench_close(&(client->conns[i]));
+    }
+    free(fds);
+    return NULL;
+}
+
+/* The send time in the last frame of a message, 0 if there is none */
+static uint64_t hp_bench_stamp(zmq_msg_t *msg)
+{
+    char stamp[HP_BENCH_STAMP_LEN + 1], *end;
+    uint64_t value;
+
+    if (zmq_msg_size(msg) < HP_BENCH_STAMP_LEN) {
+        return 0;
+    }
+
+    memcpy(stamp, zmq_msg_data(msg), HP_BENCH_STAMP_LEN);
+    stamp[HP_BENCH_STAMP_LEN] = '\0';
+
+    value = (uint64_t) strtoull(stamp, &end, 16);
+    return (*end == '\0') ? value : 0;
+}
+
+static void *hp_bench_sink(void *arg)
+{
+    struct hp_bench_sink_t *sink = (struct hp_bench_sink_t *) arg;
+    struct hp_bench_config_t *config = sink->config;
+    zmq_pollitem_t items[1];
+    zmq_msg_t msg;
+    size_t bytes = 0;
+
+    items[0].socket = sink->socket;
+    items[0].fd = 0;
+    items[0].events = ZMQ_POLLIN;
+
+    if (zmq_msg_init(&msg) != 0) {
+        return NULL;
+    }
+
+    while (!sink->stop) {
+        int64_t more;
+        size_t moresz = sizeof (int64_t);
+
+        items[0].revents = 0;
+
+        if (zmq_poll(items, 1, 100000) <= 0) {
+            continue;
+        }
+
+        while (zmq_recv(sink->socket, &msg, ZMQ_NOBLOCK) == 0) {
+            uint64_t now, stamp;
+
+            bytes += zmq_msg_size(&msg);
+
+            if (zmq_getsockopt(sink->socket, ZMQ_RCVMORE, &more, &moresz) != 0 || more) {
+                continue;
+            }
+
+            /* The body is the last frame, counted by its send time when it has one */
+            now = hp_now_ns();
+            stamp = hp_bench_stamp(&msg);
+
+            if ((stamp && stamp >= config->measure_start && stamp <= config->measure_end) ||
+                (!stamp && now >= config->measure_start && now <= config->measure_end)) {
+                sink->messages++;
+                sink->bytes += bytes;
+
+                if (stamp && now >= stamp) {
+                    hp_histogram_record(&(sink->latency), now - stamp);
+                }
+            }
+            bytes = 0;
+        }
+    }
+
+    (void) zmq_msg_close(&msg);
+    return NULL;
+}
+
+/* Asks the server to shut down, killing it if it doesn't within five seconds */
+static void hp_bench_server_stop(pid_t pid)
+{
+    int attempt;
+
+    (void) kill(pid, SIGTERM);
+
+    for (attempt = 0; attempt < 100; attempt++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return;
+        }
+        (void) usleep(50000);
+    }
+
+    fprintf(stderr, "Server didn't shut down, killing it\n");
+    (void) kill(pid, SIGKILL);
+    (void) waitpid(pid, NULL, 0);
+}
+
+/* Starts the server and waits until it accepts connections */
+static pid_t hp_bench_server_start(struct hp_bench_config_t *config)
+{
+    pid_t pid = fork();
+    int attempt;
+
+    if (pid == -1) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        (void) execvp(config->server_argv[0], config->server_argv);
+        fprintf(stderr, "Failed to run %s: %s\n", config->server_argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    for (attempt = 0; attempt < 100; attempt++) {
+        int fd, status;
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return -1;
+        }
+
+        fd = socket(config->addr.ss_family, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *) &(config->addr), config->addr_len) == 0) {
+            (void) close(fd);
+            return pid;
+        }
+
+        if (fd != -1) {
+            (void) close(fd);
+        }
+        (void) usleep(50000);
+    }
+
+    hp_bench_server_stop(pid);
+    return -1;
+}
+
+static void hp_bench_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned int) (unsigned char) *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void hp_bench_json_latency(FILE *out, const char *name, struct hp_histogram_t *histogram, bool last)
+{
+    fprintf(out, "    \"%s\": {\"count\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}%s\n",
+            name, histogram->count,
+            hp_histogram_percentile(histogram, 50.0),
+            hp_histogram_percentile(histogram, 90.0),
+            hp_histogram_percentile(histogram, 99.0),
+            hp_histogram_percentile(histogram, 99.9),
+            histogram->max, last ? "" : ",");
+}
+
+static void hp_bench_report(FILE *out, struct hp_bench_config_t *config, struct hp_bench_client_t *clients, struct hp_bench_sink_t *sink)
+{
+    static struct hp_histogram_t latency;
+    uint64_t requests = 0, errors = 0, non_2xx = 0, bytes = 0;
+    double seconds = (double) config->duration_sec;
+    int i;
+
+    for (i = 0; i < config->threads; i++) {
+        requests += clients[i].requests;
+        errors   += clients[i].errors;
+        non_2xx  += clients[i].non_2xx;
+        bytes    += clients[i].bytes;
+        hp_histogram_merge(&latency, &(clients[i].latency));
+    }
+
+    fprintf(out, "{\n  \"label\": ");
+    hp_bench_json_string(out, config->label);
+    fprintf(out, ",\n  \"config\": {\n    \"url\": \"http://%s:%s%s\",\n    \"sink\": ", config->host, config->port, config->path);
+    hp_bench_json_string(out, config->sink_dsn);
+    fprintf(out, ",\n    \"connections\": %d,\n    \"threads\": %d,\n    \"body_size\": %zu,\n    \"headers\": %d,\n    \"keepalive\": %s,\n"
+                 "    \"warmup_sec\": %ld,\n    \"duration_sec\": %ld,\n    \"server\": ",
+            config->connections, config->threads, config->body_size, config->headers, config->keepalive ? "true" : "false",
+            config->warmup_sec, config->duration_sec);
+
+    if (config->server_argv) {
+        fputc('[', out);
+        for (i = 0; config->server_argv[i]; i++) {
+            if (i > 0) {
+                fprintf(out, ", ");
+            }
+            hp_bench_json_string(out, config->server_argv[i]);
+        }
+        fputc(']', out);
+    } else {
+        fprintf(out, "null");
+    }
+
+    fprintf(out, "\n  },\n");
+    fprintf(out, "  \"requests\": %" PRIu64 ",\n  \"errors\": %" PRIu64 ",\n  \"non_2xx\": %" PRIu64 ",\n  \"request_bytes\": %" PRIu64 ",\n",
+            requests, errors, non_2xx, bytes);
+    fprintf(out, "  \"messages\": %" PRIu64 ",\n  \"message_bytes\": %" PRIu64 ",\n", sink->messages, sink->bytes);
+    fprintf(out, "  \"requests_per_sec\": %.1f,\n  \"messages_per_sec\": %.1f,\n  \"mb_per_sec\": %.3f,\n",
+            requests / seconds, sink->messages / seconds, sink->bytes / seconds / (1024 * 1024));
+    fprintf(out, "  \"latency_ns\": {\n");
+    hp_bench_json_latency(out, "response", &latency, false);
+    hp_bench_json_latency(out, "delivery", &(sink->latency), true);
+    fprintf(out, "  }\n}\n");
+}
+
+static bool hp_bench_resolve(struct hp_bench_config_t *config, char *address)
+{
+    struct addrinfo hints, *res = NULL;
+    char *colon = strrchr(address, ':');
+    bool success;
+
+    if (!colon) {
+        return false;
+    }
+    *colon = '\0';
+    config->host = address;
+    config->port = colon + 1;
+
+    memset(&hints, 0, sizeof (struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(config->host, config->port, &hints, &res) != 0) {
+        return false;
+    }
+
+    success = (res->ai_addrlen <= sizeof (config->addr));
+    if (success) {
+        memcpy(&(config->addr), res->ai_addr, res->ai_addrlen);
+        config->addr_len = res->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    static char default_address[] = "127.0.0.1:8080";
+    struct hp_bench_config_t config;
+    struct hp_bench_client_t *clients;
+    struct hp_bench_sink_t sink;
+    char *address = default_address;
+    const char *output = NULL;
+    FILE *out = stdout;
+    void *ctx;
+    pid_t server = -1;
+    int c, i, rc = 0;
+
+    memset(&config, 0, sizeof (struct hp_bench_config_t));
+    config.path = "/bench";
+    config.sink_dsn = "tcp://127.0.0.1:5567";
+    config.label = "";
+    config.connections = 64;
+    config.threads = 4;
+    config.body_size = 512;
+    config.headers = 8;
+    config.keepalive = true;
+    config.warmup_sec = 1;
+    config.duration_sec = 10;
+
+    while ((c = getopt(argc, argv, "c:d:H:l:no:p:s:t:u:w:z:")) != -1) {
+        switch (c) {
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+
+            case 'd':
+                config.duration_sec = atol(optarg);
+                break;
+
+            case 'H':
+                config.headers = atoi(optarg);
+                break;
+
+            case 'l':
+                config.label = optarg;
+                break;
+
+            case 'n':
+                config.keepalive = false;
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            case 'p':
+                config.path = optarg;
+                break;
+
+            case 's':
+                config.body_size = (size_t) atol(optarg);
+                break;
+
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+
+            case 'u':
+                address = optarg;
+                break;
+
+            case 'w':
+                config.warmup_sec = atol(optarg);
+                break;
+
+            case 'z':
+                config.sink_dsn = optarg;
+                break;
+
+            default:
+                hp_bench_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (config.connections < 1 || config.threads < 1 || config.headers < 0 || config.duration_sec < 1 || config.warmup_sec < 0) {
+        hp_bench_usage(argv[0]);
+        return 1;
+    }
+
+    if (config.threads > config.connections) {
+        config.threads = config.connections;
+    }
+
+    if (optind < argc) {
+        config.server_argv = &argv[optind];
+    }
+
+    if (hp_bench_resolve(&config, address) == false) {
+        fprintf(stderr, "Failed to resolve '%s'\n", address);
+        return 1;
+    }
+
+    /* A server going away must not take the benchmark with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    ctx = zmq_init(1);
+    if (!ctx) {
+        fprintf(stderr, "Failed to initialize zeromq: %s\n", zmq_strerror(errno));
+        return 1;
+    }
+
+    memset(&sink, 0, sizeof (struct hp_bench_sink_t));
+    sink.config = &config;
+    sink.socket = zmq_socket(ctx, ZMQ_PULL);
+
+    if (!sink.socket || zmq_bind(sink.socket, config.sink_dsn) != 0) {
+        fprintf(stderr, "Failed to bind the sink to %s: %s\n", config.sink_dsn, zmq_strerror(errno));
+        return 1;
+    }
+
+    if (config.server_argv) {
+        server = hp_bench_server_start(&config);
+
+        if (server == -1) {
+            fprintf(stderr, "Failed to start %s\n", config.server_argv[0]);
+            return 1;
+        }
+    }
+
+    clients = calloc(config.threads, sizeof (struct hp_bench_client_t));
+    if (!clients) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    config.measure_start = hp_now_ns() + (uint64_t) config.warmup_sec * 1000000000;
+    config.measure_end = config.measure_start + (uint64_t) config.duration_sec * 1000000000;
+
+    if (pthread_create(&(sink.thread), NULL, hp_bench_sink, &sink) != 0) {
+        fprintf(stderr, "Failed to start the sink\n");
+        return 1;
+    }
+
+    /* The connections are spread evenly over the threads */
+    for (i = 0; i < config.threads; i++) {
+        struct hp_bench_client_t *client = &(clients[i]);
+        int j;
+
+        client->config = &config;
+        client->num_conns = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        client->conns = calloc(client->num_conns, sizeof (struct hp_bench_conn_t));
+
+        for (j = 0; client->conns && j < client->num_conns; j++) {
+            client->conns[j].fd = -1;
+            client->conns[j].request = hp_bench_request(&config, &(client->conns[j].request_len));
+
+            if (!client->conns[j].request) {
+                break;
+            }
+        }
+
+        if (!client->conns || j < client->num_conns || pthread_create(&(client->thread), NULL, hp_bench_client, client) != 0) {
+            fprintf(stderr, "Failed to start client thread %d\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < config.threads; i++) {
+        (void) pthread_join(clients[i].thread, NULL);
+    }
+
+    /* Let the messages sent at the end of the run arrive */
+    (void) usleep(500000);
+    sink.stop = 1;
+    (void) pthread_join(sink.thread, NULL);
+
+    if (server != -1) {
+        hp_bench_server_stop(server);
+    }
+
+    if (output) {
+        out = fopen(output, "w");
+
+        if (!out) {
+            fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+            rc = 1;
+        }
+    }
+
+    if (out) {
+        hp_bench_report(out, &config, clients, &sink);
+
+        if (out != stdout) {
+            (void) fclose(out);
+        }
+    }
+
+    for (i = 0; i < config.threads; i++) {
+        int j;
+
+        for (j = 0; j < clients[i].num_conns; j++) {
+            free(clients[i].conns[j].request);
+        }
+        free(clients[i].conns);
+    }
+    free(clients);
+
+    (void) zmq_close(sink.socket);
+    (void) zmq_term(ctx);
+    return rc;
+}
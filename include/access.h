@@ -0,0 +1,104 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#ifndef __HP_ACCESS_H__
+# define __HP_ACCESS_H__
+
+#include <stdint.h>
+
+/*
+ Layout of the binary access log written with -L. Each httpd thread has
+ its own segment files named httpush.<thread>.<seq>.access. A file starts
+ with a struct hp_access_header_t followed by fixed-size records, one per
+ answered request. Integers are in host byte order. Finished segments are
+ truncated to their last record, the one being written and those left by
+ a crash end with a record whose timestamp is 0.
+ */
+
+#define HP_ACCESS_MAGIC   0x4850414c /* HPAL */
+#define HP_ACCESS_VERSION 1
+
+/* Bytes of the path kept in a record, longer ones are cut */
+#define HP_ACCESS_PATH_MAX 80
+
+/* Values of the family field */
+#define HP_ACCESS_FAMILY_NONE 0
+#define HP_ACCESS_FAMILY_IPV4 4
+#define HP_ACCESS_FAMILY_IPV6 6
+
+struct hp_access_header_t {
+    uint32_t magic;
+
+    uint16_t version;
+
+    /* sizeof (struct hp_access_record_t) */
+    uint16_t record_size;
+
+    uint32_t thread_id;
+
+    uint32_t reserved;
+
+    uint64_t seq;
+
+    /* CLOCK_REALTIME in nanoseconds when the segment was created */
+    uint64_t created;
+
+    uint64_t padding[4];
+};
+
+struct hp_access_record_t {
+    /* CLOCK_REALTIME in nanoseconds when the request arrived, written last */
+    uint64_t timestamp;
+
+    /* Nanoseconds from the arrival of the request to the reply */
+    uint64_t duration;
+
+    uint64_t body_len;
+
+    uint16_t status;
+
+    /* One of HP_ACCESS_FAMILY_*, the address is in the first 4 or 16 bytes of addr */
+    uint8_t family;
+
+    uint8_t reserved;
+
+    uint16_t port;
+
+    /* Length of the path, only the first HP_ACCESS_PATH_MAX bytes are in path */
+    uint16_t path_len;
+
+    /* Client address in network byte order */
+    uint8_t addr[16];
+
+    /* Path of the request without the query string, not terminated */
+    char path[HP_ACCESS_PATH_MAX];
+};
+
+#endif /* __HP_ACCESS_H__ */
@@ -0,0 +1,80 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#ifndef __HP_HISTOGRAM_H__
+# define __HP_HISTOGRAM_H__
+
+#include <time.h>
+
+/*
+ Log-linear latency histograms. Values below 2^(HP_HISTOGRAM_SUB_BITS + 1)
+ get a bucket each, above that every power of two is split into
+ 2^HP_HISTOGRAM_SUB_BITS buckets, which keeps the relative error under 3%.
+ Only the owning thread records into a histogram, so recording is a couple
+ of relaxed stores.
+ */
+
+static inline uint64_t hp_now_ns()
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+static inline size_t hp_histogram_index(uint64_t value)
+{
+    int msb, shift;
+    size_t index;
+
+    if (value < (2 << HP_HISTOGRAM_SUB_BITS)) {
+        return (size_t) value;
+    }
+
+    msb   = 63 - __builtin_clzll(value);
+    shift = msb - HP_HISTOGRAM_SUB_BITS;
+    index = ((size_t) (shift + 1) << HP_HISTOGRAM_SUB_BITS) + (size_t) ((value >> shift) - (1 << HP_HISTOGRAM_SUB_BITS));
+
+    return (index < HP_HISTOGRAM_BUCKETS) ? index : HP_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void hp_histogram_record(struct hp_histogram_t *histogram, uint64_t value)
+{
+    HP_COUNTER_INC(histogram->buckets[hp_histogram_index(value)]);
+    HP_COUNTER_INC(histogram->count);
+
+    if (value > histogram->max) {
+        HP_ATOMIC_STORE(&(histogram->max), value);
+    }
+}
+
+void hp_histogram_merge(struct hp_histogram_t *dst, struct hp_histogram_t *src);
+uint64_t hp_histogram_percentile(struct hp_histogram_t *histogram, double percentile);
+
+#endif /* __HP_HISTOGRAM_H__ */
@@ -61,9 +61,12 @@
 #include <syslog.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 
 /* Logging macros */
 #include "log.h"
@@ -71,8 +74,53 @@
 /* Platform specific ones */
 #include "platform.h"
 
+/* Layout of the statistics segment */
+#include "stats.h"
+
+/* Latency histograms */
+#include "histogram.h"
+
+/* Layout of the access log files */
+#include "access.h"
+
 #define HP_IDENTITY_MAX 255
 
+/* Longest command read from the monitor socket, "reload" takes a list of uris */
+#define HP_MONITOR_MESSAGE_MAX 4096
+
+/* How the HTTP listen socket(s) are shared between the httpd threads */
+typedef enum _hp_listen_mode_t {
+    /* All threads accept from the same socket */
+    HP_LISTEN_SHARED,
+    /* Each thread has its own SO_REUSEPORT socket */
+    HP_LISTEN_REUSEPORT,
+    /* A dedicated thread accepts and hands out the connections */
+    HP_LISTEN_ACCEPTOR
+} hp_listen_mode_t;
+
+/* Progress of an upgrade, sent by the new process then by the old one */
+#define HP_UPGRADE_READY 'R'
+#define HP_UPGRADE_RELEASED 'D'
+
+/* Attempts to bind the monitor and publisher sockets the old process is releasing */
+#define HP_UPGRADE_BIND_TRIES 100
+#define HP_UPGRADE_BIND_USEC 20000
+
+/* Seconds a retiring thread waits for its connections to close */
+#define HP_RETIRE_TIMEOUT 30
+
+/* How often a retiring thread checks its connections, in microseconds */
+#define HP_RETIRE_CHECK_USEC 100000
+
+/* Life of an httpd thread slot, the pool can be resized up to -T slots */
+typedef enum _hp_thread_state_t {
+    /* Never started, or retired and joined */
+    HP_THREAD_UNUSED = 0,
+    HP_THREAD_RUNNING,
+    /* Not accepting, exits once its connections are closed */
+    HP_THREAD_RETIRING
+} hp_thread_state_t;
+
 struct hp_uri_t {
 	/* the parsed 0mq uri */
     char *uri;
@@ -87,22 +135,772 @@ struct hp_uri_t {
     int linger;
 };
 
+/* Micro-batching limits, max_messages of 0 disables batching */
+struct hp_batch_config_t {
+    size_t max_messages;
+
+    size_t max_bytes;
+
+    long max_usec;
+};
+
+struct hp_batch_t {
+    struct hp_batch_config_t config;
+
+    /* Socket the batches are sent to */
+    void *socket;
+
+    /* Batch being filled */
+    char *data;
+    size_t len;
+    size_t capacity;
+    uint32_t count;
+
+    /* Size of the message between append and commit */
+    size_t pending_len;
+
+    /* Time spent sending the batches */
+    struct hp_histogram_t *send_latency;
+
+    /* Bytes sent and the queue gauges */
+    struct hp_httpd_counters_t *counters;
+
+    /* Compresses the batches, NULL if disabled */
+    struct hp_compressor_t *compressor;
+
+    /* Flushes the batch after max_usec */
+    struct event timer;
+    bool timer_pending;
+};
+
+/* The flag frame the compression stage puts in front of each message */
+#define HP_FLAGS_FRAME_SIZE 12
+
+/* Codecs of the compression stage, sent in the flag frame */
+typedef enum _hp_codec_t {
+    HP_CODEC_NONE = 0,
+    HP_CODEC_ZLIB = 1,
+    HP_CODEC_LZ4  = 2
+} hp_codec_t;
+
+/* Compression settings, HP_CODEC_NONE disables the stage */
+struct hp_compress_config_t {
+    hp_codec_t codec;
+
+    /* Messages smaller than this are not compressed */
+    size_t min_size;
+
+    /* zlib level or LZ4 acceleration */
+    int level;
+};
+
+struct hp_compressor_t {
+    struct hp_compress_config_t config;
+
+    /* Codec state, reused between messages */
+    void *state;
+
+    /* Compressed frames are written here first */
+    char *buffer;
+    size_t capacity;
+
+    /* Time spent compressing */
+    struct hp_histogram_t *latency;
+};
+
+/* Flags, header and body frames */
+#define HP_MAX_PARTS 3
+
+/* A remembered idempotency key, found again without the key itself. Hash 0 for none */
+struct hp_dedup_ref_t {
+    uint64_t hash;
+    uint32_t check;
+};
+
+/* Request waiting for its message to be sent, journaled or acknowledged */
+struct hp_waiter_t {
+    /* Request to reply to, NULL if there is none */
+    void *req;
+
+    /* Connection of the request */
+    void *owner;
+
+    /* When the request arrived */
+    uint64_t start;
+
+    /* Settled once the fate of the message is known, even if nobody is replied to */
+    struct hp_dedup_ref_t dedup;
+
+    /* The connection went away, 'req' is only handed back for the front-end to release */
+    bool detached;
+};
+
+/* Message waiting for the out socket to become writable */
+struct hp_queue_entry_t {
+    struct hp_waiter_t waiter;
+
+    /* Message frames, sent_parts of them already went out */
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int num_parts;
+    int sent_parts;
+
+    size_t size;
+};
+
+/* Called when a queued message has been sent or dropped */
+typedef void (*hp_queue_done_t)(struct hp_queue_entry_t *entry, bool sent, void *arg);
+
+/* A mapped journal file */
+struct hp_journal_segment_t {
+    int fd;
+
+    char *data;
+    size_t size;
+
+    uint64_t seq;
+
+    /* End of the records and how far they have been synced to disk */
+    size_t write_pos;
+    size_t sync_pos;
+
+    TAILQ_ENTRY(hp_journal_segment_t) entries;
+};
+
+/* Records of a segment handed to the flusher thread to sync */
+struct hp_journal_range_t {
+    struct hp_journal_segment_t *segment;
+
+    size_t start;
+    size_t end;
+
+    /* errno of the sync, 0 on success */
+    int error;
+};
+
+/*
+ Spill journal of an httpd thread. Records are appended to the last segment
+ and replayed from the first one
+ */
+struct hp_journal_t {
+    char *dir;
+    int thread_id;
+
+    size_t segment_size;
+
+    /* Cap for the size of the segment files */
+    uint64_t max_size;
+    uint64_t size;
+
+    TAILQ_HEAD(hp_journal_segments_t, hp_journal_segment_t) segments;
+    uint64_t next_seq;
+
+    /* Replay position in the first segment */
+    size_t read_pos;
+
+    /* Records and payload bytes not yet replayed */
+    uint64_t messages;
+    uint64_t bytes;
+
+    /* Group commit */
+    struct event commit_ev;
+    bool commit_pending;
+
+    struct hp_waiter_t *waiters;
+    size_t num_waiters;
+    size_t max_waiters;
+
+    /*
+     The commit the flusher thread is syncing, started and finished through
+     the pipes. Segments replayed meanwhile wait in 'retired' until it is done
+     */
+    bool syncing;
+    bool commit_again;
+
+    struct hp_waiter_t *sync_waiters;
+    size_t num_sync_waiters;
+    size_t max_sync_waiters;
+
+    struct hp_journal_range_t *ranges;
+    size_t num_ranges;
+    size_t max_ranges;
+
+    struct hp_journal_segments_t retired;
+
+    pthread_t flusher;
+    bool flusher_running;
+    int to_flusher[2];
+    int from_flusher[2];
+    struct event flushed_ev;
+
+    /* Called for the waiters once their records are on disk */
+    hp_queue_done_t done;
+    void *done_arg;
+
+    /* The journal gauges */
+    struct hp_httpd_counters_t *counters;
+};
+
+struct hp_access_config_t {
+    /* Directory of the segment files, NULL if disabled */
+    char *dir;
+
+    size_t segment_size;
+
+    /* Segment files kept per thread, the oldest are removed */
+    size_t max_files;
+};
+
+/* Client address as it goes into the access log records */
+struct hp_access_addr_t {
+    uint8_t family;
+
+    uint16_t port;
+
+    uint8_t addr[16];
+};
+
+/*
+ Access log of an httpd thread. Records are written straight into the
+ mapped segment, a new segment is started once it is full
+ */
+struct hp_access_log_t {
+    int thread_id;
+
+    struct hp_access_config_t config;
+
+    /* Sequence numbers of the segments kept, oldest first. The last one is being written */
+    uint64_t *seqs;
+    size_t num_seqs;
+    uint64_t next_seq;
+
+    /* The segment being written, data is NULL if there is none */
+    int fd;
+    char *data;
+    size_t size;
+    size_t write_pos;
+
+    /* CLOCK_REALTIME minus CLOCK_MONOTONIC, taken again once a second */
+    uint64_t clock_offset;
+    uint64_t clock_refresh;
+
+    /* Records lost while no segment could be created, and when to try again */
+    uint64_t dropped;
+    uint64_t retry_at;
+};
+
+typedef enum _hp_queue_status_t {
+    /* The socket took the message */
+    HP_QUEUE_SENT,
+    /* The message is queued, the done callback replies */
+    HP_QUEUE_PENDING,
+    /* The queue is full */
+    HP_QUEUE_FULL,
+    /* Sending failed, 'errno' tells why */
+    HP_QUEUE_ERROR
+} hp_queue_status_t;
+
+/* Bounded queue of messages drained when the out socket signals POLLOUT */
+struct hp_queue_t {
+    void *socket;
+
+    struct event_base *base;
+
+    /* Ring of entries */
+    struct hp_queue_entry_t *entries;
+    size_t size;
+    size_t head;
+    size_t count;
+    uint64_t bytes;
+
+    /* ZMQ_FD of the socket, watched while the queue is not empty */
+    struct event ev;
+    bool ev_pending;
+
+    hp_queue_done_t done;
+    void *done_arg;
+
+    /* Time spent in zmq_send */
+    struct hp_histogram_t *send_latency;
+
+    /* Bytes sent and the queue gauges */
+    struct hp_httpd_counters_t *counters;
+
+    /* Takes the messages when the queue is full, NULL if disabled */
+    struct hp_journal_t *journal;
+
+    /* Parts of the journal record being replayed that went out already */
+    int replay_parts;
+
+    /* Called once when the queue is empty and the socket writable */
+    bool idle_wanted;
+    void (*idle)(void *arg);
+    void *idle_arg;
+};
+
+/* Acknowledgements from the backend, max_inflight of 0 disables them */
+struct hp_ack_config_t {
+    /* Messages of a thread waiting for their ack */
+    size_t max_inflight;
+
+    /* How long to wait for an ack */
+    long timeout_msec;
+};
+
+typedef enum _hp_ack_status_t {
+    /* The backend acknowledged the message */
+    HP_ACK_OK,
+    /* No ack within the timeout */
+    HP_ACK_TIMEOUT,
+    /* Still waiting at shutdown */
+    HP_ACK_DROPPED
+} hp_ack_status_t;
+
+/* Called once the fate of an acknowledged message is known */
+typedef void (*hp_ack_done_t)(struct hp_waiter_t *waiter, hp_ack_status_t status, void *arg);
+
+/* Message waiting for its ack, the slot index and generation make the id */
+struct hp_ack_entry_t {
+    struct hp_waiter_t waiter;
+
+    /* When the message was sent */
+    uint64_t sent;
+
+    /* Bumped whenever the slot is taken so that late acks are ignored */
+    uint32_t generation;
+
+    /* Links of the in-flight list, or of the free list */
+    uint32_t prev;
+    uint32_t next;
+
+    bool in_flight;
+};
+
+/*
+ Messages sent on the DEALER socket of a thread and waiting for the backend
+ to acknowledge them. All messages have the same timeout, so they time out
+ in the order they were sent
+ */
+struct hp_ack_t {
+    void *socket;
+
+    struct event_base *base;
+
+    /* Previous socket after a reload, read until the messages sent on it
+       before drain_start are acked or time out */
+    void *draining;
+    uint64_t drain_start;
+    struct event drain_ev;
+
+    struct hp_ack_entry_t *entries;
+    uint32_t size;
+    uint32_t count;
+
+    uint32_t free_head;
+
+    /* In-flight messages, oldest first */
+    uint32_t oldest;
+    uint32_t newest;
+
+    /* Nanoseconds to wait for an ack */
+    uint64_t timeout;
+
+    /* ZMQ_FD of the socket, watched for the acks */
+    struct event ev;
+    bool ev_pending;
+
+    /* Fires when the oldest message times out */
+    struct event timer;
+    bool timer_pending;
+
+    hp_ack_done_t done;
+    void *done_arg;
+
+    /* Time spent in zmq_send and waiting for the acks */
+    struct hp_histogram_t *send_latency;
+    struct hp_histogram_t *latency;
+
+    /* Bytes sent and the ack counters */
+    struct hp_httpd_counters_t *counters;
+};
+
+/* Deduplication of retried requests, max_keys of 0 disables it */
+struct hp_dedup_config_t {
+    /* Header carrying the idempotency key */
+    char *header;
+    size_t header_len;
+
+    /* Keys remembered, shared by all threads */
+    size_t max_keys;
+
+    /* How long a key is remembered */
+    long ttl_sec;
+};
+
+/* Hash of a remembered key, 0 if the slot has never been used */
+struct hp_dedup_slot_t {
+    uint64_t key;
+
+    /* Second hash of the key, expiry in seconds and the in-flight bit, see dedup.c */
+    uint64_t state;
+};
+
+/* Slots a key can be in, one cache line */
+#define HP_DEDUP_WAYS (HP_CACHE_LINE_SIZE / sizeof (struct hp_dedup_slot_t))
+
+struct hp_dedup_bucket_t {
+    struct hp_dedup_slot_t slots[HP_DEDUP_WAYS];
+} HP_CACHE_ALIGNED;
+
+/*
+ Keys of the requests published recently, shared by the httpd threads
+ without locks. A key can only be in the bucket its hash picks, so memory
+ is fixed and a lookup touches one cache line
+ */
+struct hp_dedup_t {
+    struct hp_dedup_config_t config;
+
+    struct hp_dedup_bucket_t *buckets;
+    size_t mask;
+
+    /* Seconds */
+    uint64_t ttl;
+
+    /* Key of the second hash */
+    uint64_t seed;
+};
+
+typedef enum _hp_dedup_status_t {
+    /* First time the key is seen, it is in flight until done or forgotten */
+    HP_DEDUP_NEW,
+    /* A request with the key got published */
+    HP_DEDUP_DONE,
+    /* A request with the key is still being published */
+    HP_DEDUP_PENDING
+} hp_dedup_status_t;
+
+/* Streaming of large request bodies, threshold of 0 disables streaming */
+struct hp_stream_config_t {
+    /* Bodies larger than this are streamed */
+    size_t threshold;
+
+    /* Size of the body frames of a stream */
+    size_t chunk_size;
+};
+
+/* Where a connection of the front-end in conn.c is in the request */
+typedef enum _hp_conn_state_t {
+    /* Reading the request line and headers */
+    HP_CONN_HEAD,
+    /* Reading the body */
+    HP_CONN_BODY,
+    /* Body being streamed, not read until the out socket takes more */
+    HP_CONN_WAITING,
+    /* Waiting for the message to be sent or journaled */
+    HP_CONN_REPLY,
+    /* Writing the last reply before closing */
+    HP_CONN_CLOSING
+} hp_conn_state_t;
+
+/* How the body of a request is delimited */
+typedef enum _hp_conn_body_t {
+    HP_CONN_LENGTH,
+    HP_CONN_CHUNK_SIZE,
+    HP_CONN_CHUNK_DATA,
+    HP_CONN_CHUNK_END,
+    HP_CONN_TRAILER,
+    /* The whole body has been read */
+    HP_CONN_DONE
+} hp_conn_body_t;
+
+/* Path prefix whose messages go to sockets of its own, see -r */
+struct hp_route_t {
+    char *prefix;
+    size_t prefix_len;
+
+    struct hp_uri_t **uris;
+    size_t num_uris;
+};
+
+/* Node of the route trie, reached over the edge 'label' */
+struct hp_route_node_t {
+    const char *label;
+    uint32_t label_len;
+
+    /* Children are adjacent in the node array, sorted by their first byte */
+    uint32_t first_child;
+    uint32_t num_children;
+
+    /* Route whose prefix ends here, -1 if none */
+    int route;
+};
+
+/* Compressed prefix trie of the routes, the root is the first node */
+struct hp_route_trie_t {
+    struct hp_route_node_t *nodes;
+    size_t num_nodes;
+};
+
+/* Where the -K sharding key of a request is read from */
+typedef enum _hp_shard_source_t {
+    HP_SHARD_NONE,
+    HP_SHARD_HEADER,
+    HP_SHARD_QUERY
+} hp_shard_source_t;
+
+struct hp_shard_config_t {
+    hp_shard_source_t source;
+
+    /* Header or query parameter holding the key */
+    char *name;
+    size_t name_len;
+};
+
+/*
+ Socket(s) of a -r route or a -K shard in an httpd thread and the stages in
+ front of them
+ */
+struct hp_output_t {
+    void *socket;
+
+    struct hp_batch_t batch;
+    struct hp_queue_t queue;
+
+    /* In the statistics segment */
+    struct hp_output_counters_t *counters;
+};
+
+/* Path of the endpoint splitting newline-delimited bodies into messages */
+#define HP_BATCH_PATH "/batch"
+
+/* Longest line of a batch body read by the conn.c front-end */
+#define HP_BATCH_MAX_LINE (1024 * 1024)
+
+/* Largest request line and headers accepted by the parser in parser.c */
+#define HP_REQUEST_MAX_HEAD 65536
+
+#define HP_REQUEST_MAX_HEADERS 64
+
+typedef enum _hp_parse_status_t {
+    /* The head was parsed */
+    HP_PARSE_DONE,
+    /* The head is not complete yet */
+    HP_PARSE_MORE,
+    HP_PARSE_ERROR,
+    /* Too long a head or too many headers */
+    HP_PARSE_TOO_LARGE,
+    /* A transfer coding other than chunked */
+    HP_PARSE_UNSUPPORTED
+} hp_parse_status_t;
+
+/* Header of a parsed request, offsets from the start of the head */
+struct hp_request_header_t {
+    uint32_t key;
+    uint32_t key_len;
+    uint32_t value;
+    uint32_t value_len;
+};
+
+/* Request line and headers parsed in place, the method starts the head */
+struct hp_request_t {
+    size_t head_len;
+
+    uint32_t method_len;
+    uint32_t uri;
+    uint32_t uri_len;
+    int minor_version;
+
+    /* Headers acted upon by the front-end */
+    uint64_t content_length;
+    bool has_length;
+    bool has_encoding;
+    bool chunked;
+    bool keep_alive;
+    bool expect_continue;
+
+    /* Index of the X-Forwarded-For header, -1 if none */
+    int xff;
+
+    int num_headers;
+    struct hp_request_header_t headers[HP_REQUEST_MAX_HEADERS];
+};
+
+struct hp_httpd_thread_t;
+
+/* Connection of the HTTP front-end in conn.c */
+struct hp_conn_t {
+    struct hp_httpd_thread_t *thread;
+
+    int fd;
+    char remote_host[NI_MAXHOST];
+    struct hp_access_addr_t remote_addr;
+
+    struct event read_ev;
+    struct event write_ev;
+    bool reading;
+    bool writing;
+
+    /* Bytes read but not parsed yet and replies not written yet */
+    struct evbuffer *input;
+    struct evbuffer *output;
+
+    hp_conn_state_t state;
+
+    /* Copy of the head the current request was parsed from */
+    struct hp_request_t request;
+    char *head;
+    size_t head_capacity;
+
+    /* Body read so far when it can't be published from the input */
+    struct evbuffer *body;
+
+    /* Body delimiting and the bytes left of the body or chunk */
+    hp_conn_body_t framing;
+    uint64_t remaining;
+    uint64_t body_len;
+
+    bool keep_alive;
+
+    /* Where the messages of the request go, NULL for the out socket */
+    struct hp_output_t *target;
+
+    /* Body is split into messages by line, see HP_BATCH_PATH */
+    bool batch;
+    uint32_t accepted;
+    uint32_t rejected;
+
+    /* Header frame shared by the messages, bytes without a newline and
+       whether the rest of an overlong line is skipped */
+    zmq_msg_t batch_header;
+    bool has_batch_header;
+    size_t batch_scanned;
+    bool batch_skip;
+
+    /* Idempotency key remembered for the request, settled once it is published or not */
+    struct hp_dedup_ref_t dedup;
+
+    /* Body is being streamed: the id of the stream, messages and body bytes
+       sent so far and the header frame each message carries */
+    bool streaming;
+    uint64_t stream_id;
+    uint32_t stream_seq;
+    uint64_t stream_sent;
+    zmq_msg_t stream_header;
+    bool has_stream_header;
+
+    uint64_t start;
+
+    TAILQ_ENTRY(hp_conn_t) entries;
+    TAILQ_ENTRY(hp_conn_t) waiters;
+};
+
+TAILQ_HEAD(hp_conns_t, hp_conn_t);
+
 struct httpush_args_t {
     /* 0MQ context */
     void *ctx;
 
-    int fd;
+    /* HTTP listen sockets, one per thread in HP_LISTEN_REUSEPORT mode */
+    int *fds;
+    size_t num_fds;
+
+    hp_listen_mode_t listen_mode;
+
+    /* Size the thread pool can grow to at runtime, at least the initial -t */
+    int max_threads;
+
+    /* cpus to pin the httpd threads to, assigned round-robin */
+    int *cpus;
+    size_t num_cpus;
+
+    /* 0MQ I/O thread used by the out socket of each httpd thread, round-robin */
+    int *io_affinity;
+    size_t num_io_affinity;
+
+    /* One 0MQ context per NUMA node for the out sockets, NULL if not used */
+    void **node_ctx;
+    int num_nodes;
 
     /* 0MQ backend uri */
     struct hp_uri_t **uris;
     size_t num_uris;
 
+    /* File the uris are read from with -F, re-read on reload. NULL if not used */
+    char *uri_file;
+
+    /* Default hwm of the uris, for parsing them again on reload */
+    int64_t hwm;
+
+    /* Path prefixes with sockets of their own and the trie to find them */
+    struct hp_route_t *routes;
+    size_t num_routes;
+    struct hp_route_trie_t route_trie;
+
+    /* Gives each uri of -z a socket of its own, picked by a key */
+    struct hp_shard_config_t shard;
+
     /* 0MQ backend uri */
     struct hp_uri_t **m_uris;
     size_t num_m_uris;
 
     /* Whether to include headers in the messages */
     bool include_headers;
+
+    /* Micro-batching of messages */
+    struct hp_batch_config_t batch;
+
+    /* Compression of the messages */
+    struct hp_compress_config_t compress;
+
+    /* Messages each thread holds while the out socket is full, 0 disables */
+    size_t queue_size;
+
+    /* Replies wait for the backend to acknowledge the messages */
+    struct hp_ack_config_t ack;
+
+    /* Requests whose key was seen recently are not published again */
+    struct hp_dedup_config_t dedup;
+
+    /* Whether to serve the connections with conn.c instead of evhttp */
+    bool frontend;
+
+    /* Streaming of large bodies, uses the conn.c front-end */
+    struct hp_stream_config_t stream;
+
+    /* Spill journal directory, NULL if disabled */
+    const char *journal_dir;
+    size_t journal_segment_size;
+    uint64_t journal_max_size;
+
+    /* Binary access log, disabled if the directory is NULL */
+    struct hp_access_config_t access;
+
+    /* Listen socket of the admin HTTP listener, -1 if disabled */
+    int admin_fd;
+
+    /* Unix socket a new process takes the listen sockets from with -U, -1 if disabled */
+    int upgrade_fd;
+
+    /* Connection to the process the listen sockets were taken from, -1 if none */
+    int upgrade_conn;
+
+    /* Where statistics deltas are published */
+    struct hp_uri_t **p_uris;
+    size_t num_p_uris;
+
+    long publish_usec;
+};
+
+/* Sockets a running process passes to the one replacing it */
+struct hp_upgrade_fds_t {
+    /* Unix socket the next upgrade connects to */
+    int listener;
+
+    /* HTTP listen sockets, one per thread with -a reuseport */
+    int *fds;
+    size_t num_fds;
+
+    /* Listen socket of the admin HTTP listener, -1 if there is none */
+    int admin_fd;
 };
 
 struct hp_pair_t {
@@ -110,16 +908,19 @@ struct hp_pair_t {
     void *back;
 };
 
-struct hp_httpd_counters_t {
-    uint64_t code_200;
+/* The mapped statistics segment */
+struct hp_stats_t {
+    char name[64];
 
-    uint64_t code_404;
+    size_t size;
 
-    uint64_t code_412;
+    struct hp_stats_header_t *header;
 
-    uint64_t code_503;
+    struct hp_stats_slot_t *slots;
 
-    uint64_t requests;
+    /* num_outputs slots per thread */
+    struct hp_stats_output_slot_t *output_slots;
+    size_t num_outputs;
 };
 
 struct hp_httpd_thread_t {
@@ -129,14 +930,88 @@ struct hp_httpd_thread_t {
     /* The thread */
     pthread_t thread;
 
+    /* cpu the thread is pinned to, -1 if not pinned */
+    int cpu;
+
+    /* NUMA node of the thread */
+    int numa_node;
+
     struct hp_pair_t intercomm;
 
     /* Socket to communicate with device */
     void *out_socket;
 
+    /* Context and I/O thread affinity the out socket was created with */
+    void *out_ctx;
+    uint64_t affinity;
+
+    /* Out socket for the reloaded -z uris, handed over by the parent */
+    void *reload_socket;
+
+    /* Reloaded socket taken by the thread, used once no message is half sent */
+    void *next_socket;
+    struct event switch_ev;
+    bool switch_pending;
+
+    /* Sockets of the -r routes followed by those of the -K shards */
+    struct hp_output_t *outputs;
+    size_t num_outputs;
+
+    struct hp_route_trie_t *route_trie;
+    size_t num_routes;
+
+    /* With -K there is no out socket but a socket per -z uri */
+    bool sharding;
+    struct hp_shard_config_t shard;
+    struct hp_output_t *shards;
+    size_t num_shards;
+
+    /* Shard of the next request without a key */
+    size_t next_shard;
+
     /* Whether to include headers in the messages */
     bool include_headers;
 
+    /* Compresses the messages, if compression is enabled */
+    bool compressing;
+    struct hp_compressor_t compressor;
+
+    /* Messages waiting to be sent, if batching is enabled */
+    bool batching;
+    struct hp_batch_t batch;
+
+    /* Messages waiting for the out socket, if the queue is enabled */
+    bool queueing;
+    struct hp_queue_t queue;
+
+    /* Spill journal behind the queue */
+    bool journaling;
+    struct hp_journal_t journal;
+
+    /* Record of each answered request, if -L is given */
+    bool access_logging;
+    struct hp_access_log_t access_log;
+
+    /* Messages waiting for their ack, the out socket is a DEALER then */
+    bool acking;
+    struct hp_ack_t ack;
+
+    /* Keys of the recent requests, shared by the threads. NULL if disabled */
+    struct hp_dedup_t *dedup;
+
+    /* Connections are served by conn.c instead of evhttp */
+    bool frontend;
+
+    /* Large bodies are streamed, only with the conn.c front-end */
+    bool streaming;
+    struct hp_stream_config_t stream;
+    struct hp_conns_t conns;
+
+    /* Bodies being streamed and the connections waiting for the out socket */
+    int streams;
+    struct hp_conns_t stream_waiters;
+    bool stream_waking;
+
     /* Base structure */
     struct event_base *base;
 
@@ -146,17 +1021,135 @@ struct hp_httpd_thread_t {
     /* If the shutdown event arrives */
     struct event intercomm_ev;
 
-    /* Counters for the current thread */
-    struct hp_httpd_counters_t counters;
+    /* Socket this thread accepts connections from, -1 with an acceptor */
+    int listen_fd;
+    struct event accept_ev;
+
+    /* evhttp accepts the connections itself, conn.c through accept_ev */
+    struct evhttp_bound_socket *bound;
+
+    /* Connections handed over by the acceptor thread */
+    int handoff[2];
+    struct event handoff_ev;
+
+    /* Open connections, read by the acceptor thread */
+    int64_t connections;
+
+    /* Only touched by the parent */
+    hp_thread_state_t state;
+
+    /* Closing the connections as their requests finish, then exiting */
+    bool retiring;
+    uint64_t retire_deadline;
+    struct event retire_ev;
+
+    /* Set by the thread once its event loop has ended */
+    int finished;
+
+    /* Counters for the current thread, in the statistics segment */
+    struct hp_httpd_counters_t *counters;
+
+    /* Latency histograms, indexed by hp_latency_t */
+    struct hp_histogram_t *latency;
+};
+
+struct hp_acceptor_t;
+
+/* Publishes statistics deltas on a PUB socket */
+struct hp_stats_publisher_t {
+    void *socket;
+
+    /* Nanoseconds between the deltas */
+    uint64_t interval;
+
+    /* Timestamps of the previous and the next delta */
+    uint64_t last;
+    uint64_t next;
+
+    uint32_t sequence;
+
+    /* Counters sent in the previous delta */
+    struct hp_httpd_counters_t *previous;
+
+    char *buffer;
+    size_t capacity;
+};
+
+/* Admin HTTP listener */
+struct hp_admin_t {
+    pthread_t thread;
+
+    struct event_base *base;
+
+    struct evhttp *httpd;
+
+    /* Used to stop the event loop */
+    int wakeup[2];
+    struct event wakeup_ev;
+
+    struct hp_stats_t *stats;
+    int num_threads;
+
+    /* Read from the statistics segment on every request */
+    int running_threads;
+    int used_threads;
+
+    /* Preallocated space for rendering the responses */
+    char *buffer;
+    size_t capacity;
+    struct evbuffer *evb;
+
+    struct hp_httpd_counters_t sum;
+    struct hp_httpd_counters_t *per_thread;
+    struct hp_histogram_t *latency;
+};
+
+/* State of the parent thread */
+struct hp_server_t {
+    struct httpush_args_t *args;
+
+    /* Slots for -T threads, the first used_threads have been started */
+    struct hp_httpd_thread_t *threads;
+    int num_threads;
+    int used_threads;
+
+    int running_threads;
+    int retiring_threads;
+
+    /* Accepts the connections in HP_LISTEN_ACCEPTOR mode */
+    struct hp_acceptor_t *acceptor;
+
+    /* Shared memory counters */
+    struct hp_stats_t stats;
+
+    /* Keys of the recent requests, NULL if -D is not given */
+    struct hp_dedup_t *dedup;
+
+    /* Serves /metrics and /stats.json, NULL if not enabled */
+    struct hp_admin_t *admin;
+
+    /* Streams statistics deltas, NULL if not enabled */
+    struct hp_stats_publisher_t *publisher;
+
+    void *monitor_socket;
+
+    /* A new process took over, the threads are retiring and the loop ends with them */
+    bool upgraded;
+
+    /* Connection to the new process while it starts, -1 if none */
+    int upgrade_conn;
 };
 
 #define HP_SEC_TO_MSEC(sec_) (sec_ * 1000000)
 
+#define HP_USEC_TO_TIMEVAL(usec_, tv_) { (tv_).tv_sec = (usec_) / 1000000; (tv_).tv_usec = (usec_) % 1000000; }
+
 typedef enum _hp_command_t {
     HTTPD_READY = 10,
     HTTPD_FAIL,
     HTTPD_SHUTDOWN,
-    HTTPD_STATS,
+    HTTPD_RETIRE,
+    HTTPD_RELOAD,
     MONITOR_STATS
 } hp_command_t;
 
@@ -171,6 +1164,12 @@ enum {
 bool hp_sendmsg(void *socket, const void *message, size_t message_len, int flags);
 bool hp_recvmsg(void *socket, void **message, size_t *message_len, int flags);
 
+/*
+	Sending prepared messages. Both close / release the message
+*/
+bool hp_sendmsg_zmq(void *socket, zmq_msg_t *msg, int flags);
+bool hp_sendmsg_nocopy(void *socket, void *message, size_t message_len, zmq_free_fn *ffn, void *hint, int flags);
+
 /*
 	Sending and receiving commands
 */
@@ -192,14 +1191,155 @@ bool hp_recvmsg_ident(void *socket, char identity[HP_IDENTITY_MAX], size_t *iden
 bool hp_create_pair(void *context, struct hp_pair_t *pair, int pair_id);
 bool hp_close_pair(struct hp_pair_t *pair);
 
+/*
+	Option values, the uris are in the -z format
+*/
+int64_t hp_unit_to_bytes(const char *expression, bool *success);
+struct hp_uri_t **hp_parse_dsn_param(const char *param, size_t *num, int64_t default_hwm, uint64_t default_swap);
+void hp_free_uris(struct hp_uri_t **uris, size_t num_uris);
+char *hp_read_uri_file(const char *path);
+
+/* Micro-batching in batch.c */
+bool hp_batch_init(struct hp_batch_t *batch, struct hp_batch_config_t *config, struct event_base *base, void *socket);
+char *hp_batch_append(struct hp_batch_t *batch, size_t header_len, size_t body_len);
+void hp_batch_commit(struct hp_batch_t *batch);
+bool hp_batch_flush(struct hp_batch_t *batch);
+void hp_batch_free(struct hp_batch_t *batch);
+
+/* Compression stage in compress.c */
+bool hp_compressor_init(struct hp_compressor_t *compressor, struct hp_compress_config_t *config);
+int hp_compress_message(struct hp_compressor_t *compressor, zmq_msg_t *parts, int num_parts);
+void hp_compress_stream_flags(char *p, uint32_t header_len, uint32_t body_len);
+void hp_compressor_free(struct hp_compressor_t *compressor);
+
+/* Backpressure queue in queue.c */
+bool hp_queue_init(struct hp_queue_t *queue, size_t size, struct event_base *base, void *socket, hp_queue_done_t done, void *done_arg);
+hp_queue_status_t hp_queue_send(struct hp_queue_t *queue, const struct hp_waiter_t *waiter, zmq_msg_t *parts, int num_parts);
+void hp_queue_set_journal(struct hp_queue_t *queue, struct hp_journal_t *journal);
+void hp_queue_detach(struct hp_queue_t *queue, void *owner);
+bool hp_queue_idle(struct hp_queue_t *queue);
+void hp_queue_notify_idle(struct hp_queue_t *queue);
+bool hp_queue_set_socket(struct hp_queue_t *queue, void *socket);
+void hp_queue_free(struct hp_queue_t *queue);
+
+/* Backend acknowledgements in ack.c */
+bool hp_ack_init(struct hp_ack_t *ack, struct hp_ack_config_t *config, struct event_base *base, void *socket, hp_ack_done_t done, void *done_arg);
+hp_queue_status_t hp_ack_send(struct hp_ack_t *ack, const struct hp_waiter_t *waiter, zmq_msg_t *parts, int num_parts);
+void hp_ack_detach(struct hp_ack_t *ack, void *owner);
+bool hp_ack_set_socket(struct hp_ack_t *ack, void *socket);
+void hp_ack_free(struct hp_ack_t *ack);
+
+/* Deduplication in dedup.c */
+bool hp_dedup_init(struct hp_dedup_t *dedup, struct hp_dedup_config_t *config);
+hp_dedup_status_t hp_dedup_check(struct hp_dedup_t *dedup, const char *key, size_t key_len, uint64_t now, struct hp_httpd_counters_t *counters, struct hp_dedup_ref_t *ref);
+void hp_dedup_settle(struct hp_dedup_t *dedup, struct hp_dedup_ref_t *ref, bool sent, uint64_t now);
+void hp_dedup_free(struct hp_dedup_t *dedup);
+
+/* Spill journal in journal.c */
+bool hp_journal_open(struct hp_journal_t *journal, const char *dir, int thread_id, size_t segment_size, uint64_t max_size, struct event_base *base);
+bool hp_journal_append(struct hp_journal_t *journal, zmq_msg_t *parts, int num_parts, const struct hp_waiter_t *waiter);
+bool hp_journal_peek(struct hp_journal_t *journal, struct iovec *parts, int *num_parts);
+void hp_journal_consume(struct hp_journal_t *journal);
+bool hp_journal_empty(struct hp_journal_t *journal);
+void hp_journal_detach(struct hp_journal_t *journal, void *owner);
+void hp_journal_close(struct hp_journal_t *journal);
+
+/* Access log in access.c */
+bool hp_access_open(struct hp_access_log_t *log, const struct hp_access_config_t *config, int thread_id);
+void hp_access_addr_from_sockaddr(struct hp_access_addr_t *addr, const struct sockaddr *sa);
+void hp_access_addr_from_string(struct hp_access_addr_t *addr, const char *host, uint16_t port);
+void hp_access_write(struct hp_access_log_t *log, uint64_t start, uint64_t now, int status, uint64_t body_len,
+                     const struct hp_access_addr_t *addr, const char *path, size_t path_len);
+void hp_access_close(struct hp_access_log_t *log);
+
+/* Statistics segment in stats.c */
+bool hp_stats_create(struct hp_stats_t *stats, int num_threads, size_t num_outputs);
+void hp_stats_destroy(struct hp_stats_t *stats);
+void hp_stats_set_threads(struct hp_stats_t *stats, int running_threads, int used_threads);
+struct hp_httpd_counters_t *hp_stats_counters(struct hp_stats_t *stats, int thread_id);
+struct hp_histogram_t *hp_stats_latency(struct hp_stats_t *stats, int thread_id);
+struct hp_output_counters_t *hp_stats_output_counters(struct hp_stats_t *stats, int thread_id, size_t output);
+void hp_stats_read_output_counters(struct hp_output_counters_t *dst, struct hp_output_counters_t *src);
+void hp_stats_read_counters(struct hp_httpd_counters_t *dst, struct hp_httpd_counters_t *src);
+void hp_stats_sum_counters(struct hp_httpd_counters_t *sum, struct hp_httpd_counters_t *counters);
+bool hp_stats_publisher_init(struct hp_stats_publisher_t *publisher, void *socket, long interval_usec, int num_threads);
+long hp_stats_publisher_timeout(struct hp_stats_publisher_t *publisher);
+bool hp_stats_publish(struct hp_stats_publisher_t *publisher, struct hp_stats_t *stats, int num_threads);
+void hp_stats_publisher_free(struct hp_stats_publisher_t *publisher);
+
+/* Admin HTTP listener in admin.c */
+bool hp_admin_init(struct hp_admin_t *admin, struct hp_stats_t *stats, int num_threads, int fd);
+void hp_admin_stop(struct hp_admin_t *admin);
+void hp_admin_free(struct hp_admin_t *admin);
+
+/* Passing the listen sockets to a new process in upgrade.c */
+int hp_upgrade_listen(const char *path);
+bool hp_upgrade_connect(const char *path, int *conn);
+int hp_upgrade_send(struct hp_upgrade_fds_t *fds);
+bool hp_upgrade_recv(int conn, struct hp_upgrade_fds_t *fds);
+bool hp_upgrade_notify(int conn, char state);
+int hp_upgrade_wait(int conn);
+bool hp_listen_fds_inherited(int **fds, size_t *num_fds);
+
+/* cpu and NUMA placement in affinity.c */
+bool hp_parse_cpu_list(const char *list, int **cpus, size_t *num_cpus);
+int hp_numa_num_nodes();
+int hp_numa_cpu_node(int cpu);
+bool hp_thread_attr_cpu(pthread_attr_t *attr, int cpu);
+void *hp_numa_context(int node, int io_threads);
+
 int hp_server_boostrap(struct httpush_args_t *args, int http_threads);
 
 void hp_httpd_intercomm_cb(int fd, short event, void *args);
 
-struct evbuffer *hp_counters_to_xml(struct hp_httpd_counters_t *counter, int responses, int threads);
+struct evbuffer *hp_counters_to_xml(struct hp_httpd_counters_t *counter, struct hp_httpd_counters_t *thread_counters, struct hp_histogram_t *latency, int responses, int threads,
+                                    struct httpush_args_t *args, struct hp_output_counters_t *output_counters);
+
+/* Connection handling in httpd.c */
+struct hp_handoff_t {
+    int fd;
+    socklen_t addr_len;
+    struct sockaddr_storage addr;
+};
+
+void hp_httpd_accept_cb(int fd, short event, void *args);
+void hp_httpd_handoff_cb(int fd, short event, void *args);
+bool hp_httpd_accept_socket(struct hp_httpd_thread_t *thread);
 
 /* evhttp callbacks in httpd.c */
 void hp_httpd_publish_message(struct evhttp_request *req, void *args);
+void hp_httpd_queue_done(struct hp_queue_entry_t *entry, bool sent, void *args);
+void hp_httpd_ack_done(struct hp_waiter_t *waiter, hp_ack_status_t status, void *args);
+hp_queue_status_t hp_httpd_publish_parts(struct hp_httpd_thread_t *thread, struct hp_output_t *output, zmq_msg_t *parts, int num_parts,
+                                         const struct hp_waiter_t *waiter);
+struct hp_output_t *hp_httpd_output(struct hp_httpd_thread_t *thread, const char *uri, size_t uri_len, const char *key, size_t key_len);
+void hp_httpd_detach(struct hp_httpd_thread_t *thread, void *owner);
+bool hp_httpd_headers_to_msg(struct evhttp_request *req, zmq_msg_t *msg);
+bool hp_httpd_body_to_msg(struct evhttp_request *req, zmq_msg_t *msg);
+void hp_httpd_publish_batch(struct evhttp_request *req, void *args);
+size_t hp_httpd_publish_lines(struct hp_httpd_thread_t *thread, struct hp_output_t *output, zmq_msg_t *header, const char *data, size_t len, bool last,
+                              uint32_t *accepted, uint32_t *rejected);
+
+/* Path routing and sharding in route.c */
+bool hp_route_trie_build(struct hp_route_trie_t *trie, struct hp_route_t *routes, size_t num_routes);
+int hp_route_match(struct hp_route_trie_t *trie, const char *path, size_t len);
+void hp_route_trie_free(struct hp_route_trie_t *trie);
+uint64_t hp_key_hash(const char *key, size_t key_len);
+uint32_t hp_shard_pick(const char *key, size_t key_len, uint32_t num_shards);
+const char *hp_query_find(const char *uri, size_t uri_len, const char *name, size_t name_len, size_t *value_len);
+
+/* Request parser in parser.c */
+hp_parse_status_t hp_parse_request(const char *data, size_t len, struct hp_request_t *req);
+size_t hp_request_frame_size(struct hp_request_t *req, size_t remote_host_len);
+char *hp_request_frame_write(struct hp_request_t *req, const char *head, const char *remote_host, size_t remote_host_len, char *p);
+
+/* HTTP front-end in conn.c */
+bool hp_conn_new(struct hp_httpd_thread_t *thread, int fd, struct sockaddr *sa, socklen_t salen);
+void hp_conn_queue_done(struct hp_queue_entry_t *entry, bool sent, void *args);
+void hp_conn_ack_done(struct hp_waiter_t *waiter, hp_ack_status_t status, void *args);
+void hp_conn_stream_idle(void *args);
+void hp_conn_free_all(struct hp_httpd_thread_t *thread);
+void hp_conn_close_idle(struct hp_httpd_thread_t *thread);
 #ifdef DEBUG
 void hp_httpd_reflect_request(struct evhttp_request *req, void *param);
 #endif
@@ -31,27 +31,51 @@
 #ifndef __HP_LOG_H__
 # define __HP_LOG_H__
 
-#ifdef DEBUG
+/*
+ Every HP_LOG_* call site has one of these. A site logs at most
+ HP_LOG_BURST messages a second, the rest are counted and reported as
+ suppressed
+ */
+struct hp_log_site_t {
+    const char *file;
+    int line;
+    int level;
+
+    /* Second being counted and the messages logged and held back in it */
+    int64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+
+    /* Sites are linked once used, for the writer to report what was held back */
+    int registered;
+    struct hp_log_site_t *next;
+};
+
+/*
+ Formats the message into the ring of the calling thread, the writer thread
+ sends it to stderr (DEBUG) or syslog. Threads without a ring write directly.
+ Formatting stays with the caller, see log.c
+ */
+void hp_log_write(struct hp_log_site_t *site, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+bool hp_log_start(void);
+void hp_log_stop(void);
+bool hp_log_thread_start(void);
+void hp_log_thread_stop(void);
+
 #define HP_DO_LOG(level_, ...) { \
-    time_t my_time; \
-    char buffer_[26], line_[256]; \
-    time(&my_time); \
-    ctime_r(&my_time, buffer_); \
-    (void) snprintf(line_, 256, __VA_ARGS__); \
-    fprintf(stderr, "[%24.24s] [%s:%d] [%s] %s\n", buffer_, __FILE__, __LINE__, level_, line_); \
+    static struct hp_log_site_t site_ = {__FILE__, __LINE__, level_, 0, 0, 0, 0, NULL}; \
+    hp_log_write(&site_, __VA_ARGS__); \
 }
 
-#define HP_LOG_FATAL(...) HP_DO_LOG("FATAL", __VA_ARGS__);
-#define HP_LOG_ERROR(...) HP_DO_LOG("ERROR", __VA_ARGS__);
-#define HP_LOG_WARN(...)  HP_DO_LOG("WARN", __VA_ARGS__);
-#define HP_LOG_INFO(...)  HP_DO_LOG("INFO", __VA_ARGS__);
-#define HP_LOG_DEBUG(...) HP_DO_LOG("DEBUG", __VA_ARGS__);
+#define HP_LOG_FATAL(...) HP_DO_LOG(LOG_EMERG, __VA_ARGS__);
+#define HP_LOG_ERROR(...) HP_DO_LOG(LOG_ERR, __VA_ARGS__);
+#define HP_LOG_WARN(...)  HP_DO_LOG(LOG_WARNING, __VA_ARGS__);
+#define HP_LOG_INFO(...)  HP_DO_LOG(LOG_INFO, __VA_ARGS__);
+
+#ifdef DEBUG
+#define HP_LOG_DEBUG(...) HP_DO_LOG(LOG_DEBUG, __VA_ARGS__);
 #else
-#define HP_DO_LOG(level_, ...) syslog(level_, __VA_ARGS__);
-#define HP_LOG_FATAL(...)      HP_DO_LOG(LOG_EMERG, __VA_ARGS__);
-#define HP_LOG_ERROR(...)      HP_DO_LOG(LOG_ERR, __VA_ARGS__);
-#define HP_LOG_WARN(...)       HP_DO_LOG(LOG_WARNING, __VA_ARGS__);
-#define HP_LOG_INFO(...)       HP_DO_LOG(LOG_INFO, __VA_ARGS__);
 #define HP_LOG_DEBUG(...)
 #endif
 
@@ -37,6 +37,37 @@
 #  define __unused /* noop */
 #endif
 
+/* Relaxed atomics for counters shared between threads */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#  define HP_ATOMIC_LOAD(p_)      __atomic_load_n(p_, __ATOMIC_RELAXED)
+#  define HP_ATOMIC_STORE(p_, v_) __atomic_store_n(p_, v_, __ATOMIC_RELAXED)
+#  define HP_ATOMIC_ADD(p_, v_)   (void) __atomic_fetch_add(p_, v_, __ATOMIC_RELAXED)
+#else
+#  define HP_ATOMIC_LOAD(p_)      __sync_fetch_and_add(p_, 0)
+#  define HP_ATOMIC_STORE(p_, v_) (void) (*(volatile __typeof__(*(p_)) *) (p_) = (v_))
+#  define HP_ATOMIC_ADD(p_, v_)   (void) __sync_fetch_and_add(p_, v_)
+#endif
+
+/* Handing data to another thread: what was written before the release store
+   is visible once the acquire load sees the stored value */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#  define HP_ATOMIC_LOAD_ACQUIRE(p_)      __atomic_load_n(p_, __ATOMIC_ACQUIRE)
+#  define HP_ATOMIC_STORE_RELEASE(p_, v_) __atomic_store_n(p_, v_, __ATOMIC_RELEASE)
+#else
+#  define HP_ATOMIC_LOAD_ACQUIRE(p_)      __sync_fetch_and_add(p_, 0)
+#  define HP_ATOMIC_STORE_RELEASE(p_, v_) { __sync_synchronize(); *(volatile __typeof__(*(p_)) *) (p_) = (v_); }
+#endif
+
+/* Returns *p_ and sets it to zero, a full barrier */
+#define HP_ATOMIC_FETCH_CLEAR(p_) __sync_fetch_and_and(p_, 0)
+
+/* Whether *p_ was o_ and has been replaced with n_, a full barrier */
+#define HP_ATOMIC_CAS(p_, o_, n_) __sync_bool_compare_and_swap(p_, o_, n_)
+
+/* Counter with a single writer, no locked instruction needed */
+#define HP_COUNTER_ADD(c_, v_) HP_ATOMIC_STORE(&(c_), HP_ATOMIC_LOAD(&(c_)) + (v_))
+#define HP_COUNTER_INC(c_)     HP_COUNTER_ADD(c_, 1)
+
 #ifndef HAVE_STRCASECMP
 int strcasecmp(const char *left, const char *right);
 #endif
@@ -0,0 +1,213 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#ifndef __HP_STATS_H__
+# define __HP_STATS_H__
+
+#include <stdint.h>
+
+/*
+ Layout of the statistics segment /dev/shm/httpush.<pid>. The segment
+ starts with a header followed by one slot per httpd thread (-T of them) and then the
+ output slots of each thread, thread by thread: one per -r route followed
+ by one per -K shard. Each slot
+ starts on its own cache line so that threads never write to the same
+ line. Threads update their slot with relaxed atomic stores; readers
+ should load each counter atomically.
+ */
+
+#define HP_STATS_MAGIC   0x48505354 /* HPST */
+#define HP_STATS_VERSION 10
+
+#define HP_CACHE_LINE_SIZE 64
+
+#define HP_STATS_SHM_NAME "/httpush.%ld"
+
+#define HP_CACHE_ALIGNED __attribute__ ((aligned (HP_CACHE_LINE_SIZE)))
+
+struct hp_httpd_counters_t {
+    uint64_t code_200;
+
+    uint64_t code_404;
+
+    uint64_t code_412;
+
+    uint64_t code_503;
+
+    uint64_t requests;
+
+    uint64_t accepts;
+
+    /* Request body bytes received */
+    uint64_t bytes_in;
+
+    /* Bytes handed to 0MQ */
+    uint64_t bytes_out;
+
+    /* Messages and bytes waiting to be sent, gauges */
+    uint64_t queue_messages;
+
+    uint64_t queue_bytes;
+
+    /* Messages and payload bytes in the spill journal, gauges */
+    uint64_t journal_messages;
+
+    uint64_t journal_bytes;
+
+    /* Messages waiting for their ack from the backend, a gauge */
+    uint64_t ack_inflight;
+
+    /* Messages acknowledged and those that timed out, see -k */
+    uint64_t acks;
+
+    uint64_t ack_timeouts;
+
+    /* Requests with an idempotency key, duplicates among them and live keys
+       pushed out of the full cache, see -D */
+    uint64_t dedup_keys;
+
+    uint64_t dedup_hits;
+
+    uint64_t dedup_evictions;
+};
+
+/* Counters of a -r route or -K shard in a thread */
+struct hp_output_counters_t {
+    uint64_t requests;
+
+    /* Messages sent, queued or batched for the socket(s) */
+    uint64_t messages;
+
+    /* Payload bytes of those messages */
+    uint64_t bytes;
+
+    /* Messages the socket(s) couldn't take */
+    uint64_t rejected;
+};
+
+/*
+ Latency histograms, in nanoseconds. See include/histogram.h for the
+ bucket layout
+ */
+#define HP_HISTOGRAM_SUB_BITS 5
+#define HP_HISTOGRAM_MAX_BITS 39
+#define HP_HISTOGRAM_BUCKETS  ((HP_HISTOGRAM_MAX_BITS - HP_HISTOGRAM_SUB_BITS + 2) << HP_HISTOGRAM_SUB_BITS)
+
+struct hp_histogram_t {
+    uint64_t count;
+
+    uint64_t max;
+
+    uint64_t buckets[HP_HISTOGRAM_BUCKETS];
+};
+
+typedef enum _hp_latency_t {
+    /* Handling of a publish request */
+    HP_LATENCY_REQUEST,
+    /* Serializing the header frame */
+    HP_LATENCY_HEADERS,
+    /* Inside zmq_send */
+    HP_LATENCY_SEND,
+    /* Compressing a message or batch */
+    HP_LATENCY_COMPRESS,
+    /* From sending a message until the backend acknowledged it */
+    HP_LATENCY_ACK,
+    HP_LATENCY_MAX
+} hp_latency_t;
+
+struct hp_stats_header_t {
+    uint32_t magic;
+
+    uint32_t version;
+
+    /* Number of slots following the header */
+    uint32_t num_threads;
+
+    /* Size of a slot in bytes */
+    uint32_t slot_size;
+
+    /* Output slots of each thread, following the thread slots */
+    uint32_t num_outputs;
+
+    uint32_t output_slot_size;
+
+    int64_t pid;
+
+    /* Threads serving requests and the slots ever started, the pool can be
+       resized from the monitor socket. Slots of retired threads keep their
+       counters, updated atomically */
+    uint32_t running_threads;
+
+    uint32_t used_threads;
+} HP_CACHE_ALIGNED;
+
+struct hp_stats_slot_t {
+    struct hp_httpd_counters_t counters;
+
+    struct hp_histogram_t latency[HP_LATENCY_MAX] HP_CACHE_ALIGNED;
+} HP_CACHE_ALIGNED;
+
+struct hp_stats_output_slot_t {
+    struct hp_output_counters_t counters;
+} HP_CACHE_ALIGNED;
+
+/*
+ Statistics deltas published on the -P socket. Each message starts with
+ this header, all fields in network byte order, followed by the values of
+ every thread. A thread's values are HP_STATS_DELTA_FIELDS unsigned LEB128
+ varints in the order of struct hp_httpd_counters_t: counters are the
+ change since the previous message, the gauges are current values.
+ */
+#define HP_STATS_DELTA_MAGIC   0x48504454 /* HPDT */
+#define HP_STATS_DELTA_VERSION 1
+#define HP_STATS_DELTA_FIELDS  (sizeof (struct hp_httpd_counters_t) / sizeof (uint64_t))
+
+struct hp_stats_delta_header_t {
+    uint32_t magic;
+
+    uint16_t version;
+
+    uint16_t num_threads;
+
+    uint16_t num_fields;
+
+    uint16_t reserved;
+
+    /* Incremented on every message, gaps mean lost messages */
+    uint32_t sequence;
+
+    /* CLOCK_MONOTONIC in nanoseconds */
+    uint64_t timestamp;
+
+    /* Nanoseconds since the previous message */
+    uint64_t interval;
+} __attribute__ ((packed));
+
+#endif /* __HP_STATS_H__ */
@@ -5,6 +5,24 @@ $socket = $ctx->getSocket(ZMQ::SOCKET_REQ);
 $socket->setSockOpt(ZMQ::SOCKOPT_IDENTITY, "test");
 
 $socket->connect("tcp://localhost:5567");
+
+/* "threads" or "threads <n>" shows or resizes the thread pool, "reload [<uris>]" reconnects */
+if ($argc > 1) {
+	$socket->send(implode(" ", array_slice($argv, 1)), 0);
+	$sxe = simplexml_load_string($socket->recv());
+
+	if ($sxe && $sxe->reload) {
+		echo "Reload: {$sxe->reload['success']}, uris: {$sxe->reload['uris']}\n";
+		exit($sxe->reload['success'] == "true" ? 0 : 1);
+	}
+
+	if (!$sxe || !$sxe->threads)
+		die("Failed to parse the response\n");
+
+	echo "Threads running: {$sxe->threads['running']}, retiring: {$sxe->threads['retiring']}, max: {$sxe->threads['max']}\n";
+	exit($sxe->threads['success'] == "true" ? 0 : 1);
+}
+
 $socket->send("stats", 0);
 
 $xml = $socket->recv();
@@ -14,10 +32,15 @@ if (!$sxe)
 	die("Failed to parse the response\n");
 
 echo "Received responses from {$sxe->statistics->responses} out of {$sxe->statistics->threads} threads\n";
+echo "Total accepts: {$sxe->statistics->accepts}\n";
 echo "Total requests: {$sxe->statistics->requests}\n";
 
 foreach ($sxe->statistics->children() as $k => $v) {
 	if ($k == "status") {
 		echo "  HTTP code {$v['code']}: $v \n";
+	} else if ($k == "latency") {
+		echo "  Latency {$v['name']}: p50 {$v['p50']}ns, p99 {$v['p99']}ns, p99.9 {$v['p999']}ns, max {$v['max']}ns \n";
+	} else if ($k == "thread") {
+		echo "  Thread {$v['id']}: accepts {$v['accepts']}, requests {$v['requests']} \n";
 	}
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+<?php
+
+$fields = array("code_200", "code_404", "code_412", "code_503", "requests",
+                "accepts", "bytes_in", "bytes_out", "queue_messages", "queue_bytes",
+                "journal_messages", "journal_bytes", "ack_inflight", "acks",
+                "ack_timeouts", "dedup_keys", "dedup_hits", "dedup_evictions");
+
+function read_varint($data, &$pos) {
+	$value = 0;
+	$shift = 0;
+
+	do {
+		$byte = ord($data[$pos++]);
+		$value |= ($byte & 0x7f) << $shift;
+		$shift += 7;
+	} while ($byte & 0x80);
+
+	return $value;
+}
+
+$ctx = new ZMQContext();
+$socket = $ctx->getSocket(ZMQ::SOCKET_SUB);
+$socket->setSockOpt(ZMQ::SOCKOPT_SUBSCRIBE, "");
+$socket->connect("tcp://localhost:5568");
+
+$expected = null;
+
+while (true) {
+	$data = $socket->recv();
+
+	if (strlen($data) < 32)
+		die("Short message\n");
+
+	$h = unpack("Nmagic/nversion/nthreads/nfields/nreserved/Nsequence/Jtimestamp/Jinterval", $data);
+
+	if ($h['magic'] != 0x48504454 || $h['version'] != 1)
+		die("Unknown message format\n");
+
+	if ($expected !== null && $h['sequence'] != $expected)
+		echo "Lost " . ($h['sequence'] - $expected) . " messages\n";
+	$expected = $h['sequence'] + 1;
+
+	$seconds = $h['interval'] / 1000000000;
+	$pos = 32;
+
+	for ($i = 0; $i < $h['threads']; $i++) {
+		$values = array();
+
+		for ($f = 0; $f < $h['fields']; $f++) {
+			$name = isset($fields[$f]) ? $fields[$f] : "field_$f";
+			$values[$name] = read_varint($data, $pos);
+		}
+
+		if ($seconds > 0) {
+			printf("Thread %d: %.1f req/s, %.1f accepts/s, %.0f bytes in/s, queue %d messages, journal %d messages\n",
+				$i, $values['requests'] / $seconds, $values['accepts'] / $seconds,
+				$values['bytes_in'] / $seconds, $values['queue_messages'], $values['journal_messages']);
+		}
+	}
+}
@@ -0,0 +1,378 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/*
+ Binary access log. Each httpd thread writes a fixed-size record per
+ answered request straight into a segment file mapped into memory, so
+ logging a request is a handful of stores: no locks, no formatting and no
+ system calls until the segment is full. The layout of the files is in
+ include/access.h, src/httpush-access.c turns them into text.
+
+ Segments are preallocated like those of the journal. A full segment is
+ truncated to its records and closed, and once a thread has more than
+ max_files of them the oldest is removed, including the ones left by
+ earlier runs. Records are not synced, the kernel writes the pages back.
+ */
+
+#define HP_ACCESS_RECORD_SIZE sizeof (struct hp_access_record_t)
+
+/* How long to wait before trying again to create a segment */
+#define HP_ACCESS_RETRY_NSEC 1000000000ULL
+
+/* Sequence numbers skipped when another process created the segment first */
+#define HP_ACCESS_CREATE_TRIES 16
+
+static void hp_access_path(struct hp_access_log_t *log, uint64_t seq, char *path, size_t path_len)
+{
+    snprintf(path, path_len, "%s/httpush.%d.%" PRIu64 ".access", log->config.dir, log->thread_id, seq);
+}
+
+static uint64_t hp_access_realtime_ns(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+static int hp_access_seq_cmp(const void *a, const void *b)
+{
+    uint64_t x = *((const uint64_t *) a), y = *((const uint64_t *) b);
+    return (x > y) - (x < y);
+}
+
+static void hp_access_remove(struct hp_access_log_t *log, uint64_t seq)
+{
+    char path[PATH_MAX];
+
+    hp_access_path(log, seq, path, sizeof (path));
+    if (unlink(path) != 0 && errno != ENOENT) {
+        HP_LOG_WARN("Failed to remove access log segment %s: %s", path, strerror(errno));
+    }
+}
+
+/*
+ Picks up the segments of this thread left by earlier runs. Numbering
+ continues after the last one and the oldest are removed so that a new
+ segment fits in max_files
+ */
+static bool hp_access_scan(struct hp_access_log_t *log)
+{
+    uint64_t *seqs = NULL;
+    size_t num_seqs = 0, max_seqs = 0, keep, i;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(log->config.dir);
+    if (!dir) {
+        HP_LOG_ERROR("Failed to open access log directory %s: %s", log->config.dir, strerror(errno));
+        return false;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        int thread_id, len = 0;
+        uint64_t seq;
+
+        if (sscanf(entry->d_name, "httpush.%d.%" SCNu64 ".access%n", &thread_id, &seq, &len) != 2 ||
+                len == 0 || entry->d_name[len] != '\0' || thread_id != log->thread_id) {
+            continue;
+        }
+
+        if (num_seqs == max_seqs) {
+            uint64_t *tmp;
+
+            max_seqs = max_seqs ? max_seqs * 2 : 16;
+            tmp = realloc(seqs, max_seqs * sizeof (uint64_t));
+            if (!tmp) {
+                free(seqs);
+                (void) closedir(dir);
+                return false;
+            }
+            seqs = tmp;
+        }
+        seqs[num_seqs++] = seq;
+    }
+    (void) closedir(dir);
+
+    qsort(seqs, num_seqs, sizeof (uint64_t), hp_access_seq_cmp);
+
+    keep = (num_seqs < log->config.max_files) ? num_seqs : log->config.max_files - 1;
+
+    for (i = 0; i < num_seqs - keep; i++) {
+        hp_access_remove(log, seqs[i]);
+    }
+    for (i = 0; i < keep; i++) {
+        log->seqs[i] = seqs[num_seqs - keep + i];
+    }
+    log->num_seqs = keep;
+
+    if (num_seqs > 0) {
+        log->next_seq = seqs[num_seqs - 1] + 1;
+    }
+    free(seqs);
+    return true;
+}
+
+/* Truncates the segment being written to its records and closes it */
+static void hp_access_finish(struct hp_access_log_t *log)
+{
+    if (!log->data) {
+        return;
+    }
+
+    (void) munmap(log->data, log->size);
+
+    if (ftruncate(log->fd, (off_t) log->write_pos) != 0) {
+        HP_LOG_WARN("Failed to truncate access log segment %" PRIu64 ": %s", log->seqs[log->num_seqs - 1], strerror(errno));
+    }
+    (void) close(log->fd);
+
+    log->data = NULL;
+    log->fd = -1;
+}
+
+/* Opens the file of the next segment, skipping the names that are taken */
+static int hp_access_create_file(struct hp_access_log_t *log, char *path, size_t path_len)
+{
+    int fd = -1, i;
+
+    for (i = 0; i < HP_ACCESS_CREATE_TRIES; i++) {
+        hp_access_path(log, log->next_seq, path, path_len);
+
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd != -1 || errno != EEXIST) {
+            break;
+        }
+        log->next_seq++;
+    }
+    return fd;
+}
+
+static bool hp_access_segment_create(struct hp_access_log_t *log)
+{
+    struct hp_access_header_t *header;
+    char path[PATH_MAX];
+    size_t size = log->config.segment_size;
+    int fd, rc;
+    char *data;
+
+    /* Make room for the new segment */
+    if (log->num_seqs == log->config.max_files) {
+        hp_access_remove(log, log->seqs[0]);
+
+        memmove(log->seqs, log->seqs + 1, (log->num_seqs - 1) * sizeof (uint64_t));
+        log->num_seqs--;
+    }
+
+    fd = hp_access_create_file(log, path, sizeof (path));
+    if (fd == -1) {
+        HP_LOG_ERROR("Failed to create access log segment %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    rc = posix_fallocate(fd, 0, (off_t) size);
+    if (rc != 0) {
+        HP_LOG_ERROR("Failed to allocate access log segment %s: %s", path, strerror(rc));
+        goto return_error;
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        HP_LOG_ERROR("Failed to map access log segment %s: %s", path, strerror(errno));
+        goto return_error;
+    }
+
+    header = (struct hp_access_header_t *) data;
+    header->magic = HP_ACCESS_MAGIC;
+    header->version = HP_ACCESS_VERSION;
+    header->record_size = (uint16_t) HP_ACCESS_RECORD_SIZE;
+    header->thread_id = (uint32_t) log->thread_id;
+    header->reserved = 0;
+    header->seq = log->next_seq;
+    header->created = hp_access_realtime_ns();
+
+    log->fd = fd;
+    log->data = data;
+    log->size = size;
+    log->write_pos = sizeof (struct hp_access_header_t);
+
+    log->seqs[log->num_seqs++] = log->next_seq++;
+    return true;
+
+return_error:
+    (void) close(fd);
+    (void) unlink(path);
+    return false;
+}
+
+/*
+ Starts the next segment. While segments can't be created the records are
+ counted as lost and creating one is tried again once a second
+ */
+static bool hp_access_rotate(struct hp_access_log_t *log, uint64_t now)
+{
+    if (now < log->retry_at) {
+        return false;
+    }
+
+    hp_access_finish(log);
+
+    if (hp_access_segment_create(log) == false) {
+        log->retry_at = now + HP_ACCESS_RETRY_NSEC;
+        return false;
+    }
+
+    if (log->dropped > 0) {
+        HP_LOG_WARN("Lost %" PRIu64 " access log records of thread %d", log->dropped, log->thread_id);
+        log->dropped = 0;
+    }
+    return true;
+}
+
+bool hp_access_open(struct hp_access_log_t *log, const struct hp_access_config_t *config, int thread_id)
+{
+    memset(log, 0, sizeof (struct hp_access_log_t));
+
+    log->thread_id = thread_id;
+    log->config = *config;
+    log->fd = -1;
+
+    /* A segment needs room for at least one record */
+    if (log->config.segment_size < sizeof (struct hp_access_header_t) + HP_ACCESS_RECORD_SIZE || log->config.max_files < 1) {
+        errno = EINVAL;
+        return false;
+    }
+
+    log->seqs = calloc(log->config.max_files, sizeof (uint64_t));
+    if (!log->seqs) {
+        return false;
+    }
+
+    if (hp_access_scan(log) == false) {
+        hp_access_close(log);
+        return false;
+    }
+    return true;
+}
+
+void hp_access_addr_from_sockaddr(struct hp_access_addr_t *addr, const struct sockaddr *sa)
+{
+    memset(addr, 0, sizeof (struct hp_access_addr_t));
+
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+        addr->family = HP_ACCESS_FAMILY_IPV4;
+        addr->port = ntohs(sin->sin_port);
+        memcpy(addr->addr, &(sin->sin_addr), sizeof (sin->sin_addr));
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+        addr->family = HP_ACCESS_FAMILY_IPV6;
+        addr->port = ntohs(sin6->sin6_port);
+        memcpy(addr->addr, &(sin6->sin6_addr), sizeof (sin6->sin6_addr));
+    }
+}
+
+/* For evhttp, which only keeps the numeric host of the connection */
+void hp_access_addr_from_string(struct hp_access_addr_t *addr, const char *host, uint16_t port)
+{
+    memset(addr, 0, sizeof (struct hp_access_addr_t));
+
+    if (!host) {
+        return;
+    }
+
+    if (inet_pton(AF_INET, host, addr->addr) == 1) {
+        addr->family = HP_ACCESS_FAMILY_IPV4;
+    } else if (inet_pton(AF_INET6, host, addr->addr) == 1) {
+        addr->family = HP_ACCESS_FAMILY_IPV6;
+    } else {
+        return;
+    }
+    addr->port = port;
+}
+
+/*
+ Appends the record of an answered request. 'start' and 'now' are
+ CLOCK_MONOTONIC nanoseconds, the path is cut at HP_ACCESS_PATH_MAX bytes
+ */
+void hp_access_write(struct hp_access_log_t *log, uint64_t start, uint64_t now, int status, uint64_t body_len,
+                     const struct hp_access_addr_t *addr, const char *path, size_t path_len)
+{
+    struct hp_access_record_t *record;
+
+    if (!log->data || log->write_pos + HP_ACCESS_RECORD_SIZE > log->size) {
+        if (hp_access_rotate(log, now) == false) {
+            log->dropped++;
+            return;
+        }
+    }
+
+    if (now >= log->clock_refresh) {
+        log->clock_offset = hp_access_realtime_ns() - now;
+        log->clock_refresh = now + 1000000000ULL;
+    }
+
+    record = (struct hp_access_record_t *) (log->data + log->write_pos);
+
+    record->duration = now - start;
+    record->body_len = body_len;
+    record->status = (uint16_t) status;
+    record->family = addr->family;
+    record->reserved = 0;
+    record->port = addr->port;
+    record->path_len = (path_len > UINT16_MAX) ? UINT16_MAX : (uint16_t) path_len;
+    memcpy(record->addr, addr->addr, sizeof (record->addr));
+    memcpy(record->path, path, (path_len > HP_ACCESS_PATH_MAX) ? HP_ACCESS_PATH_MAX : path_len);
+
+    /* Readers of the segment take a record with a timestamp as complete */
+    HP_ATOMIC_STORE_RELEASE(&(record->timestamp), start + log->clock_offset);
+
+    log->write_pos += HP_ACCESS_RECORD_SIZE;
+}
+
+void hp_access_close(struct hp_access_log_t *log)
+{
+    hp_access_finish(log);
+
+    if (log->dropped > 0) {
+        HP_LOG_WARN("Lost %" PRIu64 " access log records of thread %d", log->dropped, log->thread_id);
+    }
+
+    free(log->seqs);
+    log->seqs = NULL;
+    log->num_seqs = 0;
+}
@@ -0,0 +1,529 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Acknowledged delivery. The out socket of the thread is a DEALER and every
+ message is preceded by an empty delimiter frame and an 8-byte id frame:
+ the generation of the slot in the upper and the slot index in the lower
+ 32 bits, in network byte order. The backend, a ROUTER or REP socket,
+ replies with the id frame and the HTTP reply is sent when the reply
+ arrives, or with a 504 once the timeout passes. Nothing blocks, the thread
+ keeps serving other requests while the messages are in flight.
+ */
+
+#define HP_ACK_NONE UINT32_MAX
+
+#define HP_ACK_ID_SIZE 8
+
+static void hp_ack_update_counters(struct hp_ack_t *ack)
+{
+    if (ack->counters) {
+        HP_ATOMIC_STORE(&(ack->counters->ack_inflight), (uint64_t) ack->count);
+    }
+}
+
+static void hp_ack_put_id(char *p, uint32_t generation, uint32_t index)
+{
+    uint32_t high = htonl(generation), low = htonl(index);
+
+    memcpy(p, &high, sizeof (uint32_t));
+    memcpy(p + sizeof (uint32_t), &low, sizeof (uint32_t));
+}
+
+static void hp_ack_get_id(const char *p, uint32_t *generation, uint32_t *index)
+{
+    uint32_t high, low;
+
+    memcpy(&high, p, sizeof (uint32_t));
+    memcpy(&low, p + sizeof (uint32_t), sizeof (uint32_t));
+
+    *generation = ntohl(high);
+    *index = ntohl(low);
+}
+
+static void hp_ack_arm_timer(struct hp_ack_t *ack)
+{
+    uint64_t now, deadline;
+    long usec = 0;
+    struct timeval tv;
+
+    if (ack->timer_pending || ack->count == 0) {
+        return;
+    }
+
+    now = hp_now_ns();
+    deadline = ack->entries[ack->oldest].sent + ack->timeout;
+
+    if (deadline > now) {
+        usec = (long) ((deadline - now) / 1000) + 1;
+    }
+
+    HP_USEC_TO_TIMEVAL(usec, tv);
+
+    if (event_add(&(ack->timer), &tv) == 0) {
+        ack->timer_pending = true;
+    }
+}
+
+/* Takes the message out of the in-flight list and replies */
+static void hp_ack_complete(struct hp_ack_t *ack, uint32_t index, hp_ack_status_t status)
+{
+    struct hp_ack_entry_t *entry = &(ack->entries[index]);
+    struct hp_waiter_t waiter = entry->waiter;
+
+    if (entry->prev != HP_ACK_NONE) {
+        ack->entries[entry->prev].next = entry->next;
+    } else {
+        ack->oldest = entry->next;
+    }
+
+    if (entry->next != HP_ACK_NONE) {
+        ack->entries[entry->next].prev = entry->prev;
+    } else {
+        ack->newest = entry->prev;
+    }
+
+    entry->in_flight = false;
+    memset(&(entry->waiter), 0, sizeof (struct hp_waiter_t));
+    entry->next = ack->free_head;
+    ack->free_head = index;
+    ack->count--;
+
+    if (ack->counters) {
+        if (status == HP_ACK_OK) {
+            HP_COUNTER_INC(ack->counters->acks);
+        } else if (status == HP_ACK_TIMEOUT) {
+            HP_COUNTER_INC(ack->counters->ack_timeouts);
+        }
+    }
+
+    if (status == HP_ACK_OK && ack->latency) {
+        hp_histogram_record(ack->latency, hp_now_ns() - entry->sent);
+    }
+    hp_ack_update_counters(ack);
+
+    if (ack->done) {
+        ack->done(&waiter, status, ack->done_arg);
+    }
+}
+
+/*
+ Reads one reply from the socket or the one being drained. The id is the
+ first non-empty frame, whatever follows it is ignored
+ */
+static bool hp_ack_recv(struct hp_ack_t *ack, void *socket)
+{
+    uint32_t generation = 0, index = HP_ACK_NONE;
+    bool found = false;
+    int64_t more = 1;
+
+    while (more) {
+        zmq_msg_t msg;
+        size_t more_size = sizeof (int64_t);
+
+        zmq_msg_init(&msg);
+
+        if (zmq_recv(socket, &msg, ZMQ_NOBLOCK) != 0) {
+            zmq_msg_close(&msg);
+            return false;
+        }
+
+        if (!found && zmq_msg_size(&msg) > 0) {
+            found = true;
+
+            if (zmq_msg_size(&msg) == HP_ACK_ID_SIZE) {
+                hp_ack_get_id((const char *) zmq_msg_data(&msg), &generation, &index);
+            }
+        }
+        zmq_msg_close(&msg);
+
+        if (zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &more_size) != 0) {
+            return false;
+        }
+    }
+
+    if (index < ack->size && ack->entries[index].in_flight && ack->entries[index].generation == generation) {
+        hp_ack_complete(ack, index, HP_ACK_OK);
+    } else {
+        /* Timed out already or not ours */
+        HP_LOG_DEBUG("Ignoring unknown ack %" PRIu32 ":%" PRIu32, generation, index);
+    }
+    return true;
+}
+
+static bool hp_ack_readable(void *socket)
+{
+    uint32_t events;
+    size_t events_size = sizeof (uint32_t);
+
+    /* Reading ZMQ_EVENTS also processes the pending commands of the socket */
+    if (zmq_getsockopt(socket, ZMQ_EVENTS, &events, &events_size) != 0) {
+        return false;
+    }
+    return (events & ZMQ_POLLIN);
+}
+
+/* The descriptor is edge-triggered, read everything there is */
+static void hp_ack_read(struct hp_ack_t *ack, void *socket)
+{
+    while (hp_ack_readable(socket)) {
+        if (hp_ack_recv(ack, socket) == false) {
+            if (errno != EAGAIN) {
+                HP_LOG_ERROR("Failed to receive ack: %s", zmq_strerror(errno));
+            }
+            break;
+        }
+    }
+}
+
+static void hp_ack_event_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_ack_t *ack = (struct hp_ack_t *) args;
+
+    hp_ack_read(ack, ack->socket);
+}
+
+/*
+ Closes the previous socket once every message sent on it has been acked
+ or has timed out. The in-flight list is in the order of sending
+ */
+static void hp_ack_drain_check(struct hp_ack_t *ack)
+{
+    if (!ack->draining) {
+        return;
+    }
+
+    if (ack->count > 0 && ack->entries[ack->oldest].sent < ack->drain_start) {
+        return;
+    }
+
+    event_del(&(ack->drain_ev));
+    (void) zmq_close(ack->draining);
+    ack->draining = NULL;
+}
+
+static void hp_ack_drain_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_ack_t *ack = (struct hp_ack_t *) args;
+
+    hp_ack_read(ack, ack->draining);
+    hp_ack_drain_check(ack);
+}
+
+static void hp_ack_timer_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_ack_t *ack = (struct hp_ack_t *) args;
+    uint64_t now = hp_now_ns();
+
+    ack->timer_pending = false;
+
+    while (ack->count > 0 && ack->entries[ack->oldest].sent + ack->timeout <= now) {
+        hp_ack_complete(ack, ack->oldest, HP_ACK_TIMEOUT);
+    }
+    hp_ack_arm_timer(ack);
+    hp_ack_drain_check(ack);
+}
+
+bool hp_ack_init(struct hp_ack_t *ack, struct hp_ack_config_t *config, struct event_base *base, void *socket, hp_ack_done_t done, void *done_arg)
+{
+    int fd;
+    size_t fd_size = sizeof (int);
+    uint32_t i;
+
+    memset(ack, 0, sizeof (struct hp_ack_t));
+
+    if (config->max_inflight < 1 || config->max_inflight >= HP_ACK_NONE) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (zmq_getsockopt(socket, ZMQ_FD, &fd, &fd_size) != 0) {
+        HP_LOG_ERROR("Failed to get the file descriptor of the socket: %s", zmq_strerror(errno));
+        return false;
+    }
+
+    ack->entries = calloc(config->max_inflight, sizeof (struct hp_ack_entry_t));
+    if (!ack->entries) {
+        return false;
+    }
+
+    ack->socket = socket;
+    ack->base = base;
+    ack->size = (uint32_t) config->max_inflight;
+    ack->timeout = (uint64_t) config->timeout_msec * 1000000;
+    ack->done = done;
+    ack->done_arg = done_arg;
+    ack->oldest = ack->newest = HP_ACK_NONE;
+
+    for (i = 0; i < ack->size; i++) {
+        ack->entries[i].next = (i + 1 < ack->size) ? i + 1 : HP_ACK_NONE;
+    }
+    ack->free_head = 0;
+
+    evtimer_set(&(ack->timer), hp_ack_timer_cb, ack);
+    event_base_set(base, &(ack->timer));
+
+    /* Acks can arrive at any time, the socket is watched all along */
+    event_set(&(ack->ev), fd, EV_READ | EV_PERSIST, hp_ack_event_cb, ack);
+    event_base_set(base, &(ack->ev));
+
+    if (event_add(&(ack->ev), NULL) != 0) {
+        free(ack->entries);
+        ack->entries = NULL;
+        return false;
+    }
+    ack->ev_pending = true;
+    return true;
+}
+
+/* Sends a frame without blocking and records the time spent in zmq_send */
+static bool hp_ack_send_frame(struct hp_ack_t *ack, zmq_msg_t *msg, int flags)
+{
+    uint64_t start = hp_now_ns();
+    int rc;
+
+    rc = zmq_send(ack->socket, msg, flags | ZMQ_NOBLOCK);
+
+    if (ack->send_latency) {
+        hp_histogram_record(ack->send_latency, hp_now_ns() - start);
+    }
+
+    if (rc != 0) {
+        return false;
+    }
+    zmq_msg_close(msg);
+    return true;
+}
+
+/*
+ Sends the message parts behind the delimiter and id frames. Returns
+ HP_QUEUE_PENDING once sent, the done callback replies when the ack
+ arrives. HP_QUEUE_FULL means too many messages are in flight or the socket
+ is full. The parts are consumed whatever the result
+ */
+hp_queue_status_t hp_ack_send(struct hp_ack_t *ack, const struct hp_waiter_t *waiter, zmq_msg_t *parts, int num_parts)
+{
+    struct hp_ack_entry_t *entry;
+    zmq_msg_t envelope[2];
+    uint32_t index;
+    size_t size = 0;
+    /* Frames sent, the two of the envelope first */
+    int i, sent = 0;
+    hp_queue_status_t status = HP_QUEUE_PENDING;
+
+    if (ack->count == ack->size) {
+        for (i = 0; i < num_parts; i++) {
+            zmq_msg_close(&(parts[i]));
+        }
+        return HP_QUEUE_FULL;
+    }
+
+    index = ack->free_head;
+    entry = &(ack->entries[index]);
+
+    zmq_msg_init_size(&(envelope[0]), 0);
+
+    if (zmq_msg_init_size(&(envelope[1]), HP_ACK_ID_SIZE) != 0) {
+        zmq_msg_close(&(envelope[0]));
+        for (i = 0; i < num_parts; i++) {
+            zmq_msg_close(&(parts[i]));
+        }
+        return HP_QUEUE_ERROR;
+    }
+    hp_ack_put_id((char *) zmq_msg_data(&(envelope[1])), entry->generation + 1, index);
+
+    for (i = 0; i < num_parts; i++) {
+        size += zmq_msg_size(&(parts[i]));
+    }
+
+    /* Once the first frame is in, 0MQ takes the rest of the message */
+    if (hp_ack_send_frame(ack, &(envelope[0]), ZMQ_SNDMORE) == false) {
+        status = (errno == EAGAIN) ? HP_QUEUE_FULL : HP_QUEUE_ERROR;
+    } else if (hp_ack_send_frame(ack, &(envelope[1]), ZMQ_SNDMORE) == false) {
+        status = HP_QUEUE_ERROR;
+        sent = 1;
+    } else {
+        for (sent = 2; sent < 2 + num_parts; sent++) {
+            if (hp_ack_send_frame(ack, &(parts[sent - 2]), (sent < 1 + num_parts) ? ZMQ_SNDMORE : 0) == false) {
+                status = HP_QUEUE_ERROR;
+                break;
+            }
+        }
+    }
+
+    if (status != HP_QUEUE_PENDING) {
+        int err = errno;
+
+        /* Close the frames that didn't go out */
+        for (i = sent; i < 2 + num_parts; i++) {
+            zmq_msg_close((i < 2) ? &(envelope[i]) : &(parts[i - 2]));
+        }
+        errno = err;
+        return status;
+    }
+
+    ack->free_head = entry->next;
+    ack->count++;
+
+    entry->waiter = *waiter;
+    entry->sent = hp_now_ns();
+    entry->generation++;
+    entry->in_flight = true;
+    entry->prev = ack->newest;
+    entry->next = HP_ACK_NONE;
+
+    if (ack->newest != HP_ACK_NONE) {
+        ack->entries[ack->newest].next = index;
+    } else {
+        ack->oldest = index;
+    }
+    ack->newest = index;
+
+    if (ack->counters) {
+        HP_COUNTER_ADD(ack->counters->bytes_out, size);
+    }
+    hp_ack_update_counters(ack);
+    hp_ack_arm_timer(ack);
+
+    /* Sending may have consumed the edge of an ack that is already there */
+    if (hp_ack_readable(ack->socket)) {
+        event_active(&(ack->ev), EV_READ, 1);
+    }
+    return HP_QUEUE_PENDING;
+}
+
+/*
+ Sends the next messages on another socket. The acks of the messages in
+ flight keep being read from the previous socket, which is closed once
+ they have all arrived or timed out. Fails while a previous socket is
+ still being drained
+ */
+bool hp_ack_set_socket(struct hp_ack_t *ack, void *socket)
+{
+    int fd, drain_fd;
+    size_t fd_size = sizeof (int);
+    void *previous = ack->socket;
+
+    if (ack->draining) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    if (zmq_getsockopt(socket, ZMQ_FD, &fd, &fd_size) != 0) {
+        return false;
+    }
+
+    fd_size = sizeof (int);
+    if (zmq_getsockopt(previous, ZMQ_FD, &drain_fd, &fd_size) != 0) {
+        return false;
+    }
+
+    if (ack->ev_pending) {
+        event_del(&(ack->ev));
+        ack->ev_pending = false;
+    }
+
+    ack->socket = socket;
+    event_set(&(ack->ev), fd, EV_READ | EV_PERSIST, hp_ack_event_cb, ack);
+    event_base_set(ack->base, &(ack->ev));
+
+    if (event_add(&(ack->ev), NULL) == 0) {
+        ack->ev_pending = true;
+    }
+
+    if (ack->count == 0) {
+        (void) zmq_close(previous);
+        return true;
+    }
+
+    ack->draining = previous;
+    ack->drain_start = hp_now_ns();
+
+    event_set(&(ack->drain_ev), drain_fd, EV_READ | EV_PERSIST, hp_ack_drain_cb, ack);
+    event_base_set(ack->base, &(ack->drain_ev));
+    (void) event_add(&(ack->drain_ev), NULL);
+
+    /* Acks may be waiting already, the edge is gone */
+    event_active(&(ack->drain_ev), EV_READ, 1);
+    return true;
+}
+
+/*
+ Marks the requests of a connection that is being closed as detached. Their
+ acks are still waited for but nobody is replied to
+ */
+void hp_ack_detach(struct hp_ack_t *ack, void *owner)
+{
+    uint32_t index;
+
+    for (index = ack->oldest; index != HP_ACK_NONE; index = ack->entries[index].next) {
+        if (ack->entries[index].waiter.owner == owner) {
+            ack->entries[index].waiter.detached = true;
+        }
+    }
+}
+
+void hp_ack_free(struct hp_ack_t *ack)
+{
+    if (!ack->entries) {
+        return;
+    }
+
+    /* Last chance for the acks that already arrived */
+    hp_ack_read(ack, ack->socket);
+
+    if (ack->draining) {
+        hp_ack_read(ack, ack->draining);
+    }
+
+    if (ack->count > 0) {
+        HP_LOG_WARN("Giving up on %" PRIu32 " unacknowledged messages", ack->count);
+    }
+
+    while (ack->count > 0) {
+        hp_ack_complete(ack, ack->oldest, HP_ACK_DROPPED);
+    }
+    hp_ack_drain_check(ack);
+
+    if (ack->ev_pending) {
+        event_del(&(ack->ev));
+        ack->ev_pending = false;
+    }
+
+    if (ack->timer_pending) {
+        event_del(&(ack->timer));
+        ack->timer_pending = false;
+    }
+
+    free(ack->entries);
+    ack->entries = NULL;
+}
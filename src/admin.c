@@ -0,0 +1,466 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <stddef.h>
+
+/*
+ Admin HTTP listener serving the statistics segment as Prometheus text
+ (/metrics) and JSON (/stats.json). It runs its own event loop in a separate
+ thread and renders the responses into a preallocated buffer.
+ */
+
+/* Response buffer per thread and for the aggregate values */
+#define HP_ADMIN_BUFFER_BASE       12288
+#define HP_ADMIN_BUFFER_PER_THREAD 2048
+
+struct hp_admin_metric_t {
+    /* Prometheus metric name */
+    const char *name;
+
+    const char *help;
+
+    const char *type;
+
+    /* Additional Prometheus label, NULL if none */
+    const char *label;
+
+    /* Key in the JSON output */
+    const char *key;
+
+    /* Offset of the value in struct hp_httpd_counters_t */
+    size_t offset;
+};
+
+#define HP_ADMIN_METRIC(name_, help_, type_, label_, field_) \
+    { name_, help_, type_, label_, #field_, offsetof(struct hp_httpd_counters_t, field_) }
+
+static const struct hp_admin_metric_t hp_admin_metrics[] = {
+    HP_ADMIN_METRIC("httpush_accepts_total", "Connections accepted", "counter", NULL, accepts),
+    HP_ADMIN_METRIC("httpush_requests_total", "Requests received", "counter", NULL, requests),
+    HP_ADMIN_METRIC("httpush_responses_total", "Responses by status code", "counter", "code=\"200\"", code_200),
+    HP_ADMIN_METRIC("httpush_responses_total", "Responses by status code", "counter", "code=\"404\"", code_404),
+    HP_ADMIN_METRIC("httpush_responses_total", "Responses by status code", "counter", "code=\"412\"", code_412),
+    HP_ADMIN_METRIC("httpush_responses_total", "Responses by status code", "counter", "code=\"503\"", code_503),
+    HP_ADMIN_METRIC("httpush_bytes_in_total", "Request body bytes received", "counter", NULL, bytes_in),
+    HP_ADMIN_METRIC("httpush_bytes_out_total", "Bytes handed to 0MQ", "counter", NULL, bytes_out),
+    HP_ADMIN_METRIC("httpush_queue_messages", "Messages waiting to be sent", "gauge", NULL, queue_messages),
+    HP_ADMIN_METRIC("httpush_queue_bytes", "Bytes waiting to be sent", "gauge", NULL, queue_bytes),
+    HP_ADMIN_METRIC("httpush_journal_messages", "Messages in the spill journal", "gauge", NULL, journal_messages),
+    HP_ADMIN_METRIC("httpush_journal_bytes", "Payload bytes in the spill journal", "gauge", NULL, journal_bytes),
+    HP_ADMIN_METRIC("httpush_ack_inflight", "Messages waiting for their ack", "gauge", NULL, ack_inflight),
+    HP_ADMIN_METRIC("httpush_acks_total", "Messages acknowledged by the backend", "counter", NULL, acks),
+    HP_ADMIN_METRIC("httpush_ack_timeouts_total", "Messages not acknowledged in time", "counter", NULL, ack_timeouts),
+    HP_ADMIN_METRIC("httpush_dedup_keys_total", "Requests with an idempotency key", "counter", NULL, dedup_keys),
+    HP_ADMIN_METRIC("httpush_dedup_hits_total", "Duplicate requests not published", "counter", NULL, dedup_hits),
+    HP_ADMIN_METRIC("httpush_dedup_evictions_total", "Keys pushed out of the full cache", "counter", NULL, dedup_evictions)
+};
+
+#define HP_ADMIN_NUM_METRICS (sizeof (hp_admin_metrics) / sizeof (hp_admin_metrics[0]))
+
+static const char *hp_admin_latency_names[HP_LATENCY_MAX] = {
+    "request",
+    "headers",
+    "send",
+    "compress",
+    "ack"
+};
+
+static const struct {
+    const char *quantile;
+    const char *key;
+    double percentile;
+} hp_admin_quantiles[] = {
+    { "0.5",   "p50",  50.0 },
+    { "0.9",   "p90",  90.0 },
+    { "0.99",  "p99",  99.0 },
+    { "0.999", "p999", 99.9 }
+};
+
+#define HP_ADMIN_NUM_QUANTILES (sizeof (hp_admin_quantiles) / sizeof (hp_admin_quantiles[0]))
+
+/* Appends into a fixed buffer, remembers if anything did not fit */
+struct hp_fmt_t {
+    char *p;
+
+    char *end;
+
+    bool overflow;
+};
+
+static void hp_fmt_str(struct hp_fmt_t *f, const char *str, size_t len)
+{
+    if (f->overflow || (size_t) (f->end - f->p) < len) {
+        f->overflow = true;
+        return;
+    }
+    memcpy(f->p, str, len);
+    f->p += len;
+}
+
+#define HP_FMT_LITERAL(f_, s_) hp_fmt_str(f_, s_, sizeof (s_) - 1)
+#define HP_FMT_CSTR(f_, s_)    hp_fmt_str(f_, s_, strlen(s_))
+
+static void hp_fmt_u64(struct hp_fmt_t *f, uint64_t value)
+{
+    char digits[20], *p = digits + sizeof (digits);
+
+    do {
+        *(--p) = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    hp_fmt_str(f, p, (digits + sizeof (digits)) - p);
+}
+
+static uint64_t hp_admin_value(struct hp_httpd_counters_t *counters, const struct hp_admin_metric_t *metric)
+{
+    return *((uint64_t *) ((char *) counters + metric->offset));
+}
+
+/* Takes a snapshot of the statistics segment */
+static void hp_admin_collect(struct hp_admin_t *admin)
+{
+    int i, j;
+
+    memset(&(admin->sum), 0, sizeof (struct hp_httpd_counters_t));
+    memset(admin->latency, 0, HP_LATENCY_MAX * sizeof (struct hp_histogram_t));
+
+    /* The pool may have been resized, retired threads keep their slots */
+    admin->running_threads = (int) HP_ATOMIC_LOAD(&(admin->stats->header->running_threads));
+    admin->used_threads = (int) HP_ATOMIC_LOAD(&(admin->stats->header->used_threads));
+
+    if (admin->used_threads > admin->num_threads) {
+        admin->used_threads = admin->num_threads;
+    }
+
+    for (i = 0; i < admin->used_threads; i++) {
+        hp_stats_read_counters(&(admin->per_thread[i]), hp_stats_counters(admin->stats, i));
+        hp_stats_sum_counters(&(admin->sum), &(admin->per_thread[i]));
+
+        for (j = 0; j < HP_LATENCY_MAX; j++) {
+            hp_histogram_merge(&(admin->latency[j]), &(hp_stats_latency(admin->stats, i)[j]));
+        }
+    }
+}
+
+static void hp_admin_prometheus_sample(struct hp_fmt_t *f, const struct hp_admin_metric_t *metric, int thread_id, uint64_t value)
+{
+    HP_FMT_CSTR(f, metric->name);
+
+    if (thread_id >= 0 || metric->label) {
+        HP_FMT_LITERAL(f, "{");
+
+        if (thread_id >= 0) {
+            HP_FMT_LITERAL(f, "thread=\"");
+            hp_fmt_u64(f, (uint64_t) thread_id);
+            HP_FMT_LITERAL(f, "\"");
+
+            if (metric->label) {
+                HP_FMT_LITERAL(f, ",");
+            }
+        }
+
+        if (metric->label) {
+            HP_FMT_CSTR(f, metric->label);
+        }
+        HP_FMT_LITERAL(f, "}");
+    }
+    HP_FMT_LITERAL(f, " ");
+    hp_fmt_u64(f, value);
+    HP_FMT_LITERAL(f, "\n");
+}
+
+static void hp_admin_render_prometheus(struct hp_admin_t *admin, struct hp_fmt_t *f)
+{
+    size_t m, q;
+    int i;
+
+    HP_FMT_LITERAL(f, "# HELP httpush_threads Number of httpd threads\n");
+    HP_FMT_LITERAL(f, "# TYPE httpush_threads gauge\n");
+    HP_FMT_LITERAL(f, "httpush_threads ");
+    hp_fmt_u64(f, (uint64_t) admin->running_threads);
+    HP_FMT_LITERAL(f, "\n");
+
+    for (m = 0; m < HP_ADMIN_NUM_METRICS; m++) {
+        const struct hp_admin_metric_t *metric = &hp_admin_metrics[m];
+
+        /* Samples with different labels share the description */
+        if (m == 0 || strcmp(metric->name, hp_admin_metrics[m - 1].name)) {
+            HP_FMT_LITERAL(f, "# HELP ");
+            HP_FMT_CSTR(f, metric->name);
+            HP_FMT_LITERAL(f, " ");
+            HP_FMT_CSTR(f, metric->help);
+            HP_FMT_LITERAL(f, "\n# TYPE ");
+            HP_FMT_CSTR(f, metric->name);
+            HP_FMT_LITERAL(f, " ");
+            HP_FMT_CSTR(f, metric->type);
+            HP_FMT_LITERAL(f, "\n");
+        }
+
+        hp_admin_prometheus_sample(f, metric, -1, hp_admin_value(&(admin->sum), metric));
+
+        for (i = 0; i < admin->used_threads; i++) {
+            hp_admin_prometheus_sample(f, metric, i, hp_admin_value(&(admin->per_thread[i]), metric));
+        }
+    }
+
+    HP_FMT_LITERAL(f, "# HELP httpush_latency_nanoseconds Publish path latency\n");
+    HP_FMT_LITERAL(f, "# TYPE httpush_latency_nanoseconds summary\n");
+
+    for (i = 0; i < HP_LATENCY_MAX; i++) {
+        for (q = 0; q < HP_ADMIN_NUM_QUANTILES; q++) {
+            HP_FMT_LITERAL(f, "httpush_latency_nanoseconds{name=\"");
+            HP_FMT_CSTR(f, hp_admin_latency_names[i]);
+            HP_FMT_LITERAL(f, "\",quantile=\"");
+            HP_FMT_CSTR(f, hp_admin_quantiles[q].quantile);
+            HP_FMT_LITERAL(f, "\"} ");
+            hp_fmt_u64(f, hp_histogram_percentile(&(admin->latency[i]), hp_admin_quantiles[q].percentile));
+            HP_FMT_LITERAL(f, "\n");
+        }
+        HP_FMT_LITERAL(f, "httpush_latency_nanoseconds_count{name=\"");
+        HP_FMT_CSTR(f, hp_admin_latency_names[i]);
+        HP_FMT_LITERAL(f, "\"} ");
+        hp_fmt_u64(f, admin->latency[i].count);
+        HP_FMT_LITERAL(f, "\n");
+    }
+}
+
+static void hp_admin_json_counters(struct hp_fmt_t *f, struct hp_httpd_counters_t *counters)
+{
+    size_t m;
+
+    for (m = 0; m < HP_ADMIN_NUM_METRICS; m++) {
+        HP_FMT_CSTR(f, m ? ",\"" : "\"");
+        HP_FMT_CSTR(f, hp_admin_metrics[m].key);
+        HP_FMT_LITERAL(f, "\":");
+        hp_fmt_u64(f, hp_admin_value(counters, &hp_admin_metrics[m]));
+    }
+}
+
+static void hp_admin_render_json(struct hp_admin_t *admin, struct hp_fmt_t *f)
+{
+    size_t q;
+    int i;
+
+    HP_FMT_LITERAL(f, "{\"threads\":");
+    hp_fmt_u64(f, (uint64_t) admin->running_threads);
+
+    HP_FMT_LITERAL(f, ",\"total\":{");
+    hp_admin_json_counters(f, &(admin->sum));
+    HP_FMT_LITERAL(f, "},\"per_thread\":[");
+
+    for (i = 0; i < admin->used_threads; i++) {
+        HP_FMT_CSTR(f, i ? ",{\"id\":" : "{\"id\":");
+        hp_fmt_u64(f, (uint64_t) i);
+        HP_FMT_LITERAL(f, ",");
+        hp_admin_json_counters(f, &(admin->per_thread[i]));
+        HP_FMT_LITERAL(f, "}");
+    }
+
+    HP_FMT_LITERAL(f, "],\"latency_ns\":{");
+
+    for (i = 0; i < HP_LATENCY_MAX; i++) {
+        HP_FMT_CSTR(f, i ? ",\"" : "\"");
+        HP_FMT_CSTR(f, hp_admin_latency_names[i]);
+        HP_FMT_LITERAL(f, "\":{\"count\":");
+        hp_fmt_u64(f, admin->latency[i].count);
+
+        for (q = 0; q < HP_ADMIN_NUM_QUANTILES; q++) {
+            HP_FMT_LITERAL(f, ",\"");
+            HP_FMT_CSTR(f, hp_admin_quantiles[q].key);
+            HP_FMT_LITERAL(f, "\":");
+            hp_fmt_u64(f, hp_histogram_percentile(&(admin->latency[i]), hp_admin_quantiles[q].percentile));
+        }
+        HP_FMT_LITERAL(f, ",\"max\":");
+        hp_fmt_u64(f, admin->latency[i].max);
+        HP_FMT_LITERAL(f, "}");
+    }
+    HP_FMT_LITERAL(f, "}}\n");
+}
+
+static void hp_admin_reply(struct hp_admin_t *admin, struct evhttp_request *req,
+                           void (*render)(struct hp_admin_t *, struct hp_fmt_t *), const char *content_type)
+{
+    struct hp_fmt_t f;
+
+    f.p = admin->buffer;
+    f.end = admin->buffer + admin->capacity;
+    f.overflow = false;
+
+    hp_admin_collect(admin);
+    render(admin, &f);
+
+    if (f.overflow) {
+        HP_LOG_ERROR("Admin response does not fit in %zu bytes", admin->capacity);
+        evhttp_send_error(req, 500, "Internal Server Error");
+        return;
+    }
+
+    evbuffer_add(admin->evb, admin->buffer, f.p - admin->buffer);
+    evhttp_add_header(req->output_headers, "Content-Type", content_type);
+    evhttp_send_reply(req, HTTP_OK, "OK", admin->evb);
+    evbuffer_drain(admin->evb, EVBUFFER_LENGTH(admin->evb));
+}
+
+static void hp_admin_metrics_cb(struct evhttp_request *req, void *args)
+{
+    hp_admin_reply((struct hp_admin_t *) args, req, hp_admin_render_prometheus, "text/plain; version=0.0.4");
+}
+
+static void hp_admin_json_cb(struct evhttp_request *req, void *args)
+{
+    hp_admin_reply((struct hp_admin_t *) args, req, hp_admin_render_json, "application/json");
+}
+
+static void hp_admin_not_found_cb(struct evhttp_request *req, void *args __unused)
+{
+    evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+}
+
+static void hp_admin_wakeup_cb(int fd, short event __unused, void *args)
+{
+    struct hp_admin_t *admin = (struct hp_admin_t *) args;
+    char c;
+
+    (void) read(fd, &c, 1);
+    event_base_loopexit(admin->base, NULL);
+}
+
+static void *hp_admin_start(void *args)
+{
+    event_base_dispatch(((struct hp_admin_t *) args)->base);
+    return NULL;
+}
+
+bool hp_admin_init(struct hp_admin_t *admin, struct hp_stats_t *stats, int num_threads, int fd)
+{
+    memset(admin, 0, sizeof (struct hp_admin_t));
+
+    admin->stats = stats;
+    admin->num_threads = num_threads;
+    admin->wakeup[0] = admin->wakeup[1] = -1;
+
+    /* Everything the responses need is allocated up front */
+    admin->capacity = HP_ADMIN_BUFFER_BASE + (num_threads * HP_ADMIN_BUFFER_PER_THREAD);
+    admin->buffer = malloc(admin->capacity);
+    admin->per_thread = calloc(num_threads, sizeof (struct hp_httpd_counters_t));
+    admin->latency = calloc(HP_LATENCY_MAX, sizeof (struct hp_histogram_t));
+    admin->evb = evbuffer_new();
+
+    if (!admin->buffer || !admin->per_thread || !admin->latency || !admin->evb) {
+        goto return_error;
+    }
+
+    admin->base = event_init();
+    if (!admin->base) {
+        goto return_error;
+    }
+
+    admin->httpd = evhttp_new(admin->base);
+    if (!admin->httpd) {
+        goto return_error;
+    }
+
+    evhttp_set_cb(admin->httpd, "/metrics", hp_admin_metrics_cb, admin);
+    evhttp_set_cb(admin->httpd, "/stats.json", hp_admin_json_cb, admin);
+    evhttp_set_gencb(admin->httpd, hp_admin_not_found_cb, admin);
+
+    if (evhttp_accept_socket(admin->httpd, fd) != 0) {
+        goto return_error;
+    }
+
+    /* The parent stops the loop through the pipe */
+    if (pipe(admin->wakeup) != 0) {
+        admin->wakeup[0] = admin->wakeup[1] = -1;
+        goto return_error;
+    }
+
+    event_set(&(admin->wakeup_ev), admin->wakeup[0], EV_READ, hp_admin_wakeup_cb, admin);
+    event_base_set(admin->base, &(admin->wakeup_ev));
+
+    if (event_add(&(admin->wakeup_ev), NULL) != 0) {
+        goto return_error;
+    }
+
+    if (pthread_create(&(admin->thread), NULL, hp_admin_start, admin)) {
+        HP_LOG_ERROR("Failed to launch admin thread");
+        goto return_error;
+    }
+    return true;
+
+return_error:
+    hp_admin_free(admin);
+    return false;
+}
+
+void hp_admin_stop(struct hp_admin_t *admin)
+{
+    char c = 0;
+
+    if (write(admin->wakeup[1], &c, 1) != 1 || pthread_join(admin->thread, NULL)) {
+        HP_LOG_ERROR("Failed to stop admin thread");
+        return;
+    }
+    hp_admin_free(admin);
+}
+
+void hp_admin_free(struct hp_admin_t *admin)
+{
+    if (admin->httpd) {
+        evhttp_free(admin->httpd);
+        admin->httpd = NULL;
+    }
+
+    if (admin->base) {
+        event_base_free(admin->base);
+        admin->base = NULL;
+    }
+
+    if (admin->wakeup[0] != -1) {
+        (void) close(admin->wakeup[0]);
+        (void) close(admin->wakeup[1]);
+        admin->wakeup[0] = admin->wakeup[1] = -1;
+    }
+
+    if (admin->evb) {
+        evbuffer_free(admin->evb);
+        admin->evb = NULL;
+    }
+
+    free(admin->buffer);
+    free(admin->per_thread);
+    free(admin->latency);
+
+    admin->buffer = NULL;
+    admin->per_thread = NULL;
+    admin->latency = NULL;
+}
+
@@ -0,0 +1,231 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+#define HP_NUMA_SYSFS "/sys/devices/system/node"
+
+/*
+ Parses a cpu list such as "0-3,8,10-11" into an array of cpu numbers
+ */
+bool hp_parse_cpu_list(const char *list, int **cpus, size_t *num_cpus) {
+    const char *p = list;
+    size_t allocated = 16;
+
+    *num_cpus = 0;
+    *cpus = malloc(allocated * sizeof (int));
+
+    if (!*cpus) {
+        return false;
+    }
+
+    while (*p) {
+        char *end;
+        long first, last, cpu;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            goto return_error;
+        }
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                goto return_error;
+            }
+            p = end;
+        }
+
+        for (cpu = first; cpu <= last; cpu++) {
+            if (*num_cpus == allocated) {
+                int *tmp = realloc(*cpus, (allocated * 2) * sizeof (int));
+                if (!tmp) {
+                    goto return_error;
+                }
+                *cpus = tmp;
+                allocated *= 2;
+            }
+            (*cpus)[(*num_cpus)++] = (int) cpu;
+        }
+
+        if (*p == ',') {
+            p++;
+        } else if (*p && !isspace((int) *p)) {
+            goto return_error;
+        } else {
+            break;
+        }
+    }
+
+    if (*num_cpus > 0) {
+        return true;
+    }
+
+return_error:
+    free(*cpus);
+    *cpus = NULL;
+    *num_cpus = 0;
+    return false;
+}
+
+/*
+ Returns the number of NUMA nodes, 1 if the information is not available
+ */
+int hp_numa_num_nodes() {
+    int nodes = 0;
+    char path[64];
+
+    while (true) {
+        (void) snprintf(path, 64, HP_NUMA_SYSFS "/node%d", nodes);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+        nodes++;
+    }
+    return (nodes > 0) ? nodes : 1;
+}
+
+/*
+ Reads the cpus of a NUMA node from sysfs
+ */
+static bool hp_numa_node_cpus(int node, int **cpus, size_t *num_cpus) {
+    FILE *fp;
+    char path[64], line[1024];
+    bool retval = false;
+
+    (void) snprintf(path, 64, HP_NUMA_SYSFS "/node%d/cpulist", node);
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+
+    if (fgets(line, sizeof (line), fp)) {
+        retval = hp_parse_cpu_list(line, cpus, num_cpus);
+    }
+    (void) fclose(fp);
+    return retval;
+}
+
+/*
+ Returns the NUMA node of the cpu, 0 if unknown
+ */
+int hp_numa_cpu_node(int cpu) {
+    int node, num_nodes = hp_numa_num_nodes();
+
+    for (node = 0; node < num_nodes; node++) {
+        int *cpus;
+        size_t i, num_cpus;
+        bool found = false;
+
+        if (hp_numa_node_cpus(node, &cpus, &num_cpus) == false) {
+            continue;
+        }
+
+        for (i = 0; i < num_cpus; i++) {
+            if (cpus[i] == cpu) {
+                found = true;
+                break;
+            }
+        }
+        free(cpus);
+
+        if (found) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+/*
+ Initializes the attributes for a thread to run on the given cpu
+ */
+bool hp_thread_attr_cpu(pthread_attr_t *attr, int cpu) {
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_attr_setaffinity_np(attr, sizeof (cpu_set_t), &set) != 0) {
+        HP_LOG_ERROR("Failed to set affinity to cpu %d", cpu);
+        return false;
+    }
+    return true;
+#else
+    (void) attr;
+    (void) cpu;
+    HP_LOG_ERROR("Setting cpu affinity is not supported on this platform");
+    return false;
+#endif
+}
+
+/*
+ Creates a 0MQ context whose I/O threads run on the cpus of the given node.
+ The I/O threads inherit the affinity of the thread calling zmq_init, so the
+ affinity of the calling thread is changed for the duration of the call.
+ */
+void *hp_numa_context(int node, int io_threads) {
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+    void *ctx;
+    int *cpus;
+    size_t i, num_cpus;
+    cpu_set_t set, orig;
+
+    if (hp_numa_node_cpus(node, &cpus, &num_cpus) == false) {
+        HP_LOG_WARN("No cpu information for NUMA node %d", node);
+        return zmq_init(io_threads);
+    }
+
+    CPU_ZERO(&set);
+    for (i = 0; i < num_cpus; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    free(cpus);
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof (cpu_set_t), &orig) != 0 ||
+        pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &set) != 0) {
+        HP_LOG_WARN("Failed to bind context to NUMA node %d", node);
+        return zmq_init(io_threads);
+    }
+
+    ctx = zmq_init(io_threads);
+
+    (void) pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &orig);
+    return ctx;
+#else
+    (void) node;
+    return zmq_init(io_threads);
+#endif
+}
+
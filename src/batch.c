@@ -0,0 +1,327 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <stddef.h>
+
+/*
+ Micro-batching of published messages. Each httpd thread appends messages
+ into a single buffer which is sent as one 0MQ message when it holds
+ max_messages messages, max_bytes bytes or when max_usec microseconds have
+ passed since the first message was added. See README.md for the framing.
+ */
+
+#define HP_BATCH_PREFIX_SIZE 4
+#define HP_BATCH_RECORD_PREFIX_SIZE 8
+
+/*
+ The buffer of a batch. 0MQ holds a reference while a send is attempted so
+ that a batch the socket refused stays with the thread and can be retried
+ */
+struct hp_batch_buffer_t {
+    int refs;
+    char data[];
+};
+
+#define HP_BATCH_BUFFER(data_) ((struct hp_batch_buffer_t *) ((data_) - offsetof(struct hp_batch_buffer_t, data)))
+
+static void hp_batch_put_uint32(char *p, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(p, &value, sizeof (uint32_t));
+}
+
+static char *hp_batch_alloc(size_t capacity)
+{
+    struct hp_batch_buffer_t *buffer = malloc(sizeof (struct hp_batch_buffer_t) + capacity);
+
+    if (!buffer) {
+        return NULL;
+    }
+    buffer->refs = 1;
+    return buffer->data;
+}
+
+/* Drops a reference to the buffer, called by 0MQ from its IO threads too */
+static void hp_batch_release(void *data, void *hint __unused)
+{
+    struct hp_batch_buffer_t *buffer = HP_BATCH_BUFFER((char *) data);
+
+    if (__sync_sub_and_fetch(&(buffer->refs), 1) == 0) {
+        free(buffer);
+    }
+}
+
+/* Publishes the state of the batch in the statistics segment */
+static void hp_batch_update_counters(struct hp_batch_t *batch)
+{
+    if (batch->counters) {
+        HP_ATOMIC_STORE(&(batch->counters->queue_messages), (uint64_t) batch->count);
+        HP_ATOMIC_STORE(&(batch->counters->queue_bytes), (uint64_t) (batch->len - HP_BATCH_PREFIX_SIZE));
+    }
+}
+
+static void hp_batch_timer_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_batch_t *batch = (struct hp_batch_t *) args;
+
+    batch->timer_pending = false;
+
+    if (hp_batch_flush(batch) == false) {
+        struct timeval tv;
+
+        HP_USEC_TO_TIMEVAL(batch->config.max_usec, tv);
+        HP_LOG_WARN("Failed to flush batch of %" PRIu32 " messages, retrying", batch->count);
+
+        /* Try again after another period */
+        if (event_add(&(batch->timer), &tv) == 0) {
+            batch->timer_pending = true;
+        }
+    }
+}
+
+/*
+ Sends the batch as a flag frame and the, possibly compressed, batch frame.
+ The reference of 0MQ to the buffer is dropped in both cases
+ */
+static bool hp_batch_send_compressed(struct hp_batch_t *batch)
+{
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int i, num_parts;
+    uint64_t start;
+    size_t size = 0;
+    bool sent = true;
+
+    if (zmq_msg_init_data(&(parts[0]), batch->data, batch->len, hp_batch_release, NULL) != 0) {
+        hp_batch_release(batch->data, NULL);
+        return false;
+    }
+
+    num_parts = hp_compress_message(batch->compressor, parts, 1);
+    if (num_parts == 0) {
+        return false;
+    }
+
+    start = hp_now_ns();
+
+    for (i = 0; i < num_parts; i++) {
+        if (!sent) {
+            zmq_msg_close(&(parts[i]));
+            continue;
+        }
+        size += zmq_msg_size(&(parts[i]));
+        sent = hp_sendmsg_zmq(batch->socket, &(parts[i]), ZMQ_NOBLOCK | ((i < num_parts - 1) ? ZMQ_SNDMORE : 0));
+    }
+
+    if (batch->send_latency) {
+        hp_histogram_record(batch->send_latency, hp_now_ns() - start);
+    }
+
+    if (sent && batch->counters) {
+        HP_COUNTER_ADD(batch->counters->bytes_out, size);
+    }
+    return sent;
+}
+
+bool hp_batch_init(struct hp_batch_t *batch, struct hp_batch_config_t *config, struct event_base *base, void *socket)
+{
+    memcpy(&(batch->config), config, sizeof (struct hp_batch_config_t));
+
+    batch->socket = socket;
+    batch->count = 0;
+    batch->len = HP_BATCH_PREFIX_SIZE;
+    batch->capacity = config->max_bytes + HP_BATCH_PREFIX_SIZE;
+    batch->pending_len = 0;
+    batch->send_latency = NULL;
+    batch->counters = NULL;
+    batch->compressor = NULL;
+    batch->timer_pending = false;
+
+    batch->data = hp_batch_alloc(batch->capacity);
+    if (!batch->data) {
+        return false;
+    }
+
+    evtimer_set(&(batch->timer), hp_batch_timer_cb, batch);
+    event_base_set(base, &(batch->timer));
+    return true;
+}
+
+/*
+ Sends the buffered messages. The buffer is handed to 0MQ as is and a new
+ one of the configured size is allocated for the next batch. The batch is
+ kept, to be retried, if the socket cannot take it right now: its messages
+ have already been answered.
+ */
+bool hp_batch_flush(struct hp_batch_t *batch)
+{
+    uint32_t events;
+    size_t events_size = sizeof (uint32_t);
+    size_t capacity = batch->config.max_bytes + HP_BATCH_PREFIX_SIZE;
+    char *next;
+    uint64_t start;
+    bool sent;
+
+    if (batch->count == 0) {
+        return true;
+    }
+
+    /* Saves compressing a batch that can't be sent */
+    if (zmq_getsockopt(batch->socket, ZMQ_EVENTS, &events, &events_size) != 0 || !(events & ZMQ_POLLOUT)) {
+        return false;
+    }
+
+    next = hp_batch_alloc(capacity);
+    if (!next) {
+        return false;
+    }
+
+    hp_batch_put_uint32(batch->data, batch->count);
+
+    /* The reference of 0MQ, the batch keeps its own until the send succeeded */
+    (void) __sync_add_and_fetch(&(HP_BATCH_BUFFER(batch->data)->refs), 1);
+
+    if (batch->compressor) {
+        sent = hp_batch_send_compressed(batch);
+    } else {
+        start = hp_now_ns();
+        sent = hp_sendmsg_nocopy(batch->socket, batch->data, batch->len, hp_batch_release, NULL, ZMQ_NOBLOCK);
+
+        if (batch->send_latency) {
+            hp_histogram_record(batch->send_latency, hp_now_ns() - start);
+        }
+
+        if (sent && batch->counters) {
+            HP_COUNTER_ADD(batch->counters->bytes_out, batch->len);
+        }
+    }
+
+    if (!sent) {
+        HP_LOG_ERROR("Failed to send batch of %" PRIu32 " messages: %s", batch->count, zmq_strerror(errno));
+        hp_batch_release(next, NULL);
+        return false;
+    }
+
+    if (batch->timer_pending) {
+        event_del(&(batch->timer));
+        batch->timer_pending = false;
+    }
+
+    hp_batch_release(batch->data, NULL);
+
+    /* An oversize message may have grown the last one */
+    batch->data = next;
+    batch->capacity = capacity;
+    batch->len = HP_BATCH_PREFIX_SIZE;
+    batch->count = 0;
+
+    hp_batch_update_counters(batch);
+    return true;
+}
+
+/*
+ Reserves room for a message with the given header and body sizes.
+ Returns a pointer where the header followed by the body must be written,
+ or NULL if the batch is full and cannot be flushed.
+ */
+char *hp_batch_append(struct hp_batch_t *batch, size_t header_len, size_t body_len)
+{
+    char *p;
+    size_t record_len = HP_BATCH_RECORD_PREFIX_SIZE + header_len + body_len;
+
+    if (header_len > UINT32_MAX || body_len > UINT32_MAX) {
+        return NULL;
+    }
+
+    if (batch->count > 0 && batch->len + record_len > batch->capacity) {
+        if (hp_batch_flush(batch) == false) {
+            return NULL;
+        }
+    }
+
+    /* Message larger than the whole batch goes out on its own, the flush shrinks the buffer back */
+    if (batch->len + record_len > batch->capacity) {
+        struct hp_batch_buffer_t *buffer = realloc(HP_BATCH_BUFFER(batch->data), sizeof (struct hp_batch_buffer_t) + batch->len + record_len);
+        if (!buffer) {
+            return NULL;
+        }
+        batch->data = buffer->data;
+        batch->capacity = batch->len + record_len;
+    }
+
+    p = batch->data + batch->len;
+
+    hp_batch_put_uint32(p, (uint32_t) header_len);
+    hp_batch_put_uint32(p + 4, (uint32_t) body_len);
+
+    batch->pending_len = record_len;
+    return p + HP_BATCH_RECORD_PREFIX_SIZE;
+}
+
+/*
+ Completes the message reserved with hp_batch_append
+ */
+void hp_batch_commit(struct hp_batch_t *batch)
+{
+    batch->len += batch->pending_len;
+    batch->pending_len = 0;
+
+    if (++(batch->count) == 1 && !batch->timer_pending) {
+        struct timeval tv;
+
+        HP_USEC_TO_TIMEVAL(batch->config.max_usec, tv);
+        if (event_add(&(batch->timer), &tv) == 0) {
+            batch->timer_pending = true;
+        }
+    }
+
+    if (batch->count >= batch->config.max_messages || batch->len >= batch->config.max_bytes) {
+        /* The timer retries if this fails */
+        if (hp_batch_flush(batch) == true) {
+            return;
+        }
+    }
+    hp_batch_update_counters(batch);
+}
+
+void hp_batch_free(struct hp_batch_t *batch)
+{
+    if (hp_batch_flush(batch) == false) {
+        HP_LOG_WARN("Dropping batch of %" PRIu32 " messages", batch->count);
+    }
+
+    if (batch->timer_pending) {
+        event_del(&(batch->timer));
+        batch->timer_pending = false;
+    }
+    hp_batch_release(batch->data, NULL);
+    batch->data = NULL;
+}
+
@@ -0,0 +1,300 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <zlib.h>
+
+#ifdef HAVE_LIBLZ4
+# include <lz4.h>
+#endif
+
+/*
+ Compression stage. A message is sent as a flag frame followed by the header
+ frame, if headers are included, and the body. Each httpd thread keeps its
+ codec state and a scratch buffer so that nothing is set up per message.
+ Messages smaller than min_size, or that don't get any smaller, are sent
+ uncompressed with HP_CODEC_NONE in the flag frame.
+ */
+
+#define HP_FLAGS_VERSION    1
+
+/* Bits of the flags byte */
+#define HP_FLAGS_STREAM     0x01
+
+static bool hp_compress_reserve(struct hp_compressor_t *compressor, size_t size)
+{
+    char *buffer;
+
+    if (compressor->capacity >= size) {
+        return true;
+    }
+
+    buffer = realloc(compressor->buffer, size);
+    if (!buffer) {
+        return false;
+    }
+    compressor->buffer = buffer;
+    compressor->capacity = size;
+    return true;
+}
+
+/* Upper bound for the compressed size, 0 if the codec can't take the input */
+static size_t hp_compress_bound(struct hp_compressor_t *compressor, size_t len)
+{
+    switch (compressor->config.codec) {
+        case HP_CODEC_ZLIB:
+            if (len > UINT32_MAX) {
+                return 0;
+            }
+            return (size_t) deflateBound((z_stream *) compressor->state, (uLong) len);
+
+#ifdef HAVE_LIBLZ4
+        case HP_CODEC_LZ4:
+            if (len > INT32_MAX / 2) {
+                return 0;
+            }
+            return (size_t) LZ4_compressBound((int) len);
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+/* Compresses into 'out', returns the compressed size or 0 on failure */
+static size_t hp_compress_frame(struct hp_compressor_t *compressor, const void *data, size_t len, char *out, size_t out_len)
+{
+    switch (compressor->config.codec) {
+        case HP_CODEC_ZLIB:
+        {
+            z_stream *zs = (z_stream *) compressor->state;
+
+            if (deflateReset(zs) != Z_OK) {
+                return 0;
+            }
+
+            zs->next_in = (Bytef *) data;
+            zs->avail_in = (uInt) len;
+            zs->next_out = (Bytef *) out;
+            zs->avail_out = (uInt) out_len;
+
+            if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+                return 0;
+            }
+            return out_len - zs->avail_out;
+        }
+
+#ifdef HAVE_LIBLZ4
+        case HP_CODEC_LZ4:
+        {
+            int rc = LZ4_compress_fast_extState(compressor->state, (const char *) data, out,
+                                                (int) len, (int) out_len, compressor->config.level);
+            return (rc > 0) ? (size_t) rc : 0;
+        }
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+static void hp_compress_put_flags(char *p, hp_codec_t codec, char flags, uint32_t header_len, uint32_t body_len)
+{
+    p[0] = HP_FLAGS_VERSION;
+    p[1] = (char) codec;
+    p[2] = flags;
+    p[3] = 0;
+
+    header_len = htonl(header_len);
+    body_len = htonl(body_len);
+
+    memcpy(p + 4, &header_len, sizeof (uint32_t));
+    memcpy(p + 8, &body_len, sizeof (uint32_t));
+}
+
+bool hp_compressor_init(struct hp_compressor_t *compressor, struct hp_compress_config_t *config)
+{
+    memset(compressor, 0, sizeof (struct hp_compressor_t));
+    memcpy(&(compressor->config), config, sizeof (struct hp_compress_config_t));
+
+    switch (config->codec) {
+        case HP_CODEC_ZLIB:
+        {
+            z_stream *zs = calloc(1, sizeof (z_stream));
+
+            if (!zs) {
+                return false;
+            }
+
+            if (deflateInit2(zs, config->level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                free(zs);
+                return false;
+            }
+            compressor->state = zs;
+        }
+        break;
+
+#ifdef HAVE_LIBLZ4
+        case HP_CODEC_LZ4:
+            compressor->state = malloc(LZ4_sizeofState());
+            if (!compressor->state) {
+                return false;
+            }
+        break;
+#endif
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+/*
+ Turns the header (optional) and body frames in 'parts' into a flag frame
+ followed by the frames, compressed if it is worth it. 'parts' must have
+ room for HP_MAX_PARTS messages. Returns the new number of parts or 0 on
+ failure, in which case the parts have been closed
+ */
+int hp_compress_message(struct hp_compressor_t *compressor, zmq_msg_t *parts, int num_parts)
+{
+    size_t len[HP_MAX_PARTS] = { 0 }, out_len[HP_MAX_PARTS] = { 0 }, total = 0, bound = 0, compressed = 0;
+    uint32_t header_len = 0;
+    hp_codec_t codec = HP_CODEC_NONE;
+    int i;
+
+    assert(num_parts > 0 && num_parts < HP_MAX_PARTS);
+
+    for (i = 0; i < num_parts; i++) {
+        len[i] = zmq_msg_size(&(parts[i]));
+        total += len[i];
+
+        if (len[i] > UINT32_MAX) {
+            goto return_error;
+        }
+    }
+
+    if (num_parts == 2) {
+        header_len = (uint32_t) len[0];
+    }
+
+    if (total >= compressor->config.min_size) {
+        uint64_t start = hp_now_ns();
+        bool fits = true;
+
+        for (i = 0; i < num_parts; i++) {
+            size_t b = hp_compress_bound(compressor, len[i]);
+
+            if (b == 0) {
+                fits = false;
+                break;
+            }
+            bound += b;
+        }
+
+        if (fits && hp_compress_reserve(compressor, bound)) {
+            char *out = compressor->buffer;
+
+            for (i = 0; i < num_parts; i++) {
+                out_len[i] = hp_compress_frame(compressor, zmq_msg_data(&(parts[i])), len[i], out, bound - compressed);
+                if (out_len[i] == 0) {
+                    break;
+                }
+                out += out_len[i];
+                compressed += out_len[i];
+            }
+
+            if (i == num_parts && compressed < total) {
+                codec = compressor->config.codec;
+            }
+        }
+
+        if (compressor->latency) {
+            hp_histogram_record(compressor->latency, hp_now_ns() - start);
+        }
+    }
+
+    /* Make room for the flag frame */
+    for (i = num_parts; i > 0; i--) {
+        zmq_msg_init(&(parts[i]));
+        zmq_msg_move(&(parts[i]), &(parts[i - 1]));
+    }
+    num_parts++;
+
+    if (zmq_msg_init_size(&(parts[0]), HP_FLAGS_FRAME_SIZE) != 0) {
+        zmq_msg_init(&(parts[0]));
+        goto return_error;
+    }
+    hp_compress_put_flags((char *) zmq_msg_data(&(parts[0])), codec, 0, header_len, (uint32_t) len[num_parts - 2]);
+
+    if (codec != HP_CODEC_NONE) {
+        char *out = compressor->buffer;
+
+        for (i = 1; i < num_parts; i++) {
+            zmq_msg_close(&(parts[i]));
+
+            if (zmq_msg_init_size(&(parts[i]), out_len[i - 1]) != 0) {
+                zmq_msg_init(&(parts[i]));
+                goto return_error;
+            }
+            memcpy(zmq_msg_data(&(parts[i])), out, out_len[i - 1]);
+            out += out_len[i - 1];
+        }
+    }
+    return num_parts;
+
+return_error:
+    for (i = 0; i < num_parts; i++) {
+        zmq_msg_close(&(parts[i]));
+    }
+    return 0;
+}
+
+/*
+ Writes the flags of a message of a streamed body at the start of its stream
+ frame. The chunks of a stream are not compressed
+ */
+void hp_compress_stream_flags(char *p, uint32_t header_len, uint32_t body_len)
+{
+    hp_compress_put_flags(p, HP_CODEC_NONE, HP_FLAGS_STREAM, header_len, body_len);
+}
+
+void hp_compressor_free(struct hp_compressor_t *compressor)
+{
+    if (compressor->state && compressor->config.codec == HP_CODEC_ZLIB) {
+        (void) deflateEnd((z_stream *) compressor->state);
+    }
+
+    free(compressor->state);
+    free(compressor->buffer);
+
+    compressor->state = NULL;
+    compressor->buffer = NULL;
+    compressor->capacity = 0;
+}
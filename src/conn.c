@@ -0,0 +1,1196 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ POST-only HTTP/1.x front-end used instead of evhttp with -f or -S. The head
+ of a request is parsed in place in the read buffer by parser.c, and a body
+ with a Content-Length is published straight from the read buffer, so the
+ only copies made are the ones into the 0MQ messages. Keep-alive and
+ pipelined requests are supported, the replies are written in order.
+
+ With -S bodies larger than the threshold are sent while they are being
+ read, each chunk_size bytes as a message of their own tagged with the id of
+ the stream and a sequence number, followed by an end or abort message. A
+ connection whose chunk the out socket refuses stops reading until the queue
+ reports the socket writable again, which keeps its memory at about a chunk
+ and a read. Any number of bodies can be streamed at the same time.
+ */
+
+/* Largest chunk size or trailer line of a chunked body */
+#define HP_CONN_MAX_LINE 1024
+
+/* Seconds a connection may stay silent while a request is being read */
+#define HP_CONN_TIMEOUT 60
+
+#define HP_CONN_READ_SIZE 16384
+
+/*
+ The stream frame: the flag frame of -Z followed by u64 stream id, u32
+ sequence, u8 kind, 3 reserved bytes and u64 offset of the body frame
+ */
+#define HP_STREAM_FRAME_SIZE (HP_FLAGS_FRAME_SIZE + 24)
+#define HP_STREAM_DATA       0
+#define HP_STREAM_END        1
+#define HP_STREAM_ABORT      2
+
+/* Ids of the streams, unique within the process */
+static uint64_t hp_conn_stream_ids = 0;
+
+static void hp_conn_process(struct hp_conn_t *conn);
+
+/* Reads while a request is being received and writes while there is output */
+static void hp_conn_update_events(struct hp_conn_t *conn)
+{
+    bool read = (conn->state == HP_CONN_HEAD || conn->state == HP_CONN_BODY);
+    bool write = (EVBUFFER_LENGTH(conn->output) > 0);
+
+    if (read) {
+        struct timeval tv = { HP_CONN_TIMEOUT, 0 };
+
+        /* Adding again restarts the timeout */
+        conn->reading = (event_add(&(conn->read_ev), &tv) == 0);
+    } else if (conn->reading) {
+        event_del(&(conn->read_ev));
+        conn->reading = false;
+    }
+
+    if (write && !conn->writing) {
+        conn->writing = (event_add(&(conn->write_ev), NULL) == 0);
+    } else if (!write && conn->writing) {
+        event_del(&(conn->write_ev));
+        conn->writing = false;
+    }
+}
+
+/* Forgets the current request */
+static void hp_conn_reset(struct hp_conn_t *conn)
+{
+    if (conn->has_batch_header) {
+        zmq_msg_close(&(conn->batch_header));
+        conn->has_batch_header = false;
+    }
+    conn->target = NULL;
+    memset(&(conn->dedup), 0, sizeof (struct hp_dedup_ref_t));
+    conn->batch = false;
+    conn->accepted = 0;
+    conn->rejected = 0;
+    conn->batch_scanned = 0;
+    conn->batch_skip = false;
+
+    evbuffer_drain(conn->body, EVBUFFER_LENGTH(conn->body));
+
+    conn->framing = HP_CONN_LENGTH;
+    conn->remaining = 0;
+    conn->body_len = 0;
+    if (conn->has_stream_header) {
+        zmq_msg_close(&(conn->stream_header));
+        conn->has_stream_header = false;
+    }
+    conn->streaming = false;
+    conn->stream_seq = 0;
+    conn->stream_sent = 0;
+}
+
+/* Appends the access log record of the current request */
+static void hp_conn_access_write(struct hp_conn_t *conn, int code, uint64_t now)
+{
+    struct hp_request_t *req = &(conn->request);
+    const char *path = "";
+    size_t path_len = 0;
+
+    /* Requests refused before their head was copied have no path */
+    if (req->head_len <= conn->head_capacity) {
+        const char *query;
+
+        path = conn->head + req->uri;
+        path_len = req->uri_len;
+
+        query = memchr(path, '?', path_len);
+        if (query) {
+            path_len = query - path;
+        }
+    }
+    hp_access_write(&(conn->thread->access_log), conn->start, now, code, conn->body_len, &(conn->remote_addr), path, path_len);
+}
+
+/*
+ Writes the reply to the current request. The connection goes back to
+ reading the next request unless it is to be closed
+ */
+static void hp_conn_reply_type(struct hp_conn_t *conn, int code, const char *reason, const char *type, const char *body)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+
+    /* A retiring thread closes each connection once its request is answered */
+    if (thread->retiring == true) {
+        conn->keep_alive = false;
+    }
+
+    evbuffer_add_printf(conn->output, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n%s",
+                        code, reason, type, strlen(body), (conn->keep_alive ? "" : "Connection: close\r\n"), body);
+
+    switch (code) {
+        case 200:
+            HP_COUNTER_INC(thread->counters->code_200);
+        break;
+
+        case 412:
+            HP_COUNTER_INC(thread->counters->code_412);
+        break;
+
+        case 503:
+            HP_COUNTER_INC(thread->counters->code_503);
+        break;
+    }
+
+    if (conn->start) {
+        uint64_t now = hp_now_ns();
+
+        hp_histogram_record(&(thread->latency[HP_LATENCY_REQUEST]), now - conn->start);
+
+        if (thread->access_logging == true) {
+            hp_conn_access_write(conn, code, now);
+        }
+        conn->start = 0;
+    }
+
+    hp_conn_reset(conn);
+    conn->state = (conn->keep_alive ? HP_CONN_HEAD : HP_CONN_CLOSING);
+    hp_conn_update_events(conn);
+}
+
+static void hp_conn_reply(struct hp_conn_t *conn, int code, const char *reason, const char *body)
+{
+    hp_conn_reply_type(conn, code, reason, "text/plain", body);
+}
+
+/* Replies to a request that can't be read any further and closes */
+static void hp_conn_error(struct hp_conn_t *conn, int code, const char *reason)
+{
+    conn->keep_alive = false;
+    hp_conn_reply(conn, code, reason, reason);
+}
+
+/* Value of a header of the current request, NULL if it has none */
+static const char *hp_conn_find_header(struct hp_conn_t *conn, const char *name, size_t name_len, size_t *value_len)
+{
+    struct hp_request_t *req = &(conn->request);
+    int i;
+
+    for (i = 0; i < req->num_headers; i++) {
+        struct hp_request_header_t *h = &(req->headers[i]);
+
+        if (h->key_len == name_len && !strncasecmp(conn->head + h->key, name, name_len)) {
+            *value_len = h->value_len;
+            return conn->head + h->value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ Settles the idempotency key of a request once it is published, 'sent', or
+ not, in which case the retry is let through
+ */
+static void hp_conn_dedup_settle(struct hp_httpd_thread_t *thread, struct hp_dedup_ref_t *ref, bool sent)
+{
+    if (thread->dedup) {
+        hp_dedup_settle(thread->dedup, ref, sent, hp_now_ns());
+    }
+}
+
+static void hp_conn_publish_reply(struct hp_conn_t *conn, bool sent)
+{
+    hp_conn_dedup_settle(conn->thread, &(conn->dedup), sent);
+
+    if (sent) {
+        hp_conn_reply(conn, 200, "OK", "Sent");
+    } else {
+        hp_conn_reply(conn, 503, "Service Unavailable", "Internal Server Error");
+    }
+}
+
+/* Sends a frame of the stream and records the time spent in zmq_send */
+static bool hp_conn_stream_send_msg(struct hp_conn_t *conn, zmq_msg_t *msg, int flags)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    size_t size = zmq_msg_size(msg);
+    uint64_t start = hp_now_ns();
+    bool sent;
+
+    sent = hp_sendmsg_zmq(thread->out_socket, msg, flags | ZMQ_NOBLOCK);
+
+    hp_histogram_record(&(thread->latency[HP_LATENCY_SEND]), hp_now_ns() - start);
+
+    if (sent) {
+        HP_COUNTER_ADD(thread->counters->bytes_out, size);
+    }
+    return sent;
+}
+
+/* Prepares the header frame of the current request */
+static bool hp_conn_header_frame(struct hp_conn_t *conn, zmq_msg_t *msg)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    size_t size, remote_host_len = strlen(conn->remote_host);
+    uint64_t start = hp_now_ns();
+    char *end;
+
+    size = hp_request_frame_size(&(conn->request), remote_host_len);
+
+    if (zmq_msg_init_size(msg, size) != 0) {
+        return false;
+    }
+
+    end = hp_request_frame_write(&(conn->request), conn->head, conn->remote_host, remote_host_len, (char *) zmq_msg_data(msg));
+    hp_histogram_record(&(thread->latency[HP_LATENCY_HEADERS]), hp_now_ns() - start);
+
+    assert(end == (char *) zmq_msg_data(msg) + size);
+    (void) end;
+    return true;
+}
+
+static void hp_conn_put_uint64(char *p, uint64_t value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = (char) (value >> (56 - (i * 8)));
+    }
+}
+
+/*
+ Prepares a message of the stream: the stream frame, a copy of the header
+ frame unless -o is given and the body frame holding the next 'len' bytes of
+ the body, empty for the end and abort messages. Returns the number of
+ frames or 0 on failure
+ */
+static int hp_conn_stream_message(struct hp_conn_t *conn, uint8_t kind, size_t len, zmq_msg_t *parts)
+{
+    size_t header_len = conn->has_stream_header ? zmq_msg_size(&(conn->stream_header)) : 0;
+    uint32_t seq = htonl(conn->stream_seq);
+    int num_parts = 0;
+    char *p;
+
+    if (zmq_msg_init_size(&(parts[num_parts]), HP_STREAM_FRAME_SIZE) != 0) {
+        return 0;
+    }
+    p = (char *) zmq_msg_data(&(parts[num_parts++]));
+
+    hp_compress_stream_flags(p, (uint32_t) header_len, (uint32_t) len);
+    p += HP_FLAGS_FRAME_SIZE;
+
+    hp_conn_put_uint64(p, conn->stream_id);
+    memcpy(p + 8, &seq, sizeof (uint32_t));
+    p[12] = (char) kind;
+    memset(p + 13, 0, 3);
+
+    /* Body bytes in the earlier messages, the length of the body at the end */
+    hp_conn_put_uint64(p + 16, conn->stream_sent);
+
+    if (conn->has_stream_header) {
+        zmq_msg_init(&(parts[num_parts]));
+
+        if (zmq_msg_copy(&(parts[num_parts]), &(conn->stream_header)) != 0) {
+            goto return_error;
+        }
+        num_parts++;
+    }
+
+    if (zmq_msg_init_size(&(parts[num_parts]), len) != 0) {
+        goto return_error;
+    }
+    memcpy(zmq_msg_data(&(parts[num_parts])), EVBUFFER_DATA(conn->body), len);
+    return num_parts + 1;
+
+return_error:
+    while (num_parts > 0) {
+        zmq_msg_close(&(parts[--num_parts]));
+    }
+    return 0;
+}
+
+/*
+ Sends the next 'len' bytes of the body as a message of the stream. Fails
+ with EAGAIN while the queue holds messages, which go first, or the socket
+ is full
+ */
+static bool hp_conn_stream_send(struct hp_conn_t *conn, size_t len)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int i, num_parts, err;
+
+    if (hp_queue_idle(&(thread->queue)) == false) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    num_parts = hp_conn_stream_message(conn, HP_STREAM_DATA, len, parts);
+    if (num_parts == 0) {
+        return false;
+    }
+
+    /* 0MQ takes the other parts once it took the first one */
+    for (i = 0; i < num_parts; i++) {
+        if (hp_conn_stream_send_msg(conn, &(parts[i]), (i < num_parts - 1) ? ZMQ_SNDMORE : 0) == false) {
+            err = errno;
+            while (++i < num_parts) {
+                zmq_msg_close(&(parts[i]));
+            }
+            errno = err;
+            return false;
+        }
+    }
+
+    evbuffer_drain(conn->body, len);
+    conn->stream_seq++;
+    conn->stream_sent += len;
+    return true;
+}
+
+static void hp_conn_stream_release(struct hp_conn_t *conn)
+{
+    if (conn->has_stream_header) {
+        zmq_msg_close(&(conn->stream_header));
+        conn->has_stream_header = false;
+    }
+    conn->streaming = false;
+    conn->thread->streams--;
+}
+
+/*
+ Ends the stream with an end or abort message. It goes through the queue, so
+ it waits there if the socket is full. The queue replies to the request once
+ the end message is sent, nobody is replied to for an abort
+ */
+static hp_queue_status_t hp_conn_stream_finish(struct hp_conn_t *conn, uint8_t kind)
+{
+    struct hp_waiter_t waiter;
+    hp_queue_status_t status = HP_QUEUE_ERROR;
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int num_parts;
+
+    memset(&waiter, 0, sizeof (struct hp_waiter_t));
+    waiter.req = waiter.owner = (kind == HP_STREAM_END) ? conn : NULL;
+    waiter.start = conn->start;
+
+    num_parts = hp_conn_stream_message(conn, kind, 0, parts);
+
+    if (num_parts > 0) {
+        status = hp_queue_send(&(conn->thread->queue), &waiter, parts, num_parts);
+    }
+    hp_conn_stream_release(conn);
+    return status;
+}
+
+/* Gives up on a stream, the consumers are told if anything was sent */
+static void hp_conn_stream_abort(struct hp_conn_t *conn)
+{
+    if (conn->stream_seq == 0) {
+        hp_conn_stream_release(conn);
+        return;
+    }
+
+    switch (hp_conn_stream_finish(conn, HP_STREAM_ABORT)) {
+        case HP_QUEUE_SENT:
+        case HP_QUEUE_PENDING:
+        break;
+
+        default:
+            HP_LOG_ERROR("Failed to abort stream %" PRIu64 ": %s", conn->stream_id, zmq_strerror(errno));
+        break;
+    }
+}
+
+/* Starts streaming the body of the current request */
+static bool hp_conn_stream_start(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+
+    thread->streams++;
+
+    conn->streaming = true;
+    conn->stream_id = __sync_add_and_fetch(&hp_conn_stream_ids, 1);
+    conn->stream_seq = 0;
+    conn->stream_sent = 0;
+
+    if (thread->include_headers == true) {
+        if (hp_conn_header_frame(conn, &(conn->stream_header)) == false) {
+            HP_LOG_ERROR("Failed to start stream: %s", zmq_strerror(errno));
+            hp_conn_stream_release(conn);
+            hp_conn_error(conn, 503, "Service Unavailable");
+            return false;
+        }
+        conn->has_stream_header = true;
+    }
+    return true;
+}
+
+/*
+ Stops reading until the queue has been sent and the socket is writable,
+ when hp_conn_stream_idle continues with the body read so far
+ */
+static void hp_conn_stream_wait(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+
+    conn->state = HP_CONN_WAITING;
+    TAILQ_INSERT_TAIL(&(thread->stream_waiters), conn, waiters);
+    hp_conn_update_events(conn);
+
+    /* hp_conn_stream_idle asks again once it is done */
+    if (!thread->stream_waking) {
+        hp_queue_notify_idle(&(thread->queue));
+    }
+}
+
+/* Called by the queue when the socket is free for the waiting streams */
+void hp_conn_stream_idle(void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct hp_conn_t *conn;
+    size_t num_waiters = 0;
+
+    TAILQ_FOREACH(conn, &(thread->stream_waiters), waiters) {
+        num_waiters++;
+    }
+
+    /* The ones the socket refuses again go back to the end of the list */
+    thread->stream_waking = true;
+
+    while (num_waiters-- > 0) {
+        conn = TAILQ_FIRST(&(thread->stream_waiters));
+        TAILQ_REMOVE(&(thread->stream_waiters), conn, waiters);
+
+        conn->state = HP_CONN_BODY;
+        hp_conn_process(conn);
+    }
+    thread->stream_waking = false;
+
+    if (!TAILQ_EMPTY(&(thread->stream_waiters))) {
+        hp_queue_notify_idle(&(thread->queue));
+    }
+}
+
+/*
+ Sends the full chunks of the body read so far, and the rest followed by the
+ end message once the body is complete. Returns true when the request is done
+ */
+static bool hp_conn_stream_flush(struct hp_conn_t *conn)
+{
+    size_t chunk_size = conn->thread->stream.chunk_size;
+
+    while (EVBUFFER_LENGTH(conn->body) >= chunk_size ||
+            (conn->framing == HP_CONN_DONE && EVBUFFER_LENGTH(conn->body) > 0)) {
+        size_t len = EVBUFFER_LENGTH(conn->body);
+
+        if (len > chunk_size) {
+            len = chunk_size;
+        }
+
+        if (hp_conn_stream_send(conn, len) == false) {
+            if (errno == EAGAIN) {
+                hp_conn_stream_wait(conn);
+                return false;
+            }
+            HP_LOG_ERROR("Failed to stream body: %s", zmq_strerror(errno));
+            hp_conn_stream_abort(conn);
+            hp_conn_error(conn, 503, "Service Unavailable");
+            return true;
+        }
+    }
+
+    if (conn->framing != HP_CONN_DONE) {
+        return false;
+    }
+
+    switch (hp_conn_stream_finish(conn, HP_STREAM_END)) {
+        case HP_QUEUE_SENT:
+            hp_conn_publish_reply(conn, true);
+        break;
+
+        case HP_QUEUE_PENDING:
+            /* Replied to by hp_conn_queue_done */
+            conn->state = HP_CONN_REPLY;
+            hp_conn_update_events(conn);
+        break;
+
+        default:
+            HP_LOG_ERROR("Failed to end stream %" PRIu64 ": %s", conn->stream_id, zmq_strerror(errno));
+            hp_conn_publish_reply(conn, false);
+        break;
+    }
+    return true;
+}
+
+/* Publishes a body that was read in full */
+static void hp_conn_publish(struct hp_conn_t *conn, const void *body, size_t body_len)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    struct hp_waiter_t waiter;
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int num_parts = 0;
+
+    /* If headers are not to be included and we have no body, send back 412 */
+    if (thread->include_headers == false && body_len < 1) {
+        hp_conn_reply(conn, 412, "Precondition Failed", "Precondition Failed");
+        return;
+    }
+
+    /*
+     A retry of a request that got through already gets the same reply,
+     unpublished, and one of a request still in flight a 409
+     */
+    if (thread->dedup) {
+        size_t key_len;
+        const char *key = hp_conn_find_header(conn, thread->dedup->config.header, thread->dedup->config.header_len, &key_len);
+
+        if (key) {
+            switch (hp_dedup_check(thread->dedup, key, key_len, conn->start, thread->counters, &(conn->dedup))) {
+                case HP_DEDUP_NEW:
+                break;
+
+                case HP_DEDUP_DONE:
+                    hp_conn_publish_reply(conn, true);
+                    return;
+
+                case HP_DEDUP_PENDING:
+                    /* The outcome of the first attempt is not known yet */
+                    hp_conn_reply(conn, 409, "Conflict", "Conflict");
+                    return;
+            }
+        }
+    }
+
+    if (thread->include_headers == true) {
+        if (hp_conn_header_frame(conn, &(parts[num_parts])) == false) {
+            goto return_error;
+        }
+        num_parts++;
+    }
+
+    if (zmq_msg_init_size(&(parts[num_parts]), body_len) != 0) {
+        if (num_parts > 0) {
+            zmq_msg_close(&(parts[0]));
+        }
+        goto return_error;
+    }
+    memcpy(zmq_msg_data(&(parts[num_parts])), body, body_len);
+    num_parts++;
+
+    waiter.req = conn;
+    waiter.owner = conn;
+    waiter.start = conn->start;
+    waiter.dedup = conn->dedup;
+    waiter.detached = false;
+
+    switch (hp_httpd_publish_parts(thread, conn->target, parts, num_parts, &waiter)) {
+        case HP_QUEUE_SENT:
+            hp_conn_publish_reply(conn, true);
+        break;
+
+        case HP_QUEUE_PENDING:
+            /* Replied to by hp_conn_queue_done or hp_conn_ack_done, which settle the key even if the client is gone */
+            memset(&(conn->dedup), 0, sizeof (struct hp_dedup_ref_t));
+            conn->state = HP_CONN_REPLY;
+            hp_conn_update_events(conn);
+        break;
+
+        case HP_QUEUE_FULL:
+            hp_conn_publish_reply(conn, false);
+        break;
+
+        default:
+            goto return_error;
+        break;
+    }
+    return;
+
+return_error:
+    HP_LOG_ERROR("Failed to send message: %s", zmq_strerror(errno));
+    hp_conn_publish_reply(conn, false);
+}
+
+/* Called by the queue once a deferred message has been sent or dropped */
+void hp_conn_queue_done(struct hp_queue_entry_t *entry, bool sent, void *args)
+{
+    struct hp_conn_t *conn = (struct hp_conn_t *) entry->waiter.req;
+
+    hp_conn_dedup_settle((struct hp_httpd_thread_t *) args, &(entry->waiter.dedup), sent);
+
+    /* The client went away while the message was queued, the conn is gone */
+    if (!conn || entry->waiter.detached) {
+        return;
+    }
+    hp_conn_publish_reply(conn, sent);
+}
+
+/* Called once the backend acknowledged a message or the ack timed out */
+void hp_conn_ack_done(struct hp_waiter_t *waiter, hp_ack_status_t status, void *args)
+{
+    struct hp_conn_t *conn = (struct hp_conn_t *) waiter->req;
+
+    hp_conn_dedup_settle((struct hp_httpd_thread_t *) args, &(waiter->dedup), (status == HP_ACK_OK));
+
+    if (!conn || waiter->detached) {
+        return;
+    }
+
+    if (status == HP_ACK_TIMEOUT) {
+        hp_conn_reply(conn, 504, "Gateway Timeout", "Gateway Timeout");
+        return;
+    }
+    hp_conn_publish_reply(conn, (status == HP_ACK_OK));
+}
+
+/* Picks the route or shard of the parsed request */
+static struct hp_output_t *hp_conn_output(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    struct hp_request_t *req = &(conn->request);
+    const char *uri = conn->head + req->uri, *key = NULL;
+    size_t key_len = 0;
+
+    switch (thread->shard.source) {
+        case HP_SHARD_HEADER:
+            key = hp_conn_find_header(conn, thread->shard.name, thread->shard.name_len, &key_len);
+        break;
+
+        case HP_SHARD_QUERY:
+            key = hp_query_find(uri, req->uri_len, thread->shard.name, thread->shard.name_len, &key_len);
+        break;
+
+        default:
+        break;
+    }
+    return hp_httpd_output(thread, uri, req->uri_len, key, key_len);
+}
+
+/*
+ Parses the request line and headers at the start of the input and keeps a
+ copy of them for the header frame. Returns false if the head is not
+ complete yet or the request was refused
+ */
+static bool hp_conn_parse_head(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    struct hp_request_t *req = &(conn->request);
+
+    /* Empty lines between requests are ignored */
+    while (EVBUFFER_LENGTH(conn->input) >= 2 && !memcmp(EVBUFFER_DATA(conn->input), "\r\n", 2)) {
+        evbuffer_drain(conn->input, 2);
+    }
+
+    switch (hp_parse_request((const char *) EVBUFFER_DATA(conn->input), EVBUFFER_LENGTH(conn->input), req)) {
+        case HP_PARSE_DONE:
+        break;
+
+        case HP_PARSE_MORE:
+            return false;
+        break;
+
+        case HP_PARSE_TOO_LARGE:
+            hp_conn_error(conn, 431, "Request Header Fields Too Large");
+            return false;
+        break;
+
+        case HP_PARSE_UNSUPPORTED:
+            hp_conn_error(conn, 501, "Not Implemented");
+            return false;
+        break;
+
+        default:
+            hp_conn_error(conn, 400, "Bad Request");
+            return false;
+        break;
+    }
+
+    HP_COUNTER_INC(thread->counters->requests);
+    conn->start = hp_now_ns();
+    hp_conn_reset(conn);
+    conn->keep_alive = req->keep_alive;
+
+    if (req->head_len > conn->head_capacity) {
+        char *head = realloc(conn->head, req->head_len);
+
+        if (!head) {
+            hp_conn_error(conn, 503, "Service Unavailable");
+            return false;
+        }
+        conn->head = head;
+        conn->head_capacity = req->head_len;
+    }
+    memcpy(conn->head, EVBUFFER_DATA(conn->input), req->head_len);
+    evbuffer_drain(conn->input, req->head_len);
+
+    /* Refused once the head is copied, so that the access log has its path */
+    if (req->method_len != 4 || memcmp(conn->head, "POST", 4)) {
+        hp_conn_error(conn, 405, "Method Not Allowed");
+        return false;
+    }
+
+    /* The path without the query string */
+    {
+        const char *uri = conn->head + req->uri;
+        const char *query = memchr(uri, '?', req->uri_len);
+        size_t path_len = query ? (size_t) (query - uri) : req->uri_len;
+
+        conn->batch = (path_len == sizeof (HP_BATCH_PATH) - 1 && !memcmp(uri, HP_BATCH_PATH, path_len));
+    }
+
+    conn->target = hp_conn_output(conn);
+
+    /* The parser refuses requests with both */
+    if (req->chunked) {
+        conn->framing = HP_CONN_CHUNK_SIZE;
+    } else if (req->content_length > 0) {
+        conn->framing = HP_CONN_LENGTH;
+        conn->remaining = req->content_length;
+    } else {
+        conn->framing = HP_CONN_DONE;
+    }
+
+    if (req->expect_continue && conn->framing != HP_CONN_DONE) {
+        evbuffer_add(conn->output, "HTTP/1.1 100 Continue\r\n\r\n", sizeof ("HTTP/1.1 100 Continue\r\n\r\n") - 1);
+    }
+
+    conn->state = HP_CONN_BODY;
+    return true;
+}
+
+/*
+ Moves the body bytes of the input to conn->body, decoding chunked bodies.
+ Returns false if the body is malformed, in which case the request has been
+ refused
+ */
+static bool hp_conn_decode_body(struct hp_conn_t *conn)
+{
+    while (conn->framing != HP_CONN_DONE) {
+        size_t avail = EVBUFFER_LENGTH(conn->input);
+        char *data = (char *) EVBUFFER_DATA(conn->input), *line_end;
+
+        switch (conn->framing) {
+            case HP_CONN_LENGTH:
+            case HP_CONN_CHUNK_DATA:
+            {
+                size_t n = (avail < conn->remaining) ? avail : (size_t) conn->remaining;
+
+                if (n > 0) {
+                    evbuffer_add(conn->body, data, n);
+                    evbuffer_drain(conn->input, n);
+
+                    conn->remaining -= n;
+                    conn->body_len += n;
+                    HP_COUNTER_ADD(conn->thread->counters->bytes_in, n);
+                }
+
+                if (conn->remaining > 0) {
+                    return true;
+                }
+                conn->framing = (conn->framing == HP_CONN_LENGTH) ? HP_CONN_DONE : HP_CONN_CHUNK_END;
+            }
+            break;
+
+            case HP_CONN_CHUNK_END:
+                if (avail < 2) {
+                    return true;
+                }
+
+                if (memcmp(data, "\r\n", 2)) {
+                    goto return_error;
+                }
+                evbuffer_drain(conn->input, 2);
+                conn->framing = HP_CONN_CHUNK_SIZE;
+            break;
+
+            case HP_CONN_CHUNK_SIZE:
+            case HP_CONN_TRAILER:
+                line_end = (char *) evbuffer_find(conn->input, (const unsigned char *) "\r\n", 2);
+
+                if (!line_end) {
+                    if (avail > HP_CONN_MAX_LINE) {
+                        goto return_error;
+                    }
+                    return true;
+                }
+
+                if (conn->framing == HP_CONN_CHUNK_SIZE) {
+                    char *num_end;
+
+                    /* Chunk extensions after ';' are ignored */
+                    errno = 0;
+                    conn->remaining = strtoull(data, &num_end, 16);
+
+                    if (!isxdigit((unsigned char) *data) || errno != 0 || (num_end != line_end && *num_end != ';' && *num_end != ' ')) {
+                        goto return_error;
+                    }
+                    conn->framing = (conn->remaining > 0) ? HP_CONN_CHUNK_DATA : HP_CONN_TRAILER;
+                } else if (line_end == data) {
+                    /* Empty line after the trailer headers, which are dropped */
+                    conn->framing = HP_CONN_DONE;
+                }
+                evbuffer_drain(conn->input, (line_end - data) + 2);
+            break;
+
+            default:
+            break;
+        }
+    }
+    return true;
+
+return_error:
+    if (conn->streaming) {
+        hp_conn_stream_abort(conn);
+    }
+    hp_conn_error(conn, 400, "Bad Request");
+    return false;
+}
+
+/* Whether the body of the current request is to be streamed */
+static bool hp_conn_wants_stream(struct hp_conn_t *conn)
+{
+    size_t threshold = conn->thread->stream.threshold;
+
+    /* Only the out socket takes streams */
+    if (!conn->thread->streaming || conn->streaming || conn->batch || conn->target) {
+        return false;
+    }
+    return (conn->body_len > threshold || (conn->framing == HP_CONN_LENGTH && conn->body_len + conn->remaining > threshold));
+}
+
+/*
+ Publishes the complete lines of a batch body read so far, and the rest once
+ the body is complete, after which the counts are replied. Returns true when
+ the request is done with
+ */
+static bool hp_conn_batch_flush(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+    bool last = (conn->framing == HP_CONN_DONE);
+    size_t len = EVBUFFER_LENGTH(conn->body);
+    char *data = (char *) EVBUFFER_DATA(conn->body), reply[64];
+
+    /* The rest of an overlong line */
+    if (conn->batch_skip) {
+        char *nl = memchr(data, '\n', len);
+
+        evbuffer_drain(conn->body, nl ? (size_t) (nl - data) + 1 : len);
+        conn->batch_skip = (nl == NULL);
+
+        len = EVBUFFER_LENGTH(conn->body);
+        data = (char *) EVBUFFER_DATA(conn->body);
+    }
+
+    /* Only the bytes read since the last time are scanned for a newline */
+    if (last || memchr(data + conn->batch_scanned, '\n', len - conn->batch_scanned)) {
+        zmq_msg_t *header = NULL;
+
+        if (thread->include_headers == true) {
+            if (!conn->has_batch_header) {
+                if (hp_conn_header_frame(conn, &(conn->batch_header)) == false) {
+                    hp_conn_error(conn, 503, "Service Unavailable");
+                    return true;
+                }
+                conn->has_batch_header = true;
+            }
+            header = &(conn->batch_header);
+        }
+
+        len = hp_httpd_publish_lines(thread, conn->target, header, data, len, last, &(conn->accepted), &(conn->rejected));
+        evbuffer_drain(conn->body, len);
+    }
+    conn->batch_scanned = EVBUFFER_LENGTH(conn->body);
+
+    if (conn->batch_scanned > HP_BATCH_MAX_LINE) {
+        evbuffer_drain(conn->body, conn->batch_scanned);
+        conn->batch_scanned = 0;
+        conn->batch_skip = true;
+        conn->rejected++;
+    }
+
+    if (!last) {
+        return false;
+    }
+
+    snprintf(reply, sizeof (reply), "{\"accepted\":%" PRIu32 ",\"rejected\":%" PRIu32 "}", conn->accepted, conn->rejected);
+
+    /* Nothing got through */
+    if (conn->accepted == 0 && conn->rejected > 0) {
+        hp_conn_reply_type(conn, 503, "Service Unavailable", "application/json", reply);
+    } else {
+        hp_conn_reply_type(conn, 200, "OK", "application/json", reply);
+    }
+    return true;
+}
+
+/*
+ Reads the body of the request from the input. Returns true when the request
+ is done with and the next one can be parsed
+ */
+static bool hp_conn_read_body(struct hp_conn_t *conn)
+{
+    if (hp_conn_wants_stream(conn) && hp_conn_stream_start(conn) == false) {
+        return false;
+    }
+
+    /* A body with a length is published straight from the input */
+    if (conn->framing == HP_CONN_LENGTH && !conn->streaming && !conn->batch) {
+        size_t len = (size_t) conn->remaining;
+
+        if (EVBUFFER_LENGTH(conn->input) < len) {
+            return false;
+        }
+        conn->body_len = len;
+        HP_COUNTER_ADD(conn->thread->counters->bytes_in, len);
+
+        hp_conn_publish(conn, EVBUFFER_DATA(conn->input), len);
+        evbuffer_drain(conn->input, len);
+        return true;
+    }
+
+    if (hp_conn_decode_body(conn) == false) {
+        return false;
+    }
+
+    if (hp_conn_wants_stream(conn) && hp_conn_stream_start(conn) == false) {
+        return false;
+    }
+
+    if (conn->streaming) {
+        return hp_conn_stream_flush(conn);
+    }
+
+    if (conn->batch) {
+        return hp_conn_batch_flush(conn);
+    }
+
+    if (conn->framing != HP_CONN_DONE) {
+        return false;
+    }
+
+    hp_conn_publish(conn, EVBUFFER_DATA(conn->body), EVBUFFER_LENGTH(conn->body));
+    return true;
+}
+
+/* Handles the requests in the input for as long as the connection is reading */
+static void hp_conn_process(struct hp_conn_t *conn)
+{
+    while (true) {
+        if (conn->state == HP_CONN_HEAD) {
+            if (hp_conn_parse_head(conn) == false) {
+                break;
+            }
+        } else if (conn->state == HP_CONN_BODY) {
+            if (hp_conn_read_body(conn) == false) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    hp_conn_update_events(conn);
+}
+
+static void hp_conn_free(struct hp_conn_t *conn)
+{
+    struct hp_httpd_thread_t *thread = conn->thread;
+
+    switch (conn->state) {
+        case HP_CONN_BODY:
+            if (conn->streaming) {
+                hp_conn_stream_abort(conn);
+            }
+        break;
+
+        case HP_CONN_WAITING:
+            TAILQ_REMOVE(&(thread->stream_waiters), conn, waiters);
+            hp_conn_stream_abort(conn);
+        break;
+
+        case HP_CONN_REPLY:
+            /* The message is still sent but nobody is replied to */
+            hp_httpd_detach(thread, conn);
+        break;
+
+        default:
+        break;
+    }
+
+    if (conn->reading) {
+        event_del(&(conn->read_ev));
+    }
+
+    if (conn->writing) {
+        event_del(&(conn->write_ev));
+    }
+
+    TAILQ_REMOVE(&(thread->conns), conn, entries);
+    HP_ATOMIC_ADD(&(thread->connections), -1);
+
+    (void) close(conn->fd);
+
+    evbuffer_free(conn->input);
+    evbuffer_free(conn->output);
+    evbuffer_free(conn->body);
+    free(conn->head);
+    free(conn);
+}
+
+static void hp_conn_read_cb(int fd, short event, void *args)
+{
+    struct hp_conn_t *conn = (struct hp_conn_t *) args;
+    int n;
+
+    conn->reading = false;
+
+    if (event & EV_TIMEOUT) {
+        hp_conn_free(conn);
+        return;
+    }
+
+    if (conn->state != HP_CONN_HEAD && conn->state != HP_CONN_BODY) {
+        return;
+    }
+
+    n = evbuffer_read(conn->input, fd, HP_CONN_READ_SIZE);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        hp_conn_free(conn);
+        return;
+    }
+    hp_conn_process(conn);
+}
+
+static void hp_conn_write_cb(int fd, short event __unused, void *args)
+{
+    struct hp_conn_t *conn = (struct hp_conn_t *) args;
+
+    conn->writing = false;
+
+    if (evbuffer_write(conn->output, fd) < 0 && errno != EAGAIN && errno != EINTR) {
+        hp_conn_free(conn);
+        return;
+    }
+
+    if (EVBUFFER_LENGTH(conn->output) == 0) {
+        if (conn->state == HP_CONN_CLOSING) {
+            hp_conn_free(conn);
+            return;
+        }
+
+        /* Requests pipelined behind the one replied to */
+        if (conn->state == HP_CONN_HEAD && EVBUFFER_LENGTH(conn->input) > 0) {
+            hp_conn_process(conn);
+            return;
+        }
+    }
+    hp_conn_update_events(conn);
+}
+
+bool hp_conn_new(struct hp_httpd_thread_t *thread, int fd, struct sockaddr *sa, socklen_t salen)
+{
+    struct hp_conn_t *conn;
+
+    conn = calloc(1, sizeof (struct hp_conn_t));
+    if (!conn) {
+        return false;
+    }
+
+    conn->input = evbuffer_new();
+    conn->output = evbuffer_new();
+    conn->body = evbuffer_new();
+
+    if (!conn->input || !conn->output || !conn->body) {
+        goto return_error;
+    }
+
+    if (getnameinfo(sa, salen, conn->remote_host, sizeof (conn->remote_host), NULL, 0, NI_NUMERICHOST) != 0) {
+        conn->remote_host[0] = '\0';
+    }
+    hp_access_addr_from_sockaddr(&(conn->remote_addr), sa);
+
+    conn->thread = thread;
+    conn->fd = fd;
+    conn->state = HP_CONN_HEAD;
+
+    event_set(&(conn->read_ev), fd, EV_READ, hp_conn_read_cb, conn);
+    event_base_set(thread->base, &(conn->read_ev));
+
+    event_set(&(conn->write_ev), fd, EV_WRITE, hp_conn_write_cb, conn);
+    event_base_set(thread->base, &(conn->write_ev));
+
+    TAILQ_INSERT_TAIL(&(thread->conns), conn, entries);
+    hp_conn_update_events(conn);
+    return true;
+
+return_error:
+    if (conn->input) {
+        evbuffer_free(conn->input);
+    }
+    if (conn->output) {
+        evbuffer_free(conn->output);
+    }
+    if (conn->body) {
+        evbuffer_free(conn->body);
+    }
+    free(conn);
+    return false;
+}
+
+/*
+ Closes the connections of a thread that has stopped. A body being streamed
+ is ended as aborted
+ */
+void hp_conn_free_all(struct hp_httpd_thread_t *thread)
+{
+    while (!TAILQ_EMPTY(&(thread->conns))) {
+        hp_conn_free(TAILQ_FIRST(&(thread->conns)));
+    }
+}
+
+/*
+ Closes the connections of a retiring thread that are waiting for a request
+ and have nothing left to write. The others close after their reply
+ */
+void hp_conn_close_idle(struct hp_httpd_thread_t *thread)
+{
+    struct hp_conn_t *conn, *next;
+
+    for (conn = TAILQ_FIRST(&(thread->conns)); conn; conn = next) {
+        next = TAILQ_NEXT(conn, entries);
+
+        if (conn->state == HP_CONN_HEAD && EVBUFFER_LENGTH(conn->input) == 0 && EVBUFFER_LENGTH(conn->output) == 0) {
+            hp_conn_free(conn);
+        }
+    }
+}
@@ -0,0 +1,223 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Cache of the idempotency keys of recent requests. The table is allocated
+ once and shared by the httpd threads: a key goes into one of the
+ HP_DEDUP_WAYS slots of the bucket its hash picks, replacing an expired or
+ forgotten key or, when the bucket is full, the one that expires first.
+
+ A slot holds the FNV-1a hash of the key and a state word packing a second,
+ seeded hash of the key, the expiry in seconds and whether the request is
+ still in flight:
+
+     63        32 31         1     0
+     +----------+------------+-----+
+     |  check   |  expires   | fly |
+     +----------+------------+-----+
+
+ Both hashes have to match for a key to be found, so two keys are only
+ mistaken for each other if 96 bits collide. Slots are claimed with a
+ compare-and-swap of the hash, so two threads seeing the same new key at
+ the same moment may both publish it; anything else is caught.
+ */
+
+/* Attempts to claim a slot before giving up on remembering a key */
+#define HP_DEDUP_RETRIES 4
+
+#define HP_DEDUP_IN_FLIGHT ((uint64_t) 1)
+
+#define HP_DEDUP_STATE(check_, expires_, flags_) \
+    (((uint64_t) (check_) << 32) | (((expires_) & 0x7fffffff) << 1) | (flags_))
+
+#define HP_DEDUP_CHECK(state_) ((uint32_t) ((state_) >> 32))
+#define HP_DEDUP_EXPIRES(state_) (((state_) >> 1) & 0x7fffffff)
+
+/* 0 marks an unused slot */
+static uint64_t hp_dedup_hash(const char *key, size_t key_len)
+{
+    uint64_t hash = hp_key_hash(key, key_len);
+    return hash ? hash : 1;
+}
+
+/* splitmix64 finalizer */
+static uint64_t hp_dedup_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ The second hash, keyed with a seed picked at startup so that keys colliding
+ under FNV-1a can't be chosen to collide here as well
+ */
+static uint32_t hp_dedup_check_hash(struct hp_dedup_t *dedup, const char *key, size_t key_len)
+{
+    uint64_t hash = dedup->seed ^ ((uint64_t) key_len * 0x9e3779b97f4a7c15ULL);
+    size_t i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ (unsigned char) key[i]) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 29;
+    }
+    return (uint32_t) (hp_dedup_mix(hash) >> 32);
+}
+
+static struct hp_dedup_bucket_t *hp_dedup_bucket(struct hp_dedup_t *dedup, uint64_t hash)
+{
+    /* The low bits of FNV-1a are the weakest */
+    return &(dedup->buckets[(hash ^ (hash >> 32)) & dedup->mask]);
+}
+
+bool hp_dedup_init(struct hp_dedup_t *dedup, struct hp_dedup_config_t *config)
+{
+    size_t num_buckets = 1;
+    void *ptr;
+
+    memset(dedup, 0, sizeof (struct hp_dedup_t));
+
+    while (num_buckets * HP_DEDUP_WAYS < config->max_keys) {
+        num_buckets <<= 1;
+    }
+
+    if (posix_memalign(&ptr, HP_CACHE_LINE_SIZE, num_buckets * sizeof (struct hp_dedup_bucket_t)) != 0) {
+        return false;
+    }
+    memset(ptr, 0, num_buckets * sizeof (struct hp_dedup_bucket_t));
+
+    dedup->config = *config;
+    dedup->buckets = (struct hp_dedup_bucket_t *) ptr;
+    dedup->mask = num_buckets - 1;
+    dedup->ttl = (uint64_t) config->ttl_sec;
+    dedup->seed = hp_dedup_mix(hp_now_ns() ^ ((uint64_t) getpid() << 32) ^ (uint64_t) (uintptr_t) ptr);
+    return true;
+}
+
+/*
+ Looks the key up. A key not seen within the ttl is remembered from 'now'
+ on as in flight, until hp_dedup_settle is called with 'ref'. The counters
+ of the calling thread are updated
+ */
+hp_dedup_status_t hp_dedup_check(struct hp_dedup_t *dedup, const char *key, size_t key_len, uint64_t now, struct hp_httpd_counters_t *counters, struct hp_dedup_ref_t *ref)
+{
+    uint64_t hash = hp_dedup_hash(key, key_len), now_sec = now / 1000000000;
+    uint32_t check = hp_dedup_check_hash(dedup, key, key_len);
+    uint64_t state = HP_DEDUP_STATE(check, now_sec + dedup->ttl, HP_DEDUP_IN_FLIGHT);
+    struct hp_dedup_bucket_t *bucket = hp_dedup_bucket(dedup, hash);
+    int attempt;
+    size_t i;
+
+    HP_COUNTER_INC(counters->dedup_keys);
+
+    ref->hash = hash;
+    ref->check = check;
+
+    for (attempt = 0; attempt < HP_DEDUP_RETRIES; attempt++) {
+        struct hp_dedup_slot_t *victim = NULL;
+        uint64_t victim_key = 0, victim_expires = UINT64_MAX;
+
+        for (i = 0; i < HP_DEDUP_WAYS; i++) {
+            struct hp_dedup_slot_t *slot = &(bucket->slots[i]);
+            uint64_t slot_key = HP_ATOMIC_LOAD(&(slot->key)), slot_state = HP_ATOMIC_LOAD(&(slot->state));
+            uint64_t slot_expires = HP_DEDUP_EXPIRES(slot_state);
+
+            if (slot_key == hash && HP_DEDUP_CHECK(slot_state) == check) {
+                if (slot_expires > now_sec) {
+                    HP_COUNTER_INC(counters->dedup_hits);
+                    return (slot_state & HP_DEDUP_IN_FLIGHT) ? HP_DEDUP_PENDING : HP_DEDUP_DONE;
+                }
+
+                /* Expired or forgotten, remembered again from now on */
+                HP_ATOMIC_STORE(&(slot->state), state);
+                return HP_DEDUP_NEW;
+            }
+
+            /* Unused and expired slots count as expiring at 0 */
+            if (slot_key == 0 || slot_expires <= now_sec) {
+                slot_expires = 0;
+            }
+
+            if (!victim || slot_expires < victim_expires) {
+                victim = slot;
+                victim_key = slot_key;
+                victim_expires = slot_expires;
+            }
+        }
+
+        if (HP_ATOMIC_CAS(&(victim->key), victim_key, hash)) {
+            HP_ATOMIC_STORE(&(victim->state), state);
+
+            if (victim_expires > 0) {
+                HP_COUNTER_INC(counters->dedup_evictions);
+            }
+            return HP_DEDUP_NEW;
+        }
+        /* Another thread took the slot, look again */
+    }
+    return HP_DEDUP_NEW;
+}
+
+/*
+ Settles a key returned as new by hp_dedup_check. Once its request is
+ published, 'sent', retries get the reply of a sent request for the ttl
+ from 'now'. Otherwise the key is forgotten and the retry goes through
+ */
+void hp_dedup_settle(struct hp_dedup_t *dedup, struct hp_dedup_ref_t *ref, bool sent, uint64_t now)
+{
+    struct hp_dedup_bucket_t *bucket;
+    uint64_t state;
+    size_t i;
+
+    if (ref->hash == 0) {
+        return;
+    }
+    bucket = hp_dedup_bucket(dedup, ref->hash);
+    state = HP_DEDUP_STATE(ref->check, sent ? now / 1000000000 + dedup->ttl : 0, 0);
+
+    for (i = 0; i < HP_DEDUP_WAYS; i++) {
+        struct hp_dedup_slot_t *slot = &(bucket->slots[i]);
+
+        if (HP_ATOMIC_LOAD(&(slot->key)) == ref->hash && HP_DEDUP_CHECK(HP_ATOMIC_LOAD(&(slot->state))) == ref->check) {
+            HP_ATOMIC_STORE(&(slot->state), state);
+        }
+    }
+    ref->hash = 0;
+}
+
+void hp_dedup_free(struct hp_dedup_t *dedup)
+{
+    free(dedup->buckets);
+    dedup->buckets = NULL;
+}
@@ -30,13 +30,31 @@
 
 #include "httpush.h"
 
+/**
+ * Sends an initialized 0MQ message.
+ * The message is always closed, regardless of the outcome
+ * 'errno' should indicate the error 
+ */
+bool hp_sendmsg_zmq(void *socket, zmq_msg_t *msg, int flags) {
+    int rc, err;
+
+    /* EAGAIN is left to the caller, retrying straight away rarely helps */
+    rc = zmq_send(socket, msg, flags);
+
+    /* zmq_msg_close must not clobber the send error */
+    err = errno;
+    zmq_msg_close(msg);
+    errno = err;
+    return (rc == 0);
+}
+
 /**
  * Wrapper for sending messages to 0MQ socket
  * Returns 0 on success and <> 0 on failure
  * 'errno' should indicate the error 
  */
 bool hp_sendmsg(void *socket, const void *message, size_t message_len, int flags) {
-    int i = 0, rc;
+    int rc;
     zmq_msg_t msg;
 
     rc = zmq_msg_init_size(&msg, message_len);
@@ -44,19 +62,25 @@ bool hp_sendmsg(void *socket, const void *message, size_t message_len, int flags
         return false;
 
     memcpy(zmq_msg_data(&msg), message, message_len);
-    while (++i < 3) {
-        rc = zmq_send(socket, &msg, flags);
-        if (rc == 0)
-            break;
+    return hp_sendmsg_zmq(socket, &msg, flags);
+}
 
-        else if (rc != 0 && errno == EAGAIN)
-            continue;
+/**
+ * Send a message without copying it. The ownership of 'message' is
+ * passed to 0MQ, which calls 'ffn' with 'hint' once it no longer needs
+ * the data. 'ffn' is called also when sending fails.
+ * Note that 'ffn' may run in one of the 0MQ I/O threads
+ */
+bool hp_sendmsg_nocopy(void *socket, void *message, size_t message_len, zmq_free_fn *ffn, void *hint, int flags) {
+    int rc;
+    zmq_msg_t msg;
 
-        break;
+    rc = zmq_msg_init_data(&msg, message, message_len, ffn, hint);
+    if (rc != 0) {
+        ffn(message, hint);
+        return false;
     }
-
-    zmq_msg_close(&msg);
-    return (rc == 0);
+    return hp_sendmsg_zmq(socket, &msg, flags);
 }
 
 /**
@@ -306,8 +330,45 @@ bool hp_recvmsg_ident(void *socket, char identity[HP_IDENTITY_MAX], size_t *iden
     return true;
 }
 
-struct evbuffer *hp_counters_to_xml(struct hp_httpd_counters_t *counter, int responses, int threads)
+static const char *hp_latency_names[HP_LATENCY_MAX] = {
+    "request",
+    "headers",
+    "send",
+    "compress",
+    "ack"
+};
+
+/*
+ How uneven the messages are spread over the shards: the busiest shard's
+ share divided by the average share, 1.0 when perfectly even
+ */
+static double hp_shard_imbalance(struct hp_output_counters_t *shards, size_t num_shards)
+{
+    uint64_t total = 0, max = 0;
+    size_t i;
+
+    for (i = 0; i < num_shards; i++) {
+        total += shards[i].messages;
+        if (shards[i].messages > max) {
+            max = shards[i].messages;
+        }
+    }
+
+    if (total == 0) {
+        return 1.0;
+    }
+    return (double) max * num_shards / total;
+}
+
+/*
+ 'output_counters' holds the counters of the -r routes followed by those of
+ the -K shards, summed over the threads
+ */
+struct evbuffer *hp_counters_to_xml(struct hp_httpd_counters_t *counter, struct hp_httpd_counters_t *thread_counters, struct hp_histogram_t *latency, int responses, int threads,
+                                    struct httpush_args_t *args, struct hp_output_counters_t *output_counters)
 {
+    int i;
+    size_t j;
     struct evbuffer *evb = evbuffer_new();
 
     if (!evb)
@@ -318,15 +379,275 @@ struct evbuffer *hp_counters_to_xml(struct hp_httpd_counters_t *counter, int res
     evbuffer_add_printf(evb, "  <statistics>\n");
     evbuffer_add_printf(evb, "    <threads>%d</threads>\n", threads);
     evbuffer_add_printf(evb, "    <responses>%d</responses>\n", responses);
+    evbuffer_add_printf(evb, "    <accepts>%" PRIu64 "</accepts>\n", counter->accepts);
     evbuffer_add_printf(evb, "    <requests>%" PRIu64 "</requests>\n", counter->requests);
     evbuffer_add_printf(evb, "    <status code=\"200\">%" PRIu64 "</status>\n", counter->code_200);
     evbuffer_add_printf(evb, "    <status code=\"404\">%" PRIu64 "</status>\n", counter->code_404);
     evbuffer_add_printf(evb, "    <status code=\"412\">%" PRIu64 "</status>\n", counter->code_412);
     evbuffer_add_printf(evb, "    <status code=\"503\">%" PRIu64 "</status>\n", counter->code_503);
+    for (i = 0; i < HP_LATENCY_MAX; i++) {
+        evbuffer_add_printf(evb, "    <latency name=\"%s\" unit=\"ns\" count=\"%" PRIu64 "\" p50=\"%" PRIu64 "\" p90=\"%" PRIu64 "\" p99=\"%" PRIu64 "\" p999=\"%" PRIu64 "\" max=\"%" PRIu64 "\" />\n",
+                            hp_latency_names[i], latency[i].count,
+                            hp_histogram_percentile(&latency[i], 50.0),
+                            hp_histogram_percentile(&latency[i], 90.0),
+                            hp_histogram_percentile(&latency[i], 99.0),
+                            hp_histogram_percentile(&latency[i], 99.9),
+                            latency[i].max);
+    }
+    if (args->ack.max_inflight > 0) {
+        evbuffer_add_printf(evb, "    <ack inflight=\"%" PRIu64 "\" acks=\"%" PRIu64 "\" timeouts=\"%" PRIu64 "\" />\n",
+                            counter->ack_inflight, counter->acks, counter->ack_timeouts);
+    }
+    if (args->dedup.max_keys > 0) {
+        evbuffer_add_printf(evb, "    <dedup keys=\"%" PRIu64 "\" hits=\"%" PRIu64 "\" evictions=\"%" PRIu64 "\" hit_rate=\"%.3f\" />\n",
+                            counter->dedup_keys, counter->dedup_hits, counter->dedup_evictions,
+                            (counter->dedup_keys > 0) ? (double) counter->dedup_hits / counter->dedup_keys : 0.0);
+    }
+    for (i = 0; i < threads; i++) {
+        evbuffer_add_printf(evb, "    <thread id=\"%d\" accepts=\"%" PRIu64 "\" requests=\"%" PRIu64 "\" />\n",
+                            i, thread_counters[i].accepts, thread_counters[i].requests);
+    }
+    for (j = 0; j < args->num_routes; j++) {
+        struct hp_output_counters_t *c = &(output_counters[j]);
+
+        evbuffer_add_printf(evb, "    <route prefix=\"%s\" requests=\"%" PRIu64 "\" messages=\"%" PRIu64 "\" bytes=\"%" PRIu64 "\" rejected=\"%" PRIu64 "\" />\n",
+                            args->routes[j].prefix, c->requests, c->messages, c->bytes, c->rejected);
+    }
+    if (args->shard.source != HP_SHARD_NONE) {
+        struct hp_output_counters_t *shards = &(output_counters[args->num_routes]);
+
+        evbuffer_add_printf(evb, "    <sharding %s=\"%s\" shards=\"%zu\" imbalance=\"%.3f\" />\n",
+                            (args->shard.source == HP_SHARD_HEADER ? "header" : "query"), args->shard.name, args->num_uris,
+                            hp_shard_imbalance(shards, args->num_uris));
+
+        for (j = 0; j < args->num_uris; j++) {
+            evbuffer_add_printf(evb, "    <shard id=\"%zu\" uri=\"%s\" requests=\"%" PRIu64 "\" messages=\"%" PRIu64 "\" bytes=\"%" PRIu64 "\" rejected=\"%" PRIu64 "\" />\n",
+                                j, args->uris[j]->uri, shards[j].requests, shards[j].messages, shards[j].bytes, shards[j].rejected);
+        }
+    }
     evbuffer_add_printf(evb, "  </statistics>\n");
     evbuffer_add_printf(evb, "</httpush>\n");
 
     return evb;
 }
 
+/*
+ Sizes with an optional G, M, k or B suffix
+ */
+int64_t hp_unit_to_bytes(const char *expression, bool *success) {
+    int64_t ret;
+
+    char *end = NULL;
+    long converted, factor = 1;
+
+    *success = false;
+    converted = strtol(expression, &end, 0);
+
+    /* Failed */
+    if (ERANGE == errno || end == expression) {
+        return 0;
+    }
+
+    if (*end) {
+        if (*end == 'G' || *end == 'g') {
+            factor = 1024 * 1024 * 1024;
+        } else if (*end == 'M' || *end == 'm') {
+            factor = 1024 * 1024;
+        } else if (*end == 'K' || *end == 'k') {
+            factor = 1024;
+        } else if (*end == 'B' || *end == 'b') {
+            /* Noop */
+        } else {
+            fprintf(stderr, "Unknown size unit '%s'\n", end);
+            return 0;
+        }
+    }
+    *success = true;
+    ret = (int64_t) converted * factor;
+    return ret;
+}
+
+static struct hp_uri_t *hp_parse_uri(const char *uri, int64_t default_hwm, uint64_t default_swap) {
+    char *pch, *ptr, *last = NULL;
+    struct hp_uri_t *retval;
+
+    struct evkeyval *item;
+    struct evkeyvalq *q;
+
+    struct evkeyvalq params;
+    evhttp_parse_query(uri, &params);
+
+    retval = malloc(sizeof (*retval));
+    retval->swap = default_swap;
+    retval->hwm = default_hwm;
+    retval->linger = 2000;
+
+    ptr = strdup(uri);
+    if (!ptr)
+        return NULL;
+
+    pch = strtok_r(ptr, "?", &last);
+    if (!pch) {
+        free(ptr);
+        return NULL;
+    }
 
+    retval->uri = strdup(pch);
+    q = &params;
+
+    TAILQ_FOREACH(item, q, next) {
+        if (!strcmp(item->key, "swap")) {
+            bool success;
+            retval->swap = (int64_t) hp_unit_to_bytes(item->value, &success);
+
+            if (!success) {
+                free(ptr);
+                evhttp_clear_headers(&params);
+                return NULL;
+            }
+
+        } else if (!strcmp(item->key, "hwm")) {
+            retval->hwm = (uint64_t) atoi(item->value);
+        } else if (!strcmp(item->key, "linger")) {
+            retval->linger = atoi(item->value);
+        }
+    }
+    free(ptr);
+    evhttp_clear_headers(&params);
+    return retval;
+}
+
+static size_t hp_count_chr(const char *haystack, char needle) {
+    size_t occurances = 0;
+
+    while (*haystack != '\0') {
+        if (*(haystack++) == needle) {
+            occurances++;
+        }
+    }
+    return occurances;
+}
+
+struct hp_uri_t **hp_parse_dsn_param(const char *param, size_t *num, int64_t default_hwm, uint64_t default_swap) {
+    size_t num_dsn = 0;
+    bool success = true;
+    char *tmp, *pch, *last = NULL;
+    struct hp_uri_t **retval = NULL;
+
+    *num = 0;
+
+    num_dsn = (hp_count_chr(param, ',') + 1);
+    retval = calloc(num_dsn, sizeof (struct hp_uri_t *));
+
+    // calloc failed
+    if (!retval) {
+        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+
+    tmp = strdup(param);
+    if (!tmp) {
+        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+        return NULL;
+    }
+
+    pch = strtok_r(tmp, ", ", &last);
+    if (!pch) {
+        free(tmp);
+        return NULL;
+    }
+
+    while (pch) {
+        struct hp_uri_t *uri_ptr;
+
+        uri_ptr = hp_parse_uri(pch, default_hwm, default_swap);
+        if (!uri_ptr) {
+            success = false;
+            break;
+        }
+
+        retval[(*num)++] = uri_ptr;
+        pch = strtok_r(NULL, ", ", &last);
+    }
+    free(tmp);
+
+    if (!success && *num > 0) {
+        size_t i;
+        for (i = 0; i < *num; i++) {
+            free(retval[i]);
+        }
+        free(retval);
+        *num = 0;
+    }
+    return retval;
+}
+
+void hp_free_uris(struct hp_uri_t **uris, size_t num_uris) {
+    size_t i;
+
+    for (i = 0; i < num_uris; i++) {
+        free(uris[i]->uri);
+        free(uris[i]);
+    }
+    free(uris);
+}
+
+/*
+ Reads the -z uris from a file, one or more per line separated by commas.
+ Blank lines and lines starting with # are skipped. Returns the uris joined
+ with commas, to be freed by the caller
+ */
+char *hp_read_uri_file(const char *path) {
+    FILE *fp;
+    char line[1024];
+    char *dsn = NULL;
+    size_t len = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
+    }
+
+    while (fgets(line, sizeof (line), fp)) {
+        char *start = line, *end, *tmp;
+        size_t n;
+
+        while (isspace((unsigned char) *start)) {
+            start++;
+        }
+
+        end = start + strlen(start);
+        while (end > start && isspace((unsigned char) *(end - 1))) {
+            end--;
+        }
+
+        if (end == start || *start == '#') {
+            continue;
+        }
+        n = end - start;
+
+        tmp = realloc(dsn, len + n + 2);
+        if (!tmp) {
+            free(dsn);
+            fclose(fp);
+            return NULL;
+        }
+        dsn = tmp;
+
+        if (len > 0) {
+            dsn[len++] = ',';
+        }
+        memcpy(dsn + len, start, n);
+        len += n;
+        dsn[len] = '\0';
+    }
+
+    if (ferror(fp) || !dsn) {
+        free(dsn);
+        fclose(fp);
+        errno = (dsn ? EIO : EINVAL);
+        return NULL;
+    }
+    fclose(fp);
+    return dsn;
+}
@@ -0,0 +1,100 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Adds the values of a histogram owned by another thread into dst
+ */
+void hp_histogram_merge(struct hp_histogram_t *dst, struct hp_histogram_t *src)
+{
+    size_t i;
+    uint64_t max = HP_ATOMIC_LOAD(&(src->max));
+
+    for (i = 0; i < HP_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += HP_ATOMIC_LOAD(&(src->buckets[i]));
+    }
+    dst->count += HP_ATOMIC_LOAD(&(src->count));
+
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+/* Highest value that falls into the bucket */
+static uint64_t hp_histogram_bucket_value(size_t index)
+{
+    size_t shift;
+    uint64_t top;
+
+    if (index < (2 << HP_HISTOGRAM_SUB_BITS)) {
+        return (uint64_t) index;
+    }
+
+    shift = (index >> HP_HISTOGRAM_SUB_BITS) - 1;
+    top   = (1 << HP_HISTOGRAM_SUB_BITS) + (index & ((1 << HP_HISTOGRAM_SUB_BITS) - 1));
+
+    return ((top + 1) << shift) - 1;
+}
+
+/*
+ Returns the value below which the given percentage of the recorded values
+ fall. The buckets are summed rather than the count, as the count may be
+ updated while the histogram is being read
+ */
+uint64_t hp_histogram_percentile(struct hp_histogram_t *histogram, double percentile)
+{
+    size_t i;
+    uint64_t total = 0, seen = 0, target;
+
+    for (i = 0; i < HP_HISTOGRAM_BUCKETS; i++) {
+        total += histogram->buckets[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    target = (uint64_t) ((percentile / 100.0) * total);
+    if (target < 1) {
+        target = 1;
+    }
+
+    for (i = 0; i < HP_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen >= target) {
+            uint64_t value = hp_histogram_bucket_value(i);
+            return (value < histogram->max) ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
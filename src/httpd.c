@@ -30,41 +30,421 @@
 
 #include "httpush.h"
 
-static void print_headers_to_buffer(struct evhttp_request *req, struct evbuffer *evb) {
-    const char *method = NULL;
-    bool has_x_forwarded_for = false;
+#ifdef HAVE_EVHTTP_SET_BEVCB
+# include <event2/bufferevent.h>
+#endif
 
-    struct evkeyval *header;
-    struct evkeyvalq *q;
+#define HP_XFF_HEADER "X-Forwarded-For"
+#define HP_XFF_HEADER_LEN (sizeof (HP_XFF_HEADER) - 1)
+
+/* Number of headers whose lengths are remembered between the two passes */
+#define HP_HEADERS_CACHED 64
+
+struct hp_header_len_t {
+    size_t key_len;
+    size_t value_len;
+    bool is_xff;
+};
+
+/* State kept between measuring and writing the header frame */
+struct hp_headers_t {
+    struct hp_header_len_t cache[HP_HEADERS_CACHED];
+
+    const char *method;
+    size_t method_len;
+
+    const char *uri;
+    size_t uri_len;
 
+    const char *remote_host;
+    size_t remote_host_len;
+
+    bool has_x_forwarded_for;
+};
+
+#define HP_COPY(p_, s_, l_) { memcpy(p_, s_, l_); p_ += l_; }
+#define HP_COPY_LITERAL(p_, s_) HP_COPY(p_, s_, sizeof (s_) - 1)
+
+static const char *hp_httpd_method(struct evhttp_request *req, size_t *len)
+{
     switch (req->type) {
         case EVHTTP_REQ_GET:
-            method = "GET";
-            break;
+            *len = 3;
+            return "GET";
 
         case EVHTTP_REQ_POST:
-            method = "POST";
-            break;
+            *len = 4;
+            return "POST";
 
         case EVHTTP_REQ_HEAD:
-            method = "HEAD";
-            break;
+            *len = 4;
+            return "HEAD";
+
+        default:
+            *len = 7;
+            return "UNKNOWN";
+    }
+}
+
+static void hp_httpd_header_len(struct evkeyval *header, struct hp_header_len_t *hl)
+{
+    hl->key_len   = strlen(header->key);
+    hl->value_len = strlen(header->value);
+    hl->is_xff    = (hl->key_len == HP_XFF_HEADER_LEN && !strcasecmp(header->key, HP_XFF_HEADER));
+}
+
+/*
+ Measures the size of the header frame: the request line and headers with
+ the client address appended to an existing X-Forwarded-For header or added
+ as a new one. Lengths are remembered for hp_httpd_headers_write.
+ */
+static size_t hp_httpd_headers_measure(struct evhttp_request *req, struct hp_headers_t *h)
+{
+    struct hp_header_len_t hl;
+    struct evkeyval *header;
+    size_t size;
+    int n = 0;
+
+    h->method = hp_httpd_method(req, &(h->method_len));
+
+    h->uri = evhttp_request_uri(req);
+    h->uri_len = strlen(h->uri);
+
+    h->remote_host = (req->remote_host ? req->remote_host : "");
+    h->remote_host_len = strlen(h->remote_host);
+
+    h->has_x_forwarded_for = false;
+
+    /* "METHOD URI HTTP/1.1\r\n" */
+    size = h->method_len + 1 + h->uri_len + sizeof (" HTTP/1.1\r\n") - 1;
+
+    TAILQ_FOREACH(header, req->input_headers, next) {
+        struct hp_header_len_t *l = (n < HP_HEADERS_CACHED) ? &(h->cache[n]) : &hl;
+        hp_httpd_header_len(header, l);
+
+        /* "Key: Value\r\n" */
+        size += l->key_len + 2 + l->value_len + 2;
+
+        if (l->is_xff) {
+            /* ", remote_host" */
+            size += 2 + h->remote_host_len;
+            h->has_x_forwarded_for = true;
+        }
+        n++;
+    }
+
+    if (!h->has_x_forwarded_for) {
+        size += HP_XFF_HEADER_LEN + 2 + h->remote_host_len + 2;
+    }
+    return size;
+}
+
+/*
+ Writes the header frame measured by hp_httpd_headers_measure into p.
+ Returns pointer past the last byte written
+ */
+static char *hp_httpd_headers_write(struct evhttp_request *req, struct hp_headers_t *h, char *p)
+{
+    struct hp_header_len_t hl;
+    struct evkeyval *header;
+    int n = 0;
+
+    HP_COPY(p, h->method, h->method_len);
+    *(p++) = ' ';
+    HP_COPY(p, h->uri, h->uri_len);
+    HP_COPY_LITERAL(p, " HTTP/1.1\r\n");
+
+    TAILQ_FOREACH(header, req->input_headers, next) {
+        struct hp_header_len_t *l = &hl;
+
+        if (n < HP_HEADERS_CACHED) {
+            l = &(h->cache[n]);
+        } else {
+            hp_httpd_header_len(header, l);
+        }
+
+        HP_COPY(p, header->key, l->key_len);
+        HP_COPY_LITERAL(p, ": ");
+        HP_COPY(p, header->value, l->value_len);
+
+        if (l->is_xff) {
+            HP_COPY_LITERAL(p, ", ");
+            HP_COPY(p, h->remote_host, h->remote_host_len);
+        }
+        HP_COPY_LITERAL(p, "\r\n");
+        n++;
+    }
+
+    if (!h->has_x_forwarded_for) {
+        HP_COPY_LITERAL(p, HP_XFF_HEADER ": ");
+        HP_COPY(p, h->remote_host, h->remote_host_len);
+        HP_COPY_LITERAL(p, "\r\n");
+    }
+    return p;
+}
+
+/*
+ Serializes the request line and headers into a 0MQ message. The size of
+ the header block is measured first so that everything is written straight
+ into the message buffer in one go.
+ */
+bool hp_httpd_headers_to_msg(struct evhttp_request *req, zmq_msg_t *msg)
+{
+    struct hp_headers_t h;
+    size_t size;
+    char *end;
+
+    size = hp_httpd_headers_measure(req, &h);
+
+    if (zmq_msg_init_size(msg, size) != 0) {
+        return false;
+    }
+
+    end = hp_httpd_headers_write(req, &h, (char *) zmq_msg_data(msg));
+
+    assert(end == (char *) zmq_msg_data(msg) + size);
+    (void) end;
+    return true;
+}
+
+/* Forgets the requests of a closed connection in the queues */
+void hp_httpd_detach(struct hp_httpd_thread_t *thread, void *owner)
+{
+    size_t i;
+
+    if (thread->acking == true) {
+        hp_ack_detach(&(thread->ack), owner);
+    }
+
+    if (thread->queueing == true) {
+        hp_queue_detach(&(thread->queue), owner);
+
+        for (i = 0; i < thread->num_outputs; i++) {
+            hp_queue_detach(&(thread->outputs[i].queue), owner);
+        }
     }
+}
+
+/*
+ Picks where the messages of a request go: the route the path of 'uri'
+ belongs to or, with -K, the shard of 'key'. Requests without a key take
+ turns between the shards. Returns NULL for the out socket
+ */
+struct hp_output_t *hp_httpd_output(struct hp_httpd_thread_t *thread, const char *uri, size_t uri_len, const char *key, size_t key_len)
+{
+    struct hp_output_t *output = NULL;
 
-    evbuffer_add_printf(evb, "%s %s HTTP/1.1\r\n", method, evhttp_request_uri(req));
+    if (thread->num_routes > 0) {
+        const char *query = memchr(uri, '?', uri_len);
+        int route = hp_route_match(thread->route_trie, uri, (query ? (size_t) (query - uri) : uri_len));
 
-    q = req->input_headers;
-    has_x_forwarded_for = (evhttp_find_header(req->input_headers, "X-Forwarded-For") != NULL);
+        if (route != -1) {
+            output = &(thread->outputs[route]);
+        }
+    }
 
-    TAILQ_FOREACH(header, q, next) {
-        if (has_x_forwarded_for && !strcasecmp(header->key, "X-Forwarded-For")) {
-            evbuffer_add_printf(evb, "X-Forwarded-For: %s, %s\r\n", header->value, req->remote_host);
+    if (!output && thread->sharding == true) {
+        if (key) {
+            output = &(thread->shards[hp_shard_pick(key, key_len, (uint32_t) thread->num_shards)]);
         } else {
-            evbuffer_add_printf(evb, "%s: %s\r\n", header->key, header->value);
+            output = &(thread->shards[thread->next_shard]);
+            thread->next_shard = (thread->next_shard + 1) % thread->num_shards;
+        }
+    }
+
+    if (output) {
+        HP_COUNTER_INC(output->counters->requests);
+    }
+    return output;
+}
+
+/* hp_httpd_output for an evhttp request */
+static struct hp_output_t *hp_httpd_request_output(struct hp_httpd_thread_t *thread, struct evhttp_request *req)
+{
+    size_t uri_len = strlen(req->uri), key_len = 0;
+    const char *key = NULL;
+
+    switch (thread->shard.source) {
+        case HP_SHARD_HEADER:
+            key = evhttp_find_header(req->input_headers, thread->shard.name);
+            if (key) {
+                key_len = strlen(key);
+            }
+        break;
+
+        case HP_SHARD_QUERY:
+            key = hp_query_find(req->uri, uri_len, thread->shard.name, thread->shard.name_len, &key_len);
+        break;
+
+        default:
+        break;
+    }
+    return hp_httpd_output(thread, req->uri, uri_len, key, key_len);
+}
+
+/* Counts a message published to a route or shard */
+static void hp_httpd_output_count(struct hp_output_t *output, bool accepted, size_t size)
+{
+    if (!output) {
+        return;
+    }
+
+    if (accepted) {
+        HP_COUNTER_INC(output->counters->messages);
+        HP_COUNTER_ADD(output->counters->bytes, size);
+    } else {
+        HP_COUNTER_INC(output->counters->rejected);
+    }
+}
+
+static void hp_httpd_connection_closed(struct evhttp_connection *evcon, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+
+#ifdef HAVE_EVHTTP_SET_BEVCB
+    /* Counted when the callback was installed */
+    HP_ATOMIC_ADD(&(thread->connections), -1);
+#endif
+
+    /* Requests still waiting for a reply were orphaned already, see hp_httpd_release_detached */
+    hp_httpd_detach(thread, evcon);
+}
+
+/* A retiring thread closes each connection once its request is answered */
+static void hp_httpd_close_if_retiring(struct hp_httpd_thread_t *thread, struct evhttp_request *req)
+{
+    if (thread->retiring == true && !evhttp_find_header(req->output_headers, "Connection")) {
+        evhttp_add_header(req->output_headers, "Connection", "close");
+    }
+}
+
+#if defined(HAVE_EVHTTP_SET_BEVCB) && !defined(HAVE_EVHTTP_SET_NEWREQCB)
+/* Marks the connections evhttp accepted that have not sent a request yet */
+static void hp_httpd_untracked_cb(struct evbuffer *buffer __unused, const struct evbuffer_cb_info *info __unused, void *args __unused)
+{
+}
+#endif
+
+/*
+ With evhttp_set_newreqcb the close callback is installed as the connection
+ is accepted, see hp_httpd_new_request. libevent 2.1 has no hook between the
+ accept and the first request, a connection is counted once that arrives and
+ the close callback is installed along with it. The ones closed before
+ sending a request are thus never counted, and never left counted either.
+ */
+static void hp_httpd_track_connection(struct hp_httpd_thread_t *thread, struct evhttp_request *req)
+{
+#if !defined(HAVE_EVHTTP_SET_NEWREQCB)
+    if (req->evcon) {
+# ifdef HAVE_EVHTTP_SET_BEVCB
+        struct bufferevent *bev = evhttp_connection_get_bufferevent(req->evcon);
+
+        /* Only the first request of the connection finds the mark */
+        if (evbuffer_remove_cb(bufferevent_get_output(bev), hp_httpd_untracked_cb, thread) == 0) {
+            HP_ATOMIC_ADD(&(thread->connections), 1);
+            evhttp_connection_set_closecb(req->evcon, hp_httpd_connection_closed, thread);
+        }
+# else
+        evhttp_connection_set_closecb(req->evcon, hp_httpd_connection_closed, thread);
+# endif
+    }
+#endif
+    hp_httpd_close_if_retiring(thread, req);
+}
+
+/* Only the conn.c front-end takes accepted sockets, evhttp accepts its own */
+static void hp_httpd_add_connection(struct hp_httpd_thread_t *thread, int fd, struct sockaddr *sa, socklen_t salen)
+{
+    HP_COUNTER_INC(thread->counters->accepts);
+    HP_ATOMIC_ADD(&(thread->connections), 1);
+
+    if (hp_conn_new(thread, fd, sa, salen) == false) {
+        HP_ATOMIC_ADD(&(thread->connections), -1);
+        (void) close(fd);
+    }
+}
+
+#ifdef HAVE_EVHTTP_SET_BEVCB
+/* Called by evhttp for each connection it accepts */
+static struct bufferevent *hp_httpd_new_connection(struct event_base *base, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct bufferevent *bev;
+
+    HP_COUNTER_INC(thread->counters->accepts);
+
+    /* The same bufferevent evhttp creates without the callback */
+    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        return NULL;
+    }
+
+# ifdef HAVE_EVHTTP_SET_NEWREQCB
+    /* hp_httpd_new_request installs the close callback next, as evhttp creates the connection */
+    HP_ATOMIC_ADD(&(thread->connections), 1);
+# else
+    (void) evbuffer_add_cb(bufferevent_get_output(bev), hp_httpd_untracked_cb, thread);
+# endif
+    return bev;
+}
+#endif
+
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+/* Called by evhttp as it creates a connection, and again for each further request on it */
+static int hp_httpd_new_request(struct evhttp_request *req, void *args)
+{
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), hp_httpd_connection_closed, args);
+    return 0;
+}
+#endif
+
+/*
+ Lets evhttp accept the connections of the listen socket of the thread.
+ Without evhttp_set_bevcb (libevent 1.4) its accepts are not counted
+ */
+bool hp_httpd_accept_socket(struct hp_httpd_thread_t *thread)
+{
+#ifdef HAVE_EVHTTP_SET_BEVCB
+    evhttp_set_bevcb(thread->httpd, hp_httpd_new_connection, thread);
+#endif
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+    evhttp_set_newreqcb(thread->httpd, hp_httpd_new_request, thread);
+#endif
+    thread->bound = evhttp_accept_socket_with_handle(thread->httpd, thread->listen_fd);
+    return (thread->bound != NULL);
+}
+
+void hp_httpd_accept_cb(int fd, short event __unused, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof (addr);
+    int nfd;
+
+    nfd = accept(fd, (struct sockaddr *) &addr, &addr_len);
+
+    if (nfd < 0) {
+        /* Another thread got the connection first */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+            HP_LOG_WARN("httpd thread %d accept failed: %s", thread->thread_id, strerror(errno));
         }
+        return;
+    }
+
+    if (evutil_make_socket_nonblocking(nfd) != 0) {
+        (void) close(nfd);
+        return;
     }
-    if (!has_x_forwarded_for) {
-        evbuffer_add_printf(evb, "X-Forwarded-For: %s\r\n", req->remote_host);
+    hp_httpd_add_connection(thread, nfd, (struct sockaddr *) &addr, addr_len);
+}
+
+void hp_httpd_handoff_cb(int fd, short event __unused, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct hp_handoff_t handoff;
+
+    while (read(fd, &handoff, sizeof (handoff)) == sizeof (handoff)) {
+        hp_httpd_add_connection(thread, handoff.fd, (struct sockaddr *) &(handoff.addr), handoff.addr_len);
     }
 }
 
@@ -73,20 +453,28 @@ void hp_httpd_reflect_request(struct evhttp_request *req, void *args) {
     struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
     struct evbuffer *evb = evbuffer_new();
 
-    ++(thread->counters.requests);
+    HP_COUNTER_INC(thread->counters->requests);
+    hp_httpd_track_connection(thread, req);
 
     if (!evb) {
         evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-        ++(thread->counters.code_503);
+        HP_COUNTER_INC(thread->counters->code_503);
     }
 
-    ++(thread->counters.code_200);
+    HP_COUNTER_INC(thread->counters->code_200);
 
     evhttp_add_header(req->output_headers, "Content-Type", "text/plain");
 
     evbuffer_add_printf(evb, "--------------------------------------------------------------------\n");
 
-    print_headers_to_buffer(req, evb);
+    {
+        zmq_msg_t msg;
+
+        if (hp_httpd_headers_to_msg(req, &msg) == true) {
+            evbuffer_add(evb, zmq_msg_data(&msg), zmq_msg_size(&msg));
+            zmq_msg_close(&msg);
+        }
+    }
 
     evbuffer_add_printf(evb, "\n--------------------------------------------------------------------\n");
 
@@ -99,48 +487,197 @@ void hp_httpd_reflect_request(struct evhttp_request *req, void *args) {
 }
 #endif
 
-void hp_httpd_publish_message(struct evhttp_request *req, void *args) 
+/*
+ Prepares the body frame. The body is copied out of the input buffer straight
+ into the message, chain by chain, without pulling the buffer up first. The
+ input buffer is left as is for the access log
+ */
+bool hp_httpd_body_to_msg(struct evhttp_request *req, zmq_msg_t *msg)
+{
+    size_t body_len = EVBUFFER_LENGTH(req->input_buffer);
+
+    if (zmq_msg_init_size(msg, body_len) != 0) {
+        return false;
+    }
+
+    if (body_len > 0 && evbuffer_copyout(req->input_buffer, zmq_msg_data(msg), body_len) != (ev_ssize_t) body_len) {
+        zmq_msg_close(msg);
+        return false;
+    }
+    return true;
+}
+
+/* Sends a prepared message and records the time spent in zmq_send */
+static bool hp_httpd_send_timed(struct hp_httpd_thread_t *thread, void *socket, zmq_msg_t *msg, int flags)
 {
-    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
     bool sent;
+    size_t size = zmq_msg_size(msg);
+    uint64_t start = hp_now_ns();
 
-    ++(thread->counters.requests);
+    sent = hp_sendmsg_zmq(socket, msg, flags);
 
-    /* If headers are not to be included and we have no body, send back 412 */
-    if (thread->include_headers == false && EVBUFFER_LENGTH(req->input_buffer) < 1) {
-        evhttp_send_error(req, 412, "Precondition Failed");
-        ++(thread->counters.code_412);
-        return;
+    hp_histogram_record(&(thread->latency[HP_LATENCY_SEND]), hp_now_ns() - start);
+
+    if (sent) {
+        HP_COUNTER_ADD(thread->counters->bytes_out, size);
     }
+    return sent;
+}
+
+/*
+ Prepares the header frame, if headers are included, and the body frame.
+ 'parts' must have room for HP_MAX_PARTS messages. Returns the number of
+ frames or 0 on failure
+ */
+static int hp_httpd_prepare_message(struct hp_httpd_thread_t *thread, struct evhttp_request *req, zmq_msg_t *parts)
+{
+    int num_parts = 0;
+    bool prepared;
 
     if (thread->include_headers == true) {
-        /* Send the first part of the message, headers */
-        struct evbuffer *header_evb = evbuffer_new();
-        if (!header_evb) {
-            evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-            ++(thread->counters.code_503);
-            return;
+        uint64_t start = hp_now_ns();
+
+        prepared = hp_httpd_headers_to_msg(req, &(parts[num_parts]));
+        hp_histogram_record(&(thread->latency[HP_LATENCY_HEADERS]), hp_now_ns() - start);
+
+        if (!prepared) {
+            return 0;
         }
+        num_parts++;
+    }
 
-        print_headers_to_buffer(req, header_evb);
-        sent = hp_sendmsg(thread->out_socket, (const void *) EVBUFFER_DATA(header_evb), EVBUFFER_LENGTH(header_evb), ZMQ_SNDMORE | ZMQ_NOBLOCK);
-        evbuffer_free(header_evb);
+    prepared = hp_httpd_body_to_msg(req, &(parts[num_parts]));
+    if (!prepared) {
+        if (num_parts > 0) {
+            zmq_msg_close(&(parts[0]));
+        }
+        return 0;
+    }
+    return num_parts + 1;
+}
 
-        if (!sent) {
-            HP_LOG_ERROR("Failed to send message: %s\n", zmq_strerror(errno));
-            evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-            ++(thread->counters.code_503);
-            return;
+/*
+ Compresses the prepared frames and sends them as a multipart 0MQ message to
+ the socket(s) of 'output', or the out socket if NULL, through the queue if
+ there is one. When the socket is full the message waits in the queue and
+ the done callback of the queue gets 'waiter', NULL if nobody waits. With -k
+ the done callback of the acks gets it instead. The parts are consumed
+ whatever the result
+ */
+hp_queue_status_t hp_httpd_publish_parts(struct hp_httpd_thread_t *thread, struct hp_output_t *output, zmq_msg_t *parts, int num_parts,
+                                         const struct hp_waiter_t *waiter)
+{
+    hp_queue_status_t status = HP_QUEUE_SENT;
+    size_t size = 0;
+    int i;
+
+    if (thread->compressing == true) {
+        num_parts = hp_compress_message(&(thread->compressor), parts, num_parts);
+        if (num_parts == 0) {
+            hp_httpd_output_count(output, false, 0);
+            return HP_QUEUE_ERROR;
+        }
+    }
+
+    /* The parts are gone once sent */
+    for (i = 0; i < num_parts; i++) {
+        size += zmq_msg_size(&(parts[i]));
+    }
+
+    if (thread->acking == true) {
+        status = hp_ack_send(&(thread->ack), waiter, parts, num_parts);
+    } else if (thread->queueing == true) {
+        status = hp_queue_send((output ? &(output->queue) : &(thread->queue)), waiter, parts, num_parts);
+    } else {
+        for (i = 0; i < num_parts; i++) {
+            int flags = ZMQ_NOBLOCK;
+
+            if (i < num_parts - 1) {
+                flags |= ZMQ_SNDMORE;
+            }
+
+            /* This should never block. Fingers crossed */
+            if (hp_httpd_send_timed(thread, (output ? output->socket : thread->out_socket), &(parts[i]), flags) == false) {
+                while (++i < num_parts) {
+                    zmq_msg_close(&(parts[i]));
+                }
+                status = HP_QUEUE_ERROR;
+                break;
+            }
         }
     }
 
-    /* This should never block. Fingers crossed */
-    sent = hp_sendmsg(thread->out_socket, (const void *) EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer), ZMQ_NOBLOCK);
+    hp_httpd_output_count(output, (status == HP_QUEUE_SENT || status == HP_QUEUE_PENDING), size);
+    return status;
+}
+
+/*
+ Adds the message to the batch of the thread. The header frame and body are
+ written straight into the batch buffer
+ */
+static bool hp_httpd_batch_message(struct hp_httpd_thread_t *thread, struct hp_output_t *output, struct evhttp_request *req)
+{
+    struct hp_batch_t *batch = (output ? &(output->batch) : &(thread->batch));
+    struct hp_headers_t h;
+    size_t header_len = 0, body_len;
+    uint64_t start, elapsed = 0;
+    char *p;
+
+    body_len = EVBUFFER_LENGTH(req->input_buffer);
+
+    if (thread->include_headers == true) {
+        start = hp_now_ns();
+        header_len = hp_httpd_headers_measure(req, &h);
+        elapsed = hp_now_ns() - start;
+    }
+
+    p = hp_batch_append(batch, header_len, body_len);
+    if (!p) {
+        hp_httpd_output_count(output, false, 0);
+        errno = EAGAIN;
+        return false;
+    }
+
+    if (thread->include_headers == true) {
+        start = hp_now_ns();
+        p = hp_httpd_headers_write(req, &h, p);
+        hp_histogram_record(&(thread->latency[HP_LATENCY_HEADERS]), elapsed + (hp_now_ns() - start));
+    }
+
+    if (body_len > 0) {
+        (void) evbuffer_copyout(req->input_buffer, p, body_len);
+    }
+    hp_batch_commit(batch);
+
+    hp_httpd_output_count(output, true, header_len + body_len);
+    return true;
+}
+
+/* Records the time a request took and, with -L, its access log record */
+static void hp_httpd_request_done(struct hp_httpd_thread_t *thread, struct evhttp_request *req, int code, uint64_t start)
+{
+    uint64_t now = hp_now_ns();
+
+    hp_histogram_record(&(thread->latency[HP_LATENCY_REQUEST]), now - start);
+
+    if (thread->access_logging == true) {
+        struct hp_access_addr_t addr;
+        const char *uri = req->uri ? req->uri : "";
+
+        hp_access_addr_from_string(&addr, req->remote_host, req->remote_port);
+        hp_access_write(&(thread->access_log), start, now, code, EVBUFFER_LENGTH(req->input_buffer), &addr, uri, strcspn(uri, "?"));
+    }
+}
+
+/* Replies to a publish request and records the time it took */
+static void hp_httpd_publish_reply(struct hp_httpd_thread_t *thread, struct evhttp_request *req, bool sent, uint64_t start)
+{
+    /* The thread may have started retiring while the message was queued */
+    hp_httpd_close_if_retiring(thread, req);
 
     if (!sent) {
-        HP_LOG_ERROR("Failed to send message: %s\n", zmq_strerror(errno));
         evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-        ++(thread->counters.code_503);
+        HP_COUNTER_INC(thread->counters->code_503);
     } else {
         struct evbuffer *evb;
 
@@ -148,16 +685,342 @@ void hp_httpd_publish_message(struct evhttp_request *req, void *args)
 
         if (!evb) {
             evhttp_send_error(req, HTTP_OK, "OK");
-            ++(thread->counters.code_200);
+        } else {
+            evbuffer_add(evb, "Sent", sizeof ("Sent") - 1);
+            evhttp_send_reply(req, HTTP_OK, "OK", evb);
+            evbuffer_free(evb);
+        }
+        HP_COUNTER_INC(thread->counters->code_200);
+    }
+    hp_httpd_request_done(thread, req, (sent ? HTTP_OK : HTTP_SERVUNAVAIL), start);
+}
+
+/* The idempotency key of the request, NULL if it has none or -D is not given */
+static const char *hp_httpd_dedup_key(struct hp_httpd_thread_t *thread, struct evhttp_request *req)
+{
+    if (!thread->dedup) {
+        return NULL;
+    }
+    return evhttp_find_header(req->input_headers, thread->dedup->config.header);
+}
+
+/*
+ Settles the idempotency key of a request once it is published, 'sent', or
+ not, in which case the retry is let through
+ */
+static void hp_httpd_dedup_settle(struct hp_httpd_thread_t *thread, struct hp_dedup_ref_t *ref, bool sent)
+{
+    if (thread->dedup) {
+        hp_dedup_settle(thread->dedup, ref, sent, hp_now_ns());
+    }
+}
+
+/* hp_httpd_publish_reply for a message that may have an idempotency key */
+static void hp_httpd_message_reply(struct hp_httpd_thread_t *thread, struct evhttp_request *req, struct hp_dedup_ref_t *ref, bool sent, uint64_t start)
+{
+    hp_httpd_dedup_settle(thread, ref, sent);
+    hp_httpd_publish_reply(thread, req, sent, start);
+}
+
+/*
+ A request whose client went away before the reply is orphaned by libevent:
+ taken off its connection, which is then freed, but not freed itself. That
+ is left to whoever was going to answer it
+ */
+static void hp_httpd_release_detached(struct hp_waiter_t *waiter)
+{
+    if (waiter->req && waiter->detached) {
+        evhttp_request_free((struct evhttp_request *) waiter->req);
+        waiter->req = NULL;
+    }
+}
+
+/* Called by the queue once a deferred message has been sent or dropped */
+void hp_httpd_queue_done(struct hp_queue_entry_t *entry, bool sent, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct hp_waiter_t *waiter = &(entry->waiter);
+
+    /* The client went away while the message was queued, the key is settled all the same */
+    if (!waiter->req || waiter->detached) {
+        hp_httpd_dedup_settle(thread, &(waiter->dedup), sent);
+        hp_httpd_release_detached(waiter);
+        return;
+    }
+    hp_httpd_message_reply(thread, waiter->req, &(waiter->dedup), sent, waiter->start);
+}
+
+/* Called once the backend acknowledged a message or the ack timed out */
+void hp_httpd_ack_done(struct hp_waiter_t *waiter, hp_ack_status_t status, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct evhttp_request *req = (struct evhttp_request *) waiter->req;
+
+    if (!req || waiter->detached) {
+        hp_httpd_dedup_settle(thread, &(waiter->dedup), (status == HP_ACK_OK));
+        hp_httpd_release_detached(waiter);
+        return;
+    }
+
+    if (status == HP_ACK_TIMEOUT) {
+        hp_httpd_dedup_settle(thread, &(waiter->dedup), false);
+
+        /* Counted in ack_timeouts */
+        evhttp_send_error(req, 504, "Gateway Timeout");
+        hp_httpd_request_done(thread, req, 504, waiter->start);
+        return;
+    }
+    hp_httpd_message_reply(thread, req, &(waiter->dedup), (status == HP_ACK_OK), waiter->start);
+}
+
+void hp_httpd_publish_message(struct evhttp_request *req, void *args) 
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct hp_output_t *output = hp_httpd_request_output(thread, req);
+    uint64_t start = hp_now_ns();
+    struct hp_waiter_t waiter;
+    const char *key;
+    bool sent;
+
+    HP_COUNTER_INC(thread->counters->requests);
+    HP_COUNTER_ADD(thread->counters->bytes_in, EVBUFFER_LENGTH(req->input_buffer));
+    hp_httpd_track_connection(thread, req);
+
+    memset(&waiter, 0, sizeof (struct hp_waiter_t));
+    waiter.req = req;
+    waiter.owner = req->evcon;
+    waiter.start = start;
+
+    /* If headers are not to be included and we have no body, send back 412 */
+    if (thread->include_headers == false && EVBUFFER_LENGTH(req->input_buffer) < 1) {
+        evhttp_send_error(req, 412, "Precondition Failed");
+        HP_COUNTER_INC(thread->counters->code_412);
+        hp_httpd_request_done(thread, req, 412, start);
+        return;
+    }
+
+    /*
+     A retry of a request that got through already gets the same reply,
+     unpublished, and one of a request still in flight a 409
+     */
+    key = hp_httpd_dedup_key(thread, req);
+    if (key) {
+        switch (hp_dedup_check(thread->dedup, key, strlen(key), start, thread->counters, &(waiter.dedup))) {
+            case HP_DEDUP_NEW:
+            break;
+
+            case HP_DEDUP_DONE:
+                hp_httpd_publish_reply(thread, req, true, start);
+                return;
+
+            case HP_DEDUP_PENDING:
+                evhttp_send_error(req, 409, "Conflict");
+                hp_httpd_request_done(thread, req, 409, start);
+                return;
+        }
+    }
+
+    if (thread->batching == true) {
+        sent = hp_httpd_batch_message(thread, output, req);
+    } else {
+        zmq_msg_t parts[HP_MAX_PARTS];
+        int num_parts;
+        hp_queue_status_t status = HP_QUEUE_ERROR;
+
+        num_parts = hp_httpd_prepare_message(thread, req, parts);
+        if (num_parts > 0) {
+            status = hp_httpd_publish_parts(thread, output, parts, num_parts, &waiter);
+        }
+
+        switch (status) {
+            case HP_QUEUE_SENT:
+                sent = true;
+            break;
+
+            case HP_QUEUE_PENDING:
+                /* Replied to once the message leaves the queue or is acknowledged */
+                return;
+            break;
+
+            case HP_QUEUE_FULL:
+                /* Shed the request, no need to log every one of them */
+                hp_httpd_message_reply(thread, req, &(waiter.dedup), false, start);
+                return;
+            break;
+
+            default:
+                sent = false;
+            break;
+        }
+    }
+
+    if (!sent) {
+        HP_LOG_ERROR("Failed to send message: %s\n", zmq_strerror(errno));
+    }
+    hp_httpd_message_reply(thread, req, &(waiter.dedup), sent, start);
+}
+
+/*
+ Publishes one line of a batch request as a message of its own, preceded by
+ a copy of the header frame if there is one. Returns whether the message was
+ accepted, that is sent, queued or journaled
+ */
+static bool hp_httpd_publish_line(struct hp_httpd_thread_t *thread, struct hp_output_t *output, zmq_msg_t *header,
+                                  const char *line, size_t len)
+{
+    zmq_msg_t parts[HP_MAX_PARTS];
+    int num_parts = 0;
+
+    if (thread->batching == true) {
+        struct hp_batch_t *batch = (output ? &(output->batch) : &(thread->batch));
+        size_t header_len = (header ? zmq_msg_size(header) : 0);
+        char *p = hp_batch_append(batch, header_len, len);
+
+        if (!p) {
+            hp_httpd_output_count(output, false, 0);
+            return false;
+        }
+
+        if (header_len > 0) {
+            memcpy(p, zmq_msg_data(header), header_len);
+            p += header_len;
+        }
+        memcpy(p, line, len);
+        hp_batch_commit(batch);
+
+        hp_httpd_output_count(output, true, header_len + len);
+        return true;
+    }
+
+    if (header) {
+        /* 0MQ shares the data of the copies */
+        zmq_msg_init(&(parts[num_parts]));
+
+        if (zmq_msg_copy(&(parts[num_parts]), header) != 0) {
+            zmq_msg_close(&(parts[num_parts]));
+            return false;
+        }
+        num_parts++;
+    }
+
+    if (zmq_msg_init_size(&(parts[num_parts]), len) != 0) {
+        if (num_parts > 0) {
+            zmq_msg_close(&(parts[0]));
+        }
+        return false;
+    }
+    memcpy(zmq_msg_data(&(parts[num_parts])), line, len);
+    num_parts++;
+
+    switch (hp_httpd_publish_parts(thread, output, parts, num_parts, NULL)) {
+        case HP_QUEUE_SENT:
+        case HP_QUEUE_PENDING:
+            return true;
+        break;
+
+        default:
+            return false;
+        break;
+    }
+}
+
+/*
+ Publishes the newline-terminated lines of a batch body. Empty lines are
+ skipped and a trailing '\r' is removed. Unless 'last' is set, an incomplete
+ line at the end is left alone. Returns the number of bytes consumed
+ */
+size_t hp_httpd_publish_lines(struct hp_httpd_thread_t *thread, struct hp_output_t *output, zmq_msg_t *header,
+                              const char *data, size_t len, bool last, uint32_t *accepted, uint32_t *rejected)
+{
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+
+        if (!nl && !last) {
+            break;
+        }
+
+        if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+
+        if (line_end > p) {
+            if (hp_httpd_publish_line(thread, output, header, p, line_end - p) == true) {
+                (*accepted)++;
+            } else {
+                (*rejected)++;
+            }
+        }
+        p = nl ? nl + 1 : end;
+    }
+    return p - data;
+}
+
+/*
+ Splits a newline-delimited body into one message per line and replies
+ with the number of lines accepted and rejected. evhttp has no hook for the
+ body of an incoming request as it arrives, so the whole body has been
+ buffered by now; the conn.c front-end of -f publishes the lines as they
+ are read
+ */
+void hp_httpd_publish_batch(struct evhttp_request *req, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct hp_output_t *output = hp_httpd_request_output(thread, req);
+    uint64_t start = hp_now_ns();
+    uint32_t accepted = 0, rejected = 0;
+    zmq_msg_t header, *header_ptr = NULL;
+    struct evbuffer *evb;
+    int code = HTTP_OK;
+
+    HP_COUNTER_INC(thread->counters->requests);
+    HP_COUNTER_ADD(thread->counters->bytes_in, EVBUFFER_LENGTH(req->input_buffer));
+    hp_httpd_track_connection(thread, req);
+
+    if (req->type != EVHTTP_REQ_POST) {
+        evhttp_send_error(req, 405, "Method Not Allowed");
+        hp_httpd_request_done(thread, req, 405, start);
+        return;
+    }
+
+    if (thread->include_headers == true) {
+        uint64_t headers_start = hp_now_ns();
+
+        if (hp_httpd_headers_to_msg(req, &header) == false) {
+            hp_httpd_publish_reply(thread, req, false, start);
             return;
         }
+        header_ptr = &header;
+        hp_histogram_record(&(thread->latency[HP_LATENCY_HEADERS]), hp_now_ns() - headers_start);
+    }
 
-        evbuffer_add(evb, "Sent", sizeof ("Sent") - 1);
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
-        evbuffer_free(evb);
+    (void) hp_httpd_publish_lines(thread, output, header_ptr, (const char *) EVBUFFER_DATA(req->input_buffer),
+                                  EVBUFFER_LENGTH(req->input_buffer), true, &accepted, &rejected);
+
+    if (header_ptr) {
+        zmq_msg_close(header_ptr);
+    }
+
+    /* Nothing got through */
+    if (accepted == 0 && rejected > 0) {
+        code = HTTP_SERVUNAVAIL;
+        HP_COUNTER_INC(thread->counters->code_503);
+    } else {
+        HP_COUNTER_INC(thread->counters->code_200);
+    }
 
-        ++(thread->counters.code_200);
+    evb = evbuffer_new();
+    if (!evb) {
+        evhttp_send_error(req, code, (code == HTTP_OK) ? "OK" : "Service Unavailable");
+    } else {
+        evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+        evbuffer_add_printf(evb, "{\"accepted\":%" PRIu32 ",\"rejected\":%" PRIu32 "}", accepted, rejected);
+        evhttp_send_reply(req, code, (code == HTTP_OK) ? "OK" : "Service Unavailable", evb);
+        evbuffer_free(evb);
     }
+    hp_httpd_request_done(thread, req, code, start);
 }
 
 static void shutdown_httpd(struct event_base *base) 
@@ -169,6 +1032,148 @@ static void shutdown_httpd(struct event_base *base)
     return;
 }
 
+/*
+ Exits the event loop of a retiring thread once its connections are gone,
+ or at the deadline if idle keep-alive connections linger
+ */
+static void hp_httpd_retire_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct timeval tv = {0, HP_RETIRE_CHECK_USEC};
+
+    /* Connections handed over before the acceptor stopped are served too */
+    if (thread->handoff[0] != -1) {
+        hp_httpd_handoff_cb(thread->handoff[0], EV_READ, thread);
+    }
+
+    if (HP_ATOMIC_LOAD(&(thread->connections)) <= 0 || hp_now_ns() >= thread->retire_deadline) {
+        HP_LOG_DEBUG("httpd thread %d retired with %" PRIi64 " connections open",
+            thread->thread_id, HP_ATOMIC_LOAD(&(thread->connections)));
+        shutdown_httpd(thread->base);
+        return;
+    }
+    evtimer_add(&(thread->retire_ev), &tv);
+}
+
+/*
+ Stops taking new connections and closes the idle ones. The acceptor
+ thread has already stopped handing connections to this thread
+ */
+static void hp_httpd_retire(struct hp_httpd_thread_t *thread)
+{
+    struct timeval tv = {0, HP_RETIRE_CHECK_USEC};
+
+    if (thread->retiring == true) {
+        return;
+    }
+    thread->retiring = true;
+    thread->retire_deadline = hp_now_ns() + (uint64_t) HP_RETIRE_TIMEOUT * 1000000000ULL;
+
+    if (thread->bound) {
+        evhttp_del_accept_socket(thread->httpd, thread->bound);
+        thread->bound = NULL;
+    } else if (thread->listen_fd != -1) {
+        event_del(&(thread->accept_ev));
+    }
+
+    if (thread->frontend == true) {
+        hp_conn_close_idle(thread);
+    }
+
+    evtimer_set(&(thread->retire_ev), hp_httpd_retire_cb, thread);
+    event_base_set(thread->base, &(thread->retire_ev));
+    evtimer_add(&(thread->retire_ev), &tv);
+}
+
+/*
+ Moves the thread to the socket of the reloaded uris. Returns false while a
+ message is half sent on the current socket: a body being streamed, a
+ multipart message at the head of the queue, or the acks of a previous
+ reload still coming back. Messages already sent are delivered by the
+ linger of the old socket, with -k it is closed once they are acked
+ */
+static bool hp_httpd_switch_socket(struct hp_httpd_thread_t *thread)
+{
+    void *previous = thread->out_socket;
+    void *next = thread->next_socket;
+
+    if (thread->streams > 0) {
+        return false;
+    }
+
+    if (thread->acking == true && hp_ack_set_socket(&(thread->ack), next) == false) {
+        if (errno == EAGAIN) {
+            return false;
+        }
+        HP_LOG_ERROR("httpd thread %d failed to switch the ack socket: %s", thread->thread_id, zmq_strerror(errno));
+        goto fail;
+    }
+
+    if (thread->queueing == true && hp_queue_set_socket(&(thread->queue), next) == false) {
+        if (errno == EAGAIN) {
+            return false;
+        }
+        HP_LOG_ERROR("httpd thread %d failed to switch the queue socket: %s", thread->thread_id, zmq_strerror(errno));
+        goto fail;
+    }
+
+    if (thread->batching == true) {
+        thread->batch.socket = next;
+    }
+
+    thread->out_socket = next;
+    thread->next_socket = NULL;
+
+    /* The acks own the previous socket until they are all in */
+    if (thread->acking == false) {
+        (void) zmq_close(previous);
+    }
+    HP_LOG_INFO("httpd thread %d switched to the reloaded uris", thread->thread_id);
+    return true;
+
+fail:
+    (void) zmq_close(next);
+    thread->next_socket = NULL;
+    return true;
+}
+
+static void hp_httpd_switch_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+    struct timeval tv = {0, 1000};
+
+    thread->switch_pending = false;
+
+    if (thread->next_socket && hp_httpd_switch_socket(thread) == false) {
+        evtimer_add(&(thread->switch_ev), &tv);
+        thread->switch_pending = true;
+    }
+}
+
+/*
+ Takes the socket the parent created for the reloaded uris. A socket taken
+ earlier but not switched to yet is replaced
+ */
+static void hp_httpd_reload(struct hp_httpd_thread_t *thread)
+{
+    void *socket = thread->reload_socket;
+
+    if (!socket || HP_ATOMIC_CAS(&(thread->reload_socket), socket, NULL) == false) {
+        return;
+    }
+
+    if (thread->next_socket) {
+        (void) zmq_close(thread->next_socket);
+    }
+    thread->next_socket = socket;
+
+    if (thread->switch_pending == false) {
+        evtimer_set(&(thread->switch_ev), hp_httpd_switch_cb, thread);
+        event_base_set(thread->base, &(thread->switch_ev));
+        hp_httpd_switch_cb(-1, EV_TIMEOUT, thread);
+    }
+}
+
 void hp_httpd_intercomm_cb(int fd __unused, short event __unused, void *args) 
 {
     struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
@@ -201,18 +1206,12 @@ void hp_httpd_intercomm_cb(int fd __unused, short event __unused, void *args)
                     return;
                 break;
 
-                case HTTPD_STATS:
-                {
-                    struct hp_httpd_counters_t counters;
-                    HP_LOG_DEBUG("httpd thread %d sending back stats", thread->thread_id);
-
-                    /* Copy the counters */
-                    memcpy(&counters, &thread->counters, sizeof(struct hp_httpd_counters_t));
-
-                    if (hp_sendmsg(thread->intercomm.back, (void *) &counters, sizeof (struct hp_httpd_counters_t), ZMQ_NOBLOCK) == false)
-                        HP_LOG_WARN("thread id %d failed to send back stats", thread->thread_id);
+                case HTTPD_RETIRE:
+                    hp_httpd_retire(thread);
+                break;
 
-                }
+                case HTTPD_RELOAD:
+                    hp_httpd_reload(thread);
                 break;
 
                 default:
@@ -0,0 +1,204 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access.h"
+
+/*
+ Turns the binary access log files written with -L into text, one line per
+ request. The files are read in the order given, e.g.
+
+ httpush-access /var/log/httpush/httpush.0.*.access > access.tsv
+ httpush-access -j /var/log/httpush/httpush.*.access | jq .
+
+ Tab-separated output starts with a line naming the columns. The path is
+ what was kept of it, path_len is its full length. Bytes that would break
+ a line or a field are escaped as \xNN in TSV and \u00NN in JSON.
+
+ Usage: httpush-access [-j] [-n] file...
+ */
+
+typedef enum _hp_access_format_t {
+    HP_ACCESS_TSV,
+    HP_ACCESS_JSON
+} hp_access_format_t;
+
+static void hp_access_show_help(const char *d)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] file...\n", d);
+    fprintf(stderr, " -j            One JSON object per line instead of tab-separated values\n");
+    fprintf(stderr, " -n            Leave out the line naming the columns\n");
+}
+
+/* Formats a CLOCK_REALTIME timestamp as RFC 3339 in UTC */
+static void hp_access_format_time(uint64_t timestamp, char *buffer, size_t buffer_len)
+{
+    time_t sec = (time_t) (timestamp / 1000000000);
+    struct tm tm;
+    size_t len;
+
+    (void) gmtime_r(&sec, &tm);
+    len = strftime(buffer, buffer_len, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buffer + len, buffer_len - len, ".%09" PRIu64 "Z", timestamp % 1000000000);
+}
+
+static void hp_access_format_addr(const struct hp_access_record_t *record, char *buffer, size_t buffer_len)
+{
+    int af = (record->family == HP_ACCESS_FAMILY_IPV6) ? AF_INET6 : AF_INET;
+
+    if (record->family == HP_ACCESS_FAMILY_NONE || !inet_ntop(af, record->addr, buffer, (socklen_t) buffer_len)) {
+        snprintf(buffer, buffer_len, "-");
+    }
+}
+
+static void hp_access_write_path(const struct hp_access_record_t *record, hp_access_format_t format)
+{
+    size_t len = (record->path_len > HP_ACCESS_PATH_MAX) ? HP_ACCESS_PATH_MAX : record->path_len, i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) record->path[i];
+
+        if (c < 0x20 || c >= 0x7f || c == '\\' || (format == HP_ACCESS_JSON && c == '"')) {
+            printf((format == HP_ACCESS_JSON) ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            putchar(c);
+        }
+    }
+}
+
+static void hp_access_write_record(const struct hp_access_header_t *header, const struct hp_access_record_t *record, hp_access_format_t format)
+{
+    char time_str[64], addr[INET6_ADDRSTRLEN];
+
+    hp_access_format_time(record->timestamp, time_str, sizeof (time_str));
+    hp_access_format_addr(record, addr, sizeof (addr));
+
+    if (format == HP_ACCESS_JSON) {
+        printf("{\"time\":\"%s\",\"thread\":%" PRIu32 ",\"client\":\"%s\",\"port\":%u,\"status\":%u,"
+               "\"bytes\":%" PRIu64 ",\"duration_us\":%.3f,\"path_len\":%u,\"path\":\"",
+               time_str, header->thread_id, addr, record->port, record->status,
+               record->body_len, (double) record->duration / 1000, record->path_len);
+        hp_access_write_path(record, format);
+        printf("\"}\n");
+    } else {
+        printf("%s\t%" PRIu32 "\t%s\t%u\t%u\t%" PRIu64 "\t%.3f\t%u\t",
+               time_str, header->thread_id, addr, record->port, record->status,
+               record->body_len, (double) record->duration / 1000, record->path_len);
+        hp_access_write_path(record, format);
+        putchar('\n');
+    }
+}
+
+/* Writes the records of a file, returns false if it isn't an access log */
+static bool hp_access_decode(const char *path, hp_access_format_t format)
+{
+    struct hp_access_header_t header;
+    struct hp_access_record_t record;
+    FILE *fp;
+    bool success = true;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (fread(&header, sizeof (header), 1, fp) != 1 || header.magic != HP_ACCESS_MAGIC) {
+        fprintf(stderr, "%s is not an access log\n", path);
+        success = false;
+    } else if (header.version != HP_ACCESS_VERSION || header.record_size != sizeof (struct hp_access_record_t)) {
+        fprintf(stderr, "%s has version %u and %u byte records, expected version %d and %zu\n",
+                path, header.version, header.record_size, HP_ACCESS_VERSION, sizeof (struct hp_access_record_t));
+        success = false;
+    } else {
+        /* The file being written and those left by a crash end with zeros */
+        while (fread(&record, sizeof (record), 1, fp) == 1 && record.timestamp != 0) {
+            hp_access_write_record(&header, &record, format);
+        }
+
+        if (ferror(fp)) {
+            fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+            success = false;
+        }
+    }
+
+    (void) fclose(fp);
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    hp_access_format_t format = HP_ACCESS_TSV;
+    bool column_names = true, success = true;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "jn")) != -1) {
+        switch (c) {
+            case 'j':
+                format = HP_ACCESS_JSON;
+                break;
+
+            case 'n':
+                column_names = false;
+                break;
+
+            default:
+                hp_access_show_help(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        hp_access_show_help(argv[0]);
+        return 1;
+    }
+
+    if (format == HP_ACCESS_TSV && column_names) {
+        printf("time\tthread\tclient\tport\tstatus\tbytes\tduration_us\tpath_len\tpath\n");
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (hp_access_decode(argv[i], format) == false) {
+            success = false;
+        }
+    }
+    return success ? 0 : 1;
+}
@@ -0,0 +1,973 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/*
+ Spill journal. When the out socket and the queue are full, messages are
+ appended to segment files which are preallocated and mapped into memory.
+ The records written during HP_JOURNAL_COMMIT_USEC are synced to disk
+ together before their requests get a reply. The sync runs on a flusher
+ thread of the journal so that the event loop keeps serving requests
+ meanwhile, the records appended while it runs make up the next commit.
+ Once the socket becomes
+ writable again the queue replays the records in order and segments that
+ have been replayed are removed.
+
+ Segment files are named httpush.<thread>.<seq>.journal. They start with
+ a struct hp_journal_header_t followed by records, each a struct
+ hp_journal_record_t followed by the message parts, padded to 8 bytes.
+ Integers are in host byte order. On startup the records up to the first
+ one with a bad checksum are recovered, replaying starts from the position
+ saved in the first segment. Records replayed just before a crash may be
+ sent again.
+ */
+
+#define HP_JOURNAL_MAGIC        0x48504a4c /* HPJL */
+#define HP_JOURNAL_RECORD_MAGIC 0x48505243 /* HPRC */
+#define HP_JOURNAL_VERSION      2
+
+/* Records appended within this time are synced together */
+#define HP_JOURNAL_COMMIT_USEC 1000
+
+#define HP_JOURNAL_ALIGN(n_) (((n_) + 7) & ~((size_t) 7))
+
+struct hp_journal_header_t {
+    uint32_t magic;
+
+    uint32_t version;
+
+    uint32_t thread_id;
+
+    uint32_t reserved;
+
+    uint64_t seq;
+
+    /* Replay position, only meaningful in the first segment */
+    uint64_t read_pos;
+};
+
+struct hp_journal_record_t {
+    uint32_t magic;
+
+    /* CRC-32 of the lengths and the payload */
+    uint32_t checksum;
+
+    uint32_t num_frames;
+
+    /* Lengths of the 0MQ message parts that follow */
+    uint32_t frame_len[HP_MAX_PARTS];
+};
+
+#define HP_JOURNAL_HEADER_SIZE HP_JOURNAL_ALIGN(sizeof (struct hp_journal_header_t))
+#define HP_JOURNAL_RECORD_SIZE(r_) HP_JOURNAL_ALIGN(sizeof (struct hp_journal_record_t) + hp_journal_payload_len(r_))
+
+static uint32_t hp_journal_crc_table[256];
+static pthread_once_t hp_journal_crc_once = PTHREAD_ONCE_INIT;
+
+static void hp_journal_crc_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        hp_journal_crc_table[i] = c;
+    }
+}
+
+static uint32_t hp_journal_crc(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    crc = ~crc;
+    while (len--) {
+        crc = hp_journal_crc_table[(crc ^ *(p++)) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static size_t hp_journal_payload_len(struct hp_journal_record_t *record)
+{
+    size_t len = 0;
+    uint32_t i;
+
+    for (i = 0; i < record->num_frames && i < HP_MAX_PARTS; i++) {
+        len += record->frame_len[i];
+    }
+    return len;
+}
+
+static uint32_t hp_journal_checksum(struct hp_journal_record_t *record)
+{
+    uint32_t crc;
+
+    crc = hp_journal_crc(0, &(record->num_frames), (1 + HP_MAX_PARTS) * sizeof (uint32_t));
+    return hp_journal_crc(crc, record + 1, hp_journal_payload_len(record));
+}
+
+static void hp_journal_path(struct hp_journal_t *journal, uint64_t seq, char *path, size_t path_len)
+{
+    snprintf(path, path_len, "%s/httpush.%d.%" PRIu64 ".journal", journal->dir, journal->thread_id, seq);
+}
+
+/* Publishes the state of the journal in the statistics segment */
+static void hp_journal_update_counters(struct hp_journal_t *journal)
+{
+    if (journal->counters) {
+        HP_ATOMIC_STORE(&(journal->counters->journal_messages), journal->messages);
+        HP_ATOMIC_STORE(&(journal->counters->journal_bytes), journal->bytes);
+    }
+}
+
+static struct hp_journal_header_t *hp_journal_segment_header(struct hp_journal_segment_t *segment)
+{
+    return (struct hp_journal_header_t *) segment->data;
+}
+
+static struct hp_journal_record_t *hp_journal_record_at(struct hp_journal_segment_t *segment, size_t pos)
+{
+    return (struct hp_journal_record_t *) (segment->data + pos);
+}
+
+static void hp_journal_segment_free(struct hp_journal_segment_t *segment)
+{
+    if (segment->data) {
+        (void) munmap(segment->data, segment->size);
+    }
+    if (segment->fd != -1) {
+        (void) close(segment->fd);
+    }
+    free(segment);
+}
+
+/* Maps the file and checks the segment header */
+static struct hp_journal_segment_t *hp_journal_segment_map(int fd, size_t size, uint64_t seq)
+{
+    struct hp_journal_segment_t *segment;
+
+    segment = calloc(1, sizeof (struct hp_journal_segment_t));
+    if (!segment) {
+        return NULL;
+    }
+
+    segment->fd = fd;
+    segment->size = size;
+    segment->seq = seq;
+
+    segment->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment->data == MAP_FAILED) {
+        segment->data = NULL;
+        segment->fd = -1;
+        hp_journal_segment_free(segment);
+        return NULL;
+    }
+
+    return segment;
+}
+
+static struct hp_journal_segment_t *hp_journal_segment_create(struct hp_journal_t *journal, size_t size)
+{
+    struct hp_journal_segment_t *segment;
+    struct hp_journal_header_t *header;
+    char path[PATH_MAX];
+    int fd, rc;
+
+    hp_journal_path(journal, journal->next_seq, path, sizeof (path));
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        HP_LOG_ERROR("Failed to create journal segment %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    /* Allocate the blocks up front so that appending never extends the file */
+    rc = posix_fallocate(fd, 0, (off_t) size);
+    if (rc != 0) {
+        HP_LOG_ERROR("Failed to allocate journal segment %s: %s", path, strerror(rc));
+        (void) close(fd);
+        (void) unlink(path);
+        return NULL;
+    }
+
+    segment = hp_journal_segment_map(fd, size, journal->next_seq);
+    if (!segment) {
+        HP_LOG_ERROR("Failed to map journal segment %s: %s", path, strerror(errno));
+        (void) close(fd);
+        (void) unlink(path);
+        return NULL;
+    }
+
+    header = hp_journal_segment_header(segment);
+    header->magic = HP_JOURNAL_MAGIC;
+    header->version = HP_JOURNAL_VERSION;
+    header->thread_id = (uint32_t) journal->thread_id;
+    header->reserved = 0;
+    header->seq = segment->seq;
+    header->read_pos = HP_JOURNAL_HEADER_SIZE;
+
+    /* The header is synced with the first commit */
+    segment->write_pos = HP_JOURNAL_HEADER_SIZE;
+    segment->sync_pos = 0;
+
+    journal->next_seq++;
+    journal->size += size;
+    return segment;
+}
+
+/*
+ Opens a segment left by a previous run and finds the end of its valid
+ records
+ */
+static struct hp_journal_segment_t *hp_journal_segment_recover(struct hp_journal_t *journal, uint64_t seq)
+{
+    struct hp_journal_segment_t *segment;
+    struct hp_journal_header_t *header;
+    char path[PATH_MAX];
+    struct stat st;
+    size_t pos;
+    int fd;
+
+    hp_journal_path(journal, seq, path, sizeof (path));
+
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        HP_LOG_WARN("Failed to open journal segment %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < HP_JOURNAL_HEADER_SIZE) {
+        HP_LOG_WARN("Ignoring truncated journal segment %s", path);
+        (void) close(fd);
+        return NULL;
+    }
+
+    segment = hp_journal_segment_map(fd, (size_t) st.st_size, seq);
+    if (!segment) {
+        HP_LOG_WARN("Failed to map journal segment %s: %s", path, strerror(errno));
+        (void) close(fd);
+        return NULL;
+    }
+
+    header = hp_journal_segment_header(segment);
+    if (header->magic != HP_JOURNAL_MAGIC || header->version != HP_JOURNAL_VERSION ||
+            header->thread_id != (uint32_t) journal->thread_id || header->seq != seq) {
+        HP_LOG_WARN("Ignoring journal segment %s with an invalid header", path);
+        hp_journal_segment_free(segment);
+        return NULL;
+    }
+
+    pos = HP_JOURNAL_HEADER_SIZE;
+
+    while (pos + sizeof (struct hp_journal_record_t) <= segment->size) {
+        struct hp_journal_record_t *record = hp_journal_record_at(segment, pos);
+
+        if (record->magic != HP_JOURNAL_RECORD_MAGIC ||
+                record->num_frames < 1 || record->num_frames > HP_MAX_PARTS ||
+                HP_JOURNAL_RECORD_SIZE(record) > segment->size - pos ||
+                record->checksum != hp_journal_checksum(record)) {
+            break;
+        }
+        pos += HP_JOURNAL_RECORD_SIZE(record);
+    }
+
+    segment->write_pos = pos;
+    segment->sync_pos = pos;
+
+    journal->size += segment->size;
+    return segment;
+}
+
+static int hp_journal_seq_cmp(const void *a, const void *b)
+{
+    uint64_t x = *((const uint64_t *) a), y = *((const uint64_t *) b);
+    return (x > y) - (x < y);
+}
+
+/* Picks up the segments of this thread left by a previous run */
+static bool hp_journal_recover(struct hp_journal_t *journal)
+{
+    struct hp_journal_segment_t *segment;
+    uint64_t *seqs = NULL;
+    size_t num_seqs = 0, max_seqs = 0, i;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(journal->dir);
+    if (!dir) {
+        HP_LOG_ERROR("Failed to open journal directory %s: %s", journal->dir, strerror(errno));
+        return false;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        int thread_id, len = 0;
+        uint64_t seq;
+
+        if (sscanf(entry->d_name, "httpush.%d.%" SCNu64 ".journal%n", &thread_id, &seq, &len) != 2 ||
+                len == 0 || entry->d_name[len] != '\0' || thread_id != journal->thread_id) {
+            continue;
+        }
+
+        if (num_seqs == max_seqs) {
+            uint64_t *tmp;
+
+            max_seqs = max_seqs ? max_seqs * 2 : 16;
+            tmp = realloc(seqs, max_seqs * sizeof (uint64_t));
+            if (!tmp) {
+                free(seqs);
+                (void) closedir(dir);
+                return false;
+            }
+            seqs = tmp;
+        }
+        seqs[num_seqs++] = seq;
+    }
+    (void) closedir(dir);
+
+    qsort(seqs, num_seqs, sizeof (uint64_t), hp_journal_seq_cmp);
+
+    for (i = 0; i < num_seqs; i++) {
+        segment = hp_journal_segment_recover(journal, seqs[i]);
+        if (segment) {
+            TAILQ_INSERT_TAIL(&(journal->segments), segment, entries);
+        }
+        journal->next_seq = seqs[i] + 1;
+    }
+    free(seqs);
+
+    segment = TAILQ_FIRST(&(journal->segments));
+    if (!segment) {
+        return true;
+    }
+
+    journal->read_pos = (size_t) hp_journal_segment_header(segment)->read_pos;
+    if (journal->read_pos < HP_JOURNAL_HEADER_SIZE || journal->read_pos > segment->write_pos) {
+        journal->read_pos = HP_JOURNAL_HEADER_SIZE;
+    }
+
+    /* Count what is left to replay */
+    TAILQ_FOREACH(segment, &(journal->segments), entries) {
+        size_t pos = (segment == TAILQ_FIRST(&(journal->segments))) ? journal->read_pos : HP_JOURNAL_HEADER_SIZE;
+
+        while (pos < segment->write_pos) {
+            struct hp_journal_record_t *record = hp_journal_record_at(segment, pos);
+
+            journal->messages++;
+            journal->bytes += hp_journal_payload_len(record);
+            pos += HP_JOURNAL_RECORD_SIZE(record);
+        }
+    }
+
+    if (journal->messages > 0) {
+        HP_LOG_INFO("Recovered %" PRIu64 " messages from the journal of thread %d", journal->messages, journal->thread_id);
+    }
+    return true;
+}
+
+/* Removes the segments that have been replayed, except the one being written */
+static void hp_journal_trim(struct hp_journal_t *journal)
+{
+    struct hp_journal_segment_t *segment;
+    char path[PATH_MAX];
+
+    while ((segment = TAILQ_FIRST(&(journal->segments))) != NULL &&
+            segment != TAILQ_LAST(&(journal->segments), hp_journal_segments_t) &&
+            journal->read_pos >= segment->write_pos) {
+
+        TAILQ_REMOVE(&(journal->segments), segment, entries);
+
+        hp_journal_path(journal, segment->seq, path, sizeof (path));
+        if (unlink(path) != 0) {
+            HP_LOG_WARN("Failed to remove journal segment %s: %s", path, strerror(errno));
+        }
+
+        journal->size -= segment->size;
+
+        /* The flusher thread may still be syncing its records */
+        if (journal->syncing) {
+            TAILQ_INSERT_TAIL(&(journal->retired), segment, entries);
+        } else {
+            hp_journal_segment_free(segment);
+        }
+
+        journal->read_pos = HP_JOURNAL_HEADER_SIZE;
+    }
+}
+
+/* Syncs the ranges of the commit, called by the flusher thread */
+static void hp_journal_sync(struct hp_journal_t *journal)
+{
+    size_t i;
+
+    for (i = 0; i < journal->num_ranges; i++) {
+        struct hp_journal_range_t *range = &(journal->ranges[i]);
+
+        range->error = 0;
+        if (msync(range->segment->data + range->start, range->end - range->start, MS_SYNC) != 0) {
+            range->error = errno;
+        }
+    }
+}
+
+static void *hp_journal_flusher(void *args)
+{
+    struct hp_journal_t *journal = (struct hp_journal_t *) args;
+    ssize_t rc;
+    char c;
+
+    for (;;) {
+        rc = read(journal->to_flusher[0], &c, 1);
+
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        }
+
+        /* Zero stops the thread */
+        if (rc != 1 || c == 0) {
+            break;
+        }
+
+        hp_journal_sync(journal);
+
+        if (write(journal->from_flusher[1], &c, 1) != 1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void hp_journal_commit(struct hp_journal_t *journal);
+
+/*
+ Finishes the commit once its ranges have been synced. The waiters get
+ false if the commit failed or any of the segments failed to sync
+ */
+static void hp_journal_commit_done(struct hp_journal_t *journal, bool synced)
+{
+    struct hp_journal_segment_t *segment;
+    size_t i;
+
+    journal->syncing = false;
+
+    for (i = 0; i < journal->num_ranges; i++) {
+        struct hp_journal_range_t *range = &(journal->ranges[i]);
+
+        if (range->error != 0) {
+            HP_LOG_ERROR("Failed to sync journal segment %" PRIu64 ": %s", range->segment->seq, strerror(range->error));
+            synced = false;
+        } else if (range->end > range->segment->sync_pos) {
+            range->segment->sync_pos = range->end;
+        }
+    }
+    journal->num_ranges = 0;
+
+    while ((segment = TAILQ_FIRST(&(journal->retired))) != NULL) {
+        TAILQ_REMOVE(&(journal->retired), segment, entries);
+        hp_journal_segment_free(segment);
+    }
+
+    for (i = 0; i < journal->num_sync_waiters; i++) {
+        struct hp_queue_entry_t entry;
+
+        if (!journal->done) {
+            continue;
+        }
+
+        memset(&entry, 0, sizeof (struct hp_queue_entry_t));
+        entry.waiter = journal->sync_waiters[i];
+
+        journal->done(&entry, synced, journal->done_arg);
+    }
+    journal->num_sync_waiters = 0;
+
+    if (journal->commit_again) {
+        journal->commit_again = false;
+        hp_journal_commit(journal);
+    }
+}
+
+/* Waits for the flusher thread to finish the commit it is syncing */
+static void hp_journal_commit_wait(struct hp_journal_t *journal)
+{
+    ssize_t rc;
+    char c;
+
+    while (journal->syncing) {
+        rc = read(journal->from_flusher[0], &c, 1);
+
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rc != 1) {
+            HP_LOG_ERROR("Lost the journal flusher of thread %d", journal->thread_id);
+            return;
+        }
+        hp_journal_commit_done(journal, true);
+    }
+}
+
+static void hp_journal_flushed_cb(int fd, short event __unused, void *args)
+{
+    struct hp_journal_t *journal = (struct hp_journal_t *) args;
+    char c;
+
+    if (read(fd, &c, 1) == 1 && journal->syncing) {
+        hp_journal_commit_done(journal, true);
+    }
+}
+
+/*
+ Collects the records appended since the previous commit and hands them to
+ the flusher thread along with their waiters. A commit started while the
+ previous one is being synced runs once that is done
+ */
+static void hp_journal_commit(struct hp_journal_t *journal)
+{
+    struct hp_journal_segment_t *segment;
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE), n = 0;
+    struct hp_waiter_t *waiters;
+    bool collected = true;
+    char c = 1;
+
+    if (journal->commit_pending) {
+        event_del(&(journal->commit_ev));
+        journal->commit_pending = false;
+    }
+
+    if (journal->syncing) {
+        journal->commit_again = true;
+        return;
+    }
+
+    TAILQ_FOREACH(segment, &(journal->segments), entries) {
+        if (segment->sync_pos < segment->write_pos) {
+            n++;
+        }
+    }
+
+    if (n > journal->max_ranges) {
+        struct hp_journal_range_t *ranges = realloc(journal->ranges, n * sizeof (struct hp_journal_range_t));
+
+        if (!ranges) {
+            HP_LOG_ERROR("Failed to allocate the journal commit of thread %d", journal->thread_id);
+            collected = false;
+        } else {
+            journal->ranges = ranges;
+            journal->max_ranges = n;
+        }
+    }
+
+    TAILQ_FOREACH(segment, &(journal->segments), entries) {
+        struct hp_journal_range_t *range;
+
+        if (segment->sync_pos >= segment->write_pos || collected == false) {
+            continue;
+        }
+
+        range = &(journal->ranges[journal->num_ranges++]);
+        range->segment = segment;
+        range->start = segment->sync_pos & ~(page_size - 1);
+        range->end = segment->write_pos;
+        range->error = 0;
+    }
+
+    /* The waiters of this commit, the next one starts with an empty array */
+    waiters = journal->sync_waiters;
+    journal->sync_waiters = journal->waiters;
+    journal->num_sync_waiters = journal->num_waiters;
+    journal->waiters = waiters;
+    journal->num_waiters = 0;
+
+    n = journal->max_sync_waiters;
+    journal->max_sync_waiters = journal->max_waiters;
+    journal->max_waiters = n;
+
+    /* The replay position is allowed to lag behind */
+    segment = TAILQ_FIRST(&(journal->segments));
+    if (segment) {
+        (void) msync(segment->data, page_size, MS_ASYNC);
+    }
+
+    if (journal->num_ranges > 0 && journal->flusher_running && write(journal->to_flusher[1], &c, 1) == 1) {
+        journal->syncing = true;
+        return;
+    }
+
+    /* Nothing to sync, or no flusher thread to do it */
+    hp_journal_sync(journal);
+    hp_journal_commit_done(journal, collected);
+}
+
+static void hp_journal_commit_cb(int fd __unused, short event __unused, void *args)
+{
+    struct hp_journal_t *journal = (struct hp_journal_t *) args;
+
+    journal->commit_pending = false;
+    hp_journal_commit(journal);
+}
+
+/* Starts the thread that syncs the commits off the event loop */
+static bool hp_journal_flusher_start(struct hp_journal_t *journal, struct event_base *base)
+{
+    if (pipe(journal->to_flusher) != 0) {
+        journal->to_flusher[0] = journal->to_flusher[1] = -1;
+        return false;
+    }
+
+    if (pipe(journal->from_flusher) != 0) {
+        journal->from_flusher[0] = journal->from_flusher[1] = -1;
+        return false;
+    }
+
+    event_set(&(journal->flushed_ev), journal->from_flusher[0], EV_READ | EV_PERSIST, hp_journal_flushed_cb, journal);
+    event_base_set(base, &(journal->flushed_ev));
+
+    if (event_add(&(journal->flushed_ev), NULL) != 0) {
+        return false;
+    }
+
+    if (pthread_create(&(journal->flusher), NULL, hp_journal_flusher, journal)) {
+        event_del(&(journal->flushed_ev));
+        return false;
+    }
+    journal->flusher_running = true;
+    return true;
+}
+
+static void hp_journal_flusher_stop(struct hp_journal_t *journal)
+{
+    char c = 0;
+    int i;
+
+    if (journal->flusher_running) {
+        if (write(journal->to_flusher[1], &c, 1) != 1 || pthread_join(journal->flusher, NULL)) {
+            HP_LOG_ERROR("Failed to stop the journal flusher of thread %d", journal->thread_id);
+        }
+        event_del(&(journal->flushed_ev));
+        journal->flusher_running = false;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (journal->to_flusher[i] != -1) {
+            (void) close(journal->to_flusher[i]);
+            journal->to_flusher[i] = -1;
+        }
+        if (journal->from_flusher[i] != -1) {
+            (void) close(journal->from_flusher[i]);
+            journal->from_flusher[i] = -1;
+        }
+    }
+}
+
+bool hp_journal_open(struct hp_journal_t *journal, const char *dir, int thread_id, size_t segment_size, uint64_t max_size, struct event_base *base)
+{
+    pthread_once(&hp_journal_crc_once, hp_journal_crc_init);
+
+    memset(journal, 0, sizeof (struct hp_journal_t));
+    TAILQ_INIT(&(journal->segments));
+    TAILQ_INIT(&(journal->retired));
+
+    journal->to_flusher[0] = journal->to_flusher[1] = -1;
+    journal->from_flusher[0] = journal->from_flusher[1] = -1;
+
+    journal->thread_id = thread_id;
+    journal->segment_size = segment_size;
+    journal->max_size = max_size;
+
+    journal->dir = strdup(dir);
+    if (!journal->dir) {
+        return false;
+    }
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        HP_LOG_ERROR("Failed to create journal directory %s: %s", dir, strerror(errno));
+        free(journal->dir);
+        journal->dir = NULL;
+        return false;
+    }
+
+    if (hp_journal_recover(journal) == false) {
+        hp_journal_close(journal);
+        return false;
+    }
+
+    evtimer_set(&(journal->commit_ev), hp_journal_commit_cb, journal);
+    event_base_set(base, &(journal->commit_ev));
+
+    if (hp_journal_flusher_start(journal, base) == false) {
+        HP_LOG_ERROR("Failed to start the journal flusher of thread %d", journal->thread_id);
+        hp_journal_close(journal);
+        return false;
+    }
+    return true;
+}
+
+/*
+ Appends the message parts to the journal. The waiter, if any, is handed to
+ the done callback once the record has been synced. The parts are closed,
+ whatever the result. Fails with ENOSPC when the journal is at its size limit
+ */
+bool hp_journal_append(struct hp_journal_t *journal, zmq_msg_t *parts, int num_parts, const struct hp_waiter_t *waiter)
+{
+    struct hp_journal_segment_t *segment;
+    struct hp_journal_record_t *record;
+    size_t payload_len = 0, record_size;
+    char *p;
+    int i;
+    bool success = false;
+
+    assert(num_parts > 0 && num_parts <= HP_MAX_PARTS);
+
+    for (i = 0; i < num_parts; i++) {
+        if (zmq_msg_size(&(parts[i])) > UINT32_MAX) {
+            errno = EMSGSIZE;
+            goto cleanup;
+        }
+        payload_len += zmq_msg_size(&(parts[i]));
+    }
+
+    record_size = HP_JOURNAL_ALIGN(sizeof (struct hp_journal_record_t) + payload_len);
+
+    if (journal->num_waiters == journal->max_waiters) {
+        size_t max_waiters = journal->max_waiters ? journal->max_waiters * 2 : 64;
+        struct hp_waiter_t *waiters = realloc(journal->waiters, max_waiters * sizeof (struct hp_waiter_t));
+
+        if (!waiters) {
+            goto cleanup;
+        }
+        journal->waiters = waiters;
+        journal->max_waiters = max_waiters;
+    }
+
+    segment = TAILQ_LAST(&(journal->segments), hp_journal_segments_t);
+
+    if (!segment || segment->write_pos + record_size > segment->size) {
+        size_t size = journal->segment_size;
+
+        /* Messages larger than a segment get one of their own */
+        if (HP_JOURNAL_HEADER_SIZE + record_size > size) {
+            size = HP_JOURNAL_HEADER_SIZE + record_size;
+        }
+
+        if (journal->size + size > journal->max_size) {
+            errno = ENOSPC;
+            goto cleanup;
+        }
+
+        segment = hp_journal_segment_create(journal, size);
+        if (!segment) {
+            goto cleanup;
+        }
+        TAILQ_INSERT_TAIL(&(journal->segments), segment, entries);
+
+        if (TAILQ_FIRST(&(journal->segments)) == segment) {
+            journal->read_pos = segment->write_pos;
+        }
+        hp_journal_trim(journal);
+    }
+
+    record = hp_journal_record_at(segment, segment->write_pos);
+    memset(record->frame_len, 0, sizeof (record->frame_len));
+    record->num_frames = (uint32_t) num_parts;
+
+    p = (char *) (record + 1);
+    for (i = 0; i < num_parts; i++) {
+        record->frame_len[i] = (uint32_t) zmq_msg_size(&(parts[i]));
+        memcpy(p, zmq_msg_data(&(parts[i])), record->frame_len[i]);
+        p += record->frame_len[i];
+    }
+
+    record->checksum = hp_journal_checksum(record);
+    record->magic = HP_JOURNAL_RECORD_MAGIC;
+
+    segment->write_pos += record_size;
+
+    journal->messages++;
+    journal->bytes += payload_len;
+
+    if (waiter && (waiter->req || waiter->dedup.hash)) {
+        journal->waiters[journal->num_waiters++] = *waiter;
+    }
+
+    if (!journal->commit_pending) {
+        struct timeval tv;
+
+        HP_USEC_TO_TIMEVAL(HP_JOURNAL_COMMIT_USEC, tv);
+        if (event_add(&(journal->commit_ev), &tv) == 0) {
+            journal->commit_pending = true;
+        }
+    }
+
+    hp_journal_update_counters(journal);
+    success = true;
+
+cleanup:
+    for (i = 0; i < num_parts; i++) {
+        int err = errno;
+        zmq_msg_close(&(parts[i]));
+        errno = err;
+    }
+    return success;
+}
+
+/*
+ Returns the frames of the oldest record. The data stays valid until
+ hp_journal_consume is called
+ */
+bool hp_journal_peek(struct hp_journal_t *journal, struct iovec *parts, int *num_parts)
+{
+    struct hp_journal_segment_t *segment = TAILQ_FIRST(&(journal->segments));
+    struct hp_journal_record_t *record;
+    char *p;
+    int n = 0;
+
+    if (journal->messages == 0 || !segment || journal->read_pos >= segment->write_pos) {
+        return false;
+    }
+
+    record = hp_journal_record_at(segment, journal->read_pos);
+    p = (char *) (record + 1);
+
+    for (n = 0; n < (int) record->num_frames; n++) {
+        parts[n].iov_base = p;
+        parts[n].iov_len = record->frame_len[n];
+        p += record->frame_len[n];
+    }
+
+    *num_parts = n;
+    return true;
+}
+
+/* Moves past the record returned by hp_journal_peek */
+void hp_journal_consume(struct hp_journal_t *journal)
+{
+    struct hp_journal_segment_t *segment = TAILQ_FIRST(&(journal->segments));
+    struct hp_journal_record_t *record;
+
+    if (journal->messages == 0 || !segment || journal->read_pos >= segment->write_pos) {
+        return;
+    }
+
+    record = hp_journal_record_at(segment, journal->read_pos);
+
+    journal->read_pos += HP_JOURNAL_RECORD_SIZE(record);
+    journal->messages--;
+    journal->bytes -= hp_journal_payload_len(record);
+
+    hp_journal_trim(journal);
+
+    segment = TAILQ_FIRST(&(journal->segments));
+    hp_journal_segment_header(segment)->read_pos = journal->read_pos;
+
+    hp_journal_update_counters(journal);
+}
+
+bool hp_journal_empty(struct hp_journal_t *journal)
+{
+    return (journal->messages == 0);
+}
+
+/*
+ Marks the requests of a connection that is being closed as detached. Their
+ records are kept
+ */
+void hp_journal_detach(struct hp_journal_t *journal, void *owner)
+{
+    size_t i;
+
+    for (i = 0; i < journal->num_waiters; i++) {
+        if (journal->waiters[i].owner == owner) {
+            journal->waiters[i].detached = true;
+        }
+    }
+
+    for (i = 0; i < journal->num_sync_waiters; i++) {
+        if (journal->sync_waiters[i].owner == owner) {
+            journal->sync_waiters[i].detached = true;
+        }
+    }
+}
+
+/*
+ Syncs and unmaps the segments. They are kept for the next run unless
+ everything has been replayed
+ */
+void hp_journal_close(struct hp_journal_t *journal)
+{
+    struct hp_journal_segment_t *segment;
+    char path[PATH_MAX];
+
+    if (!journal->dir) {
+        return;
+    }
+
+    hp_journal_commit(journal);
+    hp_journal_commit_wait(journal);
+    hp_journal_flusher_stop(journal);
+
+    /* Only if the flusher was lost, its commit is not known to be on disk */
+    if (journal->syncing) {
+        hp_journal_commit_done(journal, false);
+    }
+
+    if (journal->messages > 0) {
+        HP_LOG_WARN("Keeping %" PRIu64 " messages in the journal of thread %d", journal->messages, journal->thread_id);
+    }
+
+    while ((segment = TAILQ_FIRST(&(journal->segments))) != NULL) {
+        TAILQ_REMOVE(&(journal->segments), segment, entries);
+
+        if (journal->messages == 0) {
+            hp_journal_path(journal, segment->seq, path, sizeof (path));
+            (void) unlink(path);
+        } else {
+            (void) msync(segment->data, segment->size, MS_SYNC);
+        }
+        hp_journal_segment_free(segment);
+    }
+
+    free(journal->waiters);
+    free(journal->sync_waiters);
+    free(journal->ranges);
+    free(journal->dir);
+
+    journal->waiters = NULL;
+    journal->sync_waiters = NULL;
+    journal->ranges = NULL;
+    journal->dir = NULL;
+    journal->size = 0;
+
+    hp_journal_update_counters(journal);
+}
@@ -0,0 +1,440 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/* Longest message, longer ones are truncated */
+#define HP_LOG_LINE_MAX 256
+
+/* Records per thread, a power of two */
+#define HP_LOG_RING_SIZE 256
+
+/* Threads that can have a ring, the others write directly */
+#define HP_LOG_MAX_RINGS 128
+
+/* Messages a call site logs per second before they are suppressed */
+#define HP_LOG_BURST 10
+
+/* How often the writer thread looks at the rings, in microseconds */
+#define HP_LOG_FLUSH_USEC 20000
+
+struct hp_log_record_t {
+    time_t time;
+    struct hp_log_site_t *site;
+
+    /* Non-zero for the summary of the messages the site held back */
+    uint32_t suppressed;
+
+    char text[HP_LOG_LINE_MAX];
+};
+
+/* Single producer, the owning thread, and single consumer, the writer thread */
+struct hp_log_ring_t {
+    struct hp_log_record_t records[HP_LOG_RING_SIZE];
+
+    /* Next record to write, moved by the producer only */
+    uint32_t head;
+
+    /* Next record to read, moved by the consumer only */
+    uint32_t tail;
+
+    /* Messages lost while the ring was full */
+    uint32_t dropped;
+
+    /* Whether a thread writes to the ring, a ring is reused once its thread is gone */
+    int owned;
+
+    /* Set by the producer while it may write a record, see hp_log_enter */
+    int writing;
+};
+
+static struct {
+    /* Only ever appended to while the writer runs */
+    struct hp_log_ring_t *rings[HP_LOG_MAX_RINGS];
+    int num_rings;
+    pthread_mutex_t lock;
+
+    /* Sites that logged something, pushed at the head */
+    struct hp_log_site_t *sites;
+
+    pthread_t thread;
+    int running;
+    volatile sig_atomic_t stop;
+} hp_logger = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Ring of the calling thread, NULL if it writes directly */
+static __thread struct hp_log_ring_t *hp_log_ring = NULL;
+
+/* Reports the messages lost to full rings */
+static struct hp_log_site_t hp_log_dropped_site = {__FILE__, __LINE__, LOG_WARNING, 0, 0, 0, 1, NULL};
+
+#ifdef DEBUG
+static const char *hp_log_level_name(int level)
+{
+    switch (level) {
+        case LOG_EMERG:
+            return "FATAL";
+        case LOG_ERR:
+            return "ERROR";
+        case LOG_WARNING:
+            return "WARN";
+        case LOG_INFO:
+            return "INFO";
+        default:
+            return "DEBUG";
+    }
+}
+#endif
+
+static void hp_log_emit(time_t time, struct hp_log_site_t *site, uint32_t suppressed, const char *text)
+{
+    char summary[HP_LOG_LINE_MAX];
+
+    if (suppressed > 0) {
+        (void) snprintf(summary, sizeof (summary), "%" PRIu32 " messages suppressed from %s:%d",
+                        suppressed, site->file, site->line);
+        text = summary;
+    }
+
+#ifdef DEBUG
+    {
+        char buffer[26];
+
+        ctime_r(&time, buffer);
+        fprintf(stderr, "[%24.24s] [%s:%d] [%s] %s\n", buffer, site->file, site->line, hp_log_level_name(site->level), text);
+    }
+#else
+    (void) time;
+    syslog(site->level, "%s", text);
+#endif
+}
+
+/*
+ Ring of the calling thread while the writer runs, NULL to write directly.
+ A ring returned is handed back with hp_log_leave: hp_log_stop waits for
+ that before it writes out the rings for the last time
+ */
+static struct hp_log_ring_t *hp_log_enter(void)
+{
+    struct hp_log_ring_t *ring = hp_log_ring;
+
+    if (!ring) {
+        return NULL;
+    }
+    HP_ATOMIC_STORE(&(ring->writing), 1);
+
+    /* Either hp_log_stop sees 'writing' or this sees 'running' cleared */
+    __sync_synchronize();
+
+    if (!HP_ATOMIC_LOAD(&(hp_logger.running))) {
+        HP_ATOMIC_STORE_RELEASE(&(ring->writing), 0);
+        return NULL;
+    }
+    return ring;
+}
+
+static void hp_log_leave(struct hp_log_ring_t *ring)
+{
+    if (ring) {
+        HP_ATOMIC_STORE_RELEASE(&(ring->writing), 0);
+    }
+}
+
+/* Next free record of the ring, NULL and counted as dropped if it is full */
+static struct hp_log_record_t *hp_log_reserve(struct hp_log_ring_t *ring)
+{
+    uint32_t head = ring->head;
+
+    if (head - HP_ATOMIC_LOAD_ACQUIRE(&(ring->tail)) >= HP_LOG_RING_SIZE) {
+        HP_ATOMIC_ADD(&(ring->dropped), 1);
+        return NULL;
+    }
+    return &(ring->records[head & (HP_LOG_RING_SIZE - 1)]);
+}
+
+/* Hands the reserved record to the writer */
+static void hp_log_commit(struct hp_log_ring_t *ring)
+{
+    HP_ATOMIC_STORE_RELEASE(&(ring->head), ring->head + 1);
+}
+
+/* Reports the messages a site held back */
+static void hp_log_summary(struct hp_log_site_t *site, time_t now, struct hp_log_ring_t *ring)
+{
+    uint32_t suppressed = HP_ATOMIC_FETCH_CLEAR(&(site->suppressed));
+    struct hp_log_record_t *record;
+
+    if (suppressed == 0) {
+        return;
+    }
+
+    if (!ring) {
+        hp_log_emit(now, site, suppressed, NULL);
+        return;
+    }
+
+    record = hp_log_reserve(ring);
+    if (record) {
+        record->time = now;
+        record->site = site;
+        record->suppressed = suppressed;
+        record->text[0] = '\0';
+        hp_log_commit(ring);
+    }
+}
+
+/*
+ The message is formatted here, on the calling thread, and only the record
+ is left to the writer. The arguments can't be kept for the writer to
+ format: strings often live on the stack of the caller or in a buffer the
+ next call overwrites, such as zmq_strerror's. What the calling thread is
+ spared is the write to stderr or syslog, and at most HP_LOG_BURST
+ messages a second per site are formatted at all
+ */
+void hp_log_write(struct hp_log_site_t *site, const char *format, ...)
+{
+    time_t now = time(NULL);
+    int64_t window = HP_ATOMIC_LOAD(&(site->window));
+    struct hp_log_ring_t *ring;
+    struct hp_log_record_t *record;
+    va_list ap;
+
+    /* The writer reports what a site held back once it has gone quiet */
+    if (HP_ATOMIC_LOAD(&(site->registered)) == 0 && HP_ATOMIC_CAS(&(site->registered), 0, 1)) {
+        do {
+            site->next = hp_logger.sites;
+        } while (HP_ATOMIC_CAS(&(hp_logger.sites), site->next, site) == false);
+    }
+
+    ring = hp_log_enter();
+
+    /* A new second, the site may log again */
+    if (window != (int64_t) now && HP_ATOMIC_CAS(&(site->window), window, (int64_t) now)) {
+        HP_ATOMIC_STORE(&(site->count), 0);
+        hp_log_summary(site, now, ring);
+    }
+
+    if (__sync_add_and_fetch(&(site->count), 1) > HP_LOG_BURST) {
+        HP_ATOMIC_ADD(&(site->suppressed), 1);
+        hp_log_leave(ring);
+        return;
+    }
+
+    if (!ring) {
+        char text[HP_LOG_LINE_MAX];
+
+        va_start(ap, format);
+        (void) vsnprintf(text, sizeof (text), format, ap);
+        va_end(ap);
+
+        hp_log_emit(now, site, 0, text);
+        return;
+    }
+
+    record = hp_log_reserve(ring);
+    if (record) {
+        record->time = now;
+        record->site = site;
+        record->suppressed = 0;
+
+        va_start(ap, format);
+        (void) vsnprintf(record->text, sizeof (record->text), format, ap);
+        va_end(ap);
+
+        hp_log_commit(ring);
+    }
+    hp_log_leave(ring);
+}
+
+static void hp_log_flush(void)
+{
+    struct hp_log_site_t *site;
+    time_t now = time(NULL);
+    int i, num_rings = HP_ATOMIC_LOAD_ACQUIRE(&(hp_logger.num_rings));
+
+    for (i = 0; i < num_rings; i++) {
+        struct hp_log_ring_t *ring = hp_logger.rings[i];
+        uint32_t tail = ring->tail, head = HP_ATOMIC_LOAD_ACQUIRE(&(ring->head));
+        uint32_t dropped;
+
+        while (tail != head) {
+            struct hp_log_record_t *record = &(ring->records[tail & (HP_LOG_RING_SIZE - 1)]);
+
+            hp_log_emit(record->time, record->site, record->suppressed, record->text);
+            HP_ATOMIC_STORE_RELEASE(&(ring->tail), ++tail);
+        }
+
+        dropped = HP_ATOMIC_FETCH_CLEAR(&(ring->dropped));
+        if (dropped > 0) {
+            char text[HP_LOG_LINE_MAX];
+
+            (void) snprintf(text, sizeof (text), "%" PRIu32 " messages suppressed, the log ring of a thread was full", dropped);
+            hp_log_emit(now, &hp_log_dropped_site, 0, text);
+        }
+    }
+
+    /* Sites that went quiet after a burst */
+    for (site = HP_ATOMIC_LOAD_ACQUIRE(&(hp_logger.sites)); site; site = site->next) {
+        if (HP_ATOMIC_LOAD(&(site->window)) < (int64_t) now && HP_ATOMIC_LOAD(&(site->suppressed)) > 0) {
+            uint32_t suppressed = HP_ATOMIC_FETCH_CLEAR(&(site->suppressed));
+
+            if (suppressed > 0) {
+                hp_log_emit(now, site, suppressed, NULL);
+            }
+        }
+    }
+}
+
+static void *hp_log_writer(void *args __unused)
+{
+    while (!hp_logger.stop) {
+        hp_log_flush();
+        usleep(HP_LOG_FLUSH_USEC);
+    }
+    hp_log_flush();
+    return NULL;
+}
+
+/*
+ Starts the writer thread. Must be called after daemonizing, until then
+ and if it fails the messages are written directly
+ */
+bool hp_log_start(void)
+{
+    if (hp_logger.running) {
+        return true;
+    }
+    hp_logger.stop = 0;
+
+    if (pthread_create(&(hp_logger.thread), NULL, hp_log_writer, NULL) != 0) {
+        return false;
+    }
+    HP_ATOMIC_STORE_RELEASE(&(hp_logger.running), 1);
+    return true;
+}
+
+/* Writes out what is left in the rings and stops the writer */
+void hp_log_stop(void)
+{
+    int i;
+
+    if (!hp_logger.running) {
+        return;
+    }
+    hp_logger.stop = 1;
+    (void) pthread_join(hp_logger.thread, NULL);
+
+    /* Messages are written directly from now on, see hp_log_enter */
+    HP_ATOMIC_STORE(&(hp_logger.running), 0);
+    __sync_synchronize();
+
+    /* Threads that saw the writer running finish their record first */
+    pthread_mutex_lock(&(hp_logger.lock));
+    for (i = 0; i < hp_logger.num_rings; i++) {
+        while (HP_ATOMIC_LOAD_ACQUIRE(&(hp_logger.rings[i]->writing))) {
+            usleep(100);
+        }
+    }
+    pthread_mutex_unlock(&(hp_logger.lock));
+
+    /* Anything written since the last flush */
+    hp_log_flush();
+
+    /* Threads that still own a ring write directly from now on, it stays around for them */
+    pthread_mutex_lock(&(hp_logger.lock));
+    for (i = 0; i < hp_logger.num_rings; i++) {
+        if (hp_logger.rings[i]->owned) {
+            break;
+        }
+    }
+
+    if (i == hp_logger.num_rings) {
+        for (i = 0; i < hp_logger.num_rings; i++) {
+            free(hp_logger.rings[i]);
+        }
+        hp_logger.num_rings = 0;
+    }
+    pthread_mutex_unlock(&(hp_logger.lock));
+}
+
+/*
+ Gives the calling thread a ring of its own, reusing the one of a thread
+ that has stopped. Fails if the writer isn't running or every ring is taken
+ */
+bool hp_log_thread_start(void)
+{
+    struct hp_log_ring_t *ring = NULL;
+    int i;
+
+    if (hp_log_ring) {
+        return true;
+    }
+
+    if (!HP_ATOMIC_LOAD_ACQUIRE(&(hp_logger.running))) {
+        return false;
+    }
+
+    pthread_mutex_lock(&(hp_logger.lock));
+    for (i = 0; i < hp_logger.num_rings && !ring; i++) {
+        if (!hp_logger.rings[i]->owned) {
+            ring = hp_logger.rings[i];
+        }
+    }
+
+    if (!ring && hp_logger.num_rings < HP_LOG_MAX_RINGS) {
+        ring = calloc(1, sizeof (struct hp_log_ring_t));
+
+        if (ring) {
+            hp_logger.rings[hp_logger.num_rings] = ring;
+            HP_ATOMIC_STORE_RELEASE(&(hp_logger.num_rings), hp_logger.num_rings + 1);
+        }
+    }
+
+    if (ring) {
+        ring->owned = 1;
+    }
+    pthread_mutex_unlock(&(hp_logger.lock));
+
+    hp_log_ring = ring;
+    return (ring != NULL);
+}
+
+/* The ring of the calling thread may be taken by another thread, its records are still written out */
+void hp_log_thread_stop(void)
+{
+    if (!hp_log_ring) {
+        return;
+    }
+
+    pthread_mutex_lock(&(hp_logger.lock));
+    hp_log_ring->owned = 0;
+    pthread_mutex_unlock(&(hp_logger.lock));
+    hp_log_ring = NULL;
+}
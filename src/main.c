@@ -35,21 +35,47 @@
 /* Indicate that it's time to shut down */
 volatile sig_atomic_t shutting_down = 0;
 
+/* Indicate that the -z uris should be reloaded */
+volatile sig_atomic_t reload_requested = 0;
+
 static void hp_show_help(const char *d) {
 
     fprintf(stderr, "Usage: %s [OPTIONS]\n", d);
+    fprintf(stderr, " -a <value>    Listener mode: shared, reuseport or acceptor\n");
+    fprintf(stderr, " -A <value>    Admin HTTP port serving /metrics and /stats.json\n");
+    fprintf(stderr, " -B <value>    Batch messages, e.g. count=64,bytes=64k,usec=1000\n");
     fprintf(stderr, " -b <value>    Hostname or ip to for the HTTP daemon\n");
+    fprintf(stderr, " -C <value>    List of cpus to pin the httpd threads to (e.g. 0-3,8)\n");
     fprintf(stderr, " -d            Daemonize the program\n");
+    fprintf(stderr, " -D <value>    Answer retried requests from a cache of keys, e.g. header=Idempotency-Key,keys=256k,ttl=300\n");
+    fprintf(stderr, " -F <value>    File with the zeromq URIs to connect to, read again on SIGHUP\n");
+    fprintf(stderr, " -f            Serve POST requests with the built-in HTTP/1.1 parser instead of evhttp,\n");
+    fprintf(stderr, "               needed to publish /batch lines as they arrive, evhttp buffers the whole body\n");
     fprintf(stderr, " -g <value>    Group to run as\n");
     fprintf(stderr, " -i <value>    Number of zeromq IO threads\n");
+    fprintf(stderr, " -I <value>    List of zeromq IO threads for the httpd thread sockets (e.g. 0,1)\n");
+    fprintf(stderr, " -j <value>    Spill journal directory\n");
+    fprintf(stderr, " -J <value>    Spill journal segment size (G/M/k/B)\n");
+    fprintf(stderr, " -k <value>    Reply once the backend acknowledges the message, e.g. inflight=10000,timeout=5000\n");
+    fprintf(stderr, " -K <value>    Shard the messages over the -z URIs by a key, header=<name> or query=<name>\n");
+    fprintf(stderr, " -L <value>    Binary access log per thread, e.g. dir=/var/log/httpush,size=64M,files=16\n");
     fprintf(stderr, " -l <value>    Linger value for zeromq sockets\n");
     fprintf(stderr, " -m <value>    Bind dsn for zeromq monitoring socket\n");
+    fprintf(stderr, " -N            Use a zeromq context per NUMA node\n");
     fprintf(stderr, " -o            Optimize for bandwidth usage (exclude headers from messages)\n");
+    fprintf(stderr, " -P <value>    Bind dsn for publishing statistics deltas\n");
     fprintf(stderr, " -p <value>    HTTP listen port\n");
-    fprintf(stderr, " -s <value>    Disk offload size (G/M/k/B)\n");
+    fprintf(stderr, " -Q <value>    Messages queued per thread while the zeromq socket is full (default 0, off)\n");
+    fprintf(stderr, " -R <value>    Interval of statistics deltas in milliseconds\n");
+    fprintf(stderr, " -r <value>    Route a path prefix to its own zeromq URIs, e.g. /orders=tcp://127.0.0.1:5556\n");
+    fprintf(stderr, " -S <value>    Stream large bodies while reading them, e.g. bytes=1M,chunk=64k\n");
+    fprintf(stderr, " -s <value>    Spill journal size limit per thread (G/M/k/B)\n");
+    fprintf(stderr, " -T <value>    Number of httpd threads the pool can grow to from the monitor socket\n");
     fprintf(stderr, " -t <value>    Number of httpd threads\n");
+    fprintf(stderr, " -U <value>    Unix socket to take the listen sockets over from a running httpush on upgrade\n");
     fprintf(stderr, " -u <value>    User to run as\n");
     fprintf(stderr, " -w <value>    The 0MQ high watermark limit\n");
+    fprintf(stderr, " -Z <value>    Compress the messages (e.g. zlib,min=512,level=1)\n");
     fprintf(stderr, " -z <value>    Comma-separated list of zeromq URIs to connect to\n");
 }
 
@@ -57,6 +83,9 @@ static void hp_signal_handler(int sig) {
 
     switch (sig) {
         case SIGHUP:
+            reload_requested = 1;
+            break;
+
         case SIGINT:
         case SIGTERM:
             shutting_down = 1;
@@ -101,152 +130,375 @@ static bool hp_background() {
     return true;
 }
 
-static int64_t hp_unit_to_bytes(const char *expression, bool *success) {
-    int64_t ret;
+/*
+ Parses the deduplication settings in the form
+ "header=Idempotency-Key,keys=256k,ttl=300". Settings not given in the
+ expression keep their current values
+ */
+static bool hp_parse_dedup(const char *expression, struct hp_dedup_config_t *config) {
+    char *tmp, *pch, *last = NULL;
+    bool success = true;
 
-    char *end = NULL;
-    long converted, factor = 1;
+    tmp = strdup(expression);
+    if (!tmp) {
+        return false;
+    }
 
-    *success = false;
-    converted = strtol(expression, &end, 0);
+    for (pch = strtok_r(tmp, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
 
-    /* Failed */
-    if (ERANGE == errno || end == expression) {
-        return 0;
-    }
+        if (!value) {
+            success = false;
+            break;
+        }
+        *(value++) = '\0';
+
+        if (!strcmp(pch, "header")) {
+            const char *p;
+
+            /* The name is compared against request headers as is */
+            for (p = value; *p; p++) {
+                if (!isalnum((unsigned char) *p) && *p != '-' && *p != '_') {
+                    success = false;
+                }
+            }
 
-    if (*end) {
-        if (*end == 'G' || *end == 'g') {
-            factor = 1024 * 1024 * 1024;
-        } else if (*end == 'M' || *end == 'm') {
-            factor = 1024 * 1024;
-        } else if (*end == 'K' || *end == 'k') {
-            factor = 1024;
-        } else if (*end == 'B' || *end == 'b') {
-            /* Noop */
+            if (success && p > value) {
+                free(config->header);
+                config->header = strdup(value);
+                config->header_len = p - value;
+                success = (config->header != NULL);
+            } else {
+                success = false;
+            }
+        } else if (!strcmp(pch, "keys")) {
+            config->max_keys = (size_t) hp_unit_to_bytes(value, &success);
+        } else if (!strcmp(pch, "ttl")) {
+            config->ttl_sec = atol(value);
         } else {
-            fprintf(stderr, "Unknown swap size unit '%s'\n", end);
-            return 0;
+            fprintf(stderr, "Unknown deduplication setting '%s'\n", pch);
+            success = false;
         }
     }
-    *success = true;
-    ret = (int64_t) converted * factor;
-    return ret;
-}
+    free(tmp);
 
-static struct hp_uri_t *hp_parse_uri(const char *uri, int64_t default_hwm, uint64_t default_swap) {
-    char *pch, *ptr, *last = NULL;
-    struct hp_uri_t *retval;
+    if (config->max_keys < 1 || config->max_keys > (size_t) 1 << 30 || config->ttl_sec < 1) {
+        return false;
+    }
+    return success;
+}
 
-    struct evkeyval *item;
-    struct evkeyvalq *q;
+/*
+ Parses the access log settings in the form "dir=/var/log/httpush,size=64M,files=16".
+ Settings not given in the expression keep their current values
+ */
+static bool hp_parse_access(const char *expression, struct hp_access_config_t *config) {
+    char *tmp, *pch, *last = NULL;
+    bool success = true;
 
-    struct evkeyvalq params;
-    evhttp_parse_query(uri, &params);
+    tmp = strdup(expression);
+    if (!tmp) {
+        return false;
+    }
 
-    retval = malloc(sizeof (*retval));
-    retval->swap = default_swap;
-    retval->hwm = default_hwm;
-    retval->linger = 2000;
+    for (pch = strtok_r(tmp, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
 
-    ptr = strdup(uri);
-    if (!ptr)
-        return NULL;
+        if (!value) {
+            success = false;
+            break;
+        }
+        *(value++) = '\0';
+
+        if (!strcmp(pch, "dir")) {
+            free(config->dir);
+            config->dir = strdup(value);
+            success = (config->dir != NULL && *value != '\0');
+        } else if (!strcmp(pch, "size")) {
+            config->segment_size = (size_t) hp_unit_to_bytes(value, &success);
+        } else if (!strcmp(pch, "files")) {
+            config->max_files = (size_t) atol(value);
+        } else {
+            fprintf(stderr, "Unknown access log setting '%s'\n", pch);
+            success = false;
+        }
+    }
+    free(tmp);
 
-    pch = strtok_r(ptr, "?", &last);
-    if (!pch) {
-        free(ptr);
-        return NULL;
+    /* A segment holds at least a few records */
+    if (!config->dir || config->segment_size < 4096 || config->max_files < 1) {
+        return false;
     }
+    return success;
+}
 
-    retval->uri = strdup(pch);
-    q = &params;
+/*
+ Parses batching limits in the form "count=64,bytes=64k,usec=1000".
+ Limits not given in the expression keep their current values
+ */
+static bool hp_parse_batch(const char *expression, struct hp_batch_config_t *config) {
+    char *tmp, *pch, *last = NULL;
+    bool success = true;
 
-    TAILQ_FOREACH(item, q, next) {
-        if (!strcmp(item->key, "swap")) {
-            bool success;
-            retval->swap = (int64_t) hp_unit_to_bytes(item->value, &success);
+    tmp = strdup(expression);
+    if (!tmp) {
+        return false;
+    }
 
-            if (!success) {
-                free(ptr);
-                evhttp_clear_headers(&params);
-                return NULL;
-            }
+    for (pch = strtok_r(tmp, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
 
-        } else if (!strcmp(item->key, "hwm")) {
-            retval->hwm = (uint64_t) atoi(item->value);
-        } else if (!strcmp(item->key, "linger")) {
-            retval->linger = atoi(item->value);
+        if (!value) {
+            success = false;
+            break;
+        }
+        *(value++) = '\0';
+
+        if (!strcmp(pch, "count")) {
+            config->max_messages = (size_t) atoi(value);
+        } else if (!strcmp(pch, "bytes")) {
+            config->max_bytes = (size_t) hp_unit_to_bytes(value, &success);
+        } else if (!strcmp(pch, "usec")) {
+            config->max_usec = atol(value);
+        } else {
+            fprintf(stderr, "Unknown batch limit '%s'\n", pch);
+            success = false;
         }
     }
-    free(ptr);
-    evhttp_clear_headers(&params);
-    return retval;
+    free(tmp);
+
+    if (config->max_messages < 1 || config->max_bytes < 1 || config->max_usec < 1) {
+        return false;
+    }
+    return success;
 }
 
-static size_t hp_count_chr(const char *haystack, char needle) {
-    size_t occurances = 0;
+/*
+ Parses the streaming settings in the form "bytes=1M,chunk=64k". Settings
+ not given in the expression keep their current values
+ */
+static bool hp_parse_stream(const char *expression, struct hp_stream_config_t *config) {
+    char *tmp, *pch, *last = NULL;
+    bool success = true;
+
+    tmp = strdup(expression);
+    if (!tmp) {
+        return false;
+    }
+
+    for (pch = strtok_r(tmp, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
+
+        if (!value) {
+            success = false;
+            break;
+        }
+        *(value++) = '\0';
 
-    while (*haystack != '\0') {
-        if (*(haystack++) == needle) {
-            occurances++;
+        if (!strcmp(pch, "bytes")) {
+            config->threshold = (size_t) hp_unit_to_bytes(value, &success);
+        } else if (!strcmp(pch, "chunk")) {
+            config->chunk_size = (size_t) hp_unit_to_bytes(value, &success);
+        } else {
+            fprintf(stderr, "Unknown streaming setting '%s'\n", pch);
+            success = false;
         }
     }
-    return occurances;
+    free(tmp);
+
+    /* The stream frame holds the size of a chunk in 32 bits */
+    if (config->threshold < 1 || config->chunk_size < 1 || config->chunk_size > UINT32_MAX) {
+        return false;
+    }
+    return success;
 }
 
-static struct hp_uri_t **hp_parse_dsn_param(const char *param, size_t *num, int64_t default_hwm, uint64_t default_swap) {
-    size_t num_dsn = 0;
-    bool success = true;
+/*
+ Parses the acknowledgement settings in the form "inflight=10000,timeout=5000",
+ the timeout in milliseconds. Settings not given keep their current values
+ */
+static bool hp_parse_ack(const char *expression, struct hp_ack_config_t *config) {
     char *tmp, *pch, *last = NULL;
-    struct hp_uri_t **retval = NULL;
+    bool success = true;
 
-    *num = 0;
+    tmp = strdup(expression);
+    if (!tmp) {
+        return false;
+    }
 
-    num_dsn = (hp_count_chr(param, ',') + 1);
-    retval = calloc(num_dsn, sizeof (struct hp_uri_t *));
+    for (pch = strtok_r(tmp, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
 
-    // calloc failed
-    if (!retval) {
-        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
-        return NULL;
+        if (!value) {
+            success = false;
+            break;
+        }
+        *(value++) = '\0';
+
+        if (!strcmp(pch, "inflight")) {
+            config->max_inflight = (size_t) atol(value);
+        } else if (!strcmp(pch, "timeout")) {
+            config->timeout_msec = atol(value);
+        } else {
+            fprintf(stderr, "Unknown ack setting '%s'\n", pch);
+            success = false;
+        }
+    }
+    free(tmp);
+
+    if (config->max_inflight < 1 || config->max_inflight >= UINT32_MAX || config->timeout_msec < 1) {
+        return false;
     }
+    return success;
+}
 
-    tmp = strdup(param);
+/*
+ Parses the compression settings in the form "zlib,min=512,level=1".
+ The codec comes first, the rest keep their current values if not given
+ */
+static bool hp_parse_compress(const char *expression, struct hp_compress_config_t *config) {
+    char *tmp, *pch, *last = NULL;
+    bool success = true;
+
+    tmp = strdup(expression);
     if (!tmp) {
-        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
-        return NULL;
+        return false;
     }
 
-    pch = strtok_r(tmp, ", ", &last);
-    if (!pch) {
+    pch = strtok_r(tmp, ",", &last);
+
+    if (pch && !strcmp(pch, "zlib")) {
+        config->codec = HP_CODEC_ZLIB;
+        config->level = 1;
+#ifdef HAVE_LIBLZ4
+    } else if (pch && !strcmp(pch, "lz4")) {
+        config->codec = HP_CODEC_LZ4;
+        config->level = 1;
+#endif
+    } else {
+        fprintf(stderr, "Unknown compression codec '%s'\n", pch ? pch : "");
         free(tmp);
-        return NULL;
+        return false;
     }
 
-    while (pch) {
-        struct hp_uri_t *uri_ptr;
+    for (pch = strtok_r(NULL, ",", &last); pch && success; pch = strtok_r(NULL, ",", &last)) {
+        char *value = strchr(pch, '=');
 
-        uri_ptr = hp_parse_uri(pch, default_hwm, default_swap);
-        if (!uri_ptr) {
+        if (!value) {
             success = false;
             break;
         }
+        *(value++) = '\0';
 
-        retval[(*num)++] = uri_ptr;
-        pch = strtok_r(NULL, ", ", &last);
+        if (!strcmp(pch, "min")) {
+            config->min_size = (size_t) hp_unit_to_bytes(value, &success);
+        } else if (!strcmp(pch, "level")) {
+            config->level = atoi(value);
+        } else {
+            fprintf(stderr, "Unknown compression setting '%s'\n", pch);
+            success = false;
+        }
     }
     free(tmp);
 
-    if (!success && *num > 0) {
-        size_t i;
-        for (i = 0; i < *num; i++) {
-            free(retval[i]);
+    if (config->codec == HP_CODEC_ZLIB && (config->level < 0 || config->level > 9)) {
+        return false;
+    }
+
+    if (config->codec == HP_CODEC_LZ4 && config->level < 1) {
+        return false;
+    }
+    return success;
+}
+
+/*
+ Parses the -K key, "header=<name>" or "query=<name>"
+ */
+static bool hp_parse_shard(const char *expression, struct hp_shard_config_t *config) {
+    const char *name, *p;
+
+    if (!strncmp(expression, "header=", sizeof ("header=") - 1)) {
+        config->source = HP_SHARD_HEADER;
+        name = expression + sizeof ("header=") - 1;
+    } else if (!strncmp(expression, "query=", sizeof ("query=") - 1)) {
+        config->source = HP_SHARD_QUERY;
+        name = expression + sizeof ("query=") - 1;
+    } else {
+        return false;
+    }
+
+    /* The name ends up in the monitoring XML as is */
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '-' && *p != '_' && *p != '.') {
+            return false;
         }
-        free(retval);
-        *num = 0;
     }
-    return retval;
+
+    if (p == name) {
+        return false;
+    }
+
+    config->name = strdup(name);
+    config->name_len = p - name;
+    return (config->name != NULL);
+}
+
+/*
+ Parses the -r routes, "<prefix>=<uris>" where the uris are in the -z format,
+ and builds the trie to look them up
+ */
+static bool hp_parse_routes(const char **params, size_t num_params, struct httpush_args_t *args, int64_t default_hwm) {
+    size_t i, j;
+
+    args->routes = calloc(num_params, sizeof (struct hp_route_t));
+    if (!args->routes) {
+        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+        return false;
+    }
+
+    for (i = 0; i < num_params; i++) {
+        struct hp_route_t *route = &(args->routes[i]);
+        const char *eq = strchr(params[i], '=');
+
+        if (!eq || params[i][0] != '/') {
+            fprintf(stderr, "Option -r argument must be <prefix>=<uris> with a prefix starting with /: %s\n", params[i]);
+            return false;
+        }
+
+        route->prefix_len = eq - params[i];
+        route->prefix = strndup(params[i], route->prefix_len);
+
+        if (!route->prefix) {
+            fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+            return false;
+        }
+        args->num_routes++;
+
+        /* The prefix ends up in the monitoring XML as is */
+        if (strpbrk(route->prefix, " \t\"&<>")) {
+            fprintf(stderr, "Option -r prefix contains characters not allowed in a path: %s\n", route->prefix);
+            return false;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (!strcmp(args->routes[j].prefix, route->prefix)) {
+                fprintf(stderr, "Option -r prefix %s given more than once\n", route->prefix);
+                return false;
+            }
+        }
+
+        route->uris = hp_parse_dsn_param(eq + 1, &(route->num_uris), default_hwm, 0);
+        if (!route->uris || route->num_uris == 0) {
+            fprintf(stderr, "hp_parse_dsn_param failed for the uris of route %s\n", route->prefix);
+            return false;
+        }
+    }
+
+    if (hp_route_trie_build(&(args->route_trie), args->routes, args->num_routes) == false) {
+        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
 static bool hp_drop_privileges(const char *to_user, const char *to_group) {
@@ -292,7 +544,7 @@ static bool hp_change_working_directory() {
     return true;
 }
 
-static int hp_create_listen_socket(const char *ip, const char *port) {
+static int hp_create_listen_socket(const char *ip, const char *port, bool reuseport) {
     struct addrinfo *res, hints;
     int rc, sockfd, reuse = 1;
 
@@ -324,6 +576,21 @@ static int hp_create_listen_socket(const char *ip, const char *port) {
         return -1;
     }
 
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof (int));
+#else
+        rc = -1;
+        errno = ENOTSUP;
+#endif
+        if (rc != 0) {
+            (void) close(sockfd);
+            fprintf(stderr, "failed to set SO_REUSEPORT: %s\n", strerror(errno));
+            freeaddrinfo(res);
+            return -1;
+        }
+    }
+
     rc = bind(sockfd, res->ai_addr, res->ai_addrlen);
     freeaddrinfo(res);
 
@@ -355,22 +622,36 @@ int main(int argc, char **argv) {
     /* -- start default values -- */
     const char *monitor_dsn = "tcp://127.0.0.1:5567";
 
+    const char *publish_dsn = NULL;
+
     const char *zmq_dsn = "tcp://127.0.0.1:5555";
+    const char *uri_file = NULL;
+    char *file_dsn = NULL;
 
     const char *user = "nobody";
     const char *group = "nobody";
 
     const char *http_host = NULL;
     const char *http_port = "8080";
+    const char *admin_port = NULL;
+    const char *upgrade_path = NULL;
+    struct hp_upgrade_fds_t upgrade;
+    int *inherited_fds = NULL;
+    size_t num_inherited_fds = 0;
 
     uint64_t hwm = 0;
-    int64_t swap = 0;
 
     int io_threads = 1;
     int linger = 2000;
     int http_threads = 5;
+    int max_threads = 0;
 
     bool daemonize = false;
+    bool numa = false;
+
+    /* -r arguments, parsed once the defaults are known */
+    const char **route_params = NULL;
+    size_t num_route_params = 0;
 
     /* -- end default values --- */
 
@@ -378,26 +659,148 @@ int main(int argc, char **argv) {
     struct httpush_args_t args;
 
     args.ctx = NULL;
-    args.fd = -1;
+    args.fds = NULL;
+    args.num_fds = 0;
+    args.listen_mode = HP_LISTEN_SHARED;
+    args.cpus = NULL;
+    args.num_cpus = 0;
+    args.io_affinity = NULL;
+    args.num_io_affinity = 0;
+    args.node_ctx = NULL;
+    args.num_nodes = 0;
     args.include_headers = true;
 
+    args.admin_fd = -1;
+    args.upgrade_fd = -1;
+    args.upgrade_conn = -1;
+
+    upgrade.listener = -1;
+    upgrade.fds = NULL;
+    upgrade.num_fds = 0;
+    upgrade.admin_fd = -1;
+
+    args.p_uris = NULL;
+    args.num_p_uris = 0;
+    args.publish_usec = 100000;
+
+    args.routes = NULL;
+    args.num_routes = 0;
+
+    /* Sharding is disabled until -K is given */
+    args.shard.source = HP_SHARD_NONE;
+    args.shard.name = NULL;
+    args.shard.name_len = 0;
+    memset(&(args.route_trie), 0, sizeof (struct hp_route_trie_t));
+
+    /* Batching is disabled until -B is given */
+    args.batch.max_messages = 0;
+    args.batch.max_bytes = 64 * 1024;
+    args.batch.max_usec = 1000;
+
+    args.queue_size = 0;
+
+    /* Retries are not recognised until -D is given */
+    args.dedup.header = NULL;
+    args.dedup.header_len = 0;
+    args.dedup.max_keys = 0;
+    args.dedup.ttl_sec = 300;
+
+    /* Acks are not waited for until -k is given */
+    args.ack.max_inflight = 0;
+    args.ack.timeout_msec = 5000;
+
+    args.compress.codec = HP_CODEC_NONE;
+    args.compress.min_size = 512;
+    args.compress.level = 1;
+
+    args.frontend = false;
+
+    /* Streaming is disabled until -S is given */
+    args.stream.threshold = 0;
+    args.stream.chunk_size = 64 * 1024;
+
+    args.journal_dir = NULL;
+    args.journal_segment_size = 64 * 1024 * 1024;
+    args.journal_max_size = 1024 * 1024 * 1024;
+
+    /* The access log is disabled until -L is given */
+    args.access.dir = NULL;
+    args.access.segment_size = 64 * 1024 * 1024;
+    args.access.max_files = 16;
+
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "b:dg:i:l:m:op:s:t:u:w:z:")) != -1) {
+    while ((c = getopt(argc, argv, "A:a:B:b:C:D:dF:fg:I:i:J:j:K:k:L:l:m:NoP:p:Q:R:r:S:s:T:t:U:u:w:Z:z:")) != -1) {
         switch (c) {
 
+            case 'A':
+                admin_port = optarg;
+                break;
+
+            case 'a':
+                if (!strcmp(optarg, "shared")) {
+                    args.listen_mode = HP_LISTEN_SHARED;
+                } else if (!strcmp(optarg, "reuseport")) {
+                    args.listen_mode = HP_LISTEN_REUSEPORT;
+                } else if (!strcmp(optarg, "acceptor")) {
+                    args.listen_mode = HP_LISTEN_ACCEPTOR;
+                } else {
+                    fprintf(stderr, "Option -a argument must be one of shared, reuseport or acceptor\n");
+                    exit(1);
+                }
+                break;
+
+            case 'B':
+                args.batch.max_messages = 64;
+                if (hp_parse_batch(optarg, &(args.batch)) == false) {
+                    fprintf(stderr, "Option -B argument must be in the form count=64,bytes=64k,usec=1000\n");
+                    exit(1);
+                }
+                break;
+
             case 'b':
                 http_host = optarg;
                 break;
 
+            case 'C':
+                if (hp_parse_cpu_list(optarg, &(args.cpus), &(args.num_cpus)) == false) {
+                    fprintf(stderr, "Option -C argument must be a list of cpus\n");
+                    exit(1);
+                }
+                break;
+
+            case 'D':
+                args.dedup.max_keys = 256 * 1024;
+
+                if (hp_parse_dedup(optarg, &(args.dedup)) == false) {
+                    fprintf(stderr, "Option -D argument must be in the form header=Idempotency-Key,keys=256k,ttl=300\n");
+                    exit(1);
+                }
+                break;
+
             case 'd':
                 daemonize = true;
                 break;
 
+            case 'F':
+                uri_file = optarg;
+                break;
+
+            case 'f':
+                args.frontend = true;
+                break;
+
             case 'g':
                 group = optarg;
                 break;
 
+            case 'I':
+                if (hp_parse_cpu_list(optarg, &(args.io_affinity), &(args.num_io_affinity)) == false) {
+                    fprintf(stderr, "Option -I argument must be a list of zeromq IO threads\n");
+                    exit(1);
+                }
+                break;
+
             case 'i':
                 io_threads = atoi(optarg);
                 if (io_threads < 1) {
@@ -406,6 +809,45 @@ int main(int argc, char **argv) {
                 }
                 break;
 
+            case 'j':
+                args.journal_dir = optarg;
+                break;
+
+            case 'J':
+            {
+                bool success;
+                int64_t size = hp_unit_to_bytes(optarg, &success);
+                if (!success || size < 4096) {
+                    fprintf(stderr, "Failed to set journal segment size\n");
+                    exit(1);
+                }
+                args.journal_segment_size = (size_t) size;
+            }
+                break;
+
+            case 'K':
+                if (hp_parse_shard(optarg, &(args.shard)) == false) {
+                    fprintf(stderr, "Option -K argument must be header=<name> or query=<name>\n");
+                    exit(1);
+                }
+                break;
+
+            case 'k':
+                args.ack.max_inflight = 10000;
+
+                if (hp_parse_ack(optarg, &(args.ack)) == false) {
+                    fprintf(stderr, "Option -k argument must be in the form inflight=10000,timeout=5000\n");
+                    exit(1);
+                }
+                break;
+
+            case 'L':
+                if (hp_parse_access(optarg, &(args.access)) == false) {
+                    fprintf(stderr, "Option -L argument must be in the form dir=/var/log/httpush,size=64M,files=16\n");
+                    exit(1);
+                }
+                break;
+
             case 'l':
                 linger = atoi(optarg);
 
@@ -419,25 +861,84 @@ int main(int argc, char **argv) {
                 monitor_dsn = optarg;
                 break;
 
+            case 'N':
+                numa = true;
+                break;
+
             case 'o':
                 args.include_headers = false;
                 break;
 
+            case 'P':
+                publish_dsn = optarg;
+                break;
+
             case 'p':
                 http_port = optarg;
                 break;
 
+            case 'Q':
+            {
+                long size = atol(optarg);
+                if (size < 0) {
+                    fprintf(stderr, "Option -Q argument must be zero or a positive integer\n");
+                    exit(1);
+                }
+                args.queue_size = (size_t) size;
+            }
+                break;
+
+            case 'R':
+                args.publish_usec = atol(optarg) * 1000;
+                if (args.publish_usec < 1000) {
+                    fprintf(stderr, "Option -R argument must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+
+            case 'r':
+            {
+                const char **params = realloc(route_params, (num_route_params + 1) * sizeof (const char *));
+
+                if (!params) {
+                    fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+                    exit(1);
+                }
+                route_params = params;
+                route_params[num_route_params++] = optarg;
+            }
+                break;
+
+            case 'S':
+                args.stream.threshold = 1024 * 1024;
+
+                if (hp_parse_stream(optarg, &(args.stream)) == false) {
+                    fprintf(stderr, "Invalid streaming settings '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 's':
             {
                 bool success;
-                swap = hp_unit_to_bytes(optarg, &success);
-                if (!success) {
-                    fprintf(stderr, "Failed to set swap size\n");
+                int64_t size = hp_unit_to_bytes(optarg, &success);
+                if (!success || size < 1) {
+                    fprintf(stderr, "Failed to set journal size limit\n");
                     exit(1);
                 }
+                args.journal_max_size = (uint64_t) size;
             }
                 break;
 
+            case 'T':
+                max_threads = atoi(optarg);
+
+                if (max_threads < 1) {
+                    fprintf(stderr, "Option -T argument must be a positive integer\n");
+                    exit(1);
+                }
+                break;
+
             case 't':
                 http_threads = atoi(optarg);
 
@@ -448,6 +949,10 @@ int main(int argc, char **argv) {
 
                 break;
 
+            case 'U':
+                upgrade_path = optarg;
+                break;
+
             case 'u':
                 user = optarg;
                 break;
@@ -456,14 +961,21 @@ int main(int argc, char **argv) {
                 hwm = (uint64_t) atoi(optarg);
                 break;
 
+            case 'Z':
+                if (hp_parse_compress(optarg, &(args.compress)) == false) {
+                    fprintf(stderr, "Invalid compression settings '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'z':
                 zmq_dsn = optarg;
                 break;
 
             case '?':
-                if (optopt == 'b' || optopt == 'g' || optopt == 'i' || optopt == 'l' ||
-                        optopt == 'p' || optopt == 's' || optopt == 't' || optopt == 'u' ||
-                        optopt == 'w' || optopt == 'z') {
+                if (optopt == 'A' || optopt == 'a' || optopt == 'B' || optopt == 'b' || optopt == 'C' || optopt == 'D' || optopt == 'F' || optopt == 'g' || optopt == 'I' || optopt == 'i' || optopt == 'J' || optopt == 'j' || optopt == 'K' || optopt == 'k' || optopt == 'L' || optopt == 'l' ||
+                        optopt == 'P' || optopt == 'p' || optopt == 'Q' || optopt == 'R' || optopt == 'r' || optopt == 'S' || optopt == 's' || optopt == 'T' || optopt == 't' || optopt == 'U' || optopt == 'u' ||
+                        optopt == 'w' || optopt == 'Z' || optopt == 'z') {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 }
                 hp_show_help(argv[0]);
@@ -477,28 +989,208 @@ int main(int argc, char **argv) {
         }
     }
 
-    args.fd = hp_create_listen_socket(http_host, http_port);
-    if (args.fd == -1) {
+    /* evhttp can't take over the sockets the acceptor hands out, only the built-in parser serves them */
+    if (args.listen_mode == HP_LISTEN_ACCEPTOR && args.frontend == false && args.stream.threshold == 0) {
+        fprintf(stderr, "Option -a acceptor needs the built-in parser (-f)\n");
+        exit(1);
+    }
+
+    if ((args.frontend || args.stream.threshold > 0) && args.batch.max_messages > 0) {
+        fprintf(stderr, "Options -f and -S can't be used with -B\n");
+        exit(1);
+    }
+
+    /* The journal and streams go through the single out socket */
+    if (args.shard.source != HP_SHARD_NONE && (args.journal_dir != NULL || args.stream.threshold > 0)) {
+        fprintf(stderr, "Option -K can't be used with -j or -S\n");
+        exit(1);
+    }
+
+    /* Both processes would write the same journal files while handing over */
+    if (upgrade_path && args.journal_dir != NULL) {
+        fprintf(stderr, "Option -U can't be used with -j\n");
+        exit(1);
+    }
+
+    /* The acks come back on the single out socket, messages are never held back */
+    if (args.ack.max_inflight > 0 && (args.batch.max_messages > 0 || args.journal_dir != NULL || args.stream.threshold > 0 ||
+                                      args.shard.source != HP_SHARD_NONE || num_route_params > 0)) {
+        fprintf(stderr, "Option -k can't be used with -B, -j, -S, -K or -r\n");
+        exit(1);
+    }
+
+    if (args.dedup.max_keys > 0 && !args.dedup.header) {
+        args.dedup.header = strdup("Idempotency-Key");
+        args.dedup.header_len = sizeof ("Idempotency-Key") - 1;
+
+        if (!args.dedup.header) {
+            fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+            exit(1);
+        }
+    }
+
+    /* The pool can't outgrow the slots allocated at startup */
+    args.max_threads = (max_threads > 0) ? max_threads : http_threads;
+
+    if (args.max_threads < http_threads) {
+        fprintf(stderr, "Option -T must be at least the number of threads (-t)\n");
+        exit(1);
+    }
+
+    /* The listen socket of each thread is created before dropping privileges */
+    if (args.max_threads > http_threads && args.listen_mode == HP_LISTEN_REUSEPORT) {
+        fprintf(stderr, "Option -T can't be used with -a reuseport\n");
+        exit(1);
+    }
+
+    if (args.stream.threshold > 0 && args.queue_size == 0 && args.journal_dir == NULL) {
+        fprintf(stderr, "Option -S needs the queue (-Q) or the journal (-j)\n");
         exit(1);
     }
 
+    for (i = 0; i < args.num_io_affinity; i++) {
+        if (args.io_affinity[i] >= io_threads || args.io_affinity[i] > 63) {
+            fprintf(stderr, "Option -I refers to zeromq IO thread %d but there are %d IO threads\n", args.io_affinity[i], io_threads);
+            exit(1);
+        }
+    }
+
+    /* One socket per thread lets the kernel balance the connections */
+    args.num_fds = (args.listen_mode == HP_LISTEN_REUSEPORT) ? (size_t) http_threads : 1;
+    args.fds = calloc(args.num_fds, sizeof (int));
+
+    if (!args.fds) {
+        fprintf(stderr, "Failed to allocate memory: %s", strerror(errno));
+        exit(1);
+    }
+
+    /* A process already serving on -U passes its sockets, it keeps accepting until this one runs */
+    if (upgrade_path) {
+        if (hp_upgrade_connect(upgrade_path, &(args.upgrade_conn)) == false) {
+            fprintf(stderr, "Failed to connect to %s: %s\n", upgrade_path, strerror(errno));
+            exit(1);
+        }
+
+        if (args.upgrade_conn != -1) {
+            if (hp_upgrade_recv(args.upgrade_conn, &upgrade) == false) {
+                fprintf(stderr, "Failed to take over the listen sockets: %s\n", strerror(errno));
+                exit(1);
+            }
+            args.upgrade_fd = upgrade.listener;
+        } else {
+            args.upgrade_fd = hp_upgrade_listen(upgrade_path);
+            if (args.upgrade_fd == -1) {
+                fprintf(stderr, "Failed to listen on %s: %s\n", upgrade_path, strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    if (args.upgrade_conn != -1) {
+        if (upgrade.num_fds != args.num_fds) {
+            fprintf(stderr, "The running process has %zu listen sockets, -a and -t need %zu\n", upgrade.num_fds, args.num_fds);
+            exit(1);
+        }
+        memcpy(args.fds, upgrade.fds, sizeof (int) * args.num_fds);
+        free(upgrade.fds);
+    } else if (hp_listen_fds_inherited(&inherited_fds, &num_inherited_fds) == true) {
+        /* Socket activation */
+        if (num_inherited_fds != args.num_fds) {
+            fprintf(stderr, "Got %zu listen sockets from LISTEN_FDS, -a and -t need %zu\n", num_inherited_fds, args.num_fds);
+            exit(1);
+        }
+        memcpy(args.fds, inherited_fds, sizeof (int) * args.num_fds);
+        free(inherited_fds);
+    } else {
+        for (i = 0; i < args.num_fds; i++) {
+            args.fds[i] = hp_create_listen_socket(http_host, http_port, (args.listen_mode == HP_LISTEN_REUSEPORT));
+            if (args.fds[i] == -1) {
+                exit(1);
+            }
+        }
+    }
+
+    /* The admin port is still bound by the running process */
+    if (upgrade.admin_fd != -1 && !admin_port) {
+        (void) close(upgrade.admin_fd);
+    } else if (upgrade.admin_fd != -1) {
+        args.admin_fd = upgrade.admin_fd;
+    } else if (admin_port) {
+        args.admin_fd = hp_create_listen_socket(http_host, admin_port, false);
+        if (args.admin_fd == -1) {
+            exit(1);
+        }
+    }
+
     if (hp_drop_privileges(user, group) == false) {
         fprintf(stderr, "hp_drop_privileges failed\n");
         exit(1);
     }
 
-    args.uris = hp_parse_dsn_param(zmq_dsn, &(args.num_uris), hwm, swap);
+    /* Created as the user the threads write it as, the working directory changes before they do */
+    if (args.access.dir) {
+        char *access_dir;
+
+        if (mkdir(args.access.dir, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create access log directory %s: %s\n", args.access.dir, strerror(errno));
+            exit(1);
+        }
+
+        access_dir = realpath(args.access.dir, NULL);
+        if (!access_dir) {
+            fprintf(stderr, "Failed to resolve access log directory %s: %s\n", args.access.dir, strerror(errno));
+            exit(1);
+        }
+        free(args.access.dir);
+        args.access.dir = access_dir;
+    }
+
+    /* The file takes the place of -z, it is read again on reload */
+    if (uri_file) {
+        /* The working directory changes before the file is read again */
+        args.uri_file = realpath(uri_file, NULL);
+
+        if (args.uri_file) {
+            file_dsn = hp_read_uri_file(args.uri_file);
+        }
+
+        if (!file_dsn) {
+            fprintf(stderr, "Failed to read the uris from %s: %s\n", uri_file, strerror(errno));
+            exit(1);
+        }
+        zmq_dsn = file_dsn;
+    }
+
+    args.hwm = (int64_t) hwm;
+    args.uris = hp_parse_dsn_param(zmq_dsn, &(args.num_uris), hwm, 0);
+    free(file_dsn);
+
     if (!args.uris) {
         fprintf(stderr, "hp_parse_dsn_param failed for backend uris\n");
         exit(1);
     }
 
-    args.m_uris = hp_parse_dsn_param(monitor_dsn, &(args.num_m_uris), hwm, swap);
+    if (num_route_params > 0) {
+        if (hp_parse_routes(route_params, num_route_params, &args, hwm) == false) {
+            exit(1);
+        }
+        free(route_params);
+    }
+
+    args.m_uris = hp_parse_dsn_param(monitor_dsn, &(args.num_m_uris), hwm, 0);
     if (!args.m_uris) {
         fprintf(stderr, "hp_parse_dsn_param failed for monitor uris\n");
         exit(1);
     }
 
+    if (publish_dsn) {
+        args.p_uris = hp_parse_dsn_param(publish_dsn, &(args.num_p_uris), hwm, 0);
+        if (!args.p_uris) {
+            fprintf(stderr, "hp_parse_dsn_param failed for publisher uris\n");
+            exit(1);
+        }
+    }
+
     HP_LOG_INFO("HTTP listen: %s:%s", (http_host ? http_host : "0.0.0.0"), http_port);
 
     if (daemonize) {
@@ -519,6 +1211,13 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* The log writer is a thread, it has to be started in the daemon */
+    if (hp_log_start() == false) {
+        HP_LOG_WARN("Failed to start the log writer, logging synchronously");
+    } else {
+        (void) atexit(hp_log_stop);
+    }
+
     /* Change the current working directory */
     if (hp_change_working_directory() == false) {
         HP_LOG_ERROR("Failed to change directory: %s", strerror(errno));
@@ -533,24 +1232,76 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* Each NUMA node gets a context with IO threads running on the node */
+    if (numa) {
+        int node;
+
+        args.num_nodes = hp_numa_num_nodes();
+        args.node_ctx = calloc(args.num_nodes, sizeof (void *));
+
+        if (!args.node_ctx) {
+            HP_LOG_ERROR("Failed to allocate memory: %s", strerror(errno));
+            exit(1);
+        }
+
+        for (node = 0; node < args.num_nodes; node++) {
+            args.node_ctx[node] = hp_numa_context(node, io_threads);
+
+            if (!args.node_ctx[node]) {
+                HP_LOG_ERROR("Failed to initialize zmq context for NUMA node %d: %s", node, zmq_strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
     /* This call will block */
     rc = hp_server_boostrap(&args, http_threads);
 
-    for (i = 0; i < args.num_uris; i++) {
-        free(args.uris[i]->uri);
-        free(args.uris[i]);
+    hp_free_uris(args.uris, args.num_uris);
+    free(args.uri_file);
+
+    for (i = 0; i < args.num_routes; i++) {
+        hp_free_uris(args.routes[i].uris, args.routes[i].num_uris);
+        free(args.routes[i].prefix);
+    }
+    free(args.routes);
+    hp_route_trie_free(&(args.route_trie));
+    free(args.shard.name);
+    free(args.dedup.header);
+    free(args.access.dir);
+
+    hp_free_uris(args.m_uris, args.num_m_uris);
+    hp_free_uris(args.p_uris, args.num_p_uris);
+
+    for (i = 0; i < args.num_fds; i++) {
+        (void) close(args.fds[i]);
+    }
+    free(args.fds);
+
+    if (args.admin_fd != -1) {
+        (void) close(args.admin_fd);
     }
-    free(args.uris);
 
-    for (i = 0; i < args.num_m_uris; i++) {
-        free(args.m_uris[i]->uri);
-        free(args.m_uris[i]);
+    /* The path now belongs to the new process if there was an upgrade */
+    if (args.upgrade_fd != -1) {
+        (void) close(args.upgrade_fd);
     }
-    free(args.m_uris);
+
+    free(args.cpus);
+    free(args.io_affinity);
 
     HP_LOG_DEBUG("Terminating zmq context");
     (void) zmq_term(args.ctx);
 
+    if (args.node_ctx) {
+        int node;
+
+        for (node = 0; node < args.num_nodes; node++) {
+            (void) zmq_term(args.node_ctx[node]);
+        }
+        free(args.node_ctx);
+    }
+
     HP_LOG_INFO("Terminating process");
     exit(rc);
 }
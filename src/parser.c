@@ -0,0 +1,369 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+#include <stddef.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+/*
+ POST-only HTTP/1.x request parser of the conn.c front-end. The request line
+ and headers are parsed in place: the result is a set of offsets into the
+ read buffer, nothing is copied or allocated. Scanning for the end of the
+ head and for the end of each line is done 16 bytes at a time with SSE2
+ where available.
+ */
+
+#define HP_HEADER_IS(k_, kl_, n_) ((kl_) == sizeof (n_) - 1 && !strncasecmp((k_), (n_), (kl_)))
+
+#define HP_XFF_HEADER "X-Forwarded-For"
+
+/* Whether c is one of the token characters of RFC 7230, the only ones allowed in a header name */
+static inline bool hp_parse_is_tchar(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/* Returns a pointer to the "\r\n\r\n" ending the head or NULL */
+static const char *hp_parse_find_head_end(const char *data, size_t len)
+{
+    const char *p = data, *end = data + len;
+
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), lf));
+
+        while (mask) {
+            const char *q = p + __builtin_ctz(mask);
+
+            if (q - data >= 3 && q[-1] == '\r' && q[-2] == '\n' && q[-3] == '\r') {
+                return q - 3;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == '\n' && p - data >= 3 && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r') {
+            return p - 3;
+        }
+    }
+    return NULL;
+}
+
+/* Returns a pointer to the first 'a' or 'b' in [p, end) or end */
+static const char *hp_parse_find2(const char *p, const char *end, char a, char b)
+{
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+/* Whether the comma separated header value contains the token */
+static bool hp_parse_has_token(const char *value, size_t value_len, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *end = value + value_len;
+
+    while (value < end) {
+        const char *comma = memchr(value, ',', end - value);
+        const char *item_end = comma ? comma : end;
+
+        while (value < item_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (item_end > value && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+            item_end--;
+        }
+
+        if ((size_t) (item_end - value) == token_len && !strncasecmp(value, token, token_len)) {
+            return true;
+        }
+
+        if (!comma) {
+            break;
+        }
+        value = comma + 1;
+    }
+    return false;
+}
+
+/* Picks up the headers the front-end acts upon */
+static hp_parse_status_t hp_parse_header(struct hp_request_t *req, const char *data, struct hp_request_header_t *h)
+{
+    const char *key = data + h->key, *value = data + h->value;
+
+    switch (h->key_len) {
+        case sizeof ("Connection") - 1:
+            if (HP_HEADER_IS(key, h->key_len, "Connection")) {
+                if (hp_parse_has_token(value, h->value_len, "close")) {
+                    req->keep_alive = false;
+                } else if (hp_parse_has_token(value, h->value_len, "keep-alive")) {
+                    req->keep_alive = true;
+                }
+            }
+        break;
+
+        case sizeof ("Content-Length") - 1:
+            if (HP_HEADER_IS(key, h->key_len, "Content-Length")) {
+                char *num_end;
+
+                /* A second Content-Length is refused rather than guessed at */
+                if (req->has_length || h->value_len == 0 || !isdigit((unsigned char) *value)) {
+                    return HP_PARSE_ERROR;
+                }
+
+                errno = 0;
+                req->content_length = strtoull(value, &num_end, 10);
+
+                if (errno != 0 || num_end != value + h->value_len) {
+                    return HP_PARSE_ERROR;
+                }
+                req->has_length = true;
+            }
+        break;
+
+        case sizeof ("Transfer-Encoding") - 1:
+            if (HP_HEADER_IS(key, h->key_len, "Transfer-Encoding")) {
+                /* Repeated, the codings could be read either way */
+                if (req->has_encoding || h->value_len == 0) {
+                    return HP_PARSE_ERROR;
+                }
+                req->has_encoding = true;
+
+                /* chunked is the only coding the body can be decoded from */
+                if (!HP_HEADER_IS(value, h->value_len, "chunked")) {
+                    return HP_PARSE_UNSUPPORTED;
+                }
+                req->chunked = true;
+            }
+        break;
+
+        case sizeof ("Expect") - 1:
+            if (HP_HEADER_IS(key, h->key_len, "Expect")) {
+                req->expect_continue = (req->minor_version == 1 && hp_parse_has_token(value, h->value_len, "100-continue"));
+            }
+        break;
+
+        case sizeof (HP_XFF_HEADER) - 1:
+            if (HP_HEADER_IS(key, h->key_len, HP_XFF_HEADER)) {
+                req->xff = req->num_headers;
+            }
+        break;
+    }
+    return HP_PARSE_DONE;
+}
+
+/*
+ Parses the request line and headers at the start of data. On HP_PARSE_DONE
+ the head takes req->head_len bytes and the offsets in req point into it
+ */
+hp_parse_status_t hp_parse_request(const char *data, size_t len, struct hp_request_t *req)
+{
+    const char *end, *p, *line_end, *sp;
+    hp_parse_status_t status;
+
+    end = hp_parse_find_head_end(data, (len > HP_REQUEST_MAX_HEAD) ? HP_REQUEST_MAX_HEAD : len);
+    if (!end) {
+        return (len >= HP_REQUEST_MAX_HEAD) ? HP_PARSE_TOO_LARGE : HP_PARSE_MORE;
+    }
+
+    memset(req, 0, offsetof(struct hp_request_t, headers));
+    req->head_len = (end - data) + 4;
+    req->xff = -1;
+
+    /* "METHOD URI HTTP/1.x" */
+    line_end = hp_parse_find2(data, end, '\r', '\n');
+    if (*line_end != '\r' || line_end[1] != '\n') {
+        return HP_PARSE_ERROR;
+    }
+
+    sp = memchr(data, ' ', line_end - data);
+    if (!sp || sp == data) {
+        return HP_PARSE_ERROR;
+    }
+    req->method_len = sp - data;
+
+    p = sp + 1;
+    sp = memchr(p, ' ', line_end - p);
+    if (!sp || sp == p) {
+        return HP_PARSE_ERROR;
+    }
+    req->uri = p - data;
+    req->uri_len = sp - p;
+
+    p = sp + 1;
+    if (line_end - p != 8 || memcmp(p, "HTTP/1.", 7) || (p[7] != '0' && p[7] != '1')) {
+        return HP_PARSE_ERROR;
+    }
+    req->minor_version = p[7] - '0';
+
+    /* HTTP/1.1 connections are persistent by default, HTTP/1.0 ones are not */
+    req->keep_alive = (req->minor_version == 1);
+
+    for (p = line_end + 2; p < end + 2; p = line_end + 2) {
+        struct hp_request_header_t *h;
+        const char *colon, *value;
+
+        if (req->num_headers == HP_REQUEST_MAX_HEADERS) {
+            return HP_PARSE_TOO_LARGE;
+        }
+        h = &(req->headers[req->num_headers]);
+
+        /*
+         The name is copied into the header frame as is, so anything but a
+         token, whitespace and a bare LF included, is refused
+         */
+        for (colon = p; colon < end && hp_parse_is_tchar((unsigned char) *colon); colon++);
+
+        if (colon == end || *colon != ':' || colon == p) {
+            return HP_PARSE_ERROR;
+        }
+        h->key = p - data;
+        h->key_len = colon - p;
+
+        line_end = hp_parse_find2(colon, end, '\r', '\n');
+        if (*line_end != '\r' || line_end[1] != '\n') {
+            return HP_PARSE_ERROR;
+        }
+
+        value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        h->value = value - data;
+        h->value_len = line_end - value;
+
+        while (h->value_len > 0 && (value[h->value_len - 1] == ' ' || value[h->value_len - 1] == '\t')) {
+            h->value_len--;
+        }
+
+        status = hp_parse_header(req, data, h);
+        if (status != HP_PARSE_DONE) {
+            return status;
+        }
+        req->num_headers++;
+    }
+
+    /* Which of the two delimits the body is what request smuggling relies on */
+    if (req->has_encoding && req->has_length) {
+        return HP_PARSE_ERROR;
+    }
+    return HP_PARSE_DONE;
+}
+
+/*
+ Size of the header frame of a parsed request: the request line and the
+ headers, with the client address appended to an existing X-Forwarded-For
+ header or added as a new one. Same as hp_httpd_headers_measure
+ */
+size_t hp_request_frame_size(struct hp_request_t *req, size_t remote_host_len)
+{
+    size_t size;
+    int i;
+
+    /* "METHOD URI HTTP/1.1\r\n" */
+    size = req->method_len + 1 + req->uri_len + sizeof (" HTTP/1.1\r\n") - 1;
+
+    for (i = 0; i < req->num_headers; i++) {
+        /* "Key: Value\r\n" */
+        size += req->headers[i].key_len + 2 + req->headers[i].value_len + 2;
+    }
+
+    if (req->xff >= 0) {
+        /* ", remote_host" */
+        size += 2 + remote_host_len;
+    } else {
+        size += sizeof (HP_XFF_HEADER) - 1 + 2 + remote_host_len + 2;
+    }
+    return size;
+}
+
+#define HP_COPY(p_, s_, l_) { memcpy(p_, s_, l_); p_ += l_; }
+#define HP_COPY_LITERAL(p_, s_) HP_COPY(p_, s_, sizeof (s_) - 1)
+
+/*
+ Writes the header frame measured by hp_request_frame_size into p from the
+ head the request was parsed from. Returns pointer past the last byte written
+ */
+char *hp_request_frame_write(struct hp_request_t *req, const char *head, const char *remote_host, size_t remote_host_len, char *p)
+{
+    int i;
+
+    HP_COPY(p, head, req->method_len);
+    *(p++) = ' ';
+    HP_COPY(p, head + req->uri, req->uri_len);
+    HP_COPY_LITERAL(p, " HTTP/1.1\r\n");
+
+    for (i = 0; i < req->num_headers; i++) {
+        struct hp_request_header_t *h = &(req->headers[i]);
+
+        HP_COPY(p, head + h->key, h->key_len);
+        HP_COPY_LITERAL(p, ": ");
+        HP_COPY(p, head + h->value, h->value_len);
+
+        if (i == req->xff) {
+            HP_COPY_LITERAL(p, ", ");
+            HP_COPY(p, remote_host, remote_host_len);
+        }
+        HP_COPY_LITERAL(p, "\r\n");
+    }
+
+    if (req->xff < 0) {
+        HP_COPY_LITERAL(p, HP_XFF_HEADER ": ");
+        HP_COPY(p, remote_host, remote_host_len);
+        HP_COPY_LITERAL(p, "\r\n");
+    }
+    return p;
+}
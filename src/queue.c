@@ -0,0 +1,449 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Per-thread queue of messages the out socket couldn't take. Instead of
+ retrying zmq_send, the queue watches the ZMQ_FD of the socket and sends
+ the messages in order once the socket signals ZMQ_POLLOUT. The done
+ callback is called for each queued message so that the HTTP reply can be
+ deferred until the message has been handed to 0MQ. When the queue is full,
+ messages go to the spill journal, if there is one, and are replayed after
+ the queue has been sent.
+ */
+
+/* Publishes the state of the queue in the statistics segment */
+static void hp_queue_update_counters(struct hp_queue_t *queue)
+{
+    if (queue->counters) {
+        HP_ATOMIC_STORE(&(queue->counters->queue_messages), (uint64_t) queue->count);
+        HP_ATOMIC_STORE(&(queue->counters->queue_bytes), queue->bytes);
+    }
+}
+
+static void hp_queue_close_entry(struct hp_queue_entry_t *entry)
+{
+    int i;
+
+    for (i = entry->sent_parts; i < entry->num_parts; i++) {
+        zmq_msg_close(&(entry->parts[i]));
+    }
+    entry->sent_parts = entry->num_parts;
+}
+
+/*
+ Sends the remaining parts of the entry without blocking. On failure the
+ unsent parts are kept and 'errno' tells why
+ */
+static bool hp_queue_send_entry(struct hp_queue_t *queue, struct hp_queue_entry_t *entry)
+{
+    while (entry->sent_parts < entry->num_parts) {
+        int rc, flags = ZMQ_NOBLOCK;
+        uint64_t start = hp_now_ns();
+
+        if (entry->sent_parts < entry->num_parts - 1) {
+            flags |= ZMQ_SNDMORE;
+        }
+
+        rc = zmq_send(queue->socket, &(entry->parts[entry->sent_parts]), flags);
+
+        if (queue->send_latency) {
+            hp_histogram_record(queue->send_latency, hp_now_ns() - start);
+        }
+
+        if (rc != 0) {
+            return false;
+        }
+        zmq_msg_close(&(entry->parts[entry->sent_parts]));
+        entry->sent_parts++;
+    }
+
+    if (queue->counters) {
+        HP_COUNTER_ADD(queue->counters->bytes_out, entry->size);
+    }
+    return true;
+}
+
+/* Whether anything is waiting in the queue or the journal */
+static bool hp_queue_pending(struct hp_queue_t *queue)
+{
+    return (queue->count > 0 || (queue->journal && hp_journal_empty(queue->journal) == false));
+}
+
+/* Sends the oldest journal record, possibly in several attempts */
+static bool hp_queue_replay(struct hp_queue_t *queue)
+{
+    struct iovec parts[HP_MAX_PARTS];
+    int num_parts;
+    size_t size = 0;
+
+    if (hp_journal_peek(queue->journal, parts, &num_parts) == false) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    while (queue->replay_parts < num_parts) {
+        int flags = ZMQ_NOBLOCK;
+        uint64_t start = hp_now_ns();
+        bool sent;
+
+        if (queue->replay_parts < num_parts - 1) {
+            flags |= ZMQ_SNDMORE;
+        }
+
+        sent = hp_sendmsg(queue->socket, parts[queue->replay_parts].iov_base, parts[queue->replay_parts].iov_len, flags);
+
+        if (queue->send_latency) {
+            hp_histogram_record(queue->send_latency, hp_now_ns() - start);
+        }
+
+        if (!sent) {
+            return false;
+        }
+        queue->replay_parts++;
+    }
+
+    if (queue->counters) {
+        int i;
+
+        for (i = 0; i < num_parts; i++) {
+            size += parts[i].iov_len;
+        }
+        HP_COUNTER_ADD(queue->counters->bytes_out, size);
+    }
+
+    queue->replay_parts = 0;
+    hp_journal_consume(queue->journal);
+    return true;
+}
+
+static bool hp_queue_writable(struct hp_queue_t *queue)
+{
+    uint32_t events;
+    size_t events_size = sizeof (uint32_t);
+
+    /* Reading ZMQ_EVENTS also processes the pending commands of the socket */
+    if (zmq_getsockopt(queue->socket, ZMQ_EVENTS, &events, &events_size) != 0) {
+        return false;
+    }
+    return (events & ZMQ_POLLOUT);
+}
+
+/* Removes the head of the queue */
+static void hp_queue_complete(struct hp_queue_t *queue, bool sent)
+{
+    struct hp_queue_entry_t *entry = &(queue->entries[queue->head]);
+
+    hp_queue_close_entry(entry);
+
+    /* The slot is not reused before the callback returns */
+    if (queue->done) {
+        queue->done(entry, sent, queue->done_arg);
+    }
+
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    queue->bytes -= entry->size;
+}
+
+static void hp_queue_watch(struct hp_queue_t *queue, bool watch)
+{
+    if (watch && !queue->ev_pending) {
+        if (event_add(&(queue->ev), NULL) == 0) {
+            queue->ev_pending = true;
+        }
+    } else if (!watch && queue->ev_pending) {
+        event_del(&(queue->ev));
+        queue->ev_pending = false;
+    }
+}
+
+static void hp_queue_drain(struct hp_queue_t *queue)
+{
+    bool notify = false;
+
+    while (hp_queue_pending(queue) && hp_queue_writable(queue)) {
+        if (queue->count == 0) {
+            /* The queue is empty, continue with the journal */
+            if (hp_queue_replay(queue) == false) {
+                if (errno != EAGAIN) {
+                    HP_LOG_ERROR("Failed to replay journaled message: %s", zmq_strerror(errno));
+                }
+                break;
+            }
+        } else if (hp_queue_send_entry(queue, &(queue->entries[queue->head])) == true) {
+            hp_queue_complete(queue, true);
+        } else if (errno == EAGAIN) {
+            break;
+        } else {
+            HP_LOG_ERROR("Failed to send queued message: %s", zmq_strerror(errno));
+            hp_queue_complete(queue, false);
+        }
+    }
+
+    if (queue->idle_wanted && !hp_queue_pending(queue) && hp_queue_writable(queue)) {
+        queue->idle_wanted = false;
+        notify = true;
+    }
+
+    hp_queue_watch(queue, hp_queue_pending(queue) || queue->idle_wanted);
+    hp_queue_update_counters(queue);
+
+    /* Last, the callback may send and ask again */
+    if (notify && queue->idle) {
+        queue->idle(queue->idle_arg);
+    }
+}
+
+static void hp_queue_event_cb(int fd __unused, short event __unused, void *args)
+{
+    hp_queue_drain((struct hp_queue_t *) args);
+}
+
+bool hp_queue_init(struct hp_queue_t *queue, size_t size, struct event_base *base, void *socket, hp_queue_done_t done, void *done_arg)
+{
+    int fd;
+    size_t fd_size = sizeof (int);
+
+    memset(queue, 0, sizeof (struct hp_queue_t));
+
+    if (zmq_getsockopt(socket, ZMQ_FD, &fd, &fd_size) != 0) {
+        HP_LOG_ERROR("Failed to get the file descriptor of the socket: %s", zmq_strerror(errno));
+        return false;
+    }
+
+    /* A queue of size 0 is only useful with a journal */
+    queue->entries = calloc(size > 0 ? size : 1, sizeof (struct hp_queue_entry_t));
+    if (!queue->entries) {
+        return false;
+    }
+
+    queue->socket = socket;
+    queue->base = base;
+    queue->size = size;
+    queue->done = done;
+    queue->done_arg = done_arg;
+
+    /* The descriptor is edge-triggered: it becomes readable when the state of the socket changes */
+    event_set(&(queue->ev), fd, EV_READ | EV_PERSIST, hp_queue_event_cb, queue);
+    event_base_set(base, &(queue->ev));
+    return true;
+}
+
+/*
+ Sends the message parts or queues them if the socket is full. Messages are
+ sent straight away only when nothing is queued, which keeps them in order.
+ The parts are owned by the queue after the call, whatever the result. The
+ waiter, NULL if nobody waits, is copied into the entry of a queued message
+ */
+hp_queue_status_t hp_queue_send(struct hp_queue_t *queue, const struct hp_waiter_t *waiter, zmq_msg_t *parts, int num_parts)
+{
+    struct hp_queue_entry_t *entry;
+    int i;
+
+    assert(num_parts > 0 && num_parts <= HP_MAX_PARTS);
+
+    /* Once something is journaled, newer messages follow it there */
+    if (queue->journal && (queue->count == queue->size || hp_journal_empty(queue->journal) == false)) {
+        if (hp_journal_append(queue->journal, parts, num_parts, waiter) == false) {
+            if (errno != ENOSPC) {
+                HP_LOG_ERROR("Failed to journal message: %s", strerror(errno));
+            }
+            return HP_QUEUE_FULL;
+        }
+        hp_queue_watch(queue, true);
+        return HP_QUEUE_PENDING;
+    }
+
+    if (queue->count == queue->size) {
+        for (i = 0; i < num_parts; i++) {
+            zmq_msg_close(&(parts[i]));
+        }
+        return HP_QUEUE_FULL;
+    }
+
+    entry = &(queue->entries[(queue->head + queue->count) % queue->size]);
+
+    if (waiter) {
+        entry->waiter = *waiter;
+    } else {
+        memset(&(entry->waiter), 0, sizeof (struct hp_waiter_t));
+    }
+    entry->num_parts = num_parts;
+    entry->sent_parts = 0;
+    entry->size = 0;
+
+    for (i = 0; i < num_parts; i++) {
+        zmq_msg_init(&(entry->parts[i]));
+        zmq_msg_move(&(entry->parts[i]), &(parts[i]));
+        entry->size += zmq_msg_size(&(entry->parts[i]));
+    }
+
+    if (queue->count == 0) {
+        if (hp_queue_send_entry(queue, entry) == true) {
+            return HP_QUEUE_SENT;
+        }
+
+        if (errno != EAGAIN) {
+            int err = errno;
+            hp_queue_close_entry(entry);
+            errno = err;
+            return HP_QUEUE_ERROR;
+        }
+    }
+
+    queue->count++;
+    queue->bytes += entry->size;
+
+    hp_queue_watch(queue, true);
+    hp_queue_update_counters(queue);
+    return HP_QUEUE_PENDING;
+}
+
+/* Whether nothing is waiting and the socket can take a message */
+bool hp_queue_idle(struct hp_queue_t *queue)
+{
+    return (!hp_queue_pending(queue) && hp_queue_writable(queue));
+}
+
+/*
+ Asks for the idle callback to be called once the queue has been sent and
+ the socket is writable. It may be called before this returns
+ */
+void hp_queue_notify_idle(struct hp_queue_t *queue)
+{
+    queue->idle_wanted = true;
+    hp_queue_drain(queue);
+}
+
+/*
+ Spills to the journal when the queue is full. Anything recovered into the
+ journal is replayed as soon as the socket is writable
+ */
+void hp_queue_set_journal(struct hp_queue_t *queue, struct hp_journal_t *journal)
+{
+    queue->journal = journal;
+    hp_queue_drain(queue);
+}
+
+/*
+ Sends the rest of the queue and the journal to another socket. Fails while
+ a message is partly written to the current one, it has to be finished
+ there first
+ */
+bool hp_queue_set_socket(struct hp_queue_t *queue, void *socket)
+{
+    int fd;
+    size_t fd_size = sizeof (int);
+
+    if ((queue->count > 0 && queue->entries[queue->head].sent_parts > 0) || queue->replay_parts > 0) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    if (zmq_getsockopt(socket, ZMQ_FD, &fd, &fd_size) != 0) {
+        return false;
+    }
+
+    hp_queue_watch(queue, false);
+
+    queue->socket = socket;
+    event_set(&(queue->ev), fd, EV_READ | EV_PERSIST, hp_queue_event_cb, queue);
+    event_base_set(queue->base, &(queue->ev));
+
+    hp_queue_drain(queue);
+    return true;
+}
+
+/*
+ Marks the requests of a connection that is being closed as detached. Their
+ messages are still sent and the done callback still called, but nobody is
+ replied to
+ */
+void hp_queue_detach(struct hp_queue_t *queue, void *owner)
+{
+    size_t i;
+
+    for (i = 0; i < queue->count; i++) {
+        struct hp_queue_entry_t *entry = &(queue->entries[(queue->head + i) % queue->size]);
+
+        if (entry->waiter.owner == owner) {
+            entry->waiter.detached = true;
+        }
+    }
+
+    if (queue->journal) {
+        hp_journal_detach(queue->journal, owner);
+    }
+}
+
+void hp_queue_free(struct hp_queue_t *queue)
+{
+    if (!queue->entries) {
+        return;
+    }
+
+    /* Last chance for the queued messages */
+    hp_queue_drain(queue);
+
+    /* Keep the rest in the journal for the next run */
+    while (queue->journal && queue->count > 0 && queue->entries[queue->head].sent_parts == 0) {
+        struct hp_queue_entry_t *entry = &(queue->entries[queue->head]);
+        bool journaled;
+
+        /* The journal owns the parts after this */
+        journaled = hp_journal_append(queue->journal, entry->parts, entry->num_parts, &(entry->waiter));
+        entry->sent_parts = entry->num_parts;
+
+        if (!journaled) {
+            hp_queue_complete(queue, false);
+            continue;
+        }
+
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+        queue->bytes -= entry->size;
+    }
+
+    if (queue->count > 0) {
+        HP_LOG_WARN("Dropping %zu queued messages", queue->count);
+    }
+
+    while (queue->count > 0) {
+        hp_queue_complete(queue, false);
+    }
+
+    hp_queue_watch(queue, false);
+    hp_queue_update_counters(queue);
+
+    free(queue->entries);
+    queue->entries = NULL;
+}
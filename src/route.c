@@ -0,0 +1,263 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/*
+ Routing of publish requests by path prefix. The prefixes of the -r routes
+ are kept in a compressed trie built once at startup: every node holds the
+ bytes of the edge leading to it and the children of a node are adjacent in
+ one array, sorted by their first byte. A lookup walks the path once, so its
+ cost depends on the length of the path and not on the number of routes.
+ The trie is read-only after it has been built and shared by the threads.
+
+ With -K the messages are spread over the -z uris by a key taken from each
+ request. The shard of a key is picked with jump consistent hashing (Lamping
+ and Veach), which needs no ring in memory and moves only 1/n of the keys
+ when an n-th uri is added at the end of the list.
+ */
+
+struct hp_route_key_t {
+    const char *prefix;
+    size_t len;
+    int route;
+};
+
+static int hp_route_key_compare(const void *a, const void *b)
+{
+    const struct hp_route_key_t *x = (const struct hp_route_key_t *) a;
+    const struct hp_route_key_t *y = (const struct hp_route_key_t *) b;
+    int rc = memcmp(x->prefix, y->prefix, (x->len < y->len) ? x->len : y->len);
+
+    if (rc != 0) {
+        return rc;
+    }
+    return (x->len < y->len) ? -1 : (x->len > y->len);
+}
+
+/*
+ Fills in the children of 'node' from the sorted keys [lo, hi), which all
+ share their first 'depth' bytes
+ */
+static void hp_route_build_node(struct hp_route_trie_t *trie, struct hp_route_key_t *keys, size_t lo, size_t hi, size_t depth, uint32_t node)
+{
+    size_t i, next, child;
+
+    trie->nodes[node].route = -1;
+
+    /* The shortest key sorts first */
+    if (lo < hi && keys[lo].len == depth) {
+        trie->nodes[node].route = keys[lo].route;
+        lo++;
+    }
+
+    trie->nodes[node].first_child = (uint32_t) trie->num_nodes;
+    trie->nodes[node].num_children = 0;
+
+    for (i = lo; i < hi; i = next) {
+        for (next = i + 1; next < hi && keys[next].prefix[depth] == keys[i].prefix[depth]; next++);
+
+        trie->nodes[node].num_children++;
+        trie->num_nodes++;
+    }
+
+    child = trie->nodes[node].first_child;
+
+    for (i = lo; i < hi; i = next, child++) {
+        size_t lcp = depth + 1;
+
+        for (next = i + 1; next < hi && keys[next].prefix[depth] == keys[i].prefix[depth]; next++);
+
+        /* The first and the last key of a sorted group share the least */
+        while (lcp < keys[i].len && lcp < keys[next - 1].len && keys[i].prefix[lcp] == keys[next - 1].prefix[lcp]) {
+            lcp++;
+        }
+
+        trie->nodes[child].label = keys[i].prefix + depth;
+        trie->nodes[child].label_len = (uint32_t) (lcp - depth);
+
+        hp_route_build_node(trie, keys, i, next, lcp, (uint32_t) child);
+    }
+}
+
+/*
+ Builds the trie of the route prefixes. The prefixes must be unique and
+ must outlive the trie
+ */
+bool hp_route_trie_build(struct hp_route_trie_t *trie, struct hp_route_t *routes, size_t num_routes)
+{
+    struct hp_route_key_t *keys;
+    size_t i;
+
+    memset(trie, 0, sizeof (struct hp_route_trie_t));
+
+    keys = calloc(num_routes + 1, sizeof (struct hp_route_key_t));
+    if (!keys) {
+        return false;
+    }
+
+    /* Every key adds at most a leaf and splits at most one edge */
+    trie->nodes = calloc(2 * num_routes + 1, sizeof (struct hp_route_node_t));
+    if (!trie->nodes) {
+        free(keys);
+        return false;
+    }
+
+    for (i = 0; i < num_routes; i++) {
+        keys[i].prefix = routes[i].prefix;
+        keys[i].len = routes[i].prefix_len;
+        keys[i].route = (int) i;
+    }
+    qsort(keys, num_routes, sizeof (struct hp_route_key_t), hp_route_key_compare);
+
+    /* The root has an empty label */
+    trie->num_nodes = 1;
+    hp_route_build_node(trie, keys, 0, num_routes, 0, 0);
+
+    free(keys);
+    return true;
+}
+
+static struct hp_route_node_t *hp_route_child(struct hp_route_trie_t *trie, struct hp_route_node_t *node, unsigned char c)
+{
+    struct hp_route_node_t *children = &(trie->nodes[node->first_child]);
+    uint32_t lo = 0, hi = node->num_children;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        unsigned char first = (unsigned char) children[mid].label[0];
+
+        if (first == c) {
+            return &(children[mid]);
+        }
+
+        if (first < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/*
+ Returns the route with the longest prefix of 'path', -1 if no prefix
+ matches
+ */
+int hp_route_match(struct hp_route_trie_t *trie, const char *path, size_t len)
+{
+    struct hp_route_node_t *node;
+    size_t pos = 0;
+    int route;
+
+    if (trie->num_nodes == 0) {
+        return -1;
+    }
+
+    node = &(trie->nodes[0]);
+    route = node->route;
+
+    while (pos < len) {
+        struct hp_route_node_t *child = hp_route_child(trie, node, (unsigned char) path[pos]);
+
+        if (!child || len - pos < child->label_len || memcmp(path + pos, child->label, child->label_len)) {
+            break;
+        }
+
+        pos += child->label_len;
+        node = child;
+
+        if (node->route != -1) {
+            route = node->route;
+        }
+    }
+    return route;
+}
+
+void hp_route_trie_free(struct hp_route_trie_t *trie)
+{
+    free(trie->nodes);
+    trie->nodes = NULL;
+    trie->num_nodes = 0;
+}
+
+/* 64-bit FNV-1a */
+uint64_t hp_key_hash(const char *key, size_t key_len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Returns the shard of 'key', between 0 and num_shards - 1 */
+uint32_t hp_shard_pick(const char *key, size_t key_len, uint32_t num_shards)
+{
+    uint64_t hash = hp_key_hash(key, key_len);
+    int64_t b = -1, j = 0;
+
+    while (j < (int64_t) num_shards) {
+        b = j;
+        hash = hash * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31) / (double) ((hash >> 33) + 1)));
+    }
+    return (uint32_t) b;
+}
+
+/*
+ Finds the value of the query parameter 'name' in 'uri'. The value is not
+ decoded. Returns NULL if the parameter is not there
+ */
+const char *hp_query_find(const char *uri, size_t uri_len, const char *name, size_t name_len, size_t *value_len)
+{
+    const char *p = memchr(uri, '?', uri_len), *end = uri + uri_len;
+
+    if (!p) {
+        return NULL;
+    }
+
+    for (p++; p < end; ) {
+        const char *amp = memchr(p, '&', end - p);
+        const char *param_end = amp ? amp : end;
+
+        if ((size_t) (param_end - p) > name_len && p[name_len] == '=' && !memcmp(p, name, name_len)) {
+            const char *value = p + name_len + 1;
+
+            *value_len = param_end - value;
+            return value;
+        }
+        p = param_end + 1;
+    }
+    return NULL;
+}
@@ -31,10 +31,42 @@
 #include "httpush.h"
 
 extern sig_atomic_t shutting_down;
+extern sig_atomic_t reload_requested;
+
+/* Dedicated thread accepting connections in HP_LISTEN_ACCEPTOR mode */
+struct hp_acceptor_t {
+    pthread_t thread;
+
+    int fd;
+
+    struct hp_httpd_thread_t *threads;
+    int num_threads;
+
+    /* Threads that may be handed connections, the parent changes them as
+       the pool is resized. Held while handing a connection over so that a
+       thread is never written to after it has been taken out */
+    pthread_mutex_t lock;
+    bool *accepting;
+
+    /* Threads whose pipe was full while handing the current connection over */
+    bool *full;
+
+    volatile sig_atomic_t stop;
+};
 
 /* Start running the thread */
-static void *hp_httpd_thread_start(void *base) {
-    event_base_dispatch((struct event_base *) base);
+static void *hp_httpd_thread_start(void *args) {
+    struct hp_httpd_thread_t *thread = (struct hp_httpd_thread_t *) args;
+
+    /* Messages from the request path go through a ring, they are written by the log thread */
+    (void) hp_log_thread_start();
+
+    event_base_dispatch(thread->base);
+
+    hp_log_thread_stop();
+
+    /* The parent joins retired threads once they are done */
+    HP_ATOMIC_STORE(&(thread->finished), 1);
     return NULL;
 }
 
@@ -57,7 +89,7 @@ static bool hp_init_intercomm_event(struct hp_httpd_thread_t *thread) {
     return true;
 }
 
-static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_uris, int type, int mode) {
+static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_uris, int type, int mode, uint64_t affinity) {
     void *socket;
     int rc;
     size_t i;
@@ -68,6 +100,16 @@ static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_
         return NULL;
     }
 
+    /* Must be set before connecting to have any effect */
+    if (affinity) {
+        rc = zmq_setsockopt(socket, ZMQ_AFFINITY, (void *) &affinity, sizeof (uint64_t));
+        if (rc != 0) {
+            HP_LOG_ERROR("Failed to set affinity value: %s", zmq_strerror(errno));
+            (void) zmq_close(socket);
+            return NULL;
+        }
+    }
+
     for (i = 0; i < num_uris; i++) {
         rc = zmq_setsockopt(socket, ZMQ_HWM, (void *) &(uris[i]->hwm), sizeof (uint64_t));
         if (rc != 0) {
@@ -75,11 +117,18 @@ static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_
             return NULL;
         }
 
+#ifdef ZMQ_SWAP
         rc = zmq_setsockopt(socket, ZMQ_SWAP, (void *) &(uris[i]->swap), sizeof (int64_t));
         if (rc != 0) {
             HP_LOG_ERROR("Failed to set swap value: %s", zmq_strerror(errno));
             return NULL;
         }
+#else
+        /* Newer libzmq has no disk offload, the journal (-j) replaces it */
+        if (uris[i]->swap > 0) {
+            HP_LOG_WARN("Ignoring swap for %s, not supported by this libzmq", uris[i]->uri);
+        }
+#endif
 
         rc = zmq_setsockopt(socket, ZMQ_LINGER, (void *) &(uris[i]->linger), sizeof (int));
         if (rc != 0) {
@@ -88,7 +137,7 @@ static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_
         }
 
         HP_LOG_DEBUG("(%s) %s, swap=[%" PRIi64 "], hwm=[%" PRIu64 "], linger=[%d]",
-            (type == ZMQ_PUSH ? "connect" : "bind"), uris[i]->uri, uris[i]->swap, uris[i]->hwm, uris[i]->linger);
+            (mode == HP_CONNECT ? "connect" : "bind"), uris[i]->uri, uris[i]->swap, uris[i]->hwm, uris[i]->linger);
 
         /* Connect push sockets and bind all other sockets */
         if (mode == HP_CONNECT) {
@@ -98,98 +147,363 @@ static void *hp_create_socket(void *context, struct hp_uri_t **uris, size_t num_
         }
 
         if (rc != 0) {
+            int err = errno;
             (void) zmq_close(socket);
+            errno = err;
             return NULL;
         }
     }
     return socket;
 }
 
-static bool hp_handle_monitoring_command(void *monitor_socket, zmq_pollitem_t *t_items, int num_threads) {
-    int rc, i;
-    bool retval = false;
-    char identity[HP_IDENTITY_MAX];
-    size_t identity_size = HP_IDENTITY_MAX;
+/*
+ Binds the monitor or publisher socket. After an upgrade the old process
+ may still be releasing the endpoints, 0MQ closes sockets in the background
+ */
+static void *hp_create_bound_socket(void *context, struct hp_uri_t **uris, size_t num_uris, int type, bool upgrading) {
+    int tries = (upgrading ? HP_UPGRADE_BIND_TRIES : 1);
 
-    char message[8];
-    size_t message_size = 8;
+    while (true) {
+        void *socket = hp_create_socket(context, uris, num_uris, type, HP_BIND, 0);
 
-    HP_LOG_DEBUG("Message in monitoring socket");
+        if (socket || errno != EADDRINUSE || --tries <= 0) {
+            return socket;
+        }
+        usleep(HP_UPGRADE_BIND_USEC);
+    }
+}
+
+/* Route and shard sockets of each thread */
+static size_t hp_num_outputs(struct httpush_args_t *args) {
+    return args->num_routes + ((args->shard.source != HP_SHARD_NONE) ? args->num_uris : 0);
+}
 
-    if (hp_recvmsg_ident(monitor_socket, identity, &identity_size, message, &message_size) == true) {
+/*
+ Reads the counters of all threads from the statistics segment, including
+ those of retired threads
+ */
+static void hp_collect_counters(struct hp_server_t *server, struct hp_httpd_counters_t *sum, struct hp_httpd_counters_t *per_thread) {
+    int i;
 
-        struct evbuffer *evb;
+    memset(sum, 0, sizeof(struct hp_httpd_counters_t));
 
-        int retries = 0, received = 0;
-        struct hp_httpd_counters_t sum;
+    for (i = 0; i < server->used_threads; i++) {
+        hp_stats_read_counters(&per_thread[i], hp_stats_counters(&(server->stats), i));
+        hp_stats_sum_counters(sum, &per_thread[i]);
+    }
+}
+
+/* Replies to the "stats" command */
+static struct evbuffer *hp_monitor_stats(struct hp_server_t *server) {
+    int i, j;
+    size_t k, num_outputs = hp_num_outputs(server->args);
+    struct evbuffer *evb;
+    struct hp_httpd_counters_t sum, per_thread[server->num_threads];
+    struct hp_output_counters_t outputs[num_outputs + 1];
+    struct hp_histogram_t *latency;
+
+    /* The threads don't need to be involved, the counters are in shared memory */
+    hp_collect_counters(server, &sum, per_thread);
+
+    /* Merge the latency histograms of all threads */
+    latency = calloc(HP_LATENCY_MAX, sizeof (struct hp_histogram_t));
+    if (!latency) {
+        return NULL;
+    }
+
+    for (i = 0; i < server->used_threads; i++) {
+        for (j = 0; j < HP_LATENCY_MAX; j++) {
+            hp_histogram_merge(&latency[j], &(hp_stats_latency(&(server->stats), i)[j]));
+        }
+    }
+
+    /* Route and shard counters summed over the threads */
+    memset(outputs, 0, sizeof (outputs));
+
+    for (i = 0; i < server->used_threads; i++) {
+        for (k = 0; k < num_outputs; k++) {
+            struct hp_output_counters_t current;
+
+            hp_stats_read_output_counters(&current, hp_stats_output_counters(&(server->stats), i, k));
+            outputs[k].requests += current.requests;
+            outputs[k].messages += current.messages;
+            outputs[k].bytes    += current.bytes;
+            outputs[k].rejected += current.rejected;
+        }
+    }
+
+    /* The slots of retired threads are listed too, their counters stay in the totals */
+    evb = hp_counters_to_xml(&sum, per_thread, latency, server->running_threads, server->used_threads, server->args, outputs);
+    free(latency);
+    return evb;
+}
+
+/*
+ Sets up the stages between the httpd and the out socket. On failure the
+ stages set up so far are released by hp_thread_free_stages
+ */
+static bool hp_thread_init_stages(struct httpush_args_t *args, struct hp_httpd_thread_t *thread) {
+    hp_queue_done_t done = (thread->frontend ? hp_conn_queue_done : hp_httpd_queue_done);
+    size_t i;
 
-        if (message_size < 5 || memcmp(message, "stats", 5)) {
+    if (thread->compressing == true) {
+        if (hp_compressor_init(&(thread->compressor), &(args->compress)) == false) {
+            HP_LOG_ERROR("Failed to initialize the compressor of thread %d", thread->thread_id);
             return false;
         }
+        thread->compressor.latency = &(thread->latency[HP_LATENCY_COMPRESS]);
+    }
 
-        /* Send message to threads saying that they should return stats */
-        for (i = 0; i < num_threads; i++) {
-            if (hp_send_command(t_items[i].socket, HTTPD_STATS) == false) {
-                HP_LOG_WARN("Failed to request statistics from thread %d", i);
-            }
+    /* The shards replace the out socket */
+    if (thread->batching == true && thread->sharding == false) {
+        if (hp_batch_init(&(thread->batch), &(args->batch), thread->base, thread->out_socket) == false) {
+            return false;
         }
+        thread->batch.send_latency = &(thread->latency[HP_LATENCY_SEND]);
+        thread->batch.counters = thread->counters;
 
-        memset(&sum, 0, sizeof(struct hp_httpd_counters_t));
+        if (thread->compressing == true) {
+            thread->batch.compressor = &(thread->compressor);
+        }
+    }
 
-        while ((received < num_threads) && (retries < 5)) {
+    if (thread->queueing == true && thread->sharding == false) {
+        if (hp_queue_init(&(thread->queue), args->queue_size, thread->base, thread->out_socket, done, thread) == false) {
+            return false;
+        }
+        thread->queue.send_latency = &(thread->latency[HP_LATENCY_SEND]);
+        thread->queue.counters = thread->counters;
 
-            rc = zmq_poll(&t_items[0], num_threads, HP_SEC_TO_MSEC(1));
+        if (thread->streaming == true) {
+            thread->queue.idle = hp_conn_stream_idle;
+            thread->queue.idle_arg = thread;
+        }
+    }
 
-            if (rc < 0) {
-                shutting_down = 1;
-                break;
+    if (thread->acking == true) {
+        if (hp_ack_init(&(thread->ack), &(args->ack), thread->base, thread->out_socket,
+                (thread->frontend ? hp_conn_ack_done : hp_httpd_ack_done), thread) == false) {
+            HP_LOG_ERROR("Failed to initialize the acks of thread %d", thread->thread_id);
+            return false;
+        }
+        thread->ack.send_latency = &(thread->latency[HP_LATENCY_SEND]);
+        thread->ack.latency = &(thread->latency[HP_LATENCY_ACK]);
+        thread->ack.counters = thread->counters;
+    }
+
+    if (thread->journaling == true) {
+        if (hp_journal_open(&(thread->journal), args->journal_dir, thread->thread_id,
+                args->journal_segment_size, args->journal_max_size, thread->base) == false) {
+            HP_LOG_ERROR("Failed to open the journal of thread %d", thread->thread_id);
+            return false;
+        }
+        thread->journal.done = thread->queue.done;
+        thread->journal.done_arg = thread;
+        thread->journal.counters = thread->counters;
+
+        hp_queue_set_journal(&(thread->queue), &(thread->journal));
+    }
+
+    if (thread->access_logging == true) {
+        if (hp_access_open(&(thread->access_log), &(args->access), thread->thread_id) == false) {
+            HP_LOG_ERROR("Failed to open the access log of thread %d", thread->thread_id);
+            return false;
+        }
+    }
+
+    /* Routes and shards get the same stages, without the journal and streaming */
+    for (i = 0; i < thread->num_outputs; i++) {
+        struct hp_output_t *output = &(thread->outputs[i]);
+
+        if (thread->batching == true) {
+            if (hp_batch_init(&(output->batch), &(args->batch), thread->base, output->socket) == false) {
+                return false;
             }
+            output->batch.send_latency = &(thread->latency[HP_LATENCY_SEND]);
 
-            if (rc == 0) {
-                ++retries;
-                continue;
+            if (thread->compressing == true) {
+                output->batch.compressor = &(thread->compressor);
             }
+        }
 
-            for (i = 0; i < num_threads; i++) {
-
-                if (t_items[i].revents & ZMQ_POLLIN) {
-                    struct hp_httpd_counters_t *thread_counter = NULL;
-                    size_t msiz = sizeof (struct hp_httpd_counters_t);
-
-                    if (hp_recvmsg(t_items[i].socket, (void **) &thread_counter, &msiz, 0) == true) {
-
-                        if (msiz == sizeof (struct hp_httpd_counters_t)) {
-                            sum.code_200 += thread_counter->code_200;
-                            sum.code_404 += thread_counter->code_404;
-                            sum.code_412 += thread_counter->code_412;
-                            sum.code_503 += thread_counter->code_503;
-                            sum.requests += thread_counter->requests;
-                            ++received;
-                        }
-                        if (thread_counter)
-                            free(thread_counter);
-                    }
-                }
+        if (thread->queueing == true) {
+            if (hp_queue_init(&(output->queue), args->queue_size, thread->base, output->socket, done, thread) == false) {
+                return false;
             }
-            HP_LOG_DEBUG("received %d expecting %d", received, num_threads);
+            output->queue.send_latency = &(thread->latency[HP_LATENCY_SEND]);
+        }
+    }
+    return true;
+}
+
+/*
+ Sends out or journals whatever the stages still hold and releases them
+ */
+static void hp_thread_free_stages(struct hp_httpd_thread_t *thread) {
+    size_t i;
+
+    for (i = 0; i < thread->num_outputs; i++) {
+        if (thread->batching == true) {
+            hp_batch_free(&(thread->outputs[i].batch));
         }
 
-        evb = hp_counters_to_xml(&sum, received, num_threads);
-        if (!evb) {
+        if (thread->queueing == true) {
+            hp_queue_free(&(thread->outputs[i].queue));
+        }
+    }
+
+    if (thread->batching == true) {
+        hp_batch_free(&(thread->batch));
+    }
+
+    if (thread->queueing == true) {
+        hp_queue_free(&(thread->queue));
+    }
+
+    if (thread->acking == true) {
+        hp_ack_free(&(thread->ack));
+    }
+
+    if (thread->journaling == true) {
+        hp_journal_close(&(thread->journal));
+    }
+
+    /* After the stages, which may still answer requests */
+    if (thread->access_logging == true) {
+        hp_access_close(&(thread->access_log));
+    }
+
+    if (thread->compressing == true) {
+        hp_compressor_free(&(thread->compressor));
+    }
+}
+
+/*
+ Creates a socket for each route of the thread, connected to the uris of the
+ route, and with -K one for each -z uri
+ */
+static bool hp_thread_init_outputs(struct httpush_args_t *args, struct hp_stats_t *stats, struct hp_httpd_thread_t *thread, void *ctx, uint64_t affinity) {
+    size_t i, num_outputs = hp_num_outputs(args);
+
+    if (num_outputs == 0) {
+        return true;
+    }
+
+    thread->outputs = calloc(num_outputs, sizeof (struct hp_output_t));
+    if (!thread->outputs) {
+        return false;
+    }
+    thread->route_trie = &(args->route_trie);
+    thread->num_routes = args->num_routes;
+
+    if (thread->sharding == true) {
+        thread->shards = &(thread->outputs[args->num_routes]);
+        thread->num_shards = args->num_uris;
+    }
+
+    for (i = 0; i < num_outputs; i++) {
+        struct hp_output_t *output = &(thread->outputs[i]);
+
+        output->counters = hp_stats_output_counters(stats, thread->thread_id, i);
+
+        if (i < args->num_routes) {
+            output->socket = hp_create_socket(ctx, args->routes[i].uris, args->routes[i].num_uris, ZMQ_PUSH, HP_CONNECT, affinity);
+        } else {
+            output->socket = hp_create_socket(ctx, &(args->uris[i - args->num_routes]), 1, ZMQ_PUSH, HP_CONNECT, affinity);
+        }
+
+        if (!output->socket) {
+            if (i < args->num_routes) {
+                HP_LOG_ERROR("Failed to create socket of route %s for thread id %d", args->routes[i].prefix, thread->thread_id);
+            } else {
+                HP_LOG_ERROR("Failed to create socket of shard %zu for thread id %d", i - args->num_routes, thread->thread_id);
+            }
             return false;
         }
+        thread->num_outputs++;
+    }
+    return true;
+}
 
-        retval = hp_sendmsg_ident(monitor_socket, identity, identity_size, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb));
-        evbuffer_free(evb);
+/* Closes the out socket and the route and shard sockets of a thread */
+static bool hp_thread_close_sockets(struct hp_httpd_thread_t *thread) {
+    bool success = true;
+    size_t i;
+
+    for (i = 0; i < thread->num_outputs; i++) {
+        if (zmq_close(thread->outputs[i].socket) != 0) {
+            success = false;
+        }
     }
-    return retval;
+    free(thread->outputs);
+    thread->outputs = NULL;
+    thread->num_outputs = 0;
+
+    if (thread->out_socket && zmq_close(thread->out_socket) != 0) {
+        success = false;
+    }
+    thread->out_socket = NULL;
+
+    /* Reloaded sockets the thread never switched to */
+    if (thread->next_socket && zmq_close(thread->next_socket) != 0) {
+        success = false;
+    }
+    thread->next_socket = NULL;
+
+    if (thread->reload_socket && zmq_close(thread->reload_socket) != 0) {
+        success = false;
+    }
+    thread->reload_socket = NULL;
+    return success;
+}
+
+/* Releases what a thread used once it has been joined */
+static bool hp_free_thread(struct hp_httpd_thread_t *thread) {
+    bool success = true;
+
+    /* Send out whatever is left in the batch or the queue */
+    if (thread->frontend == true) {
+        hp_conn_free_all(thread);
+    }
+    hp_thread_free_stages(thread);
+
+    if (thread->switch_pending == true) {
+        event_del(&(thread->switch_ev));
+        thread->switch_pending = false;
+    }
+
+    /* httpd related things */
+    evhttp_free(thread->httpd);
+    event_base_free(thread->base);
+
+    if (thread->handoff[0] != -1) {
+        (void) close(thread->handoff[0]);
+        (void) close(thread->handoff[1]);
+        thread->handoff[0] = thread->handoff[1] = -1;
+    }
+
+    if (hp_close_pair(&(thread->intercomm)) == false) {
+        HP_LOG_ERROR("Failed to close thread %d intercomm", thread->thread_id);
+        success = false;
+    }
+
+    if (hp_thread_close_sockets(thread) == false) {
+        HP_LOG_ERROR("Failed to close thread id %d out sockets", thread->thread_id);
+        success = false;
+    }
+    return success;
 }
 
+/* Stops the running and retiring threads among the slots */
 static bool hp_free_threads(struct hp_httpd_thread_t *threads, int num_threads) {
-    int i, rc;
+    int i;
     bool success = true;
 
     for (i = 0; i < num_threads; i++) {
+        if (threads[i].state == HP_THREAD_UNUSED) {
+            continue;
+        }
+
         if (hp_send_command(threads[i].intercomm.front, HTTPD_SHUTDOWN) == false) {
             HP_LOG_ERROR("Failed to request thread id %d to terminate: %s", threads[i].thread_id, zmq_strerror(errno));
             success = false;
@@ -202,74 +516,204 @@ static bool hp_free_threads(struct hp_httpd_thread_t *threads, int num_threads)
             continue;
         }
 
-        /* httpd related things */
-        evhttp_free(threads[i].httpd);
-        event_base_free(threads[i].base);
-
-        if (hp_close_pair(&(threads[i].intercomm)) == false) {
-            HP_LOG_ERROR("Failed to close thread %d intercomm", threads[i].thread_id);
+        if (hp_free_thread(&(threads[i])) == false) {
             success = false;
         }
+        threads[i].state = HP_THREAD_UNUSED;
+    }
+    return success;
+}
 
-        rc = zmq_close(threads[i].out_socket);
-        if (rc != 0) {
-            HP_LOG_ERROR("Failed to close thread id %d intercomm out socket", threads[i].thread_id);
-            success = false;
+/*
+ The thread with the least open connections gets the next one, skipping the
+ ones whose pipe is full. NULL if no thread takes connections. Called with
+ the lock held
+ */
+static struct hp_httpd_thread_t *hp_acceptor_pick_thread(struct hp_acceptor_t *acceptor) {
+    int i;
+    struct hp_httpd_thread_t *least = NULL;
+    int64_t least_connections = 0;
+
+    for (i = 0; i < acceptor->num_threads; i++) {
+        int64_t connections;
+
+        if (acceptor->accepting[i] == false || acceptor->full[i] == true) {
+            continue;
+        }
+        connections = HP_ATOMIC_LOAD(&(acceptor->threads[i].connections));
+
+        if (!least || connections < least_connections) {
+            least = &(acceptor->threads[i]);
+            least_connections = connections;
         }
     }
-    return success;
+    return least;
 }
 
-static int hp_run_parent_loop(void *monitor_socket, struct hp_httpd_thread_t *threads, int num_threads) {
-    int i, rc, retval = 0;
-    zmq_pollitem_t m_items[1];
-    zmq_pollitem_t t_items[num_threads];
+/*
+ Hands a connection over to one of the threads, or closes it. The pipes
+ don't block: a thread that stopped reading its pipe is passed over for the
+ next least loaded one instead of holding up the accepts of all threads
+ */
+static void hp_acceptor_dispatch(struct hp_acceptor_t *acceptor, struct hp_handoff_t *handoff) {
+    struct hp_httpd_thread_t *thread;
+    bool handed = false;
 
-    m_items[0].socket = monitor_socket;
-    m_items[0].fd = 0;
-    m_items[0].events = ZMQ_POLLIN;
-    m_items[0].revents = 0;
+    pthread_mutex_lock(&(acceptor->lock));
 
-    for (i = 0; i < num_threads; i++) {
-        t_items[i].socket = threads[i].intercomm.front;
-        t_items[i].fd = 0;
-        t_items[i].events = ZMQ_POLLIN;
-        t_items[i].revents = 0;
+    memset(acceptor->full, 0, acceptor->num_threads * sizeof (bool));
+
+    /* Writes smaller than PIPE_BUF are atomic */
+    while (!handed && (thread = hp_acceptor_pick_thread(acceptor)) != NULL) {
+        handed = (write(thread->handoff[1], handoff, sizeof (*handoff)) == sizeof (*handoff));
+
+        if (!handed) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                HP_LOG_WARN("failed to hand connection over to thread %d: %s", thread->thread_id, strerror(errno));
+            }
+            acceptor->full[thread - acceptor->threads] = true;
+        }
     }
+    pthread_mutex_unlock(&(acceptor->lock));
 
-    while (!shutting_down) {
-        /* Poll the monitor socket for incoming events */
-        rc = zmq_poll(&m_items[0], 1, -1);
+    if (!handed) {
+        HP_LOG_WARN("no httpd thread could take the connection, closing it");
+        (void) close(handoff->fd);
+    }
+}
 
-        if (rc < 0) {
-            HP_LOG_WARN("Shutting down: %s", zmq_strerror(errno));
-            break;
+/* Starts or stops handing connections to a thread */
+static void hp_acceptor_set_accepting(struct hp_acceptor_t *acceptor, int thread_id, bool accepting) {
+    pthread_mutex_lock(&(acceptor->lock));
+    acceptor->accepting[thread_id] = accepting;
+    pthread_mutex_unlock(&(acceptor->lock));
+}
+
+/*
+ Connections handed to a retired thread after it last read its pipe go to
+ the threads still running
+ */
+static void hp_acceptor_rehome(struct hp_acceptor_t *acceptor, struct hp_httpd_thread_t *thread) {
+    struct hp_handoff_t handoff;
+
+    while (read(thread->handoff[0], &handoff, sizeof (handoff)) == sizeof (handoff)) {
+        hp_acceptor_dispatch(acceptor, &handoff);
+    }
+}
+
+static void *hp_acceptor_start(void *args) {
+    struct hp_acceptor_t *acceptor = (struct hp_acceptor_t *) args;
+    struct pollfd pfd;
+
+    pfd.fd = acceptor->fd;
+    pfd.events = POLLIN;
+
+    while (!acceptor->stop) {
+        struct hp_handoff_t handoff;
+        int rc;
+
+        /* Wake up periodically to check whether to stop */
+        rc = poll(&pfd, 1, 250);
+        if (rc <= 0) {
+            continue;
         }
 
-        if (rc > 0 && (m_items[0].revents & ZMQ_POLLIN)) {
-            /* Handle command coming in from monitoring socket */
-            if (hp_handle_monitoring_command(monitor_socket, &t_items[0], num_threads) == false) {
-                HP_LOG_WARN("monitoring command failed");
+        handoff.addr_len = sizeof (handoff.addr);
+        handoff.fd = accept(acceptor->fd, (struct sockaddr *) &(handoff.addr), &(handoff.addr_len));
+
+        if (handoff.fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                HP_LOG_WARN("acceptor failed to accept: %s", strerror(errno));
             }
+            continue;
+        }
+
+        if (evutil_make_socket_nonblocking(handoff.fd) != 0) {
+            (void) close(handoff.fd);
+            continue;
         }
+        hp_acceptor_dispatch(acceptor, &handoff);
     }
+    return NULL;
+}
 
-    if (hp_free_threads(threads, num_threads) == false) {
-        HP_LOG_ERROR("Thread termination failed. The process is likely to hang");
-        retval = 1;
+/* The first running_threads of the num_threads slots take connections */
+static bool hp_acceptor_init(struct hp_acceptor_t *acceptor, int fd, struct hp_httpd_thread_t *threads, int num_threads, int running_threads) {
+    int i;
+
+    acceptor->fd = fd;
+    acceptor->threads = threads;
+    acceptor->num_threads = num_threads;
+    acceptor->stop = 0;
+
+    acceptor->accepting = calloc(num_threads, sizeof (bool));
+    acceptor->full = calloc(num_threads, sizeof (bool));
+
+    if (!acceptor->accepting || !acceptor->full) {
+        free(acceptor->accepting);
+        free(acceptor->full);
+        return false;
     }
 
-    rc = zmq_close(monitor_socket);
-    if (rc != 0) {
-        HP_LOG_ERROR("Failed to close monitor socket. The process is likely to hang");
-        retval = 1;
+    for (i = 0; i < running_threads; i++) {
+        acceptor->accepting[i] = true;
     }
-    return retval;
+
+    if (pthread_mutex_init(&(acceptor->lock), NULL)) {
+        free(acceptor->accepting);
+        free(acceptor->full);
+        return false;
+    }
+
+    if (pthread_create(&(acceptor->thread), NULL, hp_acceptor_start, acceptor)) {
+        HP_LOG_ERROR("Failed to launch acceptor thread");
+        (void) pthread_mutex_destroy(&(acceptor->lock));
+        free(acceptor->accepting);
+        free(acceptor->full);
+        return false;
+    }
+    return true;
 }
 
-static bool hp_thread_init_events(struct hp_httpd_thread_t *thread, int fd) {
-    int rc;
+static void hp_acceptor_free(struct hp_acceptor_t *acceptor) {
+    acceptor->stop = 1;
+
+    if (pthread_join(acceptor->thread, NULL)) {
+        HP_LOG_ERROR("Failed to join acceptor thread: %s", strerror(errno));
+    }
+    (void) pthread_mutex_destroy(&(acceptor->lock));
+    free(acceptor->accepting);
+    free(acceptor->full);
+}
+
+static bool hp_thread_init_accept(struct hp_httpd_thread_t *thread) {
+    if (thread->listen_fd != -1 && thread->frontend == false) {
+        return hp_httpd_accept_socket(thread);
+    }
+
+    if (thread->listen_fd != -1) {
+        event_set(&(thread->accept_ev), thread->listen_fd, EV_READ | EV_PERSIST, hp_httpd_accept_cb, thread);
+        event_base_set(thread->base, &(thread->accept_ev));
+        return (event_add(&(thread->accept_ev), NULL) == 0);
+    }
+
+    /* Connections are handed over by the acceptor thread */
+    if (pipe(thread->handoff) != 0) {
+        thread->handoff[0] = thread->handoff[1] = -1;
+        return false;
+    }
+
+    /* The acceptor moves on to another thread when the pipe is full */
+    if (evutil_make_socket_nonblocking(thread->handoff[0]) != 0 || evutil_make_socket_nonblocking(thread->handoff[1]) != 0) {
+        return false;
+    }
+
+    event_set(&(thread->handoff_ev), thread->handoff[0], EV_READ | EV_PERSIST, hp_httpd_handoff_cb, thread);
+    event_base_set(thread->base, &(thread->handoff_ev));
+    return (event_add(&(thread->handoff_ev), NULL) == 0);
+}
 
+static bool hp_thread_init_events(struct httpush_args_t *args, struct hp_httpd_thread_t *thread) {
     /* libevent */
     thread->base = event_init();
     if (!thread->base)
@@ -285,11 +729,25 @@ static bool hp_thread_init_events(struct hp_httpd_thread_t *thread, int fd) {
 #ifdef DEBUG
     evhttp_set_cb(thread->httpd, "/reflect", hp_httpd_reflect_request, thread);
 #endif
+    evhttp_set_cb(thread->httpd, HP_BATCH_PATH, hp_httpd_publish_batch, thread);
+
     /* Catch all */
     evhttp_set_gencb(thread->httpd, hp_httpd_publish_message, thread);
 
-    rc = evhttp_accept_socket(thread->httpd, fd);
-    if (rc != 0) {
+    if (hp_thread_init_stages(args, thread) == false) {
+        hp_thread_free_stages(thread);
+        evhttp_free(thread->httpd);
+        event_base_free(thread->base);
+        return false;
+    }
+
+    if (hp_thread_init_accept(thread) == false) {
+        hp_thread_free_stages(thread);
+        if (thread->handoff[0] != -1) {
+            (void) close(thread->handoff[0]);
+            (void) close(thread->handoff[1]);
+            thread->handoff[0] = thread->handoff[1] = -1;
+        }
         evhttp_free(thread->httpd);
         event_base_free(thread->base);
         return false;
@@ -297,6 +755,7 @@ static bool hp_thread_init_events(struct hp_httpd_thread_t *thread, int fd) {
 
     /* Start listening on intercomm */
     if (hp_init_intercomm_event(thread) == false) {
+        hp_thread_free_stages(thread);
         evhttp_free(thread->httpd);
         event_base_free(thread->base);
         return false;
@@ -305,47 +764,143 @@ static bool hp_thread_init_events(struct hp_httpd_thread_t *thread, int fd) {
 }
 
 /*
- Returns the number of threads successfully initialized
-
+ Sets up the sockets and event loop of slot i and starts its thread
  */
-static int hp_init_threads(struct httpush_args_t *args, struct hp_httpd_thread_t *threads, int num_threads) {
-    int i, initialized = 0;
-
-    /* Run a loop an initialize sockets */
-    for (i = 0; i < num_threads; i++) {
+static bool hp_init_thread(struct httpush_args_t *args, struct hp_stats_t *stats, struct hp_dedup_t *dedup, struct hp_httpd_thread_t *thread, int i) {
+    void *out_ctx = args->ctx;
+    uint64_t affinity = 0;
+    pthread_attr_t attr;
+
+    /* init, a retired thread's slot is reused with its counters */
+    memset(thread, 0, sizeof (struct hp_httpd_thread_t));
+
+    thread->thread_id = i;
+    thread->counters = hp_stats_counters(stats, i);
+    thread->latency = hp_stats_latency(stats, i);
+    thread->include_headers = args->include_headers;
+    thread->compressing = (args->compress.codec != HP_CODEC_NONE);
+    thread->batching = (args->batch.max_messages > 0);
+    thread->streaming = (args->stream.threshold > 0);
+    thread->frontend = (args->frontend || thread->streaming);
+    thread->stream = args->stream;
+    thread->sharding = (args->shard.source != HP_SHARD_NONE);
+    thread->shard = args->shard;
+    thread->acking = (args->ack.max_inflight > 0);
+    thread->dedup = dedup;
+    TAILQ_INIT(&(thread->conns));
+    TAILQ_INIT(&(thread->stream_waiters));
+
+    /* Streaming takes the socket from the queue for the duration of a body. With -k
+       the acks watch the socket instead of the queue */
+    thread->queueing = (thread->batching == false && thread->acking == false && (args->queue_size > 0 || args->journal_dir != NULL || thread->streaming));
+    thread->journaling = (thread->queueing == true && args->journal_dir != NULL);
+    thread->access_logging = (args->access.dir != NULL);
+    thread->handoff[0] = thread->handoff[1] = -1;
+
+    switch (args->listen_mode) {
+        case HP_LISTEN_SHARED:
+            thread->listen_fd = args->fds[0];
+        break;
+
+        case HP_LISTEN_REUSEPORT:
+            thread->listen_fd = args->fds[i];
+        break;
+
+        case HP_LISTEN_ACCEPTOR:
+            thread->listen_fd = -1;
+        break;
+    }
 
-        /* init */
-        memset(&(threads[i]), 0, sizeof (struct hp_httpd_thread_t));
+    /* Placement of the thread */
+    thread->cpu = (args->num_cpus > 0) ? args->cpus[i % args->num_cpus] : -1;
+    thread->numa_node = 0;
 
-        threads[i].thread_id = i;
-        threads[i].include_headers = args->include_headers;
+    if (args->node_ctx) {
+        thread->numa_node = (thread->cpu != -1) ? hp_numa_cpu_node(thread->cpu) : (i % args->num_nodes);
 
-        /* init outgoing socket */
-        threads[i].out_socket = hp_create_socket(args->ctx, args->uris, args->num_uris, ZMQ_PUSH, HP_CONNECT);
-        if (!threads[i].out_socket) {
-            HP_LOG_ERROR("Failed to create out_socket for thread id %d", i);
-            break;
+        if (thread->numa_node >= args->num_nodes) {
+            thread->numa_node = 0;
         }
+        out_ctx = args->node_ctx[thread->numa_node];
+    }
 
-        /* A pair socket to communicate with the master */
-        if (hp_create_pair(args->ctx, &(threads[i].intercomm), i) == false) {
-            HP_LOG_ERROR("Failed to create pair for thread id %d", i);
-            (void) zmq_close(threads[i].out_socket);
-            break;
-        }
+    if (args->num_io_affinity > 0) {
+        affinity = ((uint64_t) 1) << args->io_affinity[i % args->num_io_affinity];
+    }
 
-        if (hp_thread_init_events(&(threads[i]), args->fd) == false) {
-            HP_LOG_ERROR("Failed to create init event loop for thread %d", i);
-            (void) zmq_close(threads[i].out_socket);
-            (void) hp_close_pair(&(threads[i].intercomm));
-            break;
+    /* A reload creates the new out socket the same way */
+    thread->out_ctx = out_ctx;
+    thread->affinity = affinity;
+
+    /* init outgoing socket, the shards take its place with -K. The acks come back on a DEALER */
+    if (thread->sharding == false) {
+        thread->out_socket = hp_create_socket(out_ctx, args->uris, args->num_uris, (thread->acking ? ZMQ_XREQ : ZMQ_PUSH),
+                                            HP_CONNECT, affinity);
+        if (!thread->out_socket) {
+            HP_LOG_ERROR("Failed to create out_socket for thread id %d", i);
+            return false;
         }
+    }
+
+    if (hp_thread_init_outputs(args, stats, thread, out_ctx, affinity) == false) {
+        (void) hp_thread_close_sockets(thread);
+        return false;
+    }
+
+    /* A pair socket to communicate with the master */
+    if (hp_create_pair(args->ctx, &(thread->intercomm), i) == false) {
+        HP_LOG_ERROR("Failed to create pair for thread id %d", i);
+        (void) hp_thread_close_sockets(thread);
+        return false;
+    }
+
+    if (hp_thread_init_events(args, thread) == false) {
+        HP_LOG_ERROR("Failed to create init event loop for thread %d", i);
+        (void) hp_thread_close_sockets(thread);
+        (void) hp_close_pair(&(thread->intercomm));
+        return false;
+    }
+
+    /* Start the thread */
+    pthread_attr_init(&attr);
+
+    if (thread->cpu != -1 && hp_thread_attr_cpu(&attr, thread->cpu) == false) {
+        HP_LOG_ERROR("Failed to pin thread id %d to cpu %d", i, thread->cpu);
+        pthread_attr_destroy(&attr);
+        evhttp_free(thread->httpd);
+        event_base_free(thread->base);
+        (void) hp_thread_close_sockets(thread);
+        (void) hp_close_pair(&(thread->intercomm));
+        return false;
+    }
 
-        /* Start the thread */
-        if (pthread_create(&(threads[i].thread), NULL, hp_httpd_thread_start, threads[i].base)) {
-            HP_LOG_ERROR("Failed to create launch thread id %d", i);
-            (void) zmq_close(threads[i].out_socket);
-            (void) hp_close_pair(&(threads[i].intercomm));
+    if (pthread_create(&(thread->thread), &attr, hp_httpd_thread_start, thread)) {
+        HP_LOG_ERROR("Failed to create launch thread id %d", i);
+        pthread_attr_destroy(&attr);
+        (void) hp_thread_close_sockets(thread);
+        (void) hp_close_pair(&(thread->intercomm));
+        return false;
+    }
+    pthread_attr_destroy(&attr);
+
+
+    HP_LOG_DEBUG("thread id %d: cpu=[%d], numa node=[%d], io affinity=[%" PRIu64 "]",
+        i, thread->cpu, thread->numa_node, affinity);
+
+    thread->state = HP_THREAD_RUNNING;
+    return true;
+}
+
+/*
+ Returns the number of threads successfully initialized
+
+ */
+static int hp_init_threads(struct httpush_args_t *args, struct hp_stats_t *stats, struct hp_dedup_t *dedup, struct hp_httpd_thread_t *threads, int num_threads) {
+    int i, initialized = 0;
+
+    /* Run a loop an initialize sockets */
+    for (i = 0; i < num_threads; i++) {
+        if (hp_init_thread(args, stats, dedup, &(threads[i]), i) == false) {
             break;
         }
         ++initialized;
@@ -355,30 +910,666 @@ static int hp_init_threads(struct httpush_args_t *args, struct hp_httpd_thread_t
     return initialized;
 }
 
+/* Asks a running thread to finish its connections and exit */
+static bool hp_retire_thread(struct hp_server_t *server, struct hp_httpd_thread_t *thread) {
+    int i = thread->thread_id;
+
+    if (server->acceptor) {
+        hp_acceptor_set_accepting(server->acceptor, i, false);
+    }
+
+    if (hp_send_command(thread->intercomm.front, HTTPD_RETIRE) == false) {
+        HP_LOG_ERROR("Failed to request thread id %d to retire: %s", i, zmq_strerror(errno));
+
+        if (server->acceptor) {
+            hp_acceptor_set_accepting(server->acceptor, i, true);
+        }
+        return false;
+    }
+    thread->state = HP_THREAD_RETIRING;
+    server->running_threads--;
+    server->retiring_threads++;
+    HP_LOG_INFO("Retiring thread id %d", i);
+    return true;
+}
+
+/*
+ Starts threads in the free slots or retires the last running ones until
+ running_threads threads are running. Retiring threads stop taking
+ connections right away and exit once their open ones are done
+ */
+static bool hp_resize_threads(struct hp_server_t *server, int running_threads) {
+    struct httpush_args_t *args = server->args;
+    bool success = true;
+    int i;
+
+    /* Each thread has its own listen socket, the kernel would keep queueing
+       connections on the sockets of retired threads */
+    if (args->listen_mode == HP_LISTEN_REUSEPORT) {
+        HP_LOG_WARN("The threads can't be resized with -a reuseport");
+        return false;
+    }
+
+    for (i = 0; i < server->num_threads && server->running_threads < running_threads; i++) {
+        struct hp_httpd_thread_t *thread = &(server->threads[i]);
+
+        if (thread->state != HP_THREAD_UNUSED) {
+            continue;
+        }
+
+        if (hp_init_thread(args, &(server->stats), server->dedup, thread, i) == false) {
+            HP_LOG_ERROR("Failed to start thread id %d", i);
+            success = false;
+            break;
+        }
+
+        if (server->acceptor) {
+            hp_acceptor_set_accepting(server->acceptor, i, true);
+        }
+        server->running_threads++;
+
+        if (i >= server->used_threads) {
+            server->used_threads = i + 1;
+        }
+        HP_LOG_INFO("Started thread id %d", i);
+    }
+
+    /* Slots taken by threads that are still retiring can't be reused yet */
+    if (server->running_threads < running_threads) {
+        success = false;
+    }
+
+    for (i = server->num_threads - 1; i >= 0 && server->running_threads > running_threads; i--) {
+        if (server->threads[i].state != HP_THREAD_RUNNING) {
+            continue;
+        }
+
+        if (hp_retire_thread(server, &(server->threads[i])) == false) {
+            success = false;
+            break;
+        }
+    }
+
+    hp_stats_set_threads(&(server->stats), server->running_threads, server->used_threads);
+    return success;
+}
+
+/* Joins the retiring threads that have finished and frees their slots */
+static void hp_reap_threads(struct hp_server_t *server) {
+    int i;
+
+    for (i = 0; i < server->num_threads; i++) {
+        struct hp_httpd_thread_t *thread = &(server->threads[i]);
+
+        if (thread->state != HP_THREAD_RETIRING || !HP_ATOMIC_LOAD(&(thread->finished))) {
+            continue;
+        }
+
+        if (pthread_join(thread->thread, NULL)) {
+            HP_LOG_ERROR("Failed to join thread id %d: %s", i, strerror(errno));
+            continue;
+        }
+
+        if (server->acceptor) {
+            hp_acceptor_rehome(server->acceptor, thread);
+        }
+
+        if (hp_free_thread(thread) == false) {
+            HP_LOG_WARN("Failed to release thread id %d", i);
+        }
+        thread->state = HP_THREAD_UNUSED;
+        server->retiring_threads--;
+        HP_LOG_INFO("Thread id %d retired", i);
+    }
+}
+
+/* Replies to the "threads" command, which resizes the pool if given a number */
+static struct evbuffer *hp_monitor_threads(struct hp_server_t *server, const char *message, size_t message_size) {
+    struct evbuffer *evb;
+    bool success = true;
+
+    if (message_size > 0) {
+        char value[16];
+        char *end;
+        long running_threads;
+
+        if (message_size >= sizeof (value)) {
+            return NULL;
+        }
+        memcpy(value, message, message_size);
+        value[message_size] = '\0';
+
+        errno = 0;
+        running_threads = strtol(value, &end, 10);
+
+        if (errno || end == value || *end != '\0') {
+            return NULL;
+        }
+
+        if (running_threads < 1 || running_threads > server->num_threads) {
+            HP_LOG_WARN("Number of threads must be between 1 and %d, see -T", server->num_threads);
+            success = false;
+        } else {
+            success = hp_resize_threads(server, (int) running_threads);
+        }
+    }
+
+    evb = evbuffer_new();
+    if (!evb) {
+        return NULL;
+    }
+
+    evbuffer_add_printf(evb, "<?xml version=\"1.0\"?>\n");
+    evbuffer_add_printf(evb, "<httpush>\n");
+    evbuffer_add_printf(evb, "  <threads success=\"%s\" running=\"%d\" retiring=\"%d\" max=\"%d\" />\n",
+                        (success ? "true" : "false"), server->running_threads, server->retiring_threads, server->num_threads);
+    evbuffer_add_printf(evb, "</httpush>\n");
+    return evb;
+}
+
+/*
+ Connects the running threads to another set of -z uris. Without 'dsn' the
+ -F file is read again, or the current uris are reconnected to. Each thread
+ switches to its new socket between messages, the old socket delivers what
+ was sent on it before going away
+ */
+static bool hp_reload_uris(struct hp_server_t *server, const char *dsn) {
+    struct httpush_args_t *args = server->args;
+    struct hp_uri_t **uris = args->uris;
+    size_t num_uris = args->num_uris;
+    void *sockets[server->num_threads];
+    char *file_dsn = NULL;
+    bool success = true;
+    int i;
+
+    /* The shards map the keys to the uris by position */
+    if (args->shard.source != HP_SHARD_NONE) {
+        HP_LOG_WARN("The -z uris can't be reloaded with -K");
+        return false;
+    }
+
+    if (!dsn && args->uri_file) {
+        file_dsn = hp_read_uri_file(args->uri_file);
+        if (!file_dsn) {
+            HP_LOG_ERROR("Failed to read the uris from %s: %s", args->uri_file, strerror(errno));
+            return false;
+        }
+        dsn = file_dsn;
+    }
+
+    if (dsn) {
+        uris = hp_parse_dsn_param(dsn, &num_uris, args->hwm, 0);
+        free(file_dsn);
+
+        if (!uris) {
+            HP_LOG_WARN("Failed to parse the reloaded uris");
+            return false;
+        }
+    }
+
+    /* All or nothing, the threads only get their sockets once every one exists */
+    for (i = 0; i < server->num_threads; i++) {
+        struct hp_httpd_thread_t *thread = &(server->threads[i]);
+
+        sockets[i] = NULL;
+
+        if (thread->state != HP_THREAD_RUNNING) {
+            continue;
+        }
+
+        sockets[i] = hp_create_socket(thread->out_ctx, uris, num_uris, (thread->acking ? ZMQ_XREQ : ZMQ_PUSH),
+                                      HP_CONNECT, thread->affinity);
+        if (!sockets[i]) {
+            HP_LOG_ERROR("Failed to create the reloaded out_socket for thread id %d", i);
+
+            while (--i >= 0) {
+                if (sockets[i]) {
+                    (void) zmq_close(sockets[i]);
+                }
+            }
+
+            if (uris != args->uris) {
+                hp_free_uris(uris, num_uris);
+            }
+            return false;
+        }
+    }
+
+    for (i = 0; i < server->num_threads; i++) {
+        struct hp_httpd_thread_t *thread = &(server->threads[i]);
+        void *previous;
+
+        if (!sockets[i]) {
+            continue;
+        }
+
+        /* A socket from an earlier reload the thread hasn't taken yet is replaced */
+        do {
+            previous = thread->reload_socket;
+        } while (HP_ATOMIC_CAS(&(thread->reload_socket), previous, sockets[i]) == false);
+
+        if (previous) {
+            (void) zmq_close(previous);
+        }
+
+        if (hp_send_command(thread->intercomm.front, HTTPD_RELOAD) == false) {
+            HP_LOG_ERROR("Failed to request thread id %d to reload: %s", i, zmq_strerror(errno));
+            success = false;
+        }
+    }
+
+    /* Threads started later connect to the new uris */
+    if (uris != args->uris) {
+        hp_free_uris(args->uris, args->num_uris);
+        args->uris = uris;
+        args->num_uris = num_uris;
+    }
+    HP_LOG_INFO("Reloaded %zu backend uris", num_uris);
+    return success;
+}
+
+/* Replies to the "reload" command */
+static struct evbuffer *hp_monitor_reload(struct hp_server_t *server, const char *message, size_t message_size) {
+    struct evbuffer *evb;
+    char *dsn = NULL;
+    bool success;
+
+    if (message_size > 0) {
+        dsn = malloc(message_size + 1);
+        if (!dsn) {
+            return NULL;
+        }
+        memcpy(dsn, message, message_size);
+        dsn[message_size] = '\0';
+    }
+
+    success = hp_reload_uris(server, dsn);
+    free(dsn);
+
+    evb = evbuffer_new();
+    if (!evb) {
+        return NULL;
+    }
+
+    evbuffer_add_printf(evb, "<?xml version=\"1.0\"?>\n");
+    evbuffer_add_printf(evb, "<httpush>\n");
+    evbuffer_add_printf(evb, "  <reload success=\"%s\" uris=\"%zu\" />\n",
+                        (success ? "true" : "false"), server->args->num_uris);
+    evbuffer_add_printf(evb, "</httpush>\n");
+    return evb;
+}
+
+/*
+ Commands on the monitor socket are "stats", "threads [<n>]" and
+ "reload [<uris>]"
+ */
+static bool hp_handle_monitoring_command(struct hp_server_t *server) {
+    bool retval = false;
+    char identity[HP_IDENTITY_MAX];
+    size_t identity_size = HP_IDENTITY_MAX;
+
+    char message[HP_MONITOR_MESSAGE_MAX];
+    size_t message_size = HP_MONITOR_MESSAGE_MAX;
+
+    HP_LOG_DEBUG("Message in monitoring socket");
+
+    if (hp_recvmsg_ident(server->monitor_socket, identity, &identity_size, message, &message_size) == true) {
+        struct evbuffer *evb;
+
+        if (message_size >= 5 && !memcmp(message, "stats", 5)) {
+            evb = hp_monitor_stats(server);
+        } else if (message_size == 7 && !memcmp(message, "threads", 7)) {
+            evb = hp_monitor_threads(server, NULL, 0);
+        } else if (message_size > 8 && !memcmp(message, "threads ", 8)) {
+            evb = hp_monitor_threads(server, message + 8, message_size - 8);
+        } else if (message_size == 6 && !memcmp(message, "reload", 6)) {
+            evb = hp_monitor_reload(server, NULL, 0);
+        } else if (message_size > 7 && !memcmp(message, "reload ", 7)) {
+            evb = hp_monitor_reload(server, message + 7, message_size - 7);
+        } else {
+            return false;
+        }
+
+        if (!evb) {
+            return false;
+        }
+
+        retval = hp_sendmsg_ident(server->monitor_socket, identity, identity_size, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb));
+        evbuffer_free(evb);
+    }
+    return retval;
+}
+
+/*
+ A new process connected to the -U socket, it gets the listen sockets and
+ starts its threads while this process keeps serving
+ */
+static void hp_upgrade_accept(struct hp_server_t *server) {
+    struct httpush_args_t *args = server->args;
+    struct hp_upgrade_fds_t fds;
+
+    fds.listener = args->upgrade_fd;
+    fds.fds = args->fds;
+    fds.num_fds = args->num_fds;
+    fds.admin_fd = args->admin_fd;
+
+    server->upgrade_conn = hp_upgrade_send(&fds);
+    if (server->upgrade_conn == -1) {
+        HP_LOG_WARN("Failed to pass the listen sockets to the new process: %s", strerror(errno));
+        return;
+    }
+    HP_LOG_INFO("Passed the listen sockets to a new process");
+}
+
+/*
+ The new process is serving once it says so. This one then lets go of the
+ upgrade, monitor and publisher sockets and retires all its threads. If
+ the new process went away instead, nothing changes
+ */
+static void hp_upgrade_handover(struct hp_server_t *server) {
+    struct httpush_args_t *args = server->args;
+    int i;
+
+    if (hp_upgrade_wait(server->upgrade_conn) != HP_UPGRADE_READY) {
+        HP_LOG_WARN("The new process failed to start, keeping on serving");
+        (void) close(server->upgrade_conn);
+        server->upgrade_conn = -1;
+        return;
+    }
+    HP_LOG_INFO("The new process is serving, retiring the threads");
+
+    (void) close(args->upgrade_fd);
+    args->upgrade_fd = -1;
+
+    /* Connections the acceptor already took are handed over before the threads retire */
+    if (server->acceptor) {
+        hp_acceptor_free(server->acceptor);
+        server->acceptor = NULL;
+    }
+
+    if (server->admin) {
+        hp_admin_stop(server->admin);
+        server->admin = NULL;
+    }
+
+    if (server->publisher) {
+        (void) zmq_close(server->publisher->socket);
+        hp_stats_publisher_free(server->publisher);
+        server->publisher = NULL;
+    }
+
+    (void) zmq_close(server->monitor_socket);
+    server->monitor_socket = NULL;
+
+    if (hp_upgrade_notify(server->upgrade_conn, HP_UPGRADE_RELEASED) == false) {
+        HP_LOG_WARN("Failed to tell the new process to bind: %s", strerror(errno));
+    }
+    (void) close(server->upgrade_conn);
+    server->upgrade_conn = -1;
+
+    for (i = 0; i < server->num_threads; i++) {
+        if (server->threads[i].state == HP_THREAD_RUNNING) {
+            (void) hp_retire_thread(server, &(server->threads[i]));
+        }
+    }
+    hp_stats_set_threads(&(server->stats), server->running_threads, server->used_threads);
+    server->upgraded = true;
+}
+
+static int hp_run_parent_loop(struct hp_server_t *server) {
+    int rc, retval = 0;
+
+    while (!shutting_down) {
+        zmq_pollitem_t m_items[3];
+        int num_items = 0, monitor_item = -1, upgrade_item = -1, conn_item = -1;
+        long timeout = -1;
+
+        if (server->monitor_socket) {
+            monitor_item = num_items++;
+            m_items[monitor_item].socket = server->monitor_socket;
+            m_items[monitor_item].fd = 0;
+        }
+
+        /* One new process at a time */
+        if (server->upgrade_conn != -1) {
+            conn_item = num_items++;
+            m_items[conn_item].socket = NULL;
+            m_items[conn_item].fd = server->upgrade_conn;
+        } else if (server->args->upgrade_fd != -1) {
+            upgrade_item = num_items++;
+            m_items[upgrade_item].socket = NULL;
+            m_items[upgrade_item].fd = server->args->upgrade_fd;
+        }
+
+        for (rc = 0; rc < num_items; rc++) {
+            m_items[rc].events = ZMQ_POLLIN;
+            m_items[rc].revents = 0;
+        }
+
+        /* Wake up in time to publish the next delta */
+        if (server->publisher) {
+            timeout = hp_stats_publisher_timeout(server->publisher);
+        }
+
+        /* and to join the threads that are done retiring */
+        if (server->retiring_threads > 0 && (timeout < 0 || timeout > HP_RETIRE_CHECK_USEC)) {
+            timeout = HP_RETIRE_CHECK_USEC;
+        }
+
+        /* and to see the signals that were delivered to another thread */
+        if (timeout < 0 || timeout > HP_SEC_TO_MSEC(1)) {
+            timeout = HP_SEC_TO_MSEC(1);
+        }
+
+        /* Poll the monitor socket for incoming events */
+        rc = zmq_poll(m_items, num_items, timeout);
+
+        if (rc < 0) {
+            if (errno != EINTR) {
+                HP_LOG_WARN("Shutting down: %s", zmq_strerror(errno));
+                break;
+            }
+            rc = 0;
+        }
+
+        if (shutting_down) {
+            break;
+        }
+
+        if (reload_requested) {
+            reload_requested = 0;
+
+            if (hp_reload_uris(server, NULL) == false) {
+                HP_LOG_WARN("Reloading the uris failed, keeping the current ones");
+            }
+        }
+
+        if (server->publisher) {
+            if (hp_stats_publish(server->publisher, &(server->stats), server->num_threads) == false) {
+                HP_LOG_WARN("Failed to publish statistics: %s", zmq_strerror(errno));
+            }
+        }
+
+        if (rc > 0 && monitor_item != -1 && (m_items[monitor_item].revents & ZMQ_POLLIN)) {
+            /* Handle command coming in from monitoring socket */
+            if (hp_handle_monitoring_command(server) == false) {
+                HP_LOG_WARN("monitoring command failed");
+            }
+        }
+
+        if (rc > 0 && upgrade_item != -1 && (m_items[upgrade_item].revents & ZMQ_POLLIN)) {
+            hp_upgrade_accept(server);
+        }
+
+        if (rc > 0 && conn_item != -1 && (m_items[conn_item].revents & ZMQ_POLLIN)) {
+            hp_upgrade_handover(server);
+        }
+
+        if (server->retiring_threads > 0) {
+            hp_reap_threads(server);
+        }
+
+        /* The new process has taken over and the last thread is gone */
+        if (server->upgraded && server->retiring_threads == 0) {
+            HP_LOG_INFO("All threads retired, handing over done");
+            break;
+        }
+    }
+
+    if (server->upgrade_conn != -1) {
+        (void) close(server->upgrade_conn);
+        server->upgrade_conn = -1;
+    }
+
+    if (server->admin) {
+        hp_admin_stop(server->admin);
+    }
+
+    if (server->publisher) {
+        (void) zmq_close(server->publisher->socket);
+        hp_stats_publisher_free(server->publisher);
+    }
+
+    /* Stop handing out connections before the threads go away */
+    if (server->acceptor) {
+        hp_acceptor_free(server->acceptor);
+    }
+
+    if (hp_free_threads(server->threads, server->num_threads) == false) {
+        HP_LOG_ERROR("Thread termination failed. The process is likely to hang");
+        retval = 1;
+    }
+
+    if (server->monitor_socket && zmq_close(server->monitor_socket) != 0) {
+        HP_LOG_ERROR("Failed to close monitor socket. The process is likely to hang");
+        retval = 1;
+    }
+    return retval;
+}
+
+/* Releases what the threads shared, once they are gone */
+static void hp_server_free(struct hp_server_t *server) {
+    if (server->dedup) {
+        hp_dedup_free(server->dedup);
+    }
+    hp_stats_destroy(&(server->stats));
+}
+
 int hp_server_boostrap(struct httpush_args_t *args, int num_threads) {
-    int rc;
-    struct hp_httpd_thread_t threads[num_threads];
-    void *monitor_socket;
+    int rc, max_threads = args->max_threads;
+    struct hp_httpd_thread_t threads[max_threads];
+    struct hp_acceptor_t acceptor;
+    struct hp_admin_t admin;
+    struct hp_stats_publisher_t publisher;
+    struct hp_dedup_t dedup;
+    struct hp_server_t server;
+    bool upgrading = false;
+
+    /* The pool can grow into the slots above num_threads at runtime */
+    memset(threads, 0, sizeof (threads));
+    memset(&server, 0, sizeof (struct hp_server_t));
+    server.args = args;
+    server.threads = threads;
+    server.num_threads = max_threads;
+    server.used_threads = num_threads;
+    server.running_threads = num_threads;
+    server.upgrade_conn = -1;
+
+    /* Counters of all threads live in shared memory */
+    if (hp_stats_create(&(server.stats), max_threads, hp_num_outputs(args)) == false) {
+        HP_LOG_ERROR("Failed to create statistics segment");
+        return 1;
+    }
 
-    rc = hp_init_threads(args, threads, num_threads);
+    /* The threads share the keys so that a retry is caught whichever thread gets it */
+    if (args->dedup.max_keys > 0) {
+        if (hp_dedup_init(&dedup, &(args->dedup)) == false) {
+            HP_LOG_ERROR("Failed to allocate the deduplication cache");
+            hp_stats_destroy(&(server.stats));
+            return 1;
+        }
+        server.dedup = &dedup;
+    }
+    hp_stats_set_threads(&(server.stats), num_threads, num_threads);
+
+    rc = hp_init_threads(args, &(server.stats), server.dedup, threads, num_threads);
     if (rc < num_threads) {
         HP_LOG_ERROR("Failed to initialize threads");
         if (hp_free_threads(threads, rc) == false) {
             HP_LOG_ERROR("Failed to terminate threads");
         }
+        hp_server_free(&server);
         return 1;
     }
 
+    if (args->listen_mode == HP_LISTEN_ACCEPTOR) {
+        if (hp_acceptor_init(&acceptor, args->fds[0], threads, max_threads, num_threads) == false) {
+            if (hp_free_threads(threads, num_threads) == false) {
+                HP_LOG_ERROR("Failed to terminate threads");
+            }
+            hp_server_free(&server);
+            return 1;
+        }
+        server.acceptor = &acceptor;
+    }
+
+    if (args->admin_fd != -1) {
+        if (hp_admin_init(&admin, &(server.stats), max_threads, args->admin_fd) == false) {
+            HP_LOG_ERROR("Failed to start admin listener");
+        } else {
+            server.admin = &admin;
+        }
+    }
+
+    /* The threads serve alongside the old process, which can now let go */
+    if (args->upgrade_conn != -1) {
+        upgrading = true;
+
+        if (hp_upgrade_notify(args->upgrade_conn, HP_UPGRADE_READY) == false ||
+                hp_upgrade_wait(args->upgrade_conn) != HP_UPGRADE_RELEASED) {
+            HP_LOG_WARN("The old process didn't confirm the upgrade: %s", strerror(errno));
+        }
+        (void) close(args->upgrade_conn);
+        args->upgrade_conn = -1;
+    }
+
+    if (args->num_p_uris > 0) {
+        void *pub_socket = hp_create_bound_socket(args->ctx, args->p_uris, args->num_p_uris, ZMQ_PUB, upgrading);
+
+        if (!pub_socket) {
+            HP_LOG_ERROR("Failed to create statistics publisher socket");
+        } else if (hp_stats_publisher_init(&publisher, pub_socket, args->publish_usec, max_threads) == false) {
+            HP_LOG_ERROR("Failed to initialize statistics publisher");
+            (void) zmq_close(pub_socket);
+        } else {
+            server.publisher = &publisher;
+        }
+    }
+
     /* Monitoring the threads */
-    monitor_socket = hp_create_socket(args->ctx, args->m_uris, args->num_m_uris, ZMQ_XREP, HP_BIND);
-    if (!monitor_socket) {
+    server.monitor_socket = hp_create_bound_socket(args->ctx, args->m_uris, args->num_m_uris, ZMQ_XREP, upgrading);
+    if (!server.monitor_socket) {
         HP_LOG_ERROR("Failed to create monitor socket");
-        if (hp_free_threads(threads, num_threads) == false) {
+        if (server.publisher) {
+            (void) zmq_close(server.publisher->socket);
+            hp_stats_publisher_free(server.publisher);
+        }
+        if (server.admin) {
+            hp_admin_stop(server.admin);
+        }
+        if (server.acceptor) {
+            hp_acceptor_free(server.acceptor);
+        }
+        if (hp_free_threads(threads, max_threads) == false) {
             HP_LOG_ERROR("Failed to terminate threads");
         }
+        hp_server_free(&server);
         return 1;
     }
 
     /* Got threads running, poll to see if they exit */
-    return hp_run_parent_loop(monitor_socket, threads, num_threads);
+    rc = hp_run_parent_loop(&server);
+
+    hp_server_free(&server);
+    return rc;
 }
@@ -0,0 +1,303 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+ Creates the statistics segment. Falls back to an anonymous mapping if
+ shared memory is not available, in which case only the process itself
+ can read the counters
+ */
+bool hp_stats_create(struct hp_stats_t *stats, int num_threads, size_t num_outputs) {
+    int fd;
+    void *ptr;
+
+    stats->size = sizeof (struct hp_stats_header_t) + num_threads * sizeof (struct hp_stats_slot_t) +
+                  num_threads * num_outputs * sizeof (struct hp_stats_output_slot_t);
+    (void) snprintf(stats->name, sizeof (stats->name), HP_STATS_SHM_NAME, (long) getpid());
+
+    fd = shm_open(stats->name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (fd >= 0) {
+        if (ftruncate(fd, stats->size) != 0) {
+            (void) close(fd);
+            (void) shm_unlink(stats->name);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) {
+        HP_LOG_WARN("Failed to create statistics segment %s: %s", stats->name, strerror(errno));
+        stats->name[0] = '\0';
+        ptr = mmap(NULL, stats->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        ptr = mmap(NULL, stats->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        (void) close(fd);
+    }
+
+    if (ptr == MAP_FAILED) {
+        HP_LOG_ERROR("Failed to map statistics segment: %s", strerror(errno));
+        if (stats->name[0]) {
+            (void) shm_unlink(stats->name);
+        }
+        return false;
+    }
+
+    memset(ptr, 0, stats->size);
+
+    stats->header = (struct hp_stats_header_t *) ptr;
+    stats->slots  = (struct hp_stats_slot_t *) ((char *) ptr + sizeof (struct hp_stats_header_t));
+    stats->output_slots = (struct hp_stats_output_slot_t *) (stats->slots + num_threads);
+    stats->num_outputs  = num_outputs;
+
+    stats->header->version     = HP_STATS_VERSION;
+    stats->header->num_threads = (uint32_t) num_threads;
+    stats->header->slot_size   = (uint32_t) sizeof (struct hp_stats_slot_t);
+    stats->header->num_outputs  = (uint32_t) num_outputs;
+    stats->header->output_slot_size = (uint32_t) sizeof (struct hp_stats_output_slot_t);
+    stats->header->pid         = (int64_t) getpid();
+
+    /* Readers check the magic last */
+    __sync_synchronize();
+    stats->header->magic = HP_STATS_MAGIC;
+    return true;
+}
+
+void hp_stats_destroy(struct hp_stats_t *stats) {
+    (void) munmap(stats->header, stats->size);
+
+    if (stats->name[0]) {
+        (void) shm_unlink(stats->name);
+    }
+    stats->header = NULL;
+    stats->slots  = NULL;
+    stats->output_slots = NULL;
+}
+
+void hp_stats_set_threads(struct hp_stats_t *stats, int running_threads, int used_threads) {
+    HP_ATOMIC_STORE(&(stats->header->running_threads), (uint32_t) running_threads);
+    HP_ATOMIC_STORE(&(stats->header->used_threads), (uint32_t) used_threads);
+}
+
+struct hp_httpd_counters_t *hp_stats_counters(struct hp_stats_t *stats, int thread_id) {
+    return &(stats->slots[thread_id].counters);
+}
+
+struct hp_histogram_t *hp_stats_latency(struct hp_stats_t *stats, int thread_id) {
+    return stats->slots[thread_id].latency;
+}
+
+struct hp_output_counters_t *hp_stats_output_counters(struct hp_stats_t *stats, int thread_id, size_t output) {
+    return &(stats->output_slots[thread_id * stats->num_outputs + output].counters);
+}
+
+/*
+ Takes a snapshot of the counters of a thread
+ */
+void hp_stats_read_counters(struct hp_httpd_counters_t *dst, struct hp_httpd_counters_t *src) {
+    dst->code_200 = HP_ATOMIC_LOAD(&(src->code_200));
+    dst->code_404 = HP_ATOMIC_LOAD(&(src->code_404));
+    dst->code_412 = HP_ATOMIC_LOAD(&(src->code_412));
+    dst->code_503 = HP_ATOMIC_LOAD(&(src->code_503));
+    dst->requests = HP_ATOMIC_LOAD(&(src->requests));
+    dst->accepts  = HP_ATOMIC_LOAD(&(src->accepts));
+
+    dst->bytes_in  = HP_ATOMIC_LOAD(&(src->bytes_in));
+    dst->bytes_out = HP_ATOMIC_LOAD(&(src->bytes_out));
+
+    dst->queue_messages = HP_ATOMIC_LOAD(&(src->queue_messages));
+    dst->queue_bytes    = HP_ATOMIC_LOAD(&(src->queue_bytes));
+
+    dst->journal_messages = HP_ATOMIC_LOAD(&(src->journal_messages));
+    dst->journal_bytes    = HP_ATOMIC_LOAD(&(src->journal_bytes));
+
+    dst->ack_inflight = HP_ATOMIC_LOAD(&(src->ack_inflight));
+    dst->acks         = HP_ATOMIC_LOAD(&(src->acks));
+    dst->ack_timeouts = HP_ATOMIC_LOAD(&(src->ack_timeouts));
+
+    dst->dedup_keys      = HP_ATOMIC_LOAD(&(src->dedup_keys));
+    dst->dedup_hits      = HP_ATOMIC_LOAD(&(src->dedup_hits));
+    dst->dedup_evictions = HP_ATOMIC_LOAD(&(src->dedup_evictions));
+}
+
+void hp_stats_read_output_counters(struct hp_output_counters_t *dst, struct hp_output_counters_t *src) {
+    dst->requests = HP_ATOMIC_LOAD(&(src->requests));
+    dst->messages = HP_ATOMIC_LOAD(&(src->messages));
+    dst->bytes    = HP_ATOMIC_LOAD(&(src->bytes));
+    dst->rejected = HP_ATOMIC_LOAD(&(src->rejected));
+}
+
+void hp_stats_sum_counters(struct hp_httpd_counters_t *sum, struct hp_httpd_counters_t *counters) {
+    sum->code_200 += counters->code_200;
+    sum->code_404 += counters->code_404;
+    sum->code_412 += counters->code_412;
+    sum->code_503 += counters->code_503;
+    sum->requests += counters->requests;
+    sum->accepts  += counters->accepts;
+
+    sum->bytes_in  += counters->bytes_in;
+    sum->bytes_out += counters->bytes_out;
+
+    sum->queue_messages += counters->queue_messages;
+    sum->queue_bytes    += counters->queue_bytes;
+
+    sum->journal_messages += counters->journal_messages;
+    sum->journal_bytes    += counters->journal_bytes;
+
+    sum->ack_inflight += counters->ack_inflight;
+    sum->acks         += counters->acks;
+    sum->ack_timeouts += counters->ack_timeouts;
+
+    sum->dedup_keys      += counters->dedup_keys;
+    sum->dedup_hits      += counters->dedup_hits;
+    sum->dedup_evictions += counters->dedup_evictions;
+}
+
+/* The gauges are sent as is, everything else as the change */
+static bool hp_stats_field_is_gauge(size_t field) {
+    return (field == offsetof(struct hp_httpd_counters_t, queue_messages) / sizeof (uint64_t) ||
+            field == offsetof(struct hp_httpd_counters_t, queue_bytes) / sizeof (uint64_t) ||
+            field == offsetof(struct hp_httpd_counters_t, journal_messages) / sizeof (uint64_t) ||
+            field == offsetof(struct hp_httpd_counters_t, journal_bytes) / sizeof (uint64_t) ||
+            field == offsetof(struct hp_httpd_counters_t, ack_inflight) / sizeof (uint64_t));
+}
+
+static char *hp_stats_put_varint(char *p, uint64_t value) {
+    while (value >= 0x80) {
+        *(p++) = (char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *(p++) = (char) value;
+    return p;
+}
+
+static void hp_stats_put_uint64(char *p, uint64_t value) {
+    uint32_t high = htonl((uint32_t) (value >> 32)), low = htonl((uint32_t) value);
+
+    memcpy(p, &high, sizeof (uint32_t));
+    memcpy(p + sizeof (uint32_t), &low, sizeof (uint32_t));
+}
+
+bool hp_stats_publisher_init(struct hp_stats_publisher_t *publisher, void *socket, long interval_usec, int num_threads) {
+    uint64_t now = hp_now_ns();
+
+    publisher->socket = socket;
+    publisher->interval = (uint64_t) interval_usec * 1000;
+    publisher->last = now;
+    publisher->next = now + publisher->interval;
+    publisher->sequence = 0;
+
+    /* A varint takes at most 10 bytes */
+    publisher->capacity = sizeof (struct hp_stats_delta_header_t) + (num_threads * HP_STATS_DELTA_FIELDS * 10);
+    publisher->buffer = malloc(publisher->capacity);
+    publisher->previous = calloc(num_threads, sizeof (struct hp_httpd_counters_t));
+
+    if (!publisher->buffer || !publisher->previous) {
+        free(publisher->buffer);
+        free(publisher->previous);
+        return false;
+    }
+    return true;
+}
+
+/*
+ Microseconds until the next delta is due, for zmq_poll
+ */
+long hp_stats_publisher_timeout(struct hp_stats_publisher_t *publisher) {
+    uint64_t now = hp_now_ns();
+
+    if (now >= publisher->next) {
+        return 0;
+    }
+    return (long) ((publisher->next - now) / 1000) + 1;
+}
+
+/*
+ Publishes the change of the counters since the previous call, if due
+ */
+bool hp_stats_publish(struct hp_stats_publisher_t *publisher, struct hp_stats_t *stats, int num_threads) {
+    struct hp_stats_delta_header_t header;
+    uint64_t now = hp_now_ns();
+    char *p;
+    int i;
+
+    if (now < publisher->next) {
+        return true;
+    }
+
+    /* Don't try to catch up if the parent was busy */
+    publisher->next += publisher->interval;
+    if (publisher->next <= now) {
+        publisher->next = now + publisher->interval;
+    }
+
+    header.magic       = htonl(HP_STATS_DELTA_MAGIC);
+    header.version     = htons(HP_STATS_DELTA_VERSION);
+    header.num_threads = htons((uint16_t) num_threads);
+    header.num_fields  = htons((uint16_t) HP_STATS_DELTA_FIELDS);
+    header.reserved    = 0;
+    header.sequence    = htonl(publisher->sequence++);
+    header.timestamp   = 0;
+    header.interval    = 0;
+
+    memcpy(publisher->buffer, &header, sizeof (header));
+    hp_stats_put_uint64(publisher->buffer + offsetof(struct hp_stats_delta_header_t, timestamp), now);
+    hp_stats_put_uint64(publisher->buffer + offsetof(struct hp_stats_delta_header_t, interval), now - publisher->last);
+    publisher->last = now;
+
+    p = publisher->buffer + sizeof (struct hp_stats_delta_header_t);
+
+    for (i = 0; i < num_threads; i++) {
+        struct hp_httpd_counters_t current;
+        uint64_t *values = (uint64_t *) &current, *previous = (uint64_t *) &(publisher->previous[i]);
+        size_t field;
+
+        hp_stats_read_counters(&current, hp_stats_counters(stats, i));
+
+        for (field = 0; field < HP_STATS_DELTA_FIELDS; field++) {
+            p = hp_stats_put_varint(p, hp_stats_field_is_gauge(field) ? values[field] : values[field] - previous[field]);
+        }
+        memcpy(&(publisher->previous[i]), &current, sizeof (struct hp_httpd_counters_t));
+    }
+
+    /* Nobody listening is not an error, PUB drops the message */
+    return hp_sendmsg(publisher->socket, publisher->buffer, p - publisher->buffer, ZMQ_NOBLOCK);
+}
+
+void hp_stats_publisher_free(struct hp_stats_publisher_t *publisher) {
+    free(publisher->buffer);
+    free(publisher->previous);
+
+    publisher->buffer = NULL;
+    publisher->previous = NULL;
+}
+
@@ -0,0 +1,317 @@
+/*
++-----------------------------------------------------------------------------------+
+|  httpush                                                                          |
+|  Copyright (c) 2010, Mikko Koppanen <mkoppanen@php.net>                           |
+|  All rights reserved.                                                             |
++-----------------------------------------------------------------------------------+
+|  Redistribution and use in source and binary forms, with or without               |
+|  modification, are permitted provided that the following conditions are met:      |
+|     * Redistributions of source code must retain the above copyright              |
+|       notice, this list of conditions and the following disclaimer.               |
+|     * Redistributions in binary form must reproduce the above copyright           |
+|       notice, this list of conditions and the following disclaimer in the         |
+|       documentation and/or other materials provided with the distribution.        |
+|     * Neither the name of the copyright holder nor the                            |
+|       names of its contributors may be used to endorse or promote products        |
+|       derived from this software without specific prior written permission.       |
++-----------------------------------------------------------------------------------+
+|  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND  |
+|  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED    |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE           |
+|  DISCLAIMED. IN NO EVENT SHALL MIKKO KOPPANEN BE LIABLE FOR ANY                   |
+|  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES       |
+|  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;     |
+|  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND      |
+|  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT       |
+|  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS    |
+|  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                     |
++-----------------------------------------------------------------------------------+
+*/
+
+#include "httpush.h"
+
+/* First bytes of the message carrying the sockets, in host byte order */
+#define HP_UPGRADE_MAGIC 0x68707570
+
+/* Upper bound of the sockets in one message */
+#define HP_UPGRADE_MAX_FDS 256
+
+/* Seconds to wait for the other process */
+#define HP_UPGRADE_TIMEOUT 10
+
+/* Fixed part of the message, the sockets follow as SCM_RIGHTS */
+struct hp_upgrade_msg_t {
+    uint32_t magic;
+    uint32_t num_fds;
+    int32_t admin;
+};
+
+/*
+ Binds the unix socket a new process connects to when taking over. A socket
+ file left by a process that is gone is replaced
+ */
+int hp_upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    (void) unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen(fd, 4) != 0 ||
+            evutil_make_socket_nonblocking(fd) != 0) {
+        int err = errno;
+        (void) close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ Connects to the process serving the upgrade socket. Succeeds with *conn
+ set to -1 if there is no such process
+ */
+bool hp_upgrade_connect(const char *path, int *conn) {
+    struct sockaddr_un addr;
+    struct timeval tv = {HP_UPGRADE_TIMEOUT, 0};
+    int fd;
+
+    *conn = -1;
+
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+        int err = errno;
+        (void) close(fd);
+
+        if (err == ENOENT || err == ECONNREFUSED) {
+            return true;
+        }
+        errno = err;
+        return false;
+    }
+
+    /* Neither side waits forever for the other */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) != 0) {
+        int err = errno;
+        (void) close(fd);
+        errno = err;
+        return false;
+    }
+    *conn = fd;
+    return true;
+}
+
+/*
+ Accepts the connection of a new process and passes it the upgrade socket,
+ the HTTP listen sockets and the admin socket. Returns the connection, over
+ which the new process says when it is ready, or -1
+ */
+int hp_upgrade_send(struct hp_upgrade_fds_t *fds) {
+    struct hp_upgrade_msg_t msg;
+    struct msghdr hdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timeval tv = {HP_UPGRADE_TIMEOUT, 0};
+    int *out;
+    size_t num_fds = 1 + fds->num_fds + (fds->admin_fd != -1 ? 1 : 0);
+    char buf[CMSG_SPACE(sizeof (int) * HP_UPGRADE_MAX_FDS)];
+    int conn;
+
+    conn = accept(fds->listener, NULL, NULL);
+    if (conn < 0) {
+        return -1;
+    }
+
+    if (num_fds > HP_UPGRADE_MAX_FDS) {
+        (void) close(conn);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    /* The accepted socket may inherit O_NONBLOCK, the exchange is short and blocking */
+    if (fcntl(conn, F_SETFL, 0) != 0 ||
+            setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) != 0) {
+        int err = errno;
+        (void) close(conn);
+        errno = err;
+        return -1;
+    }
+
+    msg.magic = HP_UPGRADE_MAGIC;
+    msg.num_fds = (uint32_t) fds->num_fds;
+    msg.admin = (fds->admin_fd != -1);
+
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof (msg);
+
+    memset(&hdr, 0, sizeof (hdr));
+    memset(buf, 0, sizeof (buf));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = buf;
+    hdr.msg_controllen = CMSG_SPACE(sizeof (int) * num_fds);
+
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int) * num_fds);
+
+    /* The upgrade socket, the listen sockets and the admin socket */
+    out = (int *) CMSG_DATA(cmsg);
+    out[0] = fds->listener;
+    memcpy(&(out[1]), fds->fds, sizeof (int) * fds->num_fds);
+
+    if (fds->admin_fd != -1) {
+        out[1 + fds->num_fds] = fds->admin_fd;
+    }
+
+    if (sendmsg(conn, &hdr, 0) != (ssize_t) sizeof (msg)) {
+        int err = errno;
+        (void) close(conn);
+        errno = err;
+        return -1;
+    }
+    return conn;
+}
+
+/*
+ Receives the sockets of the running process, to be closed by the caller.
+ The listen sockets are put in a new array
+ */
+bool hp_upgrade_recv(int conn, struct hp_upgrade_fds_t *fds) {
+    struct hp_upgrade_msg_t msg;
+    struct msghdr hdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char buf[CMSG_SPACE(sizeof (int) * HP_UPGRADE_MAX_FDS)];
+    size_t num_fds, i;
+    ssize_t rc;
+    int *in;
+
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof (msg);
+
+    memset(&hdr, 0, sizeof (hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = buf;
+    hdr.msg_controllen = sizeof (buf);
+
+    rc = recvmsg(conn, &hdr, 0);
+    if (rc != (ssize_t) sizeof (msg)) {
+        if (rc >= 0) {
+            errno = EPROTO;
+        }
+        return false;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return false;
+    }
+
+    in = (int *) CMSG_DATA(cmsg);
+    num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+
+    /* Whatever came along is closed if the message isn't what was expected */
+    if (msg.magic != HP_UPGRADE_MAGIC || (hdr.msg_flags & MSG_CTRUNC) ||
+            num_fds != 1 + msg.num_fds + (msg.admin ? 1 : 0)) {
+        for (i = 0; i < num_fds; i++) {
+            (void) close(in[i]);
+        }
+        errno = EPROTO;
+        return false;
+    }
+
+    fds->fds = calloc(msg.num_fds, sizeof (int));
+    if (!fds->fds) {
+        for (i = 0; i < num_fds; i++) {
+            (void) close(in[i]);
+        }
+        return false;
+    }
+
+    fds->listener = in[0];
+    fds->num_fds = msg.num_fds;
+    memcpy(fds->fds, &(in[1]), sizeof (int) * msg.num_fds);
+    fds->admin_fd = msg.admin ? in[1 + msg.num_fds] : -1;
+    return true;
+}
+
+/* One byte tells the other process how far the upgrade got */
+bool hp_upgrade_notify(int conn, char state) {
+    return (write(conn, &state, 1) == 1);
+}
+
+/* Returns the byte the other process sent, or -1 if it went away */
+int hp_upgrade_wait(int conn) {
+    char state;
+
+    if (read(conn, &state, 1) != 1) {
+        return -1;
+    }
+    return (unsigned char) state;
+}
+
+/*
+ Takes the listen sockets passed by the service manager, starting at
+ descriptor 3, if LISTEN_PID names this process. The variables are
+ removed so that child processes don't take them too
+ */
+bool hp_listen_fds_inherited(int **fds, size_t *num_fds) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    long n;
+    size_t i;
+
+    if (!pid || !count || strtol(pid, NULL, 10) != (long) getpid()) {
+        return false;
+    }
+
+    n = strtol(count, NULL, 10);
+    (void) unsetenv("LISTEN_PID");
+    (void) unsetenv("LISTEN_FDS");
+
+    if (n <= 0) {
+        return false;
+    }
+
+    *fds = calloc((size_t) n, sizeof (int));
+    if (!*fds) {
+        return false;
+    }
+
+    for (i = 0; i < (size_t) n; i++) {
+        (*fds)[i] = 3 + (int) i;
+        (void) evutil_make_socket_nonblocking((*fds)[i]);
+    }
+    *num_fds = (size_t) n;
+    return true;
+}